@@ -1692,6 +1692,15 @@ static void bdrv_stats_iter(QObject *data, void *opaque)
                         qdict_get_int(qdict, "wr_bytes"),
                         qdict_get_int(qdict, "rd_operations"),
                         qdict_get_int(qdict, "wr_operations"));
+    if (qdict_get_int(qdict, "completion_irqs")) {
+        monitor_printf(mon, "    completions=%" PRId64
+                            " completion_irqs=%" PRId64
+                            " completions_per_irq=%.2f\n",
+                            qdict_get_int(qdict, "completions"),
+                            qdict_get_int(qdict, "completion_irqs"),
+                            (double)qdict_get_int(qdict, "completions") /
+                            qdict_get_int(qdict, "completion_irqs"));
+    }
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1709,12 +1718,15 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              "'wr_bytes': %" PRId64 ","
                              "'rd_operations': %" PRId64 ","
                              "'wr_operations': %" PRId64 ","
-                             "'wr_highest_offset': %" PRId64
+                             "'wr_highest_offset': %" PRId64 ","
+                             "'completions': %" PRId64 ","
+                             "'completion_irqs': %" PRId64
                              "} }",
                              bs->rd_bytes, bs->wr_bytes,
                              bs->rd_ops, bs->wr_ops,
                              bs->wr_highest_sector *
-                             (uint64_t)BDRV_SECTOR_SIZE);
+                             (uint64_t)BDRV_SECTOR_SIZE,
+                             bs->completions, bs->completion_irqs);
     dict  = qobject_to_qdict(res);
 
     if (*bs->device_name) {
@@ -1745,6 +1757,19 @@ void bdrv_info_stats(Monitor *mon, QObject **ret_data)
     *ret_data = QOBJECT(devices);
 }
 
+/*
+ * Called by a guest device model when it hands @completions finished requests
+ * back to the guest at once; @irq says whether that raised an interrupt.
+ */
+void bdrv_account_completions(BlockDriverState *bs, unsigned int completions,
+                              bool irq)
+{
+    bs->completions += completions;
+    if (irq) {
+        bs->completion_irqs++;
+    }
+}
+
 const char *bdrv_get_encrypted_filename(BlockDriverState *bs)
 {
     if (bs->backing_hd && bs->backing_hd->encrypted)
@@ -56,6 +56,8 @@ void bdrv_info_print(Monitor *mon, const QObject *data);
 void bdrv_info(Monitor *mon, QObject **ret_data);
 void bdrv_stats_print(Monitor *mon, const QObject *data);
 void bdrv_info_stats(Monitor *mon, QObject **ret_data);
+void bdrv_account_completions(BlockDriverState *bs, unsigned int completions,
+                              bool irq);
 
 void bdrv_init(void);
 void bdrv_init_with_whitelist(void);
@@ -234,6 +236,10 @@ int bdrv_img_create(const char *filename, const char *fmt,
 
 #define BDRV_SECTORS_PER_DIRTY_CHUNK 2048
 
+#ifdef CONFIG_POSIX
+int raw_get_aio_fd(BlockDriverState *bs);
+#endif
+
 void bdrv_set_dirty_tracking(BlockDriverState *bs, int enable);
 int bdrv_get_dirty(BlockDriverState *bs, int64_t sector);
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
@@ -582,6 +582,34 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+/*
+ * Return the file descriptor behind a raw image, for callers that submit
+ * I/O to it themselves, or -ENOTSUP if the image is not a plain file or
+ * host device.
+ */
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (!strcmp(bs->drv->format_name, "raw")) {
+        bs = bs->file;
+        if (!bs || !bs->drv) {
+            return -ENOTSUP;
+        }
+    }
+    if (bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+    s = bs->opaque;
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+    return s->fd;
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
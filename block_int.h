@@ -181,6 +181,10 @@ struct BlockDriverState {
     uint64_t rd_ops;
     uint64_t wr_ops;
     uint64_t wr_highest_sector;
+    /* requests the guest device completed, and interrupts it raised for
+     * them; accounted by device models that batch their completions */
+    uint64_t completions;
+    uint64_t completion_irqs;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
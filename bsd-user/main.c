@@ -37,6 +37,8 @@
 #define DEBUG_LOGFILE "/tmp/qemu.log"
 
 int singlestep;
+int tb_hot_threshold;
+const char *pin_globals;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long mmap_min_addr;
 unsigned long guest_base;
@@ -693,6 +695,8 @@ static void usage(void)
            "-d options   activate log (logfile=%s)\n"
            "-p pagesize  set the host page size to 'pagesize'\n"
            "-singlestep  always run in singlestep mode\n"
+           "-tb-hot-threshold n  retranslate blocks executed n times as traces\n"
+           "-pin-globals list  keep the listed TCG globals in host registers\n"
            "-strace      log system calls\n"
            "\n"
            "Environment variables:\n"
@@ -856,6 +860,16 @@ int main(int argc, char **argv)
             optind++;
         } else if (!strcmp(r, "singlestep")) {
             singlestep = 1;
+        } else if (!strcmp(r, "tb-hot-threshold")) {
+            if (optind >= argc)
+                break;
+            tb_hot_threshold = atoi(argv[optind++]);
+            if (tb_hot_threshold < 0)
+                tb_hot_threshold = 0;
+        } else if (!strcmp(r, "pin-globals")) {
+            if (optind >= argc)
+                break;
+            pin_globals = argv[optind++];
         } else if (!strcmp(r, "strace")) {
             do_strace = 1;
         } else
@@ -893,7 +907,7 @@ int main(int argc, char **argv)
         cpu_model = "any";
 #endif
     }
-    cpu_exec_init_all(0);
+    cpu_exec_init_all(0, 0);
     /* NOTE: we need to init the CPU at this stage to get
        qemu_host_page_size */
     env = cpu_init(cpu_model);
@@ -48,6 +48,27 @@ void mmap_unlock(void)
     }
 }
 
+/* Guest threads are not run in parallel here, so readers simply take
+   the lock.  */
+void mmap_read_lock(void)
+{
+    mmap_lock();
+}
+
+void mmap_read_unlock(void)
+{
+    mmap_unlock();
+}
+
+/* Release the lock if a fault longjmp'd out of code that held it.  */
+void mmap_lock_reset(void)
+{
+    if (mmap_lock_count) {
+        mmap_lock_count = 0;
+        pthread_mutex_unlock(&mmap_mutex);
+    }
+}
+
 /* Grab lock to make sure things are in a consistent state after fork().  */
 void mmap_fork_start(void)
 {
@@ -72,6 +93,18 @@ void mmap_lock(void)
 void mmap_unlock(void)
 {
 }
+
+void mmap_read_lock(void)
+{
+}
+
+void mmap_read_unlock(void)
+{
+}
+
+void mmap_lock_reset(void)
+{
+}
 #endif
 
 void *qemu_vmalloc(size_t size)
@@ -22,6 +22,9 @@
 #include "tcg.h"
 #include "kvm.h"
 #include "qemu-barrier.h"
+#if defined(CONFIG_USER_ONLY)
+#include "qemu.h"
+#endif
 
 #if !defined(CONFIG_SOFTMMU)
 #undef EAX
@@ -45,7 +48,7 @@
 #define env cpu_single_env
 #endif
 
-int tb_invalidated_flag;
+unsigned int tb_invalidate_gen;
 
 //#define CONFIG_DEBUG_EXEC
 //#define DEBUG_SIGNAL
@@ -128,53 +131,50 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
     unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1, phys_page2;
-    target_ulong virt_page2;
-
-    tb_invalidated_flag = 0;
+#if defined(CONFIG_USE_NPTL)
+    unsigned int gen;
+#endif
 
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    phys_page2 = -1;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
+    h = tb_jmp_cache_hash_func(pc);
+#if defined(CONFIG_USE_NPTL)
+    gen = tb_invalidate_gen;
+    smp_rmb();
+#endif
+    tb = tb_phys_hash_lookup(env, pc, cs_base, flags, phys_pc);
+    if (tb) {
+        /* we add the TB in the virtual pc hash table */
+        env->tb_jmp_cache[h] = tb;
+#if defined(CONFIG_USE_NPTL)
+        /* another thread may have invalidated the TB since it was
+           found, or flushed the buffer and recycled the TB for another
+           block, which clears its flags; see tb_phys_invalidate() and
+           tb_flush() */
+        smp_mb();
+        if (likely(tb_invalidate_gen == gen)) {
+            return tb;
         }
-        ptb1 = &tb->phys_hash_next;
+#else
+        return tb;
+#endif
     }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
+
+    /* look again with tb_lock held, as another thread may just have
+       translated the block */
+    mmap_read_lock();
+    tb_lock_acquire();
+    tb = tb_phys_hash_lookup(env, pc, cs_base, flags, phys_pc);
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        tb = tb_gen_code(env, pc, cs_base, flags, 0);
     }
-    /* we add the TB in the virtual pc hash table */
-    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    env->tb_jmp_cache[h] = tb;
+    tb_lock_release();
+    mmap_read_unlock();
     return tb;
 }
 
@@ -229,6 +229,7 @@ int cpu_exec(CPUState *env1)
     TranslationBlock *tb;
     uint8_t *tc_ptr;
     unsigned long next_tb;
+    unsigned int gen, link_gen;
 
     if (cpu_halted(env1) == EXCP_HALTED)
         return EXCP_HALTED;
@@ -346,6 +347,7 @@ int cpu_exec(CPUState *env1)
             }
 
             next_tb = 0; /* force lookup of first TB */
+            link_gen = 0;
             for(;;) {
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
@@ -573,17 +575,9 @@ int cpu_exec(CPUState *env1)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
+                gen = tb_invalidate_gen;
+                smp_rmb();
                 tb = tb_find_fast();
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tb_invalidated_flag = 0;
-                }
 #ifdef CONFIG_DEBUG_EXEC
                 qemu_log_mask(CPU_LOG_EXEC, "Trace 0x%08lx [" TARGET_FMT_lx "] %s\n",
                              (long)tb->tc_ptr, tb->pc,
@@ -591,11 +585,18 @@ int cpu_exec(CPUState *env1)
 #endif
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
-                   jump. */
+                   jump.  The calling TB may have been invalidated, for
+                   example while generating code, since it was looked
+                   up; do not link it then. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                    tb_lock_acquire();
+                    if (tb_invalidate_gen == link_gen) {
+                        tb_add_jump((TranslationBlock *)(next_tb & ~3),
+                                    next_tb & 3, tb);
+                    }
+                    tb_lock_release();
                 }
-                spin_unlock(&tb_lock);
+                link_gen = gen;
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -638,12 +639,28 @@ int cpu_exec(CPUState *env1)
                             next_tb = 0;
                             cpu_loop_exit();
                         }
+                    } else if ((next_tb & 3) == 3) {
+                        /* Execution counter expired: the block is hot
+                           and is replaced by a trace.  */
+                        tb = (TranslationBlock *)(long)(next_tb & ~3);
+                        cpu_pc_from_tb(env, tb);
+                        mmap_read_lock();
+                        tb_lock_acquire();
+                        tb_gen_trace(env, tb, link_gen);
+                        tb_lock_release();
+                        mmap_read_unlock();
+                        next_tb = 0;
                     }
                 }
                 env->current_tb = NULL;
                 /* reset soft MMU for next block (it can currently
                    only be set by a memory fault) */
             } /* for(;;) */
+        } else {
+            /* a fault while translating or invalidating code may have
+               longjmp'd here with the locks held */
+            tb_lock_reset();
+            mmap_lock_reset();
         }
     } /* for(;;) */
 
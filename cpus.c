@@ -312,6 +312,15 @@ void qemu_notify_event(void)
 void qemu_mutex_lock_iothread(void) {}
 void qemu_mutex_unlock_iothread(void) {}
 
+void do_info_mutex(Monitor *mon)
+{
+    monitor_printf(mon, "global mutex: not used without the I/O thread\n");
+    if (kvm_enabled()) {
+        monitor_printf(mon, "vcpu exits without the global mutex: %" PRIu64
+                       "\n", kvm_get_lockless_exits());
+    }
+}
+
 void vm_stop(int reason)
 {
     do_vm_stop(reason);
@@ -322,7 +331,8 @@ void vm_stop(int reason)
 #include "qemu-thread.h"
 
 QemuMutex qemu_global_mutex;
-static QemuMutex qemu_fair_mutex;
+static QemuCond qemu_io_proceeded_cond;
+static bool iothread_requesting_mutex;
 
 static QemuThread io_thread;
 
@@ -341,6 +351,83 @@ static void tcg_init_ipi(void);
 static void kvm_init_ipi(CPUState *env);
 static sigset_t block_io_signals(void);
 
+/* Global mutex statistics.  Only the holder of the mutex updates them.  */
+typedef struct GlobalMutexStats {
+    uint64_t acquired;
+    uint64_t contended;
+    int64_t wait_ns;
+    int64_t max_wait_ns;
+    int64_t hold_ns;
+    int64_t max_hold_ns;
+    int64_t acquired_at;
+    uint64_t kicks;
+    uint64_t kicks_coalesced;
+} GlobalMutexStats;
+
+static GlobalMutexStats global_mutex_stats;
+static GlobalMutexStats global_mutex_last;
+static int64_t global_mutex_stats_time;
+
+static void qemu_global_mutex_acquired(int64_t wait_ns)
+{
+    GlobalMutexStats *s = &global_mutex_stats;
+
+    s->acquired++;
+    if (wait_ns) {
+        s->contended++;
+        s->wait_ns += wait_ns;
+        if (wait_ns > s->max_wait_ns) {
+            s->max_wait_ns = wait_ns;
+        }
+    }
+    s->acquired_at = get_clock();
+}
+
+static void qemu_global_mutex_released(void)
+{
+    GlobalMutexStats *s = &global_mutex_stats;
+    int64_t held = get_clock() - s->acquired_at;
+
+    s->hold_ns += held;
+    if (held > s->max_hold_ns) {
+        s->max_hold_ns = held;
+    }
+}
+
+static void qemu_global_mutex_lock(void)
+{
+    int64_t start;
+
+    if (qemu_mutex_trylock(&qemu_global_mutex) == 0) {
+        qemu_global_mutex_acquired(0);
+        return;
+    }
+    start = get_clock();
+    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_global_mutex_acquired(MAX(get_clock() - start, 1));
+}
+
+static void qemu_global_mutex_unlock(void)
+{
+    qemu_global_mutex_released();
+    qemu_mutex_unlock(&qemu_global_mutex);
+}
+
+/* Sleeping on a condition is not holding the mutex, nor waiting for it */
+static void qemu_global_cond_wait(QemuCond *cond)
+{
+    qemu_global_mutex_released();
+    qemu_cond_wait(cond, &qemu_global_mutex);
+    qemu_global_mutex_acquired(0);
+}
+
+static void qemu_global_cond_timedwait(QemuCond *cond, uint64_t msecs)
+{
+    qemu_global_mutex_released();
+    qemu_cond_timedwait(cond, &qemu_global_mutex, msecs);
+    qemu_global_mutex_acquired(0);
+}
+
 /* If we have signalfd, we mask out the signals we want to handle and then
  * use signalfd to listen for them.  We rely on whatever the current signal
  * handler is to dispatch the signals when we receive them.
@@ -414,9 +501,10 @@ int qemu_init_main_loop(void)
 
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_system_cond);
-    qemu_mutex_init(&qemu_fair_mutex);
+    qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
-    qemu_mutex_lock(&qemu_global_mutex);
+    global_mutex_stats_time = get_clock();
+    qemu_global_mutex_lock();
 
     qemu_thread_self(&io_thread);
 
@@ -452,7 +540,7 @@ void run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
     while (!wi.done) {
         CPUState *self_env = cpu_single_env;
 
-        qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(&qemu_work_cond);
         cpu_single_env = self_env;
     }
 }
@@ -475,6 +563,7 @@ static void flush_queued_work(CPUState *env)
 
 static void qemu_wait_io_event_common(CPUState *env)
 {
+    env->thread_kicked = false;
     if (env->stop) {
         env->stop = 0;
         env->stopped = 1;
@@ -488,19 +577,12 @@ static void qemu_tcg_wait_io_event(void)
     CPUState *env;
 
     while (!any_cpu_has_work())
-        qemu_cond_timedwait(tcg_halt_cond, &qemu_global_mutex, 1000);
+        qemu_global_cond_timedwait(tcg_halt_cond, 1000);
 
-    qemu_mutex_unlock(&qemu_global_mutex);
-
-    /*
-     * Users of qemu_global_mutex can be starved, having no chance
-     * to acquire it since this path will get to it first.
-     * So use another lock to provide fairness.
-     */
-    qemu_mutex_lock(&qemu_fair_mutex);
-    qemu_mutex_unlock(&qemu_fair_mutex);
-
-    qemu_mutex_lock(&qemu_global_mutex);
+    /* Let the I/O thread in before we go back to the guest */
+    while (iothread_requesting_mutex) {
+        qemu_global_cond_wait(&qemu_io_proceeded_cond);
+    }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         qemu_wait_io_event_common(env);
@@ -549,12 +631,12 @@ static void qemu_kvm_eat_signal(CPUState *env, int timeout)
     sigaddset(&waitset, SIGBUS);
 
     do {
-        qemu_mutex_unlock(&qemu_global_mutex);
+        qemu_global_mutex_unlock();
 
         r = sigtimedwait(&waitset, &siginfo, &ts);
         e = errno;
 
-        qemu_mutex_lock(&qemu_global_mutex);
+        qemu_global_mutex_lock();
 
         if (r == -1 && !(e == EAGAIN || e == EINTR)) {
             fprintf(stderr, "sigtimedwait: %s\n", strerror(e));
@@ -583,7 +665,7 @@ static void qemu_kvm_eat_signal(CPUState *env, int timeout)
 static void qemu_kvm_wait_io_event(CPUState *env)
 {
     while (!cpu_has_work(env))
-        qemu_cond_timedwait(env->halt_cond, &qemu_global_mutex, 1000);
+        qemu_global_cond_timedwait(env->halt_cond, 1000);
 
     qemu_kvm_eat_signal(env, 0);
     qemu_wait_io_event_common(env);
@@ -595,7 +677,7 @@ static void *kvm_cpu_thread_fn(void *arg)
 {
     CPUState *env = arg;
 
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_global_mutex_lock();
     qemu_thread_self(env->thread);
     if (kvm_enabled())
         kvm_init_vcpu(env);
@@ -608,7 +690,7 @@ static void *kvm_cpu_thread_fn(void *arg)
 
     /* and wait for machine initialization */
     while (!qemu_system_ready)
-        qemu_cond_timedwait(&qemu_system_cond, &qemu_global_mutex, 100);
+        qemu_global_cond_timedwait(&qemu_system_cond, 100);
 
     while (1) {
         if (cpu_can_run(env))
@@ -627,14 +709,14 @@ static void *tcg_cpu_thread_fn(void *arg)
     qemu_thread_self(env->thread);
 
     /* signal CPU creation */
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_global_mutex_lock();
     for (env = first_cpu; env != NULL; env = env->next_cpu)
         env->created = 1;
     qemu_cond_signal(&qemu_cpu_cond);
 
     /* and wait for machine initialization */
     while (!qemu_system_ready)
-        qemu_cond_timedwait(&qemu_system_cond, &qemu_global_mutex, 100);
+        qemu_global_cond_timedwait(&qemu_system_cond, 100);
 
     while (1) {
         cpu_exec_all();
@@ -647,8 +729,18 @@ static void *tcg_cpu_thread_fn(void *arg)
 void qemu_cpu_kick(void *_env)
 {
     CPUState *env = _env;
+
     qemu_cond_broadcast(env->halt_cond);
-    qemu_thread_signal(env->thread, SIG_IPI);
+    /* One signal is enough to get the vcpu out of the guest; any further
+     * kick before it next waits for I/O finds the work anyway.
+     */
+    if (!env->thread_kicked) {
+        qemu_thread_signal(env->thread, SIG_IPI);
+        env->thread_kicked = true;
+        global_mutex_stats.kicks++;
+    } else {
+        global_mutex_stats.kicks_coalesced++;
+    }
 }
 
 int qemu_cpu_self(void *_env)
@@ -734,23 +826,79 @@ static sigset_t block_io_signals(void)
 
 void qemu_mutex_lock_iothread(void)
 {
+    int64_t start;
+
     if (kvm_enabled()) {
-        qemu_mutex_lock(&qemu_fair_mutex);
-        qemu_mutex_lock(&qemu_global_mutex);
-        qemu_mutex_unlock(&qemu_fair_mutex);
+        qemu_global_mutex_lock();
+        return;
+    }
+
+    /* The TCG thread only drops the mutex when it runs out of work or is
+     * kicked, so kick it and have it wait for us before it takes the
+     * mutex again.
+     */
+    iothread_requesting_mutex = true;
+    if (qemu_mutex_trylock(&qemu_global_mutex) == 0) {
+        qemu_global_mutex_acquired(0);
     } else {
-        qemu_mutex_lock(&qemu_fair_mutex);
-        if (qemu_mutex_trylock(&qemu_global_mutex)) {
-            qemu_thread_signal(tcg_cpu_thread, SIG_IPI);
-            qemu_mutex_lock(&qemu_global_mutex);
-        }
-        qemu_mutex_unlock(&qemu_fair_mutex);
+        start = get_clock();
+        qemu_thread_signal(tcg_cpu_thread, SIG_IPI);
+        qemu_mutex_lock(&qemu_global_mutex);
+        qemu_global_mutex_acquired(MAX(get_clock() - start, 1));
     }
+    iothread_requesting_mutex = false;
+    qemu_cond_broadcast(&qemu_io_proceeded_cond);
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
-    qemu_mutex_unlock(&qemu_global_mutex);
+    qemu_global_mutex_unlock();
+}
+
+void do_info_mutex(Monitor *mon)
+{
+    GlobalMutexStats *s = &global_mutex_stats, *l = &global_mutex_last;
+    static uint64_t last_lockless_exits;
+    uint64_t acquired, contended, lockless_exits;
+    int64_t now, delta;
+
+    now = get_clock();
+    delta = now - global_mutex_stats_time;
+    if (delta <= 0) {
+        delta = 1;
+    }
+
+    acquired = s->acquired - l->acquired;
+    contended = s->contended - l->contended;
+    monitor_printf(mon, "global mutex: %.1f acquisitions/s, "
+                   "%.1f%% contended\n", acquired * 1e9 / delta,
+                   acquired ? contended * 100.0 / acquired : 0.0);
+    monitor_printf(mon, "  held   %5.1f%% of the time, %" PRId64
+                   " ns average, %" PRId64 " ns max\n",
+                   (s->hold_ns - l->hold_ns) * 100.0 / delta,
+                   acquired ? (s->hold_ns - l->hold_ns) / (int64_t)acquired : 0,
+                   s->max_hold_ns);
+    monitor_printf(mon, "  waited %5.1f%% of the time, %" PRId64
+                   " ns average, %" PRId64 " ns max\n",
+                   (s->wait_ns - l->wait_ns) * 100.0 / delta,
+                   contended ? (s->wait_ns - l->wait_ns) / (int64_t)contended
+                             : 0,
+                   s->max_wait_ns);
+    monitor_printf(mon, "vcpu kicks: %.1f signals/s, %.1f coalesced/s\n",
+                   (s->kicks - l->kicks) * 1e9 / delta,
+                   (s->kicks_coalesced - l->kicks_coalesced) * 1e9 / delta);
+    if (kvm_enabled()) {
+        lockless_exits = kvm_get_lockless_exits();
+        monitor_printf(mon, "vcpu exits without the global mutex: %.1f/s\n",
+                       (lockless_exits - last_lockless_exits) * 1e9 / delta);
+        last_lockless_exits = lockless_exits;
+    }
+    monitor_printf(mon, "(rates over the last %.1f s)\n", delta / 1e9);
+
+    *l = *s;
+    s->max_hold_ns = 0;
+    s->max_wait_ns = 0;
+    global_mutex_stats_time = now;
 }
 
 static int all_vcpus_paused(void)
@@ -777,7 +925,7 @@ void pause_all_vcpus(void)
     }
 
     while (!all_vcpus_paused()) {
-        qemu_cond_timedwait(&qemu_pause_cond, &qemu_global_mutex, 100);
+        qemu_global_cond_timedwait(&qemu_pause_cond, 100);
         penv = first_cpu;
         while (penv) {
             qemu_cpu_kick(penv);
@@ -808,7 +956,7 @@ static void tcg_init_vcpu(void *_env)
         qemu_cond_init(env->halt_cond);
         qemu_thread_create(env->thread, tcg_cpu_thread_fn, env);
         while (env->created == 0)
-            qemu_cond_timedwait(&qemu_cpu_cond, &qemu_global_mutex, 100);
+            qemu_global_cond_timedwait(&qemu_cpu_cond, 100);
         tcg_cpu_thread = env->thread;
         tcg_halt_cond = env->halt_cond;
     } else {
@@ -824,7 +972,7 @@ static void kvm_start_vcpu(CPUState *env)
     qemu_cond_init(env->halt_cond);
     qemu_thread_create(env->thread, kvm_cpu_thread_fn, env);
     while (env->created == 0)
-        qemu_cond_timedwait(&qemu_cpu_cond, &qemu_global_mutex, 100);
+        qemu_global_cond_timedwait(&qemu_cpu_cond, 100);
 }
 
 void qemu_init_vcpu(void *_env)
@@ -6,6 +6,7 @@ int qemu_init_main_loop(void);
 void qemu_main_loop_start(void);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
+void do_info_mutex(Monitor *mon);
 
 /* vl.c */
 extern int smp_cores;
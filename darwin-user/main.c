@@ -842,7 +842,7 @@ int main(int argc, char **argv)
 #endif
     }
     
-    cpu_exec_init_all(0);
+    cpu_exec_init_all(0, 0);
     /* NOTE: we need to init the CPU at this stage to get
        qemu_host_page_size */
     env = cpu_init(cpu_model);
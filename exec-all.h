@@ -88,6 +88,7 @@ int cpu_restore_state(struct TranslationBlock *tb,
                       void *puc);
 void cpu_resume_from_signal(CPUState *env1, void *puc);
 void cpu_io_recompile(CPUState *env, void *retaddr);
+void tb_gen_trace(CPUState *env, TranslationBlock *tb, unsigned int gen);
 TranslationBlock *tb_gen_code(CPUState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
@@ -107,9 +108,6 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
-
 #define MIN_CODE_GEN_BUFFER_SIZE     (1024 * 1024)
 
 /* estimated block size for TB allocation */
@@ -131,13 +129,14 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_HOT_COUNT   0x10000 /* Count executions to detect hot blocks.  */
+#define CF_TRACE       0x20000 /* Hot block retranslated as a trace.  */
+#define CF_INVALID     0x40000 /* Removed by tb_phys_invalidate().  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -158,6 +157,9 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* executions left before the block is retranslated as a trace
+       (only used with CF_HOT_COUNT) */
+    uint32_t hot_count;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -175,19 +177,15 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
-{
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
-}
-
 TranslationBlock *tb_alloc(target_ulong pc);
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *env);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
-
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+TranslationBlock *tb_phys_hash_lookup(CPUState *env1, target_ulong pc,
+                                      target_ulong cs_base, uint64_t flags,
+                                      tb_page_addr_t phys_pc);
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -267,7 +265,26 @@ TranslationBlock *tb_find_pc(unsigned long pc_ptr);
 
 extern spinlock_t tb_lock;
 
-extern int tb_invalidated_flag;
+/* tb_lock must be held to translate code, to invalidate it and to link
+   TBs, but not to look TBs up.  tb_lock_reset() drops it after a fault
+   longjmp'd out of code that held it. */
+void tb_lock_acquire(void);
+void tb_lock_release(void);
+void tb_lock_reset(void);
+
+/* bumped whenever a TB is invalidated or the buffer is flushed */
+extern unsigned int tb_invalidate_gen;
+
+/* In user mode the guest memory map is protected by a lock that is held
+   for writing while the map changes and for reading while translating.
+   It is taken before tb_lock.  See mmap.c for user mode. */
+#if !defined(CONFIG_USER_ONLY)
+static inline void mmap_lock(void) {}
+static inline void mmap_unlock(void) {}
+static inline void mmap_read_lock(void) {}
+static inline void mmap_read_unlock(void) {}
+static inline void mmap_lock_reset(void) {}
+#endif
 
 #if !defined(CONFIG_USER_ONLY)
 
@@ -342,6 +359,8 @@ CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler);
 
 /* vl.c */
 extern int singlestep;
+extern int tb_hot_threshold;
+extern const char *pin_globals;
 
 /* cpu-exec.c */
 extern volatile sig_atomic_t exit_request;
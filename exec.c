@@ -33,6 +33,7 @@
 #include "osdep.h"
 #include "kvm.h"
 #include "qemu-timer.h"
+#include "qemu-barrier.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #include <signal.h>
@@ -72,12 +73,69 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
+/* The translation buffer is split into equally sized regions which
+   are filled one after the other.  Each region owns a slice of the TB
+   descriptor array so that tb_find_pc() can locate the region from the
+   host address.  When no region is left, the region with the oldest
+   generation is evicted instead of flushing the whole buffer. */
+typedef struct TBRegion {
+    uint8_t *start;
+    uint8_t *end;               /* end of the code once the region is full */
+    TranslationBlock *tbs;
+    int nb_tbs;
+    int nb_retranslated;        /* TBs translated from evicted code */
+    unsigned int generation;
+} TBRegion;
+
 static TranslationBlock *tbs;
-static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-static int nb_tbs;
-/* any access to the tbs or the page table must use this lock */
+static TBRegion *tb_regions;
+static int nb_tb_regions;       /* regions reserved in the buffer */
+static int nb_tb_regions_init;  /* regions used before growing */
+static int nb_tb_regions_used;  /* regions handed out so far */
+static TBRegion *cur_region;
+static unsigned int tb_region_generation;
+static int code_gen_max_blocks; /* per region */
+
+/* The physical PC hash table.  Each bucket fills a cache line and
+   stores the hash of its entries next to the TB pointers, so that a
+   lookup only dereferences the TBs whose hash matches.  Full buckets
+   are extended with overflow buckets, and the table doubles when it
+   is more than 3/4 full.
+
+   Lookups do not take tb_lock.  An entry is published by storing its
+   TB pointer after the TB is complete and its hash is stored, and a
+   resized table replaces the old one with a single pointer store.  A
+   lookup may thus miss a TB that is being added, so misses are checked
+   again with tb_lock held.  Replaced tables are freed only when no
+   other thread can still be walking them. */
+#define TB_HASH_BUCKET_ENTRIES \
+    ((64 - sizeof(void *)) / (sizeof(uint32_t) + sizeof(void *)))
+#define TB_HASH_MIN_BITS 12
+#define TB_HASH_MAX_BITS 22
+
+typedef struct TBHashBucket {
+    uint32_t hash[TB_HASH_BUCKET_ENTRIES];
+    TranslationBlock *tb[TB_HASH_BUCKET_ENTRIES];
+    struct TBHashBucket *next;
+} __attribute__((aligned (64))) TBHashBucket;
+
+typedef struct TBHashTable {
+    TBHashBucket *buckets;
+    unsigned int bits;
+    struct TBHashTable *next;   /* in the list of replaced tables */
+} TBHashTable;
+
+static TBHashTable *tb_hash;
+static TBHashTable *tb_hash_retired;
+static int tb_hash_count;
+static int tb_hash_nb_overflow;
+/* any change to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
+#if defined(CONFIG_USE_NPTL)
+static __thread int have_tb_lock;
+#else
+static int have_tb_lock;
+#endif
 
 #if defined(__arm__) || defined(__sparc_v9__)
 /* The prologue must be reachable with a direct jump. ARM and Sparc64
@@ -98,8 +156,9 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 uint8_t code_gen_prologue[1024] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
-/* threshold to flush the translated code buffer */
-static unsigned long code_gen_buffer_max_size;
+static unsigned long code_gen_region_size;
+/* threshold to switch to the next region */
+static unsigned long code_gen_region_max_size;
 static uint8_t *code_gen_ptr;
 
 #if !defined(CONFIG_USER_ONLY)
@@ -127,6 +186,9 @@ typedef struct PageDesc {
     /* in order to optimize self modifying code, we count the number
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
+    /* set once TBs of this page were dropped because the translation
+       buffer was full */
+    unsigned int code_evicted;
     uint8_t *code_bitmap;
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
@@ -220,6 +282,14 @@ static int tlb_flush_count;
 #endif
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_trace_count;
+static int tb_region_evict_count;
+static int tb_evict_count;
+static int tb_gen_count;
+static int tb_retranslate_count;
+static int tb_hash_resize_count;
+static int64_t tb_hash_lookup_count;
+static int64_t tb_hash_probe_count;
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -440,11 +510,11 @@ static inline PhysPageDesc *phys_page_find(target_phys_addr_t index)
 static void tlb_protect_code(ram_addr_t ram_addr);
 static void tlb_unprotect_code_phys(CPUState *env, ram_addr_t ram_addr,
                                     target_ulong vaddr);
-#define mmap_lock() do { } while(0)
-#define mmap_unlock() do { } while(0)
 #endif
 
 #define DEFAULT_CODE_GEN_BUFFER_SIZE (32 * 1024 * 1024)
+/* number of regions the initial translation buffer is split into */
+#define CODE_GEN_REGIONS 8
 
 #if defined(CONFIG_USER_ONLY)
 /* Currently it is not recommended to allocate big chunks of data in
@@ -457,12 +527,54 @@ static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
                __attribute__((aligned (CODE_GEN_ALIGN)));
 #endif
 
-static void code_gen_alloc(unsigned long tb_size)
+static unsigned long code_gen_region_size_for(unsigned long size)
+{
+    unsigned long region_size;
+
+    region_size = size / CODE_GEN_REGIONS;
+    if (region_size < MIN_CODE_GEN_BUFFER_SIZE)
+        region_size = MIN_CODE_GEN_BUFFER_SIZE;
+    return region_size & ~(CODE_GEN_ALIGN - 1);
+}
+
+static void code_gen_regions_init(unsigned long init_size)
 {
+    int i;
+
+    nb_tb_regions = code_gen_buffer_size / code_gen_region_size;
+    nb_tb_regions_init = init_size / code_gen_region_size;
+    if (nb_tb_regions_init < 1)
+        nb_tb_regions_init = 1;
+    if (nb_tb_regions_init > nb_tb_regions)
+        nb_tb_regions_init = nb_tb_regions;
+    code_gen_region_max_size = code_gen_region_size -
+        (TCG_MAX_OP_SIZE * OPC_MAX_SIZE);
+    code_gen_max_blocks = code_gen_region_size / CODE_GEN_AVG_BLOCK_SIZE;
+    /* descriptors of regions that are never used are not touched, so
+       reserving them for the maximum size costs only address space */
+    tbs = qemu_malloc(nb_tb_regions * code_gen_max_blocks *
+                      sizeof(TranslationBlock));
+    tb_regions = qemu_mallocz(nb_tb_regions * sizeof(TBRegion));
+    for (i = 0; i < nb_tb_regions; i++) {
+        tb_regions[i].start = code_gen_buffer + i * code_gen_region_size;
+        tb_regions[i].end = tb_regions[i].start;
+        tb_regions[i].tbs = tbs + i * code_gen_max_blocks;
+    }
+    nb_tb_regions_used = 1;
+    cur_region = &tb_regions[0];
+    cur_region->generation = ++tb_region_generation;
+}
+
+static void code_gen_alloc(unsigned long tb_size, unsigned long tb_max_size)
+{
+    unsigned long init_size;
+
 #ifdef USE_STATIC_CODE_GEN_BUFFER
     code_gen_buffer = static_code_gen_buffer;
     code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
     map_exec(code_gen_buffer, code_gen_buffer_size);
+    init_size = code_gen_buffer_size;
+    code_gen_region_size = code_gen_region_size_for(init_size);
 #else
     code_gen_buffer_size = tb_size;
     if (code_gen_buffer_size == 0) {
@@ -476,6 +588,12 @@ static void code_gen_alloc(unsigned long tb_size)
     }
     if (code_gen_buffer_size < MIN_CODE_GEN_BUFFER_SIZE)
         code_gen_buffer_size = MIN_CODE_GEN_BUFFER_SIZE;
+    /* the buffer starts at the requested size and may grow up to
+       tb_max_size, so reserve the maximum now */
+    init_size = code_gen_buffer_size;
+    code_gen_region_size = code_gen_region_size_for(init_size);
+    if (tb_max_size > code_gen_buffer_size)
+        code_gen_buffer_size = tb_max_size;
     /* The code gen buffer location may have constraints depending on
        the host cpu and OS */
 #if defined(__linux__) 
@@ -553,20 +671,244 @@ static void code_gen_alloc(unsigned long tb_size)
 #endif
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size - 
-        (TCG_MAX_OP_SIZE * OPC_MAX_SIZE);
-    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tbs = qemu_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    if (code_gen_region_size > code_gen_buffer_size)
+        code_gen_region_size = code_gen_buffer_size & ~(CODE_GEN_ALIGN - 1);
+    code_gen_regions_init(init_size);
+}
+
+void tb_lock_acquire(void)
+{
+    spin_lock(&tb_lock);
+    have_tb_lock = 1;
+}
+
+void tb_lock_release(void)
+{
+    have_tb_lock = 0;
+    spin_unlock(&tb_lock);
+}
+
+/* release tb_lock if a fault longjmp'd out of code that held it */
+void tb_lock_reset(void)
+{
+    if (have_tb_lock) {
+        tb_lock_release();
+    }
+}
+
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc,
+                                    target_ulong cs_base, uint64_t flags)
+{
+    uint64_t h;
+
+    h = (uint64_t)phys_pc ^ ((uint64_t)cs_base << 17) ^
+        (flags * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static TBHashTable *tb_hash_alloc(unsigned int bits)
+{
+    TBHashTable *t;
+
+    t = qemu_mallocz(sizeof(*t));
+    t->bits = bits;
+    t->buckets = qemu_memalign(sizeof(TBHashBucket),
+                               sizeof(TBHashBucket) << bits);
+    memset(t->buckets, 0, sizeof(TBHashBucket) << bits);
+    return t;
+}
+
+static void tb_hash_free_overflow(TBHashBucket *buckets, unsigned int bits)
+{
+    TBHashBucket *b, *next;
+    unsigned int i;
+
+    for (i = 0; i < (1u << bits); i++) {
+        for (b = buckets[i].next; b != NULL; b = next) {
+            next = b->next;
+            qemu_vfree(b);
+        }
+        buckets[i].next = NULL;
+    }
+}
+
+/* Only this thread can be walking a table when it runs the only CPU.
+   System emulation runs all the CPUs in one thread. */
+static int tb_hash_single_thread(void)
+{
+#if defined(CONFIG_USE_NPTL)
+    return first_cpu == NULL || first_cpu->next_cpu == NULL;
+#else
+    return 1;
+#endif
+}
+
+/* publish a new table and retire the current one.  The replaced tables
+   add up to less than the current one, so they are simply kept until
+   the process is down to a single thread. */
+static void tb_hash_replace(TBHashTable *t)
+{
+    TBHashTable *old;
+
+    smp_wmb();
+    old = tb_hash;
+    tb_hash = t;
+    if (!old) {
+        return;
+    }
+    old->next = tb_hash_retired;
+    tb_hash_retired = old;
+    if (tb_hash_single_thread()) {
+        while ((old = tb_hash_retired) != NULL) {
+            tb_hash_retired = old->next;
+            tb_hash_free_overflow(old->buckets, old->bits);
+            qemu_vfree(old->buckets);
+            qemu_free(old);
+        }
+    }
+}
+
+static void tb_hash_insert_1(TBHashBucket *b, uint32_t h,
+                             TranslationBlock *tb)
+{
+    int i;
+
+    for (;;) {
+        for (i = 0; i < TB_HASH_BUCKET_ENTRIES; i++) {
+            if (!b->tb[i]) {
+                b->hash[i] = h;
+                smp_wmb();
+                b->tb[i] = tb;
+                return;
+            }
+        }
+        if (!b->next) {
+            TBHashBucket *next;
+
+            next = qemu_memalign(sizeof(TBHashBucket), sizeof(TBHashBucket));
+            memset(next, 0, sizeof(TBHashBucket));
+            smp_wmb();
+            b->next = next;
+            tb_hash_nb_overflow++;
+        }
+        b = b->next;
+    }
+}
+
+/* rehash every entry into a table of 1 << bits buckets.  The stored
+   hashes are reused, so the TBs themselves are not touched. */
+static void tb_hash_resize(unsigned int bits)
+{
+    TBHashTable *t;
+    TBHashBucket *b;
+    unsigned int i, mask;
+    int j;
+
+    t = tb_hash_alloc(bits);
+    mask = (1u << bits) - 1;
+    tb_hash_nb_overflow = 0;
+    for (i = 0; i < (1u << tb_hash->bits); i++) {
+        for (b = &tb_hash->buckets[i]; b != NULL; b = b->next) {
+            for (j = 0; j < TB_HASH_BUCKET_ENTRIES; j++) {
+                if (b->tb[j]) {
+                    tb_hash_insert_1(&t->buckets[b->hash[j] & mask],
+                                     b->hash[j], b->tb[j]);
+                }
+            }
+        }
+    }
+    tb_hash_replace(t);
+    tb_hash_resize_count++;
+}
+
+static void tb_hash_insert(TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    uint32_t h;
+
+    if (tb_hash->bits < TB_HASH_MAX_BITS &&
+        tb_hash_count >= (TB_HASH_BUCKET_ENTRIES << tb_hash->bits) / 4 * 3) {
+        tb_hash_resize(tb_hash->bits + 1);
+    }
+    h = tb_hash_func(phys_pc, tb->cs_base, tb->flags);
+    tb_hash_insert_1(&tb_hash->buckets[h & ((1u << tb_hash->bits) - 1)],
+                     h, tb);
+    tb_hash_count++;
+}
+
+static void tb_hash_remove(TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    TBHashBucket *b;
+    uint32_t h;
+    int i;
+
+    h = tb_hash_func(phys_pc, tb->cs_base, tb->flags);
+    for (b = &tb_hash->buckets[h & ((1u << tb_hash->bits) - 1)];
+         b != NULL; b = b->next) {
+        for (i = 0; i < TB_HASH_BUCKET_ENTRIES; i++) {
+            if (b->tb[i] == tb) {
+                b->tb[i] = NULL;
+                tb_hash_count--;
+                return;
+            }
+        }
+    }
+}
+
+/* find the TB translated for the given CPU state, or NULL.  This does
+   not need tb_lock, but without it a TB that is being added may be
+   missed. */
+TranslationBlock *tb_phys_hash_lookup(CPUState *env1, target_ulong pc,
+                                      target_ulong cs_base, uint64_t flags,
+                                      tb_page_addr_t phys_pc)
+{
+    TBHashTable *t;
+    TBHashBucket *b;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_page1;
+    target_ulong virt_page2;
+    uint32_t h;
+    int i;
+
+    phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, cs_base, flags);
+    tb_hash_lookup_count++;
+    t = tb_hash;
+    for (b = &t->buckets[h & ((1u << t->bits) - 1)];
+         b != NULL; b = b->next) {
+        for (i = 0; i < TB_HASH_BUCKET_ENTRIES; i++) {
+            tb = b->tb[i];
+            if (!tb || b->hash[i] != h)
+                continue;
+            tb_hash_probe_count++;
+            if (tb->pc == pc &&
+                tb->page_addr[0] == phys_page1 &&
+                tb->cs_base == cs_base &&
+                tb->flags == flags) {
+                /* check next page if needed */
+                if (tb->page_addr[1] == -1)
+                    return tb;
+                virt_page2 = (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+                if (tb->page_addr[1] == get_page_addr_code(env1, virt_page2))
+                    return tb;
+            }
+        }
+    }
+    return NULL;
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
-   size. */
-void cpu_exec_init_all(unsigned long tb_size)
+   size. The buffer may grow up to 'tb_max_size' bytes when code is
+   retranslated too often; zero means no growth. */
+void cpu_exec_init_all(unsigned long tb_size, unsigned long tb_max_size)
 {
     cpu_gen_init();
-    code_gen_alloc(tb_size);
+    code_gen_alloc(tb_size, tb_max_size);
     code_gen_ptr = code_gen_buffer;
+    tb_hash_replace(tb_hash_alloc(TB_HASH_MIN_BITS));
     page_init();
 #if !defined(CONFIG_USER_ONLY)
     io_mem_init();
@@ -670,6 +1012,9 @@ static void page_flush_tb_1 (int level, void **lp)
     if (level == 0) {
         PageDesc *pd = *lp;
         for (i = 0; i < L2_SIZE; ++i) {
+            if (pd[i].first_tb) {
+                pd[i].code_evicted = 1;
+            }
             pd[i].first_tb = NULL;
             invalidate_page_bitmap(pd + i);
         }
@@ -694,25 +1039,50 @@ static void page_flush_tb(void)
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+    int i;
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+    printf("qemu: flush regions=%d cur_code_size=%ld cur_nb_tbs=%d\n",
+           nb_tb_regions_used,
+           (unsigned long)(code_gen_ptr - cur_region->start),
+           cur_region->nb_tbs);
 #endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
+    if ((unsigned long)(code_gen_ptr - cur_region->start) >
+        code_gen_region_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
-    nb_tbs = 0;
+    /* the regions stay allocated; the emptied ones are reused before
+       the buffer grows again */
+    for (i = 0; i < nb_tb_regions_used; i++) {
+        tb_regions[i].nb_tbs = 0;
+        tb_regions[i].nb_retranslated = 0;
+        tb_regions[i].end = tb_regions[i].start;
+        tb_regions[i].generation = 0;
+    }
+    cur_region = &tb_regions[0];
+    cur_region->generation = ++tb_region_generation;
+
+    /* as in tb_phys_invalidate(): a thread still looking up a TB either
+       sees the new generation or has its jump cache cleared below */
+    tb_invalidate_gen++;
+    smp_mb();
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    /* the overflow buckets are kept, as other threads may be walking
+       them */
+    for (i = 0; i < (1u << tb_hash->bits); i++) {
+        TBHashBucket *b;
+
+        for (b = &tb_hash->buckets[i]; b != NULL; b = b->next) {
+            memset(b->tb, 0, sizeof(b->tb));
+        }
+    }
+    tb_hash_count = 0;
     page_flush_tb();
 
-    code_gen_ptr = code_gen_buffer;
+    code_gen_ptr = cur_region->start;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
@@ -723,10 +1093,12 @@ void tb_flush(CPUState *env1)
 static void tb_invalidate_check(target_ulong address)
 {
     TranslationBlock *tb;
-    int i;
+    TBRegion *r;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for(r = tb_regions; r < tb_regions + nb_tb_regions_used; r++) {
+        for(tb = r->tbs; tb < r->tbs + r->nb_tbs; tb++) {
+            if (tb->cflags & CF_INVALID)
+                continue;
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -741,10 +1113,13 @@ static void tb_invalidate_check(target_ulong address)
 static void tb_page_check(void)
 {
     TranslationBlock *tb;
-    int i, flags1, flags2;
+    TBRegion *r;
+    int flags1, flags2;
 
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for(r = tb_regions; r < tb_regions + nb_tb_regions_used; r++) {
+        for(tb = r->tbs; tb < r->tbs + r->nb_tbs; tb++) {
+            if (tb->cflags & CF_INVALID)
+                continue;
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
             if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
@@ -757,21 +1132,6 @@ static void tb_page_check(void)
 
 #endif
 
-/* invalidate one TB */
-static inline void tb_remove(TranslationBlock **ptb, TranslationBlock *tb,
-                             int next_offset)
-{
-    TranslationBlock *tb1;
-    for(;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = *(TranslationBlock **)((char *)tb1 + next_offset);
-            break;
-        }
-        ptb = (TranslationBlock **)((char *)tb1 + next_offset);
-    }
-}
-
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -832,11 +1192,9 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
+    /* remove the TB from the hash table */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb,
-              offsetof(TranslationBlock, phys_hash_next));
+    tb_hash_remove(tb, phys_pc);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -850,7 +1208,13 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         invalidate_page_bitmap(p);
     }
 
-    tb_invalidated_flag = 1;
+    /* a thread that found the TB before it left the hash table checks
+       tb_invalidate_gen after adding it to its jump cache, so either
+       that thread sees the new generation or the loop below sees its
+       jump cache entry */
+    tb->cflags |= CF_INVALID;
+    tb_invalidate_gen++;
+    smp_mb();
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
@@ -944,6 +1308,7 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    PageDesc *p;
 
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
@@ -952,8 +1317,18 @@ TranslationBlock *tb_gen_code(CPUState *env,
         tb_flush(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
-        /* Don't forget to invalidate previous TB info.  */
-        tb_invalidated_flag = 1;
+    }
+    tb_gen_count++;
+    p = page_find(phys_pc >> TARGET_PAGE_BITS);
+    if (p && p->code_evicted) {
+        tb_retranslate_count++;
+        cur_region->nb_retranslated++;
+    }
+    if (cflags == 0 && tb_hot_threshold > 0) {
+        /* count executions so that the block can be retranslated as
+           a trace once it is hot */
+        cflags = CF_HOT_COUNT;
+        tb->hot_count = tb_hot_threshold;
     }
     tc_ptr = code_gen_ptr;
     tb->tc_ptr = tc_ptr;
@@ -1226,16 +1601,81 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif /* TARGET_HAS_SMC */
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* invalidate all the TBs of a region so that it can be reused */
+static void tb_region_evict(TBRegion *r)
+{
+    TranslationBlock *tb;
+    PageDesc *p;
+    int i;
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        tb = &r->tbs[i];
+        if (tb->cflags & CF_INVALID)
+            continue;
+        p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
+        p->code_evicted = 1;
+        if (tb->page_addr[1] != -1) {
+            p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
+            p->code_evicted = 1;
+        }
+        tb_phys_invalidate(tb, -1);
+        tb_evict_count++;
+    }
+    r->nb_tbs = 0;
+    r->nb_retranslated = 0;
+    r->end = r->start;
+    tb_region_evict_count++;
+}
+
+/* Switch to another region once the current one is full.  The buffer
+   grows up to its initial size freely, and beyond it (up to the
+   reserved maximum) only while a large part of the code translated in
+   the last region had already been evicted once.  Otherwise the oldest
+   region is evicted.  Return 0 if the whole buffer must be flushed. */
+static int tb_region_next(void)
+{
+    TBRegion *r, *oldest;
+    int i;
+
+    cur_region->end = code_gen_ptr;
+    oldest = NULL;
+    for (i = 0; i < nb_tb_regions_used; i++) {
+        r = &tb_regions[i];
+        if (r != cur_region &&
+            (!oldest || r->generation < oldest->generation))
+            oldest = r;
+    }
+    if (oldest && oldest->nb_tbs == 0) {
+        r = oldest;
+    } else if (nb_tb_regions_used < nb_tb_regions_init ||
+               (nb_tb_regions_used < nb_tb_regions &&
+                cur_region->nb_retranslated * 4 > cur_region->nb_tbs)) {
+        r = &tb_regions[nb_tb_regions_used++];
+    } else if (oldest) {
+        tb_region_evict(oldest);
+        r = oldest;
+    } else {
+        return 0;
+    }
+    r->generation = ++tb_region_generation;
+    cur_region = r;
+    code_gen_ptr = r->start;
+    return 1;
+}
+
+/* Allocate a new translation block. Move to the next region if too
+   many translation blocks or too much generated code; return NULL if
+   the translation buffer must be flushed. */
 TranslationBlock *tb_alloc(target_ulong pc)
 {
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
-        return NULL;
-    tb = &tbs[nb_tbs++];
+    if (cur_region->nb_tbs >= code_gen_max_blocks ||
+        (code_gen_ptr - cur_region->start) >= code_gen_region_max_size) {
+        if (!tb_region_next())
+            return NULL;
+    }
+    tb = &cur_region->tbs[cur_region->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
     return tb;
@@ -1243,12 +1683,14 @@ TranslationBlock *tb_alloc(target_ulong pc)
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = cur_region;
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
-        nb_tbs--;
+        r->nb_tbs--;
     }
 }
 
@@ -1257,17 +1699,9 @@ void tb_free(TranslationBlock *tb)
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
-    /* Grab the mmap lock to stop another thread invalidating this TB
+    /* Grab the mmap lock to stop another thread unmapping this TB
        before we are done.  */
-    mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    mmap_read_lock();
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1286,10 +1720,14 @@ void tb_link_page(TranslationBlock *tb,
     if (tb->tb_next_offset[1] != 0xffff)
         tb_reset_jump(tb, 1);
 
+    /* add in the physical hash table last: other threads may find the
+       TB from then on without taking tb_lock */
+    tb_hash_insert(tb, phys_pc);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
-    mmap_unlock();
+    mmap_read_unlock();
 }
 
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
@@ -1299,18 +1737,24 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
     int m_min, m_max, m;
     unsigned long v;
     TranslationBlock *tb;
+    TBRegion *r;
+    uint8_t *end;
 
-    if (nb_tbs <= 0)
+    if (tc_ptr < (unsigned long)code_gen_buffer)
         return NULL;
-    if (tc_ptr < (unsigned long)code_gen_buffer ||
-        tc_ptr >= (unsigned long)code_gen_ptr)
+    m = (tc_ptr - (unsigned long)code_gen_buffer) / code_gen_region_size;
+    if (m >= nb_tb_regions_used)
+        return NULL;
+    r = &tb_regions[m];
+    end = (r == cur_region) ? code_gen_ptr : r->end;
+    if (r->nb_tbs <= 0 || tc_ptr >= (unsigned long)end)
         return NULL;
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (unsigned long)tb->tc_ptr;
         if (v == tc_ptr)
             return tb;
@@ -1320,7 +1764,7 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1740,7 +2184,8 @@ static int cpu_notify_migration_log(int enable)
 }
 
 static void phys_page_for_each_1(CPUPhysMemoryClient *client,
-                                 int level, void **lp)
+                                 int level, void **lp,
+                                 target_phys_addr_t addr)
 {
     int i;
 
@@ -1749,16 +2194,20 @@ static void phys_page_for_each_1(CPUPhysMemoryClient *client,
     }
     if (level == 0) {
         PhysPageDesc *pd = *lp;
+        addr <<= L2_BITS + TARGET_PAGE_BITS;
         for (i = 0; i < L2_SIZE; ++i) {
             if (pd[i].phys_offset != IO_MEM_UNASSIGNED) {
-                client->set_memory(client, pd[i].region_offset,
+                client->set_memory(client,
+                                   addr | ((target_phys_addr_t)i <<
+                                           TARGET_PAGE_BITS),
                                    TARGET_PAGE_SIZE, pd[i].phys_offset);
             }
         }
     } else {
         void **pp = *lp;
         for (i = 0; i < L2_SIZE; ++i) {
-            phys_page_for_each_1(client, level - 1, pp + i);
+            phys_page_for_each_1(client, level - 1, pp + i,
+                                 (addr << L2_BITS) | i);
         }
     }
 }
@@ -1768,7 +2217,7 @@ static void phys_page_for_each(CPUPhysMemoryClient *client)
     int i;
     for (i = 0; i < P_L1_SIZE; ++i) {
         phys_page_for_each_1(client, P_L1_SHIFT / L2_BITS - 1,
-                             l1_phys_map + 1);
+                             l1_phys_map + i, i);
     }
 }
 
@@ -2415,7 +2864,9 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         if (!(p->flags & PAGE_WRITE) &&
             (flags & PAGE_WRITE) &&
             p->first_tb) {
+            tb_lock_acquire();
             tb_invalidate_phys_page(addr, 0, NULL);
+            tb_lock_release();
         }
         p->flags = flags;
     }
@@ -2445,12 +2896,20 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     end = TARGET_PAGE_ALIGN(start+len); /* must do before we loose bits in the next step */
     start = start & TARGET_PAGE_MASK;
 
+    p = NULL;
     for (addr = start, len = end - start;
          len != 0;
          len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if( !p )
-            return -1;
+        /* the descriptors of consecutive pages are adjacent within a
+           leaf of the page table, so large buffers only walk the table
+           once per leaf */
+        if (p && ((addr >> TARGET_PAGE_BITS) & (L2_SIZE - 1)) != 0) {
+            p++;
+        } else {
+            p = page_find(addr >> TARGET_PAGE_BITS);
+            if( !p )
+                return -1;
+        }
         if( !(p->flags & PAGE_VALID) )
             return -1;
 
@@ -2465,7 +2924,6 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
                 if (!page_unprotect(addr, 0, NULL))
                     return -1;
             }
-            return 0;
         }
     }
     return 0;
@@ -2481,12 +2939,18 @@ int page_unprotect(target_ulong address, unsigned long pc, void *puc)
 
     /* Technically this isn't safe inside a signal handler.  However we
        know this only ever happens in a synchronous SEGV handler, so in
-       practice it seems to be ok.  */
-    mmap_lock();
+       practice it seems to be ok.  The map only has to stay put, so
+       threads unprotect pages in parallel with translation; tb_lock
+       serializes the changes to the page flags and the TBs.  If the
+       current TB is invalidated, tb_invalidate_phys_page() longjmps
+       back to cpu_exec(), which drops both locks.  */
+    mmap_read_lock();
+    tb_lock_acquire();
 
     p = page_find(address >> TARGET_PAGE_BITS);
     if (!p) {
-        mmap_unlock();
+        tb_lock_release();
+        mmap_read_unlock();
         return 0;
     }
 
@@ -2512,10 +2976,12 @@ int page_unprotect(target_ulong address, unsigned long pc, void *puc)
         mprotect((void *)g2h(host_start), qemu_host_page_size,
                  prot & PAGE_BITS);
 
-        mmap_unlock();
+        tb_lock_release();
+        mmap_read_unlock();
         return 1;
     }
-    mmap_unlock();
+    tb_lock_release();
+    mmap_read_unlock();
     return 0;
 }
 
@@ -4242,45 +4708,130 @@ void cpu_io_recompile(CPUState *env, void *retaddr)
     cpu_resume_from_signal(env, NULL);
 }
 
+/* Retranslate a block whose execution counter expired.  The trace
+   replaces the block in the physical hash table; jumps into the old
+   block are unlinked by tb_phys_invalidate.  'gen' is the value of
+   tb_invalidate_gen sampled before the block was looked up.  Must be
+   called with tb_lock held.  */
+void tb_gen_trace(CPUState *env, TranslationBlock *tb, unsigned int gen)
+{
+    target_ulong pc, cs_base;
+    uint64_t flags;
+
+    /* another thread may have retranslated the block already (the
+       counter is not decremented atomically, so several threads can
+       see it expire), or invalidated it or flushed the buffer after
+       the block exited */
+    if (tb->cflags & CF_INVALID) {
+        return;
+    }
+    if (tb_invalidate_gen != gen) {
+        /* the TB may have been recycled; try again when it is hot */
+        tb->hot_count = tb_hot_threshold;
+        return;
+    }
+    pc = tb->pc;
+    cs_base = tb->cs_base;
+    flags = tb->flags;
+    tb_phys_invalidate(tb, -1);
+    tb_gen_code(env, pc, cs_base, flags, CF_TRACE);
+    tb_trace_count++;
+}
+
 #if !defined(CONFIG_USER_ONLY)
 
+static void tb_hash_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    TBHashBucket *b;
+    unsigned int i;
+    int j, n, used, chain_max;
+
+    used = 0;
+    chain_max = 0;
+    for (i = 0; i < (1u << tb_hash->bits); i++) {
+        n = 0;
+        for (b = &tb_hash->buckets[i]; b != NULL; b = b->next) {
+            for (j = 0; j < TB_HASH_BUCKET_ENTRIES; j++) {
+                if (b->tb[j])
+                    n++;
+            }
+        }
+        if (n) {
+            used++;
+        }
+        if (n > chain_max) {
+            chain_max = n;
+        }
+    }
+    cpu_fprintf(f, "TB hash buckets     %u x %d entries (%d overflow, "
+                "%d resizes)\n",
+                1u << tb_hash->bits, (int)TB_HASH_BUCKET_ENTRIES,
+                tb_hash_nb_overflow, tb_hash_resize_count);
+    cpu_fprintf(f, "TB hash occupancy   %d%% (avg chain %0.2f max=%d TBs)\n",
+                (int)(((int64_t)used * 100) >> tb_hash->bits),
+                used ? (double)tb_hash_count / used : 0, chain_max);
+    cpu_fprintf(f, "TB hash lookups     %" PRId64
+                " (%0.2f TBs compared/lookup)\n",
+                tb_hash_lookup_count,
+                tb_hash_lookup_count ?
+                (double)tb_hash_probe_count / tb_hash_lookup_count : 0);
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int trace_count, trace_target_size, nb_tbs;
+    long code_size;
     TranslationBlock *tb;
+    TBRegion *r;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    trace_count = 0;
+    trace_target_size = 0;
+    nb_tbs = 0;
+    code_size = 0;
+    for(r = tb_regions; r < tb_regions + nb_tb_regions_used; r++) {
+        code_size += (r == cur_region ? code_gen_ptr : r->end) - r->start;
+        nb_tbs += r->nb_tbs;
+        for(i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size)
+                max_target_code_size = tb->size;
+            if (tb->page_addr[1] != -1)
+                cross_page++;
+            if (tb->cflags & CF_TRACE) {
+                trace_count++;
+                trace_target_size += tb->size;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %ld/%ld\n",
+                code_size, nb_tb_regions_used * code_gen_region_max_size);
+    cpu_fprintf(f, "regions             %d/%d (initial %d, %ld KB each)\n",
+                nb_tb_regions_used, nb_tb_regions, nb_tb_regions_init,
+                code_gen_region_size / 1024);
     cpu_fprintf(f, "TB count            %d/%d\n", 
-                nb_tbs, code_gen_max_blocks);
+                nb_tbs, nb_tb_regions_used * code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %ld bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4289,10 +4840,22 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+    cpu_fprintf(f, "trace TB count      %d (avg target size %d bytes)\n",
+                trace_count,
+                trace_count ? trace_target_size / trace_count : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d (%d TBs evicted)\n",
+                tb_region_evict_count, tb_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB translate count  %d (%d%% retranslations)\n",
+                tb_gen_count,
+                tb_gen_count ? (int)((tb_retranslate_count * 100LL) /
+                                     tb_gen_count) : 0);
+    cpu_fprintf(f, "TB trace count      %d (threshold %d)\n",
+                tb_trace_count, tb_hot_threshold);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    tb_hash_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -30,6 +30,9 @@ these four paragraphs for those parts of this code that are retained.
 
 =============================================================================*/
 
+#include <float.h>
+#include <math.h>
+
 #include "softfloat.h"
 
 /*----------------------------------------------------------------------------
@@ -1823,6 +1826,71 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  When the rounding mode is round-to-nearest-even and the
+| inexact flag is already raised, an operation on zero or normal operands
+| that yields a normal result raises no further exception, and the host FPU
+| returns exactly the same result as the software routines.  Anything else,
+| including results that might have overflowed or underflowed, is computed in
+| software.  The fast path needs a host that evaluates `float' and `double'
+| in their own precision.
+*----------------------------------------------------------------------------*/
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define USE_HARDFLOAT
+#endif
+
+#ifdef USE_HARDFLOAT
+typedef union {
+    float32 s;
+    float h;
+} float32_host;
+
+typedef union {
+    float64 s;
+    double h;
+} float64_host;
+
+INLINE int hardfloat_enabled(float_status *status)
+{
+    return (STATUS(float_exception_flags) & float_flag_inexact) &&
+           STATUS(float_rounding_mode) == float_round_nearest_even;
+}
+
+INLINE int float32_is_zero_or_normal(float32 a)
+{
+    int16 aExp = extractFloat32Exp(a);
+    return aExp != 0xFF && (aExp != 0 || extractFloat32Frac(a) == 0);
+}
+
+INLINE int float64_is_zero_or_normal(float64 a)
+{
+    int16 aExp = extractFloat64Exp(a);
+    return aExp != 0x7FF && (aExp != 0 || extractFloat64Frac(a) == 0);
+}
+
+INLINE int float32_hard_args(float32 a, float32 b STATUS_PARAM)
+{
+    return hardfloat_enabled(status) &&
+           float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b);
+}
+
+INLINE int float64_hard_args(float64 a, float64 b STATUS_PARAM)
+{
+    return hardfloat_enabled(status) &&
+           float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b);
+}
+
+INLINE int float32_hard_result_ok(float32_host r)
+{
+    return fabsf(r.h) > FLT_MIN && fabsf(r.h) <= FLT_MAX;
+}
+
+INLINE int float64_hard_result_ok(float64_host r)
+{
+    return fabs(r.h) > DBL_MIN && fabs(r.h) <= DBL_MAX;
+}
+#endif
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -1832,6 +1900,18 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HARDFLOAT
+    if (float32_hard_args(a, b STATUS_VAR)) {
+        float32_host ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h + ub.h;
+        if (float32_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1855,6 +1935,18 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HARDFLOAT
+    if (float32_hard_args(a, b STATUS_VAR)) {
+        float32_host ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h - ub.h;
+        if (float32_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1882,6 +1974,18 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     bits32 aSig, bSig;
     bits64 zSig64;
     bits32 zSig;
+#ifdef USE_HARDFLOAT
+    if (float32_hard_args(a, b STATUS_VAR)) {
+        float32_host ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h * ub.h;
+        if (float32_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
 
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
@@ -1943,6 +2047,18 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int16 aExp, bExp, zExp;
     bits32 aSig, bSig, zSig;
+#ifdef USE_HARDFLOAT
+    if (float32_hard_args(a, b STATUS_VAR) && extractFloat32Exp(b) != 0) {
+        float32_host ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h / ub.h;
+        if (float32_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -2109,6 +2225,18 @@ float32 float32_sqrt( float32 a STATUS_PARAM )
     int16 aExp, zExp;
     bits32 aSig, zSig;
     bits64 rem, term;
+#ifdef USE_HARDFLOAT
+    if (hardfloat_enabled(status) && float32_is_zero_or_normal(a) &&
+        !extractFloat32Sign(a)) {
+        float32_host ua, ur;
+
+        ua.s = a;
+        ur.h = sqrtf(ua.h);
+        if (float32_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat32Frac( a );
@@ -3142,6 +3270,18 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HARDFLOAT
+    if (float64_hard_args(a, b STATUS_VAR)) {
+        float64_host ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h + ub.h;
+        if (float64_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3165,6 +3305,18 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HARDFLOAT
+    if (float64_hard_args(a, b STATUS_VAR)) {
+        float64_host ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h - ub.h;
+        if (float64_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3190,6 +3342,18 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int16 aExp, bExp, zExp;
     bits64 aSig, bSig, zSig0, zSig1;
+#ifdef USE_HARDFLOAT
+    if (float64_hard_args(a, b STATUS_VAR)) {
+        float64_host ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h * ub.h;
+        if (float64_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
 
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
@@ -3253,6 +3417,18 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     bits64 aSig, bSig, zSig;
     bits64 rem0, rem1;
     bits64 term0, term1;
+#ifdef USE_HARDFLOAT
+    if (float64_hard_args(a, b STATUS_VAR) && extractFloat64Exp(b) != 0) {
+        float64_host ua, ub, ur;
+
+        ua.s = a;
+        ub.s = b;
+        ur.h = ua.h / ub.h;
+        if (float64_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3410,6 +3586,18 @@ float64 float64_sqrt( float64 a STATUS_PARAM )
     int16 aExp, zExp;
     bits64 aSig, zSig, doubleZSig;
     bits64 rem0, rem1, term0, term1;
+#ifdef USE_HARDFLOAT
+    if (hardfloat_enabled(status) && float64_is_zero_or_normal(a) &&
+        !extractFloat64Sign(a)) {
+        float64_host ua, ur;
+
+        ua.s = a;
+        ur.h = sqrt(ua.h);
+        if (float64_hard_result_ok(ur)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat64Frac( a );
@@ -1369,6 +1369,11 @@ show virtual to physical memory mappings (i386, SH4 and SPARC only)
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info timers
+show the pending timers and how often each owner re-arms and fires them
+@item info mutex
+show how often the global mutex is taken, contended and held, and how many
+vcpu kicks and lock-free vcpu exits there are
 @item info kvm
 show KVM information
 @item info numa
@@ -31,6 +31,7 @@
 #include "net/checksum.h"
 #include "loader.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 
 #include "e1000_hw.h"
 
@@ -91,6 +92,18 @@ typedef struct E1000State_st {
     uint32_t rxbuf_size;
     uint32_t rxbuf_min_shift;
     int check_rxov;
+
+    /* Interrupt moderation: RXT0 and TXDW wait for the delay timers,
+     * and ITR keeps a minimum gap between asserted interrupts. */
+    QEMUTimer *rdtr_timer;
+    QEMUTimer *radv_timer;
+    QEMUTimer *tidv_timer;
+    QEMUTimer *tadv_timer;
+    QEMUTimer *itr_timer;
+    int64_t itr_next;           /* earliest time for the next interrupt */
+    int irq_level;
+    uint32_t mitigation;
+    uint32_t adaptive_delay;    /* us, receive delay if the guest sets none */
     struct e1000_tx {
         unsigned char header[256];
         unsigned char vlan_header[4];
@@ -137,7 +150,9 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(ITR),	defreg(RDTR),	defreg(RADV),
+    defreg(TIDV),	defreg(TADV),	defreg(IAC),	defreg(ICRXPTC),
+    defreg(ICRXATC),	defreg(ICTXPTC),	defreg(ICTXATC),
 };
 
 enum { PHY_R = 1, PHY_W = 2, PHY_RW = PHY_R | PHY_W };
@@ -161,11 +176,30 @@ ioport_map(PCIDevice *pci_dev, int region_num, pcibus_t addr,
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    int level;
+    int64_t now;
+
     if (val)
         val |= E1000_ICR_INT_ASSERTED;
     s->mac_reg[ICR] = val;
     s->mac_reg[ICS] = val;
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+
+    level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
+    if (level && !s->irq_level) {
+        /* ITR is in 256ns units; the cause stays in ICR meanwhile */
+        if (s->mitigation && (s->mac_reg[ITR] & 0xffff)) {
+            now = qemu_get_clock_ns(vm_clock);
+            if (now < s->itr_next) {
+                if (!qemu_timer_pending(s->itr_timer))
+                    qemu_mod_timer(s->itr_timer, s->itr_next);
+                return;
+            }
+            s->itr_next = now + (s->mac_reg[ITR] & 0xffff) * 256;
+        }
+        s->mac_reg[IAC]++;
+    }
+    s->irq_level = level;
+    qemu_set_irq(s->dev.irq[0], level);
 }
 
 static void
@@ -176,6 +210,86 @@ set_ics(E1000State *s, int index, uint32_t val)
     set_interrupt_cause(s, 0, val | s->mac_reg[ICR]);
 }
 
+static void
+e1000_itr_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    set_ics(s, 0, 0);
+}
+
+/* The delay timers count in 1.024us units */
+static void
+e1000_arm_delay(QEMUTimer *pkt_timer, QEMUTimer *abs_timer,
+                uint32_t pkt_delay, uint32_t abs_delay)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+
+    qemu_mod_timer(pkt_timer, now + pkt_delay * 1024);
+    if (abs_delay && !qemu_timer_pending(abs_timer))
+        qemu_mod_timer(abs_timer, now + abs_delay * 1024);
+}
+
+/* RXT0 for a received packet, right away or after RDTR/RADV */
+static uint32_t
+e1000_rx_cause(E1000State *s)
+{
+    uint32_t rdtr = s->mac_reg[RDTR] & 0xffff;
+    uint32_t radv = s->mac_reg[RADV] & 0xffff;
+
+    /* A guest that asks for no moderation at all can still get it */
+    if (!rdtr && !(s->mac_reg[ITR] & 0xffff) && s->adaptive_delay) {
+        rdtr = s->adaptive_delay * 1000 / 1024 + 1;
+        radv = rdtr * 4;
+    }
+    if (!s->mitigation || !rdtr)
+        return E1000_ICS_RXT0;
+    e1000_arm_delay(s->rdtr_timer, s->radv_timer, rdtr, radv);
+    return 0;
+}
+
+static void
+e1000_rx_timer(E1000State *s, int index)
+{
+    s->mac_reg[index]++;
+    qemu_del_timer(s->rdtr_timer);
+    qemu_del_timer(s->radv_timer);
+    set_ics(s, 0, E1000_ICS_RXT0);
+}
+
+static void
+e1000_rdtr_timer(void *opaque)
+{
+    e1000_rx_timer(opaque, ICRXPTC);
+}
+
+static void
+e1000_radv_timer(void *opaque)
+{
+    e1000_rx_timer(opaque, ICRXATC);
+}
+
+static void
+e1000_tx_timer(E1000State *s, int index)
+{
+    s->mac_reg[index]++;
+    qemu_del_timer(s->tidv_timer);
+    qemu_del_timer(s->tadv_timer);
+    set_ics(s, 0, E1000_ICS_TXDW);
+}
+
+static void
+e1000_tidv_timer(void *opaque)
+{
+    e1000_tx_timer(opaque, ICTXPTC);
+}
+
+static void
+e1000_tadv_timer(void *opaque)
+{
+    e1000_tx_timer(opaque, ICTXATC);
+}
+
 static int
 rxbufsize(uint32_t v)
 {
@@ -515,43 +629,76 @@ txdesc_writeback(target_phys_addr_t base, struct e1000_tx_desc *dp)
     return E1000_ICR_TXDW;
 }
 
+/* Descriptors fetched with one read, like the hardware's prefetch */
+#define E1000_TX_BATCH 32
+
 static void
 start_xmit(E1000State *s)
 {
     target_phys_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc desc[E1000_TX_BATCH];
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    uint32_t ring = s->mac_reg[TDLEN] / sizeof(desc[0]), wb, delay = 0;
+    unsigned int i, n;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
         return;
     }
 
+    qemu_send_batch_begin(&s->nic->nc);
     while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+        /* up to TDT or the end of the ring, whichever comes first */
+        if (s->mac_reg[TDH] >= ring)
+            n = 1;
+        else if (s->mac_reg[TDT] > s->mac_reg[TDH])
+            n = MIN(s->mac_reg[TDT], ring) - s->mac_reg[TDH];
+        else
+            n = ring - s->mac_reg[TDH];
+        n = MIN(n, E1000_TX_BATCH);
+
         base = ((uint64_t)s->mac_reg[TDBAH] << 32) + s->mac_reg[TDBAL] +
                sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        cpu_physical_memory_read(base, (void *)&desc, sizeof(desc));
-
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
-
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(base, &desc);
-
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
-         */
-        if (s->mac_reg[TDH] == tdh_start) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+        cpu_physical_memory_read(base, (void *)desc, n * sizeof(desc[0]));
+
+        for (i = 0; i < n; i++, base += sizeof(desc[0])) {
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)desc[i].buffer_addr,
+                   desc[i].lower.data, desc[i].upper.data);
+
+            process_tx_desc(s, &desc[i]);
+            wb = txdesc_writeback(base, &desc[i]);
+            /* IDE defers TXDW by TIDV/TADV */
+            if (wb && s->mitigation && (s->mac_reg[TIDV] & 0xffff) &&
+                (le32_to_cpu(desc[i].lower.data) & E1000_TXD_CMD_IDE))
+                delay = 1;
+            else
+                cause |= wb;
+
+            if (++s->mac_reg[TDH] * sizeof(desc[0]) >= s->mac_reg[TDLEN])
+                s->mac_reg[TDH] = 0;
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                goto out;
+            }
         }
     }
+out:
+    qemu_send_batch_end(&s->nic->nc);
+
+    if (cause & E1000_ICR_TXDW) {
+        qemu_del_timer(s->tidv_timer);
+        qemu_del_timer(s->tadv_timer);
+    } else if (delay) {
+        e1000_arm_delay(s->tidv_timer, s->tadv_timer,
+                        s->mac_reg[TIDV] & 0xffff, s->mac_reg[TADV] & 0xffff);
+    }
     set_ics(s, 0, cause);
 }
 
@@ -632,7 +779,8 @@ e1000_can_receive(VLANClientState *nc)
 }
 
 static ssize_t
-e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
+e1000_do_receive(VLANClientState *nc, const uint8_t *buf, size_t size,
+                 uint8_t csum_status)
 {
     E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
     struct e1000_rx_desc desc;
@@ -686,7 +834,7 @@ e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
             cpu_physical_memory_write(le64_to_cpu(desc.buffer_addr),
                                       (void *)(buf + vlan_offset), size);
             desc.length = cpu_to_le16(size + fcs_len(s));
-            desc.status |= E1000_RXD_STAT_EOP|E1000_RXD_STAT_IXSM;
+            desc.status |= E1000_RXD_STAT_EOP|csum_status;
         } else { // as per intel docs; skip descriptors with null buf addr
             DBGOUT(RX, "Null RX descriptor!!\n");
         }
@@ -715,7 +863,7 @@ e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
         s->mac_reg[TORH]++;
     s->mac_reg[TORL] = n;
 
-    n = E1000_ICS_RXT0;
+    n = e1000_rx_cause(s);
     if ((rdt = s->mac_reg[RDT]) < s->mac_reg[RDH])
         rdt += s->mac_reg[RDLEN] / sizeof(desc);
     if (((rdt - s->mac_reg[RDH]) * sizeof(desc)) <= s->mac_reg[RDLEN] >>
@@ -727,6 +875,33 @@ e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
     return size;
 }
 
+static ssize_t
+e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
+{
+    return e1000_do_receive(nc, buf, size, E1000_RXD_STAT_IXSM);
+}
+
+/* A frame merged from TCP segments by the net layer, whose checksums
+ * are known to be good; it looks like the result of LRO to the guest. */
+static ssize_t
+e1000_receive_coalesced(VLANClientState *nc, const uint8_t *buf, size_t size,
+                        int hdr_len, int mss)
+{
+    return e1000_do_receive(nc, buf, size,
+                            E1000_RXD_STAT_IPCS|E1000_RXD_STAT_TCPCS);
+}
+
+/* Frames longer than the MTU only go to guests that set up jumbo frames */
+static int
+e1000_coalesce_limit(VLANClientState *nc)
+{
+    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+
+    if (!(s->mac_reg[RCTL] & E1000_RCTL_LPE))
+        return 0;
+    return s->rxbuf_size;
+}
+
 static uint32_t
 mac_readreg(E1000State *s, int index)
 {
@@ -775,6 +950,15 @@ set_rdt(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xffff;
 }
 
+/* Writing RDTR with FPD set fires a pending receive interrupt now */
+static void
+set_rdtr(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & 0xffff;
+    if ((val & E1000_RDT_FPDB) && qemu_timer_pending(s->rdtr_timer))
+        e1000_rdtr_timer(s);
+}
+
 static void
 set_16bit(E1000State *s, int index, uint32_t val)
 {
@@ -824,11 +1008,15 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(ITR),	getreg(RDTR),
+    getreg(RADV),	getreg(TIDV),	getreg(TADV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
     [ICR] = mac_icr_read,	[EECD] = get_eecd,	[EERD] = flash_eerd_read,
+    [IAC] = mac_read_clr4,	[ICRXPTC] = mac_read_clr4,
+    [ICRXATC] = mac_read_clr4,	[ICTXPTC] = mac_read_clr4,
+    [ICTXATC] = mac_read_clr4,
     [CRCERRS ... MPC] = &mac_readreg,
     [RA ... RA+31] = &mac_readreg,
     [MTA ... MTA+127] = &mac_readreg,
@@ -844,6 +1032,8 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDLEN] = set_dlen,	[RDLEN] = set_dlen,	[TCTL] = set_tctl,
     [TDT] = set_tctl,	[MDIC] = set_mdic,	[ICS] = set_ics,
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
+    [ITR] = set_16bit,	[RADV] = set_16bit,	[TIDV] = set_16bit,
+    [TADV] = set_16bit,	[RDTR] = set_rdtr,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
     [RA ... RA+31] = &mac_writereg,
@@ -917,11 +1107,50 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+/* The delay timers are not migrated; whatever they were holding back
+ * is signalled right after the move instead. */
+static int e1000_post_load(void *opaque, int version_id)
+{
+    E1000State *s = opaque;
+
+    s->irq_level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
+    if (s->mitigation && (s->mac_reg[RDTR] & 0xffff ||
+                          s->mac_reg[TIDV] & 0xffff || s->adaptive_delay)) {
+        set_ics(s, 0, E1000_ICS_RXT0 | E1000_ICS_TXDW);
+    }
+    return 0;
+}
+
+static bool e1000_intr_moderation_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->mitigation &&
+           (s->mac_reg[ITR] || s->mac_reg[RDTR] || s->mac_reg[RADV] ||
+            s->mac_reg[TIDV] || s->mac_reg[TADV]);
+}
+
+static const VMStateDescription vmstate_e1000_intr_moderation = {
+    .name = "e1000/intr_moderation",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .post_load = e1000_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_PCI_DEVICE(dev, E1000State),
         VMSTATE_UNUSED_TEST(is_version_1, 4), /* was instance id */
@@ -992,6 +1221,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_e1000_intr_moderation,
+            .needed = e1000_intr_moderation_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1076,6 +1313,16 @@ pci_e1000_uninit(PCIDevice *dev)
 {
     E1000State *d = DO_UPCAST(E1000State, dev, dev);
 
+    qemu_del_timer(d->rdtr_timer);
+    qemu_free_timer(d->rdtr_timer);
+    qemu_del_timer(d->radv_timer);
+    qemu_free_timer(d->radv_timer);
+    qemu_del_timer(d->tidv_timer);
+    qemu_free_timer(d->tidv_timer);
+    qemu_del_timer(d->tadv_timer);
+    qemu_free_timer(d->tadv_timer);
+    qemu_del_timer(d->itr_timer);
+    qemu_free_timer(d->itr_timer);
     cpu_unregister_io_memory(d->mmio_index);
     qemu_del_vlan_client(&d->nic->nc);
     return 0;
@@ -1091,6 +1338,14 @@ static void e1000_reset(void *opaque)
     memmove(d->mac_reg, mac_reg_init, sizeof mac_reg_init);
     d->rxbuf_min_shift = 1;
     memset(&d->tx, 0, sizeof d->tx);
+
+    qemu_del_timer(d->rdtr_timer);
+    qemu_del_timer(d->radv_timer);
+    qemu_del_timer(d->tidv_timer);
+    qemu_del_timer(d->tadv_timer);
+    qemu_del_timer(d->itr_timer);
+    d->itr_next = 0;
+    d->irq_level = 0;
 }
 
 static NetClientInfo net_e1000_info = {
@@ -1098,6 +1353,8 @@ static NetClientInfo net_e1000_info = {
     .size = sizeof(NICState),
     .can_receive = e1000_can_receive,
     .receive = e1000_receive,
+    .coalesce_limit = e1000_coalesce_limit,
+    .receive_coalesced = e1000_receive_coalesced,
     .cleanup = e1000_cleanup,
     .link_status_changed = e1000_set_link_status,
 };
@@ -1147,6 +1404,12 @@ static int pci_e1000_init(PCIDevice *pci_dev)
     d->nic = qemu_new_nic(&net_e1000_info, &d->conf,
                           d->dev.qdev.info->name, d->dev.qdev.id, d);
 
+    d->rdtr_timer = qemu_new_timer(vm_clock, e1000_rdtr_timer, d);
+    d->radv_timer = qemu_new_timer(vm_clock, e1000_radv_timer, d);
+    d->tidv_timer = qemu_new_timer(vm_clock, e1000_tidv_timer, d);
+    d->tadv_timer = qemu_new_timer(vm_clock, e1000_tadv_timer, d);
+    d->itr_timer = qemu_new_timer(vm_clock, e1000_itr_timer, d);
+
     qemu_format_nic_info_str(&d->nic->nc, macaddr);
 
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
@@ -1171,6 +1434,8 @@ static PCIDeviceInfo e1000_info = {
     .romfile    = "pxe-e1000.bin",
     .qdev.props = (Property[]) {
         DEFINE_NIC_PROPERTIES(E1000State, conf),
+        DEFINE_PROP_BIT("mitigation", E1000State, mitigation, 0, true),
+        DEFINE_PROP_UINT32("adaptive_delay", E1000State, adaptive_delay, 0),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
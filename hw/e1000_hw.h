@@ -509,6 +509,10 @@
 #define E1000_RCTL_FLXBUF_MASK    0x78000000    /* Flexible buffer size */
 #define E1000_RCTL_FLXBUF_SHIFT   27            /* Flexible buffer shift */
 
+/* Receive Delay Timer */
+#define E1000_RDT_DELAY           0x0000ffff    /* Delay timer (1=1.024us) */
+#define E1000_RDT_FPDB            0x80000000    /* Flush descriptor block */
+
 
 #define E1000_EEPROM_SWDPIN0   0x0001   /* SWDPIN 0 EEPROM Value */
 #define E1000_EEPROM_LED_LOGIC 0x0020   /* Led Logic Word */
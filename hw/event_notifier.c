@@ -60,3 +60,10 @@ int event_notifier_test(EventNotifier *e)
     }
     return r == sizeof(value);
 }
+
+int event_notifier_set(EventNotifier *e)
+{
+    uint64_t value = 1;
+    int r = write(e->fd, &value, sizeof(value));
+    return r == sizeof(value) ? 0 : -errno;
+}
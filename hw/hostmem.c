@@ -0,0 +1,155 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "hw.h"
+#include "hostmem.h"
+
+/* Drop [start, end) from the map, splitting regions that straddle it. */
+static void hostmem_unassign(HostMem *hostmem, target_phys_addr_t start,
+                             target_phys_addr_t end)
+{
+    HostMemRegion *r;
+    target_phys_addr_t r_end;
+    int i;
+
+    for (i = 0; i < hostmem->num_regions; i++) {
+        r = &hostmem->regions[i];
+        r_end = r->guest_addr + r->size;
+        if (r_end <= start || r->guest_addr >= end) {
+            continue;
+        }
+        if (r->guest_addr >= start && r_end <= end) {
+            /* fully covered */
+            *r = hostmem->regions[--hostmem->num_regions];
+            i--;
+        } else if (r->guest_addr < start && r_end > end) {
+            /* hole in the middle: keep the head here, append the tail */
+            hostmem->regions = qemu_realloc(hostmem->regions,
+                (hostmem->num_regions + 1) * sizeof(HostMemRegion));
+            r = &hostmem->regions[i];
+            hostmem->regions[hostmem->num_regions].guest_addr = end;
+            hostmem->regions[hostmem->num_regions].size = r_end - end;
+            hostmem->regions[hostmem->num_regions].host_addr =
+                (uint8_t *)r->host_addr + (end - r->guest_addr);
+            hostmem->num_regions++;
+            r->size = start - r->guest_addr;
+        } else if (r->guest_addr < start) {
+            r->size = start - r->guest_addr;
+        } else {
+            r->host_addr = (uint8_t *)r->host_addr + (end - r->guest_addr);
+            r->size = r_end - end;
+            r->guest_addr = end;
+        }
+    }
+}
+
+static void hostmem_assign(HostMem *hostmem, target_phys_addr_t start,
+                           target_phys_addr_t size, uint8_t *host)
+{
+    HostMemRegion *r;
+    int i;
+
+    /* The map is reported a page at a time, so extend a neighbour when
+     * both the guest and the host ranges are contiguous.  */
+    for (i = 0; i < hostmem->num_regions; i++) {
+        r = &hostmem->regions[i];
+        if (r->guest_addr + r->size == start &&
+            (uint8_t *)r->host_addr + r->size == host) {
+            r->size += size;
+            return;
+        }
+        if (start + size == r->guest_addr && host + size == r->host_addr) {
+            r->guest_addr = start;
+            r->host_addr = host;
+            r->size += size;
+            return;
+        }
+    }
+    hostmem->regions = qemu_realloc(hostmem->regions,
+        (hostmem->num_regions + 1) * sizeof(HostMemRegion));
+    r = &hostmem->regions[hostmem->num_regions++];
+    r->guest_addr = start;
+    r->size = size;
+    r->host_addr = host;
+}
+
+static void hostmem_client_set_memory(CPUPhysMemoryClient *client,
+                                      target_phys_addr_t start_addr,
+                                      ram_addr_t size,
+                                      ram_addr_t phys_offset)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+
+    qemu_mutex_lock(&hostmem->lock);
+    hostmem_unassign(hostmem, start_addr, start_addr + size);
+    if (flags == IO_MEM_RAM) {
+        hostmem_assign(hostmem, start_addr, size,
+                       qemu_get_ram_ptr(phys_offset));
+    }
+    qemu_mutex_unlock(&hostmem->lock);
+}
+
+static int hostmem_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                            target_phys_addr_t start_addr,
+                                            target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int hostmem_client_migration_log(CPUPhysMemoryClient *client,
+                                        int enable)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+
+    if (hostmem->log_handler) {
+        hostmem->log_handler(hostmem->opaque, enable);
+    }
+    return 0;
+}
+
+void hostmem_init(HostMem *hostmem, HostMemLogHandler *log_handler,
+                  void *opaque)
+{
+    memset(hostmem, 0, sizeof(*hostmem));
+    qemu_mutex_init(&hostmem->lock);
+    hostmem->log_handler = log_handler;
+    hostmem->opaque = opaque;
+    hostmem->client.set_memory = hostmem_client_set_memory;
+    hostmem->client.sync_dirty_bitmap = hostmem_client_sync_dirty_bitmap;
+    hostmem->client.migration_log = hostmem_client_migration_log;
+    cpu_register_phys_memory_client(&hostmem->client);
+}
+
+void hostmem_finalize(HostMem *hostmem)
+{
+    cpu_unregister_phys_memory_client(&hostmem->client);
+    qemu_mutex_destroy(&hostmem->lock);
+    qemu_free(hostmem->regions);
+    hostmem->regions = NULL;
+    hostmem->num_regions = 0;
+}
+
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t addr,
+                     target_phys_addr_t len)
+{
+    HostMemRegion *r;
+    void *host = NULL;
+    int i;
+
+    qemu_mutex_lock(&hostmem->lock);
+    for (i = 0; i < hostmem->num_regions; i++) {
+        r = &hostmem->regions[i];
+        if (addr >= r->guest_addr && addr - r->guest_addr < r->size &&
+            len <= r->size - (addr - r->guest_addr)) {
+            host = (uint8_t *)r->host_addr + (addr - r->guest_addr);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&hostmem->lock);
+    return host;
+}
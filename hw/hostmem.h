@@ -0,0 +1,45 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+#ifndef HOSTMEM_H
+#define HOSTMEM_H
+
+#include "cpu-common.h"
+#include "qemu-thread.h"
+
+typedef struct HostMemRegion {
+    target_phys_addr_t guest_addr;
+    target_phys_addr_t size;
+    void *host_addr;
+} HostMemRegion;
+
+typedef void HostMemLogHandler(void *opaque, int enable);
+
+/* A copy of the guest RAM layout, kept up to date as the memory map
+ * changes, so that threads which do not hold the global mutex can
+ * translate guest physical addresses.  Only RAM is mapped.
+ */
+typedef struct HostMem {
+    CPUPhysMemoryClient client;
+    QemuMutex lock;
+    HostMemRegion *regions;
+    int num_regions;
+    HostMemLogHandler *log_handler;
+    void *opaque;
+} HostMem;
+
+void hostmem_init(HostMem *hostmem, HostMemLogHandler *log_handler,
+                  void *opaque);
+void hostmem_finalize(HostMem *hostmem);
+
+/* Return a host pointer for [addr, addr + len) or NULL if the range is not
+ * in one piece of guest RAM.  The pointer stays valid while the memory map
+ * does not change.
+ */
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t addr,
+                     target_phys_addr_t len);
+
+#endif
@@ -1112,6 +1112,7 @@ void pc_basic_device_init(qemu_irq *isa_irq,
     qemu_irq *cpu_exit_irq;
 
     register_ioport_write(0x80, 1, 1, ioport80_write, NULL);
+    ioport_set_lockless(0x80, 1);
 
     register_ioport_write(0xf0, 1, 1, ioportF0_write, NULL);
 
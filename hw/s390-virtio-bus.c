@@ -123,7 +123,7 @@ static int s390_virtio_blk_init(VirtIOS390Device *dev)
 {
     VirtIODevice *vdev;
 
-    vdev = virtio_blk_init((DeviceState *)dev, &dev->block);
+    vdev = virtio_blk_init((DeviceState *)dev, &dev->block, &dev->blk);
     if (!vdev) {
         return -1;
     }
@@ -333,6 +333,8 @@ static VirtIOS390DeviceInfo s390_virtio_net = {
         DEFINE_PROP_INT32("x-txburst", VirtIOS390Device,
                           net.txburst, TX_BURST),
         DEFINE_PROP_STRING("tx", VirtIOS390Device, net.tx),
+        DEFINE_PROP_BIT("sw_gro", VirtIOS390Device, net.sw_gro, 0, true),
+        DEFINE_PROP_BIT("sw_gso", VirtIOS390Device, net.sw_gso, 0, true),
         DEFINE_PROP_END_OF_LIST(),
     },
 };
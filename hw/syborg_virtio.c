@@ -302,6 +302,8 @@ static SysBusDeviceInfo syborg_virtio_net_info = {
         DEFINE_PROP_INT32("x-txburst", SyborgVirtIOProxy,
                           net.txburst, TX_BURST),
         DEFINE_PROP_STRING("tx", SyborgVirtIOProxy, net.tx),
+        DEFINE_PROP_BIT("sw_gro", SyborgVirtIOProxy, net.sw_gro, 0, true),
+        DEFINE_PROP_BIT("sw_gso", SyborgVirtIOProxy, net.sw_gso, 0, true),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
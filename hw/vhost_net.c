@@ -50,6 +50,9 @@ unsigned vhost_net_get_features(struct vhost_net *net, unsigned features)
     if (!(net->dev.features & (1 << VIRTIO_RING_F_INDIRECT_DESC))) {
         features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
     }
+    if (!(net->dev.features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
+    }
     if (!(net->dev.features & (1 << VIRTIO_NET_F_MRG_RXBUF))) {
         features &= ~(1 << VIRTIO_NET_F_MRG_RXBUF);
     }
@@ -65,6 +68,9 @@ void vhost_net_ack_features(struct vhost_net *net, unsigned features)
     if (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) {
         net->dev.acked_features |= (1 << VIRTIO_RING_F_INDIRECT_DESC);
     }
+    if (features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        net->dev.acked_features |= (1 << VIRTIO_RING_F_EVENT_IDX);
+    }
     if (features & (1 << VIRTIO_NET_F_MRG_RXBUF)) {
         net->dev.acked_features |= (1 << VIRTIO_NET_F_MRG_RXBUF);
     }
@@ -121,8 +127,9 @@ fail:
     return NULL;
 }
 
-int vhost_net_start(struct vhost_net *net,
-                    VirtIODevice *dev)
+static int vhost_net_start_one(struct vhost_net *net,
+                               VirtIODevice *dev,
+                               int vq_index)
 {
     struct vhost_vring_file file = { };
     int r;
@@ -133,6 +140,7 @@ int vhost_net_start(struct vhost_net *net,
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.vq_index = vq_index;
     r = vhost_dev_start(&net->dev, dev);
     if (r < 0) {
         return r;
@@ -163,8 +171,8 @@ fail:
     return r;
 }
 
-void vhost_net_stop(struct vhost_net *net,
-                    VirtIODevice *dev)
+static void vhost_net_stop_one(struct vhost_net *net,
+                               VirtIODevice *dev)
 {
     struct vhost_vring_file file = { .fd = -1 };
 
@@ -179,6 +187,61 @@ void vhost_net_stop(struct vhost_net *net,
     }
 }
 
+static struct vhost_net *vhost_net_get_queue(NICState *nic, int queue)
+{
+    return tap_get_vhost_net(qemu_get_subqueue(nic, queue)->nc.peer);
+}
+
+/* Start one vhost_net per rx/tx pair; pair i serves virtio queues 2i and
+ * 2i+1.  The guest notifiers cover the whole device and are bound once.
+ */
+int vhost_net_start(VirtIODevice *dev, NICState *nic, int queues)
+{
+    int i, r;
+
+    if (!dev->binding->set_guest_notifiers) {
+        fprintf(stderr, "binding does not support guest notifiers\n");
+        return -ENOSYS;
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, true);
+    if (r < 0) {
+        fprintf(stderr, "Error binding guest notifier: %d\n", -r);
+        return r;
+    }
+
+    for (i = 0; i < queues; i++) {
+        r = vhost_net_start_one(vhost_net_get_queue(nic, i), dev, i * 2);
+        if (r < 0) {
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    while (--i >= 0) {
+        vhost_net_stop_one(vhost_net_get_queue(nic, i), dev);
+    }
+    dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    return r;
+}
+
+void vhost_net_stop(VirtIODevice *dev, NICState *nic, int queues)
+{
+    int i, r;
+
+    for (i = 0; i < queues; i++) {
+        vhost_net_stop_one(vhost_net_get_queue(nic, i), dev);
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    if (r < 0) {
+        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
+        fflush(stderr);
+    }
+    assert(r >= 0);
+}
+
 void vhost_net_cleanup(struct vhost_net *net)
 {
     vhost_dev_cleanup(&net->dev);
@@ -193,13 +256,11 @@ struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd)
 	return NULL;
 }
 
-int vhost_net_start(struct vhost_net *net,
-		    VirtIODevice *dev)
+int vhost_net_start(VirtIODevice *dev, NICState *nic, int queues)
 {
 	return -ENOSYS;
 }
-void vhost_net_stop(struct vhost_net *net,
-		    VirtIODevice *dev)
+void vhost_net_stop(VirtIODevice *dev, NICState *nic, int queues)
 {
 }
 
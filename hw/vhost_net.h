@@ -8,8 +8,8 @@ typedef struct vhost_net VHostNetState;
 
 VHostNetState *vhost_net_init(VLANClientState *backend, int devfd);
 
-int vhost_net_start(VHostNetState *net, VirtIODevice *dev);
-void vhost_net_stop(VHostNetState *net, VirtIODevice *dev);
+int vhost_net_start(VirtIODevice *dev, NICState *nic, int queues);
+void vhost_net_stop(VirtIODevice *dev, NICState *nic, int queues);
 
 void vhost_net_cleanup(VHostNetState *net);
 
@@ -0,0 +1,661 @@
+/*
+ * Virtio Block Device data plane
+ *
+ * A device with a data plane hands its request queue to a thread of its
+ * own.  The thread waits on the queue's ioeventfd, reads the vring straight
+ * from guest memory, submits linux-aio to the image file and signals
+ * completions through the guest notifier, all without taking the global
+ * mutex.  Only raw images are supported, and the normal request path takes
+ * over whenever the VM is stopped or its memory is being migrated.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <poll.h>
+
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu-thread.h"
+#include "qemu-barrier.h"
+#include "kvm.h"
+#include "blockdev.h"
+#include "virtio-blk.h"
+#include "virtio-blk-dataplane.h"
+#include "hostmem.h"
+#include "event_notifier.h"
+
+/* vring layout, see virtio.c */
+typedef struct VRingDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDesc;
+
+typedef struct VRingAvail
+{
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[0];
+} VRingAvail;
+
+typedef struct VRingUsedElem
+{
+    uint32_t id;
+    uint32_t len;
+} VRingUsedElem;
+
+typedef struct VRingUsed
+{
+    uint16_t flags;
+    uint16_t idx;
+    VRingUsedElem ring[0];
+} VRingUsed;
+
+typedef struct DataPlaneRequest {
+    struct iocb iocb;
+    unsigned int head;
+    uint8_t *status;
+    unsigned int len;
+    struct iovec *iov;
+} DataPlaneRequest;
+
+struct VirtIOBlockDataPlane {
+    VirtIODevice *vdev;
+    VirtQueue *vq;
+    BlockDriverState *bs;
+    const char *serial;
+    unsigned short sector_mask;
+    int64_t nb_sectors;
+    int fd;
+
+    bool started;
+    bool log_active;
+    bool use_ioeventfd;
+    bool stopping;
+
+    QemuThread thread;
+    HostMem hostmem;
+    EventNotifier *kick;          /* guest kicks the queue */
+    EventNotifier own_kick;       /* ... when there is no ioeventfd */
+    EventNotifier *guest_notifier;
+    EventNotifier io_done;        /* linux-aio completions */
+    EventNotifier stop_notifier;
+    aio_context_t io_ctx;
+
+    unsigned int num;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    unsigned int inflight;
+    DataPlaneRequest *flush_req;  /* waits for the requests in flight */
+    bool notify_pending;
+    bool event_idx;               /* VIRTIO_RING_F_EVENT_IDX negotiated */
+    bool signalled_used_valid;
+    uint16_t signalled_used;
+
+    DataPlaneRequest *reqs;       /* indexed by head descriptor */
+    struct iocb **iocbs;
+    int nb_iocbs;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];
+};
+
+static int io_setup(unsigned nr_events, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr_events, ctx);
+}
+
+static int io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long nr,
+                        struct io_event *events, struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/* used_event follows the avail ring, avail_event the used ring */
+static inline uint16_t *data_plane_used_event(VirtIOBlockDataPlane *s)
+{
+    return &s->avail->ring[s->num];
+}
+
+static inline uint16_t *data_plane_avail_event(VirtIOBlockDataPlane *s)
+{
+    return (uint16_t *)&s->used->ring[s->num];
+}
+
+static bool data_plane_need_notify(VirtIOBlockDataPlane *s)
+{
+    uint16_t old;
+    bool valid;
+
+    if ((s->vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        !s->inflight && s->avail->idx == s->last_avail_idx) {
+        return true;
+    }
+    if (!s->event_idx) {
+        return !(s->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    valid = s->signalled_used_valid;
+    old = s->signalled_used;
+    s->signalled_used_valid = true;
+    s->signalled_used = s->used_idx;
+    return !valid ||
+        virtio_need_event(*data_plane_used_event(s), s->used_idx, old);
+}
+
+static void data_plane_notify_guest(VirtIOBlockDataPlane *s)
+{
+    s->notify_pending = false;
+
+    /* the used index must be visible before we look at the flags */
+    smp_mb();
+    if (data_plane_need_notify(s)) {
+        event_notifier_set(s->guest_notifier);
+    }
+}
+
+static void data_plane_complete_request(VirtIOBlockDataPlane *s,
+                                        DataPlaneRequest *req, int status)
+{
+    VRingUsedElem *elem;
+
+    *req->status = status;
+    elem = &s->used->ring[s->used_idx % s->num];
+    elem->id = req->head;
+    elem->len = req->len + 1;
+    /* the element must be written before the index */
+    smp_wmb();
+    s->used->idx = ++s->used_idx;
+    /* the index wrapped past the value we last signalled on */
+    if (unlikely((int16_t)(s->used_idx - s->signalled_used) <= 0)) {
+        s->signalled_used_valid = false;
+    }
+
+    qemu_free(req->iov);
+    req->iov = NULL;
+    s->notify_pending = true;
+}
+
+static void data_plane_flush(VirtIOBlockDataPlane *s, DataPlaneRequest *req)
+{
+    data_plane_complete_request(s, req, fdatasync(s->fd) ?
+                                VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK);
+}
+
+static void data_plane_submit(VirtIOBlockDataPlane *s)
+{
+    DataPlaneRequest *req;
+    int done = 0, ret;
+
+    while (done < s->nb_iocbs) {
+        ret = io_submit(s->io_ctx, s->nb_iocbs - done, s->iocbs + done);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /* fail the first request that could not be queued */
+            req = container_of(s->iocbs[done], DataPlaneRequest, iocb);
+            s->inflight--;
+            data_plane_complete_request(s, req, VIRTIO_BLK_S_IOERR);
+            ret = 1;
+        }
+        done += ret;
+    }
+    s->nb_iocbs = 0;
+}
+
+/* Collect the buffers of the chain at head into s->sg, device-readable
+ * buffers first.  Returns the total number of buffers.
+ */
+static unsigned int data_plane_get_buffers(VirtIOBlockDataPlane *s,
+                                           unsigned int head,
+                                           unsigned int *out_num,
+                                           unsigned int *in_num)
+{
+    VRingDesc *desc = s->desc;
+    VRingDesc d;
+    unsigned int max = s->num, i = head, n = 0;
+
+    if (desc[i].flags & VRING_DESC_F_INDIRECT) {
+        d = desc[i];
+        if (d.len % sizeof(VRingDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+        max = d.len / sizeof(VRingDesc);
+        desc = hostmem_lookup(&s->hostmem, d.addr, d.len);
+        if (!desc) {
+            error_report("Indirect buffer table not in guest RAM");
+            exit(1);
+        }
+        i = 0;
+    }
+
+    *out_num = *in_num = 0;
+    do {
+        if (i >= max || n >= VIRTQUEUE_MAX_SIZE) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+        d = desc[i];
+        s->sg[n].iov_base = hostmem_lookup(&s->hostmem, d.addr, d.len);
+        s->sg[n].iov_len = d.len;
+        if (!s->sg[n].iov_base) {
+            error_report("virtio-blk buffer not in guest RAM");
+            exit(1);
+        }
+        if (d.flags & VRING_DESC_F_WRITE) {
+            (*in_num)++;
+        } else {
+            if (*in_num) {
+                error_report("virtio-blk read buffer after write buffer");
+                exit(1);
+            }
+            (*out_num)++;
+        }
+        n++;
+        i = d.next;
+    } while (d.flags & VRING_DESC_F_NEXT);
+
+    return n;
+}
+
+static void data_plane_handle_request(VirtIOBlockDataPlane *s,
+                                      unsigned int head)
+{
+    DataPlaneRequest *req = &s->reqs[head];
+    struct virtio_blk_outhdr hdr;
+    unsigned int out_num, in_num, n, i;
+    struct iovec *data;
+    unsigned int data_num;
+    size_t size = 0;
+
+    n = data_plane_get_buffers(s, head, &out_num, &in_num);
+    if (out_num < 1 || in_num < 1) {
+        error_report("virtio-blk missing headers");
+        exit(1);
+    }
+    if (s->sg[0].iov_len < sizeof(hdr) || s->sg[n - 1].iov_len < 1) {
+        error_report("virtio-blk header not in correct element");
+        exit(1);
+    }
+    memcpy(&hdr, s->sg[0].iov_base, sizeof(hdr));
+
+    req->head = head;
+    req->status = s->sg[n - 1].iov_base;
+    req->len = 0;
+    req->iov = NULL;
+
+    if (hdr.type & VIRTIO_BLK_T_FLUSH) {
+        /* the flush must cover the writes submitted before it, so hold it
+         * (and the rest of the ring) until they have completed */
+        data_plane_submit(s);
+        if (s->inflight) {
+            s->flush_req = req;
+        } else {
+            data_plane_flush(s, req);
+        }
+        return;
+    } else if (hdr.type & VIRTIO_BLK_T_SCSI_CMD) {
+        data_plane_complete_request(s, req, VIRTIO_BLK_S_UNSUPP);
+        return;
+    } else if (hdr.type & VIRTIO_BLK_T_GET_ID) {
+        memcpy(s->sg[out_num].iov_base, s->serial,
+               MIN(s->sg[out_num].iov_len, BLOCK_SERIAL_STRLEN));
+        data_plane_complete_request(s, req, VIRTIO_BLK_S_OK);
+        return;
+    }
+
+    if (hdr.type & VIRTIO_BLK_T_OUT) {
+        data = &s->sg[1];
+        data_num = out_num - 1;
+    } else {
+        data = &s->sg[out_num];
+        data_num = in_num - 1;
+    }
+    for (i = 0; i < data_num; i++) {
+        size += data[i].iov_len;
+    }
+    if ((hdr.sector & s->sector_mask) || (size % BDRV_SECTOR_SIZE) ||
+        hdr.sector > s->nb_sectors ||
+        size / BDRV_SECTOR_SIZE > s->nb_sectors - hdr.sector) {
+        data_plane_complete_request(s, req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+
+    /* s->sg is reused for the next request */
+    req->iov = qemu_malloc(data_num * sizeof(struct iovec));
+    memcpy(req->iov, data, data_num * sizeof(struct iovec));
+    req->len = size;
+
+    memset(&req->iocb, 0, sizeof(req->iocb));
+    req->iocb.aio_data = (uintptr_t)req;
+    req->iocb.aio_lio_opcode = (hdr.type & VIRTIO_BLK_T_OUT) ?
+        IOCB_CMD_PWRITEV : IOCB_CMD_PREADV;
+    req->iocb.aio_fildes = s->fd;
+    req->iocb.aio_buf = (uintptr_t)req->iov;
+    req->iocb.aio_nbytes = data_num;
+    req->iocb.aio_offset = hdr.sector * BDRV_SECTOR_SIZE;
+    req->iocb.aio_flags = IOCB_FLAG_RESFD;
+    req->iocb.aio_resfd = event_notifier_get_fd(&s->io_done);
+
+    s->iocbs[s->nb_iocbs++] = &req->iocb;
+    s->inflight++;
+}
+
+static void data_plane_handle_ring(VirtIOBlockDataPlane *s)
+{
+    unsigned int head;
+
+    if (s->flush_req) {
+        /* the ring is picked up again once the flush is done */
+        return;
+    }
+
+    for (;;) {
+        /* no need for kicks while we are looking anyway; with event
+         * indexes the guest stops kicking once it is past avail_event */
+        if (!s->event_idx) {
+            s->used->flags |= VRING_USED_F_NO_NOTIFY;
+        }
+
+        while (!s->flush_req && s->last_avail_idx != s->avail->idx) {
+            /* read the ring entry after the index */
+            smp_rmb();
+            head = s->avail->ring[s->last_avail_idx % s->num];
+            s->last_avail_idx++;
+            if (head >= s->num) {
+                error_report("Guest says index %u is available", head);
+                exit(1);
+            }
+            data_plane_handle_request(s, head);
+        }
+        if (s->flush_req) {
+            return;
+        }
+
+        if (s->event_idx) {
+            *data_plane_avail_event(s) = s->last_avail_idx;
+        } else {
+            s->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+        }
+        /* catch requests queued before the guest saw the flag change */
+        smp_mb();
+        if (s->last_avail_idx == s->avail->idx) {
+            break;
+        }
+    }
+
+    data_plane_submit(s);
+}
+
+static void data_plane_handle_completions(VirtIOBlockDataPlane *s)
+{
+    struct io_event events[64];
+    struct timespec ts = { 0, 0 };
+    DataPlaneRequest *req;
+    int ret, i;
+
+    do {
+        ret = io_getevents(s->io_ctx, 0, ARRAY_SIZE(events), events, &ts);
+        for (i = 0; i < ret; i++) {
+            req = (DataPlaneRequest *)(uintptr_t)events[i].data;
+            s->inflight--;
+            data_plane_complete_request(s, req,
+                events[i].res == req->len ? VIRTIO_BLK_S_OK :
+                                            VIRTIO_BLK_S_IOERR);
+        }
+    } while (ret == ARRAY_SIZE(events));
+
+    if (s->flush_req && !s->inflight) {
+        req = s->flush_req;
+        s->flush_req = NULL;
+        data_plane_flush(s, req);
+        /* also turns guest kicks back on */
+        data_plane_handle_ring(s);
+    }
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    struct pollfd pfd[3];
+
+    pfd[0].fd = event_notifier_get_fd(s->kick);
+    pfd[1].fd = event_notifier_get_fd(&s->io_done);
+    pfd[2].fd = event_notifier_get_fd(&s->stop_notifier);
+    pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+
+    while (!s->stopping || s->inflight) {
+        if (poll(pfd, 3, -1) < 0) {
+            continue;
+        }
+        if (pfd[1].revents & POLLIN) {
+            event_notifier_test_and_clear(&s->io_done);
+            data_plane_handle_completions(s);
+        }
+        if (pfd[0].revents & POLLIN) {
+            event_notifier_test_and_clear(s->kick);
+            data_plane_handle_ring(s);
+        }
+        if (pfd[2].revents & POLLIN) {
+            /* finish what is in flight, leave new kicks to the caller */
+            event_notifier_test_and_clear(&s->stop_notifier);
+            s->stopping = true;
+            pfd[0].fd = -1;
+        }
+        if (s->notify_pending) {
+            data_plane_notify_guest(s);
+        }
+    }
+    return NULL;
+}
+
+static void data_plane_log_handler(void *opaque, int enable)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    VirtIODevice *vdev = s->vdev;
+
+    /* Our writes to guest memory are not logged, so let the normal
+     * request path handle the device while memory is being migrated.
+     */
+    if (enable) {
+        if (s->started) {
+            virtio_blk_data_plane_stop(s);
+            virtio_queue_notify_vq(s->vq);
+        }
+        s->log_active = true;
+    } else {
+        s->log_active = false;
+        if ((vdev->status & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running) {
+            virtio_blk_data_plane_start(s);
+        }
+    }
+}
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial)
+{
+    VirtIOBlockDataPlane *s;
+    int fd;
+
+    /* TCG would not see our writes to guest memory */
+    if (!kvm_enabled()) {
+        error_report("virtio-blk data plane needs KVM");
+        return NULL;
+    }
+    if (bdrv_is_read_only(conf->bs)) {
+        error_report("virtio-blk data plane does not support read-only "
+                     "drives");
+        return NULL;
+    }
+    fd = raw_get_aio_fd(conf->bs);
+    if (fd < 0) {
+        error_report("virtio-blk data plane needs a raw image file or "
+                     "host device");
+        return NULL;
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+    s->vdev = vdev;
+    s->vq = virtio_get_queue(vdev, 0);
+    s->bs = conf->bs;
+    s->fd = fd;
+    s->serial = serial;
+    s->sector_mask = (conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
+    if (event_notifier_init(&s->own_kick, 0) < 0 ||
+        event_notifier_init(&s->io_done, 0) < 0 ||
+        event_notifier_init(&s->stop_notifier, 0) < 0) {
+        error_report("virtio-blk data plane: cannot create eventfds");
+        exit(1);
+    }
+    hostmem_init(&s->hostmem, data_plane_log_handler, s);
+    return s;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+    virtio_blk_data_plane_stop(s);
+    hostmem_finalize(&s->hostmem);
+    event_notifier_cleanup(&s->own_kick);
+    event_notifier_cleanup(&s->io_done);
+    event_notifier_cleanup(&s->stop_notifier);
+    qemu_free(s);
+}
+
+int virtio_blk_data_plane_started(VirtIOBlockDataPlane *s)
+{
+    return s && s->started;
+}
+
+int virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    int r;
+
+    if (s->started) {
+        return 0;
+    }
+    if (s->log_active) {
+        return -EBUSY;
+    }
+    if (!vdev->binding->set_guest_notifiers) {
+        error_report("virtio-blk data plane needs guest notifiers");
+        return -ENOSYS;
+    }
+
+    /* requests of the normal path must not complete behind our back */
+    virtio_blk_drain(vdev);
+
+    s->num = virtio_queue_get_num(vdev, 0);
+    s->desc = hostmem_lookup(&s->hostmem, virtio_queue_get_desc_addr(vdev, 0),
+                             virtio_queue_get_desc_size(vdev, 0));
+    s->avail = hostmem_lookup(&s->hostmem,
+                              virtio_queue_get_avail_addr(vdev, 0),
+                              virtio_queue_get_avail_size(vdev, 0));
+    s->used = hostmem_lookup(&s->hostmem, virtio_queue_get_used_addr(vdev, 0),
+                             virtio_queue_get_used_size(vdev, 0));
+    if (!s->num || !s->desc || !s->avail || !s->used) {
+        error_report("virtio-blk data plane: vring not in guest RAM");
+        return -EFAULT;
+    }
+    s->nb_sectors = bdrv_getlength(s->bs) / BDRV_SECTOR_SIZE;
+
+    s->io_ctx = 0;
+    if (io_setup(s->num, &s->io_ctx) < 0) {
+        r = -errno;
+        error_report("virtio-blk data plane: io_setup failed: %d", r);
+        return r;
+    }
+
+    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, true);
+    if (r < 0) {
+        error_report("virtio-blk data plane: no guest notifier: %d", -r);
+        io_destroy(s->io_ctx);
+        return r;
+    }
+    s->guest_notifier = virtio_queue_get_guest_notifier(s->vq);
+
+    /* Let the kernel deliver kicks straight to our thread if it can,
+     * otherwise the vCPU forwards them from virtio_blk_handle_output.
+     */
+    s->use_ioeventfd = kvm_enabled() && vdev->binding->set_host_notifier &&
+        vdev->binding->set_host_notifier(vdev->binding_opaque, 0, true) == 0;
+    s->kick = s->use_ioeventfd ? virtio_queue_get_host_notifier(s->vq)
+                               : &s->own_kick;
+
+    s->reqs = qemu_mallocz(s->num * sizeof(DataPlaneRequest));
+    s->iocbs = qemu_malloc(s->num * sizeof(struct iocb *));
+    s->nb_iocbs = 0;
+    s->inflight = 0;
+    s->flush_req = NULL;
+    s->stopping = false;
+    s->notify_pending = false;
+    s->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, 0);
+    s->used_idx = s->used->idx;
+    s->event_idx = !!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX));
+    s->signalled_used_valid = false;
+
+    s->started = true;
+    /* pick up requests queued before we started */
+    event_notifier_set(s->kick);
+    qemu_thread_create(&s->thread, data_plane_thread, s);
+    return 0;
+}
+
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+
+    if (!s->started) {
+        return;
+    }
+
+    event_notifier_set(&s->stop_notifier);
+    qemu_thread_join(&s->thread);
+    s->started = false;
+
+    io_destroy(s->io_ctx);
+    virtio_queue_set_last_avail_idx(vdev, 0, s->last_avail_idx);
+    virtio_queue_invalidate_signalled_used(vdev, 0);
+    qemu_free(s->reqs);
+    qemu_free(s->iocbs);
+
+    /* kicks from now on go to the normal path */
+    if (s->use_ioeventfd) {
+        vdev->binding->set_host_notifier(vdev->binding_opaque, 0, false);
+    } else {
+        event_notifier_test_and_clear(&s->own_kick);
+    }
+
+    /* deliver an interrupt the main loop has not seen yet */
+    if (event_notifier_test_and_clear(s->guest_notifier)) {
+        virtio_irq(s->vq);
+    }
+    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
+}
+
+void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s)
+{
+    event_notifier_set(&s->own_kick);
+}
@@ -0,0 +1,30 @@
+/*
+ * Virtio Block Device data plane
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef _QEMU_VIRTIO_BLK_DATAPLANE_H
+#define _QEMU_VIRTIO_BLK_DATAPLANE_H
+
+#include "virtio.h"
+
+typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
+
+/* Requests of a device with a data plane are processed by a thread of
+ * its own, which reads the vring straight from guest memory and submits
+ * linux-aio to the image file without taking the global mutex.
+ */
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial);
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
+int virtio_blk_data_plane_start(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s);
+int virtio_blk_data_plane_started(VirtIOBlockDataPlane *s);
+
+/* Forward a guest kick that did not arrive through an ioeventfd */
+void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s);
+
+#endif
@@ -14,8 +14,12 @@
 #include <qemu-common.h>
 #include "qemu-error.h"
 #include "trace.h"
+#include "qemu-timer.h"
 #include "blockdev.h"
 #include "virtio-blk.h"
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "virtio-blk-dataplane.h"
+#endif
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
@@ -28,9 +32,16 @@ typedef struct VirtIOBlock
     void *rq;
     QEMUBH *bh;
     BlockConf *conf;
+    virtio_blk_conf *blk;
+    QEMUBH *complete_bh;
+    QEMUTimer *complete_timer;
+    unsigned int complete_pending;
     unsigned short sector_mask;
     char sn[BLOCK_SERIAL_STRLEN];
     DeviceState *qdev;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -49,6 +60,37 @@ typedef struct VirtIOBlockReq
     struct VirtIOBlockReq *next;
 } VirtIOBlockReq;
 
+/*
+ * Finished requests are written to the used ring as they complete, but the
+ * used index is only published, and the guest notified, once per batch:
+ * from a bottom half after the current AIO completion pass, or when the
+ * optional x-complete-delay window or x-complete-batch count runs out.
+ * Nothing is held while the VM is stopped, so that the used index in guest
+ * RAM is final before it is migrated.
+ */
+static void virtio_blk_complete_flush(VirtIOBlock *s)
+{
+    unsigned int count = s->complete_pending;
+    bool irq;
+
+    qemu_bh_cancel(s->complete_bh);
+    qemu_del_timer(s->complete_timer);
+    if (!count) {
+        return;
+    }
+    s->complete_pending = 0;
+
+    virtqueue_flush(s->vq, count);
+    irq = virtio_notify(&s->vdev, s->vq);
+    trace_virtio_blk_complete_flush(s, count, irq);
+    bdrv_account_completions(s->bs, count, irq);
+}
+
+static void virtio_blk_complete_cb(void *opaque)
+{
+    virtio_blk_complete_flush(opaque);
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
 {
     VirtIOBlock *s = req->dev;
@@ -56,10 +98,21 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     req->in->status = status;
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(&s->vdev, s->vq);
-
+    virtqueue_fill(s->vq, &req->elem, req->qiov.size + sizeof(*req->in),
+                   s->complete_pending++);
     qemu_free(req);
+
+    if (!vm_running || (s->blk->complete_batch &&
+        s->complete_pending >= s->blk->complete_batch)) {
+        virtio_blk_complete_flush(s);
+    } else if (s->complete_pending == 1) {
+        if (s->blk->complete_delay) {
+            qemu_mod_timer(s->complete_timer, qemu_get_clock_ns(vm_clock) +
+                           s->blk->complete_delay * 1000LL);
+        } else {
+            qemu_bh_schedule(s->complete_bh);
+        }
+    }
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -366,6 +419,13 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         .num_writes = 0,
     };
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (virtio_blk_data_plane_started(s->dataplane)) {
+        virtio_blk_data_plane_notify(s->dataplane);
+        return;
+    }
+#endif
+
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
@@ -404,8 +464,11 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
 {
     VirtIOBlock *s = opaque;
 
-    if (!running)
+    if (!running) {
+        /* publish before the final RAM pass of a migration */
+        virtio_blk_complete_flush(s);
         return;
+    }
 
     if (!s->bh) {
         s->bh = qemu_bh_new(virtio_blk_dma_restart_bh, s);
@@ -413,13 +476,41 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
     }
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if ((status & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running) {
+        /* the normal request path stays in charge if this fails */
+        virtio_blk_data_plane_start(s->dataplane);
+    } else {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+}
+#endif
+
+/* Wait for the requests the main loop has in flight and publish them */
+void virtio_blk_drain(VirtIODevice *vdev)
+{
+    qemu_aio_flush();
+    virtio_blk_complete_flush(to_virtio_blk(vdev));
+}
+
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
      */
     qemu_aio_flush();
+
+    /* the rings are going away, drop completions not yet published */
+    s->complete_pending = 0;
+    qemu_bh_cancel(s->complete_bh);
+    qemu_del_timer(s->complete_timer);
 }
 
 /* coalesce internal state, copy to pci i/o region 0
@@ -471,11 +562,12 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     VirtIOBlock *s = opaque;
     VirtIOBlockReq *req = s->rq;
 
+    assert(!s->complete_pending);
     virtio_save(&s->vdev, f);
     
     while (req) {
         qemu_put_sbyte(f, 1);
-        qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        virtqueue_save_element(f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -491,20 +583,16 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     virtio_load(&s->vdev, f);
     while (qemu_get_sbyte(f)) {
         VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-        qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        virtqueue_load_element(f, s->vq, &req->elem);
         req->next = s->rq;
         s->rq = req;
-
-        virtqueue_map_sg(req->elem.in_sg, req->elem.in_addr,
-            req->elem.in_num, 1);
-        virtqueue_map_sg(req->elem.out_sg, req->elem.out_addr,
-            req->elem.out_num, 0);
     }
 
     return 0;
 }
 
-VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
+VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
+                              virtio_blk_conf *blk)
 {
     VirtIOBlock *s;
     int cylinders, heads, secs;
@@ -529,6 +617,7 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
     s->vdev.reset = virtio_blk_reset;
     s->bs = conf->bs;
     s->conf = conf;
+    s->blk = blk;
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
     bdrv_guess_geometry(s->bs, &cylinders, &heads, &secs);
@@ -540,6 +629,22 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
     strncpy(s->sn, dinfo->serial, sizeof (s->sn));
 
     s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    s->complete_bh = qemu_bh_new(virtio_blk_complete_cb, s);
+    s->complete_timer = qemu_new_timer(vm_clock, virtio_blk_complete_cb, s);
+
+    if (blk->data_plane) {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+        s->dataplane = virtio_blk_data_plane_create(&s->vdev, conf, s->sn);
+        if (s->dataplane) {
+            s->vdev.set_status = virtio_blk_set_status;
+        } else {
+            error_report("virtio-blk: falling back to the normal request "
+                         "path");
+        }
+#else
+        error_report("virtio-blk: data plane is not supported by this build");
+#endif
+    }
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
@@ -556,5 +661,12 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_blk_data_plane_destroy(s->dataplane);
+#endif
+    virtio_blk_complete_flush(s);
+    qemu_bh_delete(s->complete_bh);
+    qemu_del_timer(s->complete_timer);
+    qemu_free_timer(s->complete_timer);
     unregister_savevm(s->qdev, "virtio-blk", s);
 }
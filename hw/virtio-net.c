@@ -15,6 +15,7 @@
 #include "virtio.h"
 #include "net.h"
 #include "net/checksum.h"
+#include "net/gso.h"
 #include "net/tap.h"
 #include "qemu-error.h"
 #include "qemu-timer.h"
@@ -26,26 +27,38 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* One rx/tx pair, served by the NIC queue with the same index */
+typedef struct VirtIONetQueue
+{
+    VirtQueue *rx_vq;
+    VirtQueue *tx_vq;
+    QEMUTimer *tx_timer;
+    QEMUBH *tx_bh;
+    int tx_waiting;
+    /* Inside a receive batch the rx interrupt is raised once, at the end */
+    int rx_batch;
+    int rx_notify;
+    struct {
+        VirtQueueElement elem;
+        ssize_t len;
+    } async_tx;
+    struct VirtIONet *n;
+} VirtIONetQueue;
+
 typedef struct VirtIONet
 {
     VirtIODevice vdev;
     uint8_t mac[ETH_ALEN];
     uint16_t status;
-    VirtQueue *rx_vq;
-    VirtQueue *tx_vq;
+    VirtIONetQueue *vqs;
     VirtQueue *ctrl_vq;
     NICState *nic;
-    QEMUTimer *tx_timer;
-    QEMUBH *tx_bh;
     uint32_t tx_timeout;
     int32_t tx_burst;
-    int tx_waiting;
     uint32_t has_vnet_hdr;
+    uint32_t sw_gro;
+    uint32_t sw_gso;
     uint8_t has_ufo;
-    struct {
-        VirtQueueElement elem;
-        ssize_t len;
-    } async_tx;
     int mergeable_rx_bufs;
     uint8_t promisc;
     uint8_t allmulti;
@@ -63,6 +76,10 @@ typedef struct VirtIONet
     } mac_table;
     uint32_t *vlans;
     DeviceState *qdev;
+    int multiqueue;
+    uint16_t max_queues;
+    uint16_t curr_queues;
+    size_t config_size;
 } VirtIONet;
 
 /* TODO
@@ -74,14 +91,43 @@ static VirtIONet *to_virtio_net(VirtIODevice *vdev)
     return (VirtIONet *)vdev;
 }
 
+static VirtIONetQueue *virtio_net_get_subqueue(VLANClientState *nc)
+{
+    NICState *nic = DO_UPCAST(NICState, nc, nc);
+    VirtIONet *n = nic->opaque;
+
+    return &n->vqs[nic->queue_index];
+}
+
+/* rx/tx pair i uses virtqueues 2i and 2i + 1 */
+static int vq2q(int queue_index)
+{
+    return queue_index / 2;
+}
+
+static VLANClientState *virtio_net_get_peer(VirtIONet *n, int queue_index)
+{
+    return qemu_get_subqueue(n->nic, queue_index)->nc.peer;
+}
+
+static void virtio_net_format_info_str(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_format_nic_info_str(&qemu_get_subqueue(n->nic, i)->nc, n->mac);
+    }
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
     netcfg.status = n->status;
+    netcfg.max_virtqueue_pairs = n->max_queues;
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
-    memcpy(config, &netcfg, sizeof(netcfg));
+    memcpy(config, &netcfg, n->config_size);
 }
 
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -89,11 +135,11 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
-    memcpy(&netcfg, config, sizeof(netcfg));
+    memcpy(&netcfg, config, n->config_size);
 
     if (memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
-        qemu_format_nic_info_str(&n->nic->nc, n->mac);
+        virtio_net_format_info_str(n);
     }
 }
 
@@ -118,8 +164,10 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     if (!!n->vhost_started == virtio_net_started(n, status)) {
         return;
     }
+    /* vhost serves the active pairs only; a change in their number
+     * stops it first, see virtio_net_handle_mq */
     if (!n->vhost_started) {
-        int r = vhost_net_start(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        int r = vhost_net_start(&n->vdev, n->nic, n->curr_queues);
         if (r < 0) {
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
@@ -127,7 +175,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
             n->vhost_started = 1;
         }
     } else {
-        vhost_net_stop(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        vhost_net_stop(&n->vdev, n->nic, n->curr_queues);
         n->vhost_started = 0;
     }
 }
@@ -135,25 +183,32 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q;
+    int i;
 
     virtio_net_vhost_status(n, status);
 
-    if (!n->tx_waiting) {
-        return;
-    }
+    for (i = 0; i < n->max_queues; i++) {
+        q = &n->vqs[i];
 
-    if (virtio_net_started(n, status) && !n->vhost_started) {
-        if (n->tx_timer) {
-            qemu_mod_timer(n->tx_timer,
-                           qemu_get_clock(vm_clock) + n->tx_timeout);
-        } else {
-            qemu_bh_schedule(n->tx_bh);
+        if (!q->tx_waiting) {
+            continue;
         }
-    } else {
-        if (n->tx_timer) {
-            qemu_del_timer(n->tx_timer);
+
+        if (virtio_net_started(n, status) && !n->vhost_started &&
+            i < n->curr_queues) {
+            if (q->tx_timer) {
+                qemu_mod_timer(q->tx_timer,
+                               qemu_get_clock(vm_clock) + n->tx_timeout);
+            } else {
+                qemu_bh_schedule(q->tx_bh);
+            }
         } else {
-            qemu_bh_cancel(n->tx_bh);
+            if (q->tx_timer) {
+                qemu_del_timer(q->tx_timer);
+            } else {
+                qemu_bh_cancel(q->tx_bh);
+            }
         }
     }
 }
@@ -174,10 +229,33 @@ static void virtio_net_set_link_status(VLANClientState *nc)
     virtio_net_set_status(&n->vdev, n->vdev.status);
 }
 
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue);
+static void virtio_net_set_queues(VirtIONet *n);
+
+/* Forget the packets of every pair still waiting in the peers' queues,
+ * along with the tx element they came from. */
+static void virtio_net_drop_async_tx(VirtIONet *n)
+{
+    VirtIONetQueue *q;
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        q = &n->vqs[i];
+
+        qemu_purge_queued_packets(&qemu_get_subqueue(n->nic, i)->nc);
+        if (q->async_tx.elem.out_num) {
+            virtqueue_release_element(q->tx_vq, &q->async_tx.elem);
+            q->async_tx.elem.out_num = q->async_tx.len = 0;
+        }
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
+    virtio_net_drop_async_tx(n);
+
     /* Reset back to compatibility mode */
     n->promisc = 1;
     n->allmulti = 0;
@@ -193,6 +271,11 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.uni_overflow = 0;
     memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    /* Back to a single pair until the guest negotiates more */
+    if (n->max_queues > 1) {
+        virtio_net_set_multiqueue(n, 0);
+    }
 }
 
 static int peer_has_vnet_hdr(VirtIONet *n)
@@ -218,27 +301,71 @@ static int peer_has_ufo(VirtIONet *n)
     return n->has_ufo;
 }
 
+/* All queues of a multiqueue tap are opened alike, so queue 0 answers
+ * for the others above; settings must reach every queue, though. */
+static void peer_using_vnet_hdr(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        tap_using_vnet_hdr(virtio_net_get_peer(n, i), 1);
+    }
+}
+
+static void peer_set_offload(VirtIONet *n, uint32_t features)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        tap_set_offload(virtio_net_get_peer(n, i),
+                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
+                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+    }
+}
+
 static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
     features |= (1 << VIRTIO_NET_F_MAC);
 
+    if (n->max_queues == 1) {
+        features &= ~(0x1 << VIRTIO_NET_F_MQ);
+    }
+
     if (peer_has_vnet_hdr(n)) {
-        tap_using_vnet_hdr(n->nic->nc.peer, 1);
+        peer_using_vnet_hdr(n);
     } else {
-        features &= ~(0x1 << VIRTIO_NET_F_CSUM);
-        features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
-        features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO6);
-        features &= ~(0x1 << VIRTIO_NET_F_HOST_ECN);
+        /* Checksums and segmentation the guest leaves to us are done in
+         * software before the frame goes to the backend (net/gso.c). */
+        if (!n->sw_gso) {
+            features &= ~(0x1 << VIRTIO_NET_F_CSUM);
+        }
+        if (!(features & (0x1 << VIRTIO_NET_F_CSUM))) {
+            features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
+            features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO6);
+            features &= ~(0x1 << VIRTIO_NET_F_HOST_ECN);
+            features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
+        }
 
-        features &= ~(0x1 << VIRTIO_NET_F_GUEST_CSUM);
-        features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO4);
+        /* The net layer merges IPv4 TCP segments into TSO frames for
+         * guests that take them, but leaves everything else alone. */
+        if (!n->sw_gro) {
+            features &= ~(0x1 << VIRTIO_NET_F_GUEST_CSUM);
+        }
+        if (!(features & (0x1 << VIRTIO_NET_F_GUEST_CSUM))) {
+            features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO4);
+        }
         features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO6);
         features &= ~(0x1 << VIRTIO_NET_F_GUEST_ECN);
     }
 
-    if (!peer_has_vnet_hdr(n) || !peer_has_ufo(n)) {
+    if (!peer_has_vnet_hdr(n)) {
+        features &= ~(0x1 << VIRTIO_NET_F_GUEST_UFO);
+    } else if (!peer_has_ufo(n)) {
         features &= ~(0x1 << VIRTIO_NET_F_GUEST_UFO);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
@@ -271,16 +398,16 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
 static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
+
+    if (n->max_queues > 1) {
+        virtio_net_set_multiqueue(n, !!(features & (1 << VIRTIO_NET_F_MQ)));
+    }
 
     n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
 
     if (n->has_vnet_hdr) {
-        tap_set_offload(n->nic->nc.peer,
-                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+        peer_set_offload(n, features);
     }
     if (!n->nic->nc.peer ||
         n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP) {
@@ -289,7 +416,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
     if (!tap_get_vhost_net(n->nic->nc.peer)) {
         return;
     }
-    vhost_net_ack_features(tap_get_vhost_net(n->nic->nc.peer), features);
+    for (i = 0; i < n->max_queues; i++) {
+        vhost_net_ack_features(tap_get_vhost_net(virtio_net_get_peer(n, i)),
+                               features);
+    }
 }
 
 static int virtio_net_handle_rx_mode(VirtIONet *n, uint8_t cmd,
@@ -399,6 +529,42 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                VirtQueueElement *elem)
+{
+    uint16_t queues;
+
+    if (elem->out_num != 2 ||
+        elem->out_sg[1].iov_len != sizeof(struct virtio_net_ctrl_mq)) {
+        error_report("virtio-net ctrl invalid multiqueue command");
+        return VIRTIO_NET_ERR;
+    }
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || !n->multiqueue) {
+        return VIRTIO_NET_ERR;
+    }
+
+    queues = lduw_le_p(elem->out_sg[1].iov_base);
+
+    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+        queues > n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+
+    /* Stop vhost with the old number of pairs; set_status restarts it
+     * with the new one. */
+    if (n->vhost_started) {
+        vhost_net_stop(&n->vdev, n->nic, n->curr_queues);
+        n->vhost_started = 0;
+    }
+    n->curr_queues = queues;
+    virtio_net_set_queues(n);
+    virtio_net_set_status(&n->vdev, n->vdev.status);
+
+    return VIRTIO_NET_OK;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -427,6 +593,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_mac(n, ctrl.cmd, &elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_VLAN)
             status = virtio_net_handle_vlan_table(n, ctrl.cmd, &elem);
+        else if (ctrl.class == VIRTIO_NET_CTRL_MQ)
+            status = virtio_net_handle_mq(n, ctrl.cmd, &elem);
 
         stb_p(elem.in_sg[elem.in_num - 1].iov_base, status);
 
@@ -440,8 +608,9 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int queue_index = vq2q(virtio_get_queue_index(vq));
 
-    qemu_flush_queued_packets(&n->nic->nc);
+    qemu_flush_queued_packets(&qemu_get_subqueue(n->nic, queue_index)->nc);
 
     /* We now have RX buffers, signal to the IO thread to break out of the
      * select to re-poll the tap file descriptor */
@@ -451,35 +620,43 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 static int virtio_net_can_receive(VLANClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
     if (!n->vdev.vm_running) {
         return 0;
     }
 
-    if (!virtio_queue_ready(n->rx_vq) ||
+    if (DO_UPCAST(NICState, nc, nc)->queue_index >= n->curr_queues) {
+        return 0;
+    }
+
+    if (!virtio_queue_ready(q->rx_vq) ||
         !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return 0;
 
     return 1;
 }
 
-static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
-    if (virtio_queue_empty(n->rx_vq) ||
+    VirtIONet *n = q->n;
+
+    if (virtio_queue_empty(q->rx_vq) ||
         (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(n->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(n->rx_vq, 1);
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(n->rx_vq) ||
+        if (virtio_queue_empty(q->rx_vq) ||
             (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(n->rx_vq, bufsize, 0)))
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0)))
             return 0;
     }
 
-    virtio_queue_set_notification(n->rx_vq, 0);
+    virtio_queue_set_notification(q->rx_vq, 0);
     return 1;
 }
 
@@ -512,7 +689,8 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static int receive_header(VirtIONet *n, struct iovec *iov, int iovcnt,
-                          const void *buf, size_t size, size_t hdr_len)
+                          const void *buf, size_t size, size_t hdr_len,
+                          const struct virtio_net_hdr *gso)
 {
     struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)iov[0].iov_base;
     int offset = 0;
@@ -520,7 +698,12 @@ static int receive_header(VirtIONet *n, struct iovec *iov, int iovcnt,
     hdr->flags = 0;
     hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
 
-    if (n->has_vnet_hdr) {
+    if (gso) {
+        memcpy(hdr, gso, sizeof(*hdr));
+        if (!(n->vdev.guest_features & (1 << VIRTIO_NET_F_GUEST_CSUM))) {
+            hdr->flags &= ~VIRTIO_NET_HDR_F_DATA_VALID;
+        }
+    } else if (n->has_vnet_hdr) {
         memcpy(hdr, buf, sizeof(*hdr));
         offset = sizeof(*hdr);
         work_around_broken_dhclient(hdr, buf + offset, size - offset);
@@ -588,13 +771,16 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
+static ssize_t virtio_net_do_receive(VLANClientState *nc,
+                                     const struct virtio_net_hdr *gso,
+                                     const uint8_t *buf, size_t size)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONet *n = q->n;
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t guest_hdr_len, offset, i, host_hdr_len;
 
-    if (!virtio_net_can_receive(&n->nic->nc))
+    if (!virtio_net_can_receive(nc))
         return -1;
 
     /* hdr_len refers to the header we supply to the guest */
@@ -603,7 +789,7 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
 
 
     host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
-    if (!virtio_net_has_buffers(n, size + guest_hdr_len - host_hdr_len))
+    if (!virtio_net_has_buffers(q, size + guest_hdr_len - host_hdr_len))
         return 0;
 
     if (!receive_filter(n, buf, size))
@@ -618,7 +804,7 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
 
         total = 0;
 
-        if (virtqueue_pop(n->rx_vq, &elem) == 0) {
+        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -646,7 +832,8 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
                 mhdr = (struct virtio_net_hdr_mrg_rxbuf *)sg[0].iov_base;
 
             offset += receive_header(n, sg, elem.in_num,
-                                     buf + offset, size - offset, guest_hdr_len);
+                                     buf + offset, size - offset, guest_hdr_len,
+                                     gso);
             total += guest_hdr_len;
         }
 
@@ -666,40 +853,93 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
                          i, n->mergeable_rx_bufs,
                          offset, size, guest_hdr_len, host_hdr_len);
 #endif
+            virtqueue_release_element(q->rx_vq, &elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(n->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, i++);
     }
 
     if (mhdr)
         mhdr->num_buffers = i;
 
-    virtqueue_flush(n->rx_vq, i);
-    virtio_notify(&n->vdev, n->rx_vq);
+    virtqueue_flush(q->rx_vq, i);
+    if (q->rx_batch) {
+        q->rx_notify = 1;
+    } else {
+        virtio_notify(&n->vdev, q->rx_vq);
+    }
 
     return size;
 }
 
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
+static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
+{
+    return virtio_net_do_receive(nc, NULL, buf, size);
+}
 
-static void virtio_net_tx_complete(VLANClientState *nc, ssize_t len)
+/* Merged TCP segments go to the guest as a TSO frame */
+static ssize_t virtio_net_receive_coalesced(VLANClientState *nc,
+                                            const uint8_t *buf, size_t size,
+                                            int hdr_len, int mss)
+{
+    struct virtio_net_hdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr.hdr_len = hdr_len;
+    hdr.gso_size = mss;
+
+    return virtio_net_do_receive(nc, &hdr, buf, size);
+}
+
+/* With a vnet_hdr the backend sends large frames itself */
+static int virtio_net_coalesce_limit(VLANClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
 
-    virtqueue_push(n->tx_vq, &n->async_tx.elem, n->async_tx.len);
-    virtio_notify(&n->vdev, n->tx_vq);
+    if (n->has_vnet_hdr ||
+        !(n->vdev.guest_features & (1 << VIRTIO_NET_F_GUEST_TSO4))) {
+        return 0;
+    }
+    return VIRTIO_NET_MAX_BUFSIZE - sizeof(struct virtio_net_hdr);
+}
+
+static void virtio_net_receive_batch(VLANClientState *nc, bool start)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
 
-    n->async_tx.elem.out_num = n->async_tx.len = 0;
+    q->rx_batch = start;
+    if (!start && q->rx_notify) {
+        q->rx_notify = 0;
+        virtio_notify(&q->n->vdev, q->rx_vq);
+    }
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+static void virtio_net_tx_complete(VLANClientState *nc, ssize_t len)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONet *n = q->n;
+
+    virtqueue_push(q->tx_vq, &q->async_tx.elem, q->async_tx.len);
+    virtio_notify(&n->vdev, q->tx_vq);
+
+    q->async_tx.elem.out_num = q->async_tx.len = 0;
+
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
+    VirtIONet *n = q->n;
+    VirtQueue *vq = q->tx_vq;
+    VLANClientState *nc = &qemu_get_subqueue(n->nic, q - n->vqs)->nc;
     VirtQueueElement elem;
     int32_t num_packets = 0;
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -708,8 +948,8 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 
     assert(n->vdev.vm_running);
 
-    if (n->async_tx.elem.out_num) {
-        virtio_queue_set_notification(n->tx_vq, 0);
+    if (q->async_tx.elem.out_num) {
+        virtio_queue_set_notification(vq, 0);
         return num_packets;
     }
 
@@ -718,6 +958,7 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
         unsigned int out_num = elem.out_num;
         struct iovec *out_sg = &elem.out_sg[0];
         unsigned hdr_len;
+        NetGSOInfo gso = { 0 };
 
         /* hdr_len refers to the header received from the guest */
         hdr_len = n->mergeable_rx_bufs ?
@@ -729,8 +970,15 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             exit(1);
         }
 
-        /* ignore the header if GSO is not supported */
+        /* without a vnet header, the net layer does what it asks for */
         if (!n->has_vnet_hdr) {
+            struct virtio_net_hdr *hdr = out_sg->iov_base;
+
+            gso.flags = hdr->flags;
+            gso.type = hdr->gso_type;
+            gso.size = hdr->gso_size;
+            gso.csum_start = hdr->csum_start;
+            gso.csum_offset = hdr->csum_offset;
             out_num--;
             out_sg++;
             len += hdr_len;
@@ -741,46 +989,54 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             len += hdr_len;
         }
 
-        ret = qemu_sendv_packet_async(&n->nic->nc, out_sg, out_num,
-                                      virtio_net_tx_complete);
+        ret = net_gso_sendv(nc, &gso, out_sg, out_num,
+                            virtio_net_tx_complete);
         if (ret == 0) {
-            virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
-            n->async_tx.len  = len;
+            virtio_queue_set_notification(vq, 0);
+            q->async_tx.elem = elem;
+            q->async_tx.len  = len;
+            if (num_packets) {
+                virtio_notify(&n->vdev, vq);
+            }
             return -EBUSY;
         }
 
         len += ret;
 
         virtqueue_push(vq, &elem, len);
-        virtio_notify(&n->vdev, vq);
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+
+    /* one interrupt for the whole burst */
+    if (num_packets) {
+        virtio_notify(&n->vdev, vq);
+    }
     return num_packets;
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         return;
     }
 
-    if (n->tx_waiting) {
+    if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
-        qemu_del_timer(n->tx_timer);
-        n->tx_waiting = 0;
-        virtio_net_flush_tx(n, vq);
+        qemu_del_timer(q->tx_timer);
+        q->tx_waiting = 0;
+        virtio_net_flush_tx(q);
     } else {
-        qemu_mod_timer(n->tx_timer,
+        qemu_mod_timer(q->tx_timer,
                        qemu_get_clock(vm_clock) + n->tx_timeout);
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
 }
@@ -788,48 +1044,51 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
-    if (unlikely(n->tx_waiting)) {
+    if (unlikely(q->tx_waiting)) {
         return;
     }
-    n->tx_waiting = 1;
+    q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(n->tx_bh);
+    qemu_bh_schedule(q->tx_bh);
 }
 
 static void virtio_net_tx_timer(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 static void virtio_net_tx_bh(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     int32_t ret;
 
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (unlikely(!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)))
         return;
 
-    ret = virtio_net_flush_tx(n, n->tx_vq);
+    ret = virtio_net_flush_tx(q);
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
@@ -837,25 +1096,82 @@ static void virtio_net_tx_bh(void *opaque)
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
         return;
     }
 
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(n->tx_vq, 1);
-    if (virtio_net_flush_tx(n, n->tx_vq) > 0) {
-        virtio_queue_set_notification(n->tx_vq, 0);
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (virtio_net_flush_tx(q) > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+    }
+}
+
+static void virtio_net_add_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+
+    q->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    if (q->tx_timer) {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
+    } else {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
+    }
+}
+
+/* The control queue follows the last pair the guest may use: it is
+ * queue 2 without VIRTIO_NET_F_MQ and queue 2 * max_queues with it,
+ * so the layout is rebuilt whenever the feature is (un)negotiated.
+ */
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
+{
+    int i, max = multiqueue ? n->max_queues : 1;
+
+    n->multiqueue = multiqueue;
+
+    for (i = 2; i <= n->max_queues * 2; i++) {
+        virtio_del_queue(&n->vdev, i);
+    }
+    for (i = 1; i < max; i++) {
+        virtio_net_add_queue(n, i);
+    }
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+
+    if (!multiqueue) {
+        n->curr_queues = 1;
+        virtio_net_set_queues(n);
+    }
+}
+
+/* Detach the tap queues of unused pairs, so that the host does not
+ * steer packets to them. */
+static void virtio_net_set_queues(VirtIONet *n)
+{
+    VLANClientState *peer;
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        peer = virtio_net_get_peer(n, i);
+        if (!peer || peer->info->type != NET_CLIENT_TYPE_TAP) {
+            continue;
+        }
+        if (i < n->curr_queues) {
+            tap_enable(peer);
+        } else {
+            tap_disable(peer);
+        }
     }
 }
 
 static void virtio_net_save(QEMUFile *f, void *opaque)
 {
     VirtIONet *n = opaque;
+    int i;
 
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
@@ -863,7 +1179,7 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     virtio_save(&n->vdev, f);
 
     qemu_put_buffer(f, n->mac, ETH_ALEN);
-    qemu_put_be32(f, n->tx_waiting);
+    qemu_put_be32(f, n->vqs[0].tx_waiting);
     qemu_put_be32(f, n->mergeable_rx_bufs);
     qemu_put_be16(f, n->status);
     qemu_put_byte(f, n->promisc);
@@ -879,6 +1195,16 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     qemu_put_byte(f, n->nouni);
     qemu_put_byte(f, n->nobcast);
     qemu_put_byte(f, n->has_ufo);
+
+    /* Only multiqueue devices carry this, and migrate only to their
+     * own kind. */
+    if (n->max_queues > 1) {
+        qemu_put_be16(f, n->max_queues);
+        qemu_put_be16(f, n->curr_queues);
+        for (i = 1; i < n->curr_queues; i++) {
+            qemu_put_be32(f, n->vqs[i].tx_waiting);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -892,7 +1218,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     virtio_load(&n->vdev, f);
 
     qemu_get_buffer(f, n->mac, ETH_ALEN);
-    n->tx_waiting = qemu_get_be32(f);
+    n->vqs[0].tx_waiting = qemu_get_be32(f);
     n->mergeable_rx_bufs = qemu_get_be32(f);
 
     if (version_id >= 3)
@@ -931,13 +1257,8 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (n->has_vnet_hdr) {
-            tap_using_vnet_hdr(n->nic->nc.peer, 1);
-            tap_set_offload(n->nic->nc.peer,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+            peer_using_vnet_hdr(n);
+            peer_set_offload(n, n->vdev.guest_features);
         }
     }
 
@@ -960,6 +1281,24 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (n->max_queues > 1) {
+        if (qemu_get_be16(f) != n->max_queues) {
+            error_report("virtio-net: saved image has a different number "
+                         "of queues");
+            return -1;
+        }
+        n->curr_queues = qemu_get_be16(f);
+        if (n->curr_queues < 1 || n->curr_queues > n->max_queues) {
+            error_report("virtio-net: saved image uses %d queues, "
+                         "only %d available", n->curr_queues, n->max_queues);
+            return -1;
+        }
+        for (i = 1; i < n->curr_queues; i++) {
+            n->vqs[i].tx_waiting = qemu_get_be32(f);
+        }
+        virtio_net_set_queues(n);
+    }
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -982,7 +1321,10 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
-        .cleanup = virtio_net_cleanup,
+    .receive_batch = virtio_net_receive_batch,
+    .coalesce_limit = virtio_net_coalesce_limit,
+    .receive_coalesced = virtio_net_receive_coalesced,
+    .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
 };
 
@@ -990,6 +1332,7 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               virtio_net_conf *net)
 {
     VirtIONet *n;
+    int i;
 
     n = (VirtIONet *)virtio_common_init("virtio-net", VIRTIO_ID_NET,
                                         sizeof(struct virtio_net_config),
@@ -1002,7 +1345,6 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->vdev.bad_features = virtio_net_bad_features;
     n->vdev.reset = virtio_net_reset;
     n->vdev.set_status = virtio_net_set_status;
-    n->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
 
     if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
         error_report("virtio-net: "
@@ -1011,25 +1353,49 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
         error_report("Defaulting to \"bh\"");
     }
 
-    if (net->tx && !strcmp(net->tx, "timer")) {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
-        n->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, n);
-        n->tx_timeout = net->txtimer;
-    } else {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
-        n->tx_bh = qemu_bh_new(virtio_net_tx_bh, n);
-    }
-    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
     qemu_macaddr_default_if_unset(&conf->macaddr);
     memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
     n->status = VIRTIO_NET_S_LINK_UP;
 
+    /* One rx/tx pair for each queue of the backend */
     n->nic = qemu_new_nic(&net_virtio_info, conf, dev->info->name, dev->id, n);
+    n->max_queues = n->nic->queues;
+    n->curr_queues = 1;
+    n->vqs = qemu_mallocz(n->max_queues * sizeof(VirtIONetQueue));
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->n = n;
+        if (net->tx && !strcmp(net->tx, "timer")) {
+            q->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, q);
+        } else {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+    }
+    n->tx_timeout = net->txtimer;
 
-    qemu_format_nic_info_str(&n->nic->nc, conf->macaddr.a);
+    /* Start out with the layout of a single queue device */
+    virtio_net_add_queue(n, 0);
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+
+    /* max_virtqueue_pairs is only visible to the guest on multiqueue
+     * devices, and those get a vector for each virtqueue by default. */
+    if (n->max_queues > 1) {
+        n->config_size = sizeof(struct virtio_net_config);
+        n->vdev.nvectors = 2 * n->max_queues + 2;
+    } else {
+        n->config_size = offsetof(struct virtio_net_config,
+                                  max_virtqueue_pairs);
+        n->vdev.nvectors = 3;
+    }
+    n->vdev.config_len = n->config_size;
+
+    virtio_net_format_info_str(n);
 
-    n->tx_waiting = 0;
     n->tx_burst = net->txburst;
+    n->sw_gro = net->sw_gro;
+    n->sw_gso = net->sw_gso;
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
 
@@ -1049,24 +1415,31 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 void virtio_net_exit(VirtIODevice *vdev)
 {
     VirtIONet *n = DO_UPCAST(VirtIONet, vdev, vdev);
+    NICState *nic = n->nic;
+    int i;
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
-    qemu_purge_queued_packets(&n->nic->nc);
-
     unregister_savevm(n->qdev, "virtio-net", n);
 
     qemu_free(n->mac_table.macs);
     qemu_free(n->vlans);
 
-    if (n->tx_timer) {
-        qemu_del_timer(n->tx_timer);
-        qemu_free_timer(n->tx_timer);
-    } else {
-        qemu_bh_delete(n->tx_bh);
+    virtio_net_drop_async_tx(n);
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->tx_timer) {
+            qemu_del_timer(q->tx_timer);
+            qemu_free_timer(q->tx_timer);
+        } else {
+            qemu_bh_delete(q->tx_bh);
+        }
     }
+    qemu_free(n->vqs);
 
     virtio_cleanup(&n->vdev);
-    qemu_del_vlan_client(&n->nic->nc);
+    qemu_del_vlan_client(&nic->nc);
 }
@@ -44,6 +44,7 @@
 #define VIRTIO_NET_F_CTRL_RX    18      /* Control channel RX mode support */
 #define VIRTIO_NET_F_CTRL_VLAN  19      /* Control channel VLAN filtering */
 #define VIRTIO_NET_F_CTRL_RX_EXTRA 20   /* Extra RX mode control support */
+#define VIRTIO_NET_F_MQ         22      /* Host supports several rx/tx pairs */
 
 #define VIRTIO_NET_S_LINK_UP    1       /* Link is up */
 
@@ -61,6 +62,8 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint32_t sw_gro;    /* offer GUEST_TSO4 without a vnet_hdr backend */
+    uint32_t sw_gso;    /* offer CSUM and HOST_* without a vnet_hdr backend */
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -72,6 +75,9 @@ struct virtio_net_config
     uint8_t mac[ETH_ALEN];
     /* See VIRTIO_NET_F_STATUS and VIRTIO_NET_S_* above */
     uint16_t status;
+    /* Number of rx/tx pairs, see VIRTIO_NET_F_MQ and VIRTIO_NET_CTRL_MQ.
+     * Only present when the device has more than one pair. */
+    uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /* This is the first element of the scatter-gather list.  If you don't
@@ -79,6 +85,7 @@ struct virtio_net_config
 struct virtio_net_hdr
 {
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM     1       // Use csum_start, csum_offset
+#define VIRTIO_NET_HDR_F_DATA_VALID     2       // Checksums already verified
     uint8_t flags;
 #define VIRTIO_NET_HDR_GSO_NONE         0       // Not a GSO frame
 #define VIRTIO_NET_HDR_GSO_TCPV4        1       // GSO frame, IPv4 TCP (TSO)
@@ -167,6 +174,24 @@ struct virtio_net_ctrl_mac {
  #define VIRTIO_NET_CTRL_VLAN_ADD             0
  #define VIRTIO_NET_CTRL_VLAN_DEL             1
 
+/*
+ * Control multiqueue
+ *
+ * The VQ_PAIRS_SET command selects how many rx/tx pairs the guest uses,
+ * between MIN and the max_virtqueue_pairs config field.  It expects an
+ * out entry containing a 2 byte count.  The host only receives into and
+ * transmits from the first virtqueue_pairs pairs.  Multiqueue is
+ * available with the VIRTIO_NET_F_MQ feature bit; until the guest sends
+ * this command only the first pair is used.
+ */
+struct virtio_net_ctrl_mq {
+    uint16_t virtqueue_pairs;
+};
+#define VIRTIO_NET_CTRL_MQ         4
+ #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET      0
+ #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN      1
+ #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX      0x8000
+
 #define DEFINE_VIRTIO_NET_FEATURES(_state, _field) \
         DEFINE_VIRTIO_COMMON_FEATURES(_state, _field), \
         DEFINE_PROP_BIT("csum", _state, _field, VIRTIO_NET_F_CSUM, true), \
@@ -185,5 +210,6 @@ struct virtio_net_ctrl_mac {
         DEFINE_PROP_BIT("ctrl_vq", _state, _field, VIRTIO_NET_F_CTRL_VQ, true), \
         DEFINE_PROP_BIT("ctrl_rx", _state, _field, VIRTIO_NET_F_CTRL_RX, true), \
         DEFINE_PROP_BIT("ctrl_vlan", _state, _field, VIRTIO_NET_F_CTRL_VLAN, true), \
-        DEFINE_PROP_BIT("ctrl_rx_extra", _state, _field, VIRTIO_NET_F_CTRL_RX_EXTRA, true)
+        DEFINE_PROP_BIT("ctrl_rx_extra", _state, _field, VIRTIO_NET_F_CTRL_RX_EXTRA, true), \
+        DEFINE_PROP_BIT("mq", _state, _field, VIRTIO_NET_F_MQ, true)
 #endif
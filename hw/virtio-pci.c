@@ -104,6 +104,7 @@ typedef struct {
     uint32_t class_code;
     uint32_t nvectors;
     BlockConf block;
+    virtio_blk_conf blk;
     NICConf nic;
     uint32_t host_features;
 #ifdef CONFIG_LINUX
@@ -724,7 +725,7 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
         proxy->class_code != PCI_CLASS_STORAGE_OTHER)
         proxy->class_code = PCI_CLASS_STORAGE_SCSI;
 
-    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block);
+    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block, &proxy->blk);
     if (!vdev) {
         return -1;
     }
@@ -793,7 +794,10 @@ static int virtio_net_init_pci(PCIDevice *pci_dev)
 
     vdev = virtio_net_init(&pci_dev->qdev, &proxy->nic, &proxy->net);
 
-    vdev->nvectors = proxy->nvectors;
+    /* virtio_net_init picks a default that depends on the queues */
+    if (proxy->nvectors != DEV_NVECTORS_UNSPECIFIED) {
+        vdev->nvectors = proxy->nvectors;
+    }
     virtio_init_pci(proxy, vdev,
                     PCI_VENDOR_ID_REDHAT_QUMRANET,
                     PCI_DEVICE_ID_VIRTIO_NET,
@@ -860,6 +864,12 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                             VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
             DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
+            DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, blk.data_plane,
+                            0, false),
+            DEFINE_PROP_UINT32("x-complete-delay", VirtIOPCIProxy,
+                               blk.complete_delay, 0),
+            DEFINE_PROP_UINT32("x-complete-batch", VirtIOPCIProxy,
+                               blk.complete_batch, 0),
             DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
             DEFINE_PROP_END_OF_LIST(),
         },
@@ -873,7 +883,8 @@ static PCIDeviceInfo virtio_info[] = {
         .qdev.props = (Property[]) {
             DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                             VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, false),
-            DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 3),
+            DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                               DEV_NVECTORS_UNSPECIFIED),
             DEFINE_VIRTIO_NET_FEATURES(VirtIOPCIProxy, host_features),
             DEFINE_NIC_PROPERTIES(VirtIOPCIProxy, nic),
             DEFINE_PROP_UINT32("x-txtimer", VirtIOPCIProxy,
@@ -881,6 +892,8 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_INT32("x-txburst", VirtIOPCIProxy,
                               net.txburst, TX_BURST),
             DEFINE_PROP_STRING("tx", VirtIOPCIProxy, net.tx),
+            DEFINE_PROP_BIT("sw_gro", VirtIOPCIProxy, net.sw_gro, 0, true),
+            DEFINE_PROP_BIT("sw_gso", VirtIOPCIProxy, net.sw_gso, 0, true),
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
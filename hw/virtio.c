@@ -17,20 +17,18 @@
 #include "qemu-error.h"
 #include "virtio.h"
 #include "sysemu.h"
+#include "qemu-barrier.h"
+#include "range.h"
 
 /* The alignment to use between consumer and producer parts of vring.
  * x86 pagesize again. */
 #define VIRTIO_PCI_VRING_ALIGN         4096
 
-/* QEMU doesn't strictly need write barriers since everything runs in
- * lock-step.  We'll leave the calls to wmb() in though to make it obvious for
- * KVM or if kqemu gets SMP support.
- * In any case, we must prevent the compiler from reordering the code.
- * TODO: we likely need some rmb()/mb() as well.
+/* The guest may look at the rings from another CPU while we update them,
+ * so order our accesses: read the available index before the entries it
+ * covers, and write used entries before the index that publishes them.
  */
 
-#define wmb() __asm__ __volatile__("": : :"memory")
-
 typedef struct VRingDesc
 {
     uint64_t addr;
@@ -59,25 +57,155 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+/* The rings are read and written through a host mapping made when the
+ * guest sets the queue address, rather than with one physical memory
+ * lookup per field.  If the memory map changes under a ring its mapping
+ * is dropped and made again on next use; a ring that is not in one piece
+ * of RAM goes through ld*_phys()/st*_phys() as before.
+ */
 typedef struct VRing
 {
     unsigned int num;
     target_phys_addr_t desc;
     target_phys_addr_t avail;
     target_phys_addr_t used;
+    uint8_t *host;          /* the whole ring, from desc, or NULL */
+    target_phys_addr_t size;
+    int remap;              /* try to map it on next use */
 } VRing;
 
+/* A descriptor table: the ring's own, or an indirect one */
+typedef struct VRingDescTable
+{
+    target_phys_addr_t pa;
+    VRingDesc *host;
+    target_phys_addr_t len;
+} VRingDescTable;
+
+/* Storage for the scatter lists of a popped element, 1 << order entries
+ * of each.  Elements take it from, and give it back to, free lists in
+ * their queue, so that what they cost follows the length of their chain
+ * instead of VIRTQUEUE_MAX_SIZE.
+ */
+#define VIRTQUEUE_SG_ORDERS 11  /* up to 1024 == VIRTQUEUE_MAX_SIZE */
+
+struct VirtQueueSG
+{
+    VirtQueueSG *next;          /* on the free list */
+    unsigned int order;
+    struct iovec *sg;
+    target_phys_addr_t addr[0];
+};
+
+/* How VirtQueueElement used to look; in-flight elements still go into
+ * the migration stream like this */
+typedef struct VirtQueueElementOld
+{
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    target_phys_addr_t in_addr[VIRTQUEUE_MAX_SIZE];
+    target_phys_addr_t out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
 struct VirtQueue
 {
     VRing vring;
     target_phys_addr_t pa;
     uint16_t last_avail_idx;
+    /* Last used index value we have signalled on */
+    uint16_t signalled_used;
+    /* Whether signalled_used is valid */
+    bool signalled_used_valid;
+    /* Notification enabled? */
+    bool notification;
     int inuse;
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    QLIST_ENTRY(VirtQueue) mapped;
+    VirtQueueSG *free_sg[VIRTQUEUE_SG_ORDERS];
+    unsigned int sg_order;      /* what the last chain needed */
+};
+
+static QLIST_HEAD(, VirtQueue) mapped_vqs = QLIST_HEAD_INITIALIZER(mapped_vqs);
+static CPUPhysMemoryClient virtio_memory_client;
+static int virtio_memory_client_registered;
+
+static void virtqueue_unmap_ring(VirtQueue *vq)
+{
+    if (vq->vring.host) {
+        cpu_physical_memory_unmap(vq->vring.host, vq->vring.size, 1,
+                                  vq->vring.size);
+        vq->vring.host = NULL;
+        QLIST_REMOVE(vq, mapped);
+    }
+    vq->vring.remap = 0;
+}
+
+static void virtqueue_map_ring(VirtQueue *vq)
+{
+    target_phys_addr_t len = vq->vring.size;
+    ram_addr_t ram_addr;
+    void *host;
+
+    vq->vring.remap = 0;
+    host = cpu_physical_memory_map(vq->vring.desc, &len, 1);
+    if (!host) {
+        return;
+    }
+    /* only RAM, never the bounce buffer, may be held on to */
+    if (len != vq->vring.size || qemu_ram_addr_from_host(host, &ram_addr)) {
+        cpu_physical_memory_unmap(host, len, 0, 0);
+        return;
+    }
+
+    if (!virtio_memory_client_registered) {
+        cpu_register_phys_memory_client(&virtio_memory_client);
+        virtio_memory_client_registered = 1;
+    }
+    vq->vring.host = host;
+    QLIST_INSERT_HEAD(&mapped_vqs, vq, mapped);
+}
+
+static void virtio_client_set_memory(CPUPhysMemoryClient *client,
+                                     target_phys_addr_t start_addr,
+                                     ram_addr_t size,
+                                     ram_addr_t phys_offset)
+{
+    VirtQueue *vq, *next;
+
+    /* called before the map changes, so only note that it did */
+    QLIST_FOREACH_SAFE(vq, &mapped_vqs, mapped, next) {
+        if (ranges_overlap(start_addr, size, vq->vring.desc,
+                           vq->vring.size)) {
+            virtqueue_unmap_ring(vq);
+            vq->vring.remap = 1;
+        }
+    }
+}
+
+static int virtio_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                           target_phys_addr_t start_addr,
+                                           target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int virtio_client_migration_log(CPUPhysMemoryClient *client,
+                                       int enable)
+{
+    return 0;
+}
+
+static CPUPhysMemoryClient virtio_memory_client = {
+    .set_memory = virtio_client_set_memory,
+    .sync_dirty_bitmap = virtio_client_sync_dirty_bitmap,
+    .migration_log = virtio_client_migration_log,
 };
 
 /* virt queue functions */
@@ -85,110 +213,255 @@ static void virtqueue_init(VirtQueue *vq)
 {
     target_phys_addr_t pa = vq->pa;
 
+    virtqueue_unmap_ring(vq);
+
     vq->vring.desc = pa;
     vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    vq->vring.size = vq->vring.used - pa +
+                     offsetof(VRingUsed, ring[vq->vring.num]) +
+                     sizeof(uint16_t);
+    if (pa) {
+        virtqueue_map_ring(vq);
+    }
 }
 
-static inline uint64_t vring_desc_addr(target_phys_addr_t desc_pa, int i)
+static inline uint8_t *vring_host(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
+    if (unlikely(vq->vring.remap)) {
+        virtqueue_map_ring(vq);
+    }
+    return vq->vring.host;
 }
 
-static inline uint32_t vring_desc_len(target_phys_addr_t desc_pa, int i)
+static inline VRingAvail *vring_avail_host(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
+    uint8_t *host = vring_host(vq);
+
+    return host ? (VRingAvail *)(host + (vq->vring.avail - vq->vring.desc))
+                : NULL;
 }
 
-static inline uint16_t vring_desc_flags(target_phys_addr_t desc_pa, int i)
+static inline VRingUsed *vring_used_host(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
+    uint8_t *host = vring_host(vq);
+
+    return host ? (VRingUsed *)(host + (vq->vring.used - vq->vring.desc))
+                : NULL;
 }
 
-static inline uint16_t vring_desc_next(target_phys_addr_t desc_pa, int i)
+static void vring_desc_table_init(VirtQueue *vq, VRingDescTable *table)
 {
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+    table->pa = vq->vring.desc;
+    table->host = (VRingDesc *)vring_host(vq);
+    table->len = 0;
+}
+
+/* Switch to the indirect table a descriptor points to, mapping it once
+ * instead of reading it a field at a time.  Must be released with
+ * vring_desc_table_release() before any buffer is mapped, in case it took
+ * the bounce buffer.
+ */
+static void vring_desc_table_indirect(VRingDescTable *table,
+                                      const VRingDesc *desc)
+{
+    target_phys_addr_t len = desc->len;
+
+    table->pa = desc->addr;
+    table->host = cpu_physical_memory_map(table->pa, &len, 0);
+    table->len = len;
+    if (table->host && (len == 0 || len != desc->len)) {
+        cpu_physical_memory_unmap(table->host, len, 0, 0);
+        table->host = NULL;
+        table->len = 0;
+    }
+}
+
+static void vring_desc_table_release(VRingDescTable *table)
+{
+    if (table->len) {
+        cpu_physical_memory_unmap(table->host, table->len, 0, table->len);
+        table->host = NULL;
+        table->len = 0;
+    }
+}
+
+static inline void vring_desc_read(const VRingDescTable *table, int i,
+                                   VRingDesc *desc)
+{
+    if (table->host) {
+        const VRingDesc *d = &table->host[i];
+
+        desc->addr = ldq_p(&d->addr);
+        desc->len = ldl_p(&d->len);
+        desc->flags = lduw_p(&d->flags);
+        desc->next = lduw_p(&d->next);
+    } else {
+        target_phys_addr_t pa = table->pa + sizeof(VRingDesc) * i;
+
+        desc->addr = ldq_phys(pa + offsetof(VRingDesc, addr));
+        desc->len = ldl_phys(pa + offsetof(VRingDesc, len));
+        desc->flags = lduw_phys(pa + offsetof(VRingDesc, flags));
+        desc->next = lduw_phys(pa + offsetof(VRingDesc, next));
+    }
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return lduw_phys(pa);
+    VRingAvail *avail = vring_avail_host(vq);
+
+    if (avail) {
+        return lduw_p(&avail->flags);
+    }
+    return lduw_phys(vq->vring.avail + offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(pa);
+    VRingAvail *avail = vring_avail_host(vq);
+    uint16_t idx;
+
+    if (avail) {
+        idx = lduw_p(&avail->idx);
+    } else {
+        idx = lduw_phys(vq->vring.avail + offsetof(VRingAvail, idx));
+    }
+    /* the entries it covers are read after it */
+    smp_rmb();
+    return idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return lduw_phys(pa);
+    VRingAvail *avail = vring_avail_host(vq);
+
+    if (avail) {
+        return lduw_p(&avail->ring[i]);
+    }
+    return lduw_phys(vq->vring.avail + offsetof(VRingAvail, ring[i]));
+}
+
+static inline uint16_t vring_used_event(VirtQueue *vq)
+{
+    return vring_avail_ring(vq, vq->vring.num);
 }
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(pa, val);
+    VRingUsed *used = vring_used_host(vq);
+
+    if (used) {
+        stl_p(&used->ring[i].id, val);
+    } else {
+        stl_phys(vq->vring.used + offsetof(VRingUsed, ring[i].id), val);
+    }
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(pa, val);
+    VRingUsed *used = vring_used_host(vq);
+
+    if (used) {
+        stl_p(&used->ring[i].len, val);
+    } else {
+        stl_phys(vq->vring.used + offsetof(VRingUsed, ring[i].len), val);
+    }
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return lduw_phys(pa);
+    VRingUsed *used = vring_used_host(vq);
+
+    if (used) {
+        return lduw_p(&used->idx);
+    }
+    return lduw_phys(vq->vring.used + offsetof(VRingUsed, idx));
 }
 
-static inline void vring_used_idx_increment(VirtQueue *vq, uint16_t val)
+/* Stores through the host mapping bypass the dirty bitmap that migration
+ * and TCG rely on.  Mark the used ring once per update instead of once per
+ * store; for RAM, which is all we map, cpu_physical_memory_unmap() does
+ * only that and leaves the mapping alone.
+ */
+static inline void vring_used_set_dirty(void *ptr, target_phys_addr_t len)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(pa, vring_used_idx(vq) + val);
+    cpu_physical_memory_unmap(ptr, len, 1, len);
+}
+
+static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
+{
+    VRingUsed *used = vring_used_host(vq);
+
+    if (used) {
+        stw_p(&used->idx, val);
+        vring_used_set_dirty(used,
+                             offsetof(VRingUsed, ring[vq->vring.num]));
+    } else {
+        stw_phys(vq->vring.used + offsetof(VRingUsed, idx), val);
+    }
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    VRingUsed *used = vring_used_host(vq);
+    target_phys_addr_t pa = vq->vring.used + offsetof(VRingUsed, flags);
+
+    if (used) {
+        stw_p(&used->flags, lduw_p(&used->flags) | mask);
+        vring_used_set_dirty(used, sizeof(used->flags));
+    } else {
+        stw_phys(pa, lduw_phys(pa) | mask);
+    }
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    VRingUsed *used = vring_used_host(vq);
+    target_phys_addr_t pa = vq->vring.used + offsetof(VRingUsed, flags);
+
+    if (used) {
+        stw_p(&used->flags, lduw_p(&used->flags) & ~mask);
+        vring_used_set_dirty(used, sizeof(used->flags));
+    } else {
+        stw_phys(pa, lduw_phys(pa) & ~mask);
+    }
+}
+
+/* The avail_event word sits right after the used ring */
+static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
+{
+    VRingUsed *used = vring_used_host(vq);
+
+    if (used) {
+        uint16_t *event = (uint16_t *)&used->ring[vq->vring.num];
+
+        stw_p(event, val);
+        vring_used_set_dirty(event, sizeof(*event));
+    } else {
+        stw_phys(vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]),
+                 val);
+    }
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
-    if (enable)
+    vq->notification = enable;
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        /* ask for a kick on the next buffer, or only once the guest
+         * has gone all the way round the index space */
+        vring_avail_event(vq, vring_avail_idx(vq) - !enable);
+    } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
-    else
+    } else {
         vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+    }
+    if (enable) {
+        /* the guest must see this before the caller looks at the ring
+         * again, or a buffer added in between would go unnoticed */
+        smp_mb();
+    }
 }
 
 int virtio_queue_ready(VirtQueue *vq)
@@ -201,13 +474,99 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static VirtQueueSG *virtqueue_alloc_sg(VirtQueue *vq, unsigned int order)
 {
-    unsigned int offset;
+    VirtQueueSG *store = vq->free_sg[order];
+    unsigned int n = 1 << order;
+
+    if (store) {
+        vq->free_sg[order] = store->next;
+        return store;
+    }
+
+    store = qemu_malloc(sizeof(*store) + n * sizeof(store->addr[0]) +
+                        n * sizeof(store->sg[0]));
+    store->order = order;
+    store->sg = (struct iovec *)&store->addr[n];
+    return store;
+}
+
+static void virtqueue_free_sg(VirtQueue *vq, VirtQueueSG *store)
+{
+    store->next = vq->free_sg[store->order];
+    vq->free_sg[store->order] = store;
+}
+
+static void virtqueue_release_sg(VirtQueue *vq)
+{
+    VirtQueueSG *store;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
+    for (i = 0; i < VIRTQUEUE_SG_ORDERS; i++) {
+        while ((store = vq->free_sg[i]) != NULL) {
+            vq->free_sg[i] = store->next;
+            qemu_free(store);
+        }
+    }
+}
+
+static unsigned int virtqueue_sg_order(unsigned int num)
+{
+    unsigned int order = 0;
+
+    while ((1U << order) < num) {
+        order++;
+    }
+    return order;
+}
+
+/* While an element is being collected its out entries sit at the front
+ * of the storage and its in entries, last first, at the back.
+ */
+static VirtQueueSG *virtqueue_grow_sg(VirtQueue *vq, VirtQueueSG *old,
+                                      unsigned int out_num,
+                                      unsigned int in_num)
+{
+    VirtQueueSG *store = virtqueue_alloc_sg(vq, old->order + 1);
+    unsigned int old_n = 1 << old->order, n = 1 << store->order;
+
+    memcpy(store->addr, old->addr, out_num * sizeof(store->addr[0]));
+    memcpy(store->sg, old->sg, out_num * sizeof(store->sg[0]));
+    memcpy(store->addr + n - in_num, old->addr + old_n - in_num,
+           in_num * sizeof(store->addr[0]));
+    memcpy(store->sg + n - in_num, old->sg + old_n - in_num,
+           in_num * sizeof(store->sg[0]));
+    virtqueue_free_sg(vq, old);
+    return store;
+}
+
+/* Point elem at its collected entries, the in ones back in chain order */
+static void virtqueue_set_sg(VirtQueueElement *elem, VirtQueueSG *store)
+{
+    unsigned int n = 1 << store->order, a, b;
+
+    for (a = n - elem->in_num, b = n - 1; a < b; a++, b--) {
+        target_phys_addr_t addr = store->addr[a];
+        struct iovec sg = store->sg[a];
+
+        store->addr[a] = store->addr[b];
+        store->sg[a] = store->sg[b];
+        store->addr[b] = addr;
+        store->sg[b] = sg;
+    }
+
+    elem->store = store;
+    elem->out_addr = store->addr;
+    elem->out_sg = store->sg;
+    elem->in_addr = store->addr + n - elem->in_num;
+    elem->in_sg = store->sg + n - elem->in_num;
+}
+
+static void virtqueue_unmap_element(VirtQueue *vq, VirtQueueElement *elem,
+                                    unsigned int len)
+{
+    unsigned int offset;
+    int i;
 
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
@@ -225,6 +584,17 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
 
+    virtqueue_free_sg(vq, elem->store);
+    elem->store = NULL;
+}
+
+void virtqueue_fill(VirtQueue *vq, VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_element(vq, elem, len);
+
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
@@ -232,16 +602,32 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_ring_len(vq, idx, len);
 }
 
+/* Drop an element without returning it to the guest: its mappings and
+ * storage are given back, but the descriptor stays in use.
+ */
+void virtqueue_release_element(VirtQueue *vq, VirtQueueElement *elem)
+{
+    virtqueue_unmap_element(vq, elem, UINT_MAX);
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
+    uint16_t old, new;
+
     /* Make sure buffer is written before we update index. */
-    wmb();
+    smp_wmb();
     trace_virtqueue_flush(vq, count);
-    vring_used_idx_increment(vq, count);
+    old = vring_used_idx(vq);
+    new = old + count;
+    vring_used_idx_set(vq, new);
     vq->inuse -= count;
+    /* the index wrapped past the value we last signalled on */
+    if (unlikely((uint16_t)(new - vq->signalled_used) < (uint16_t)(new - old))) {
+        vq->signalled_used_valid = false;
+    }
 }
 
-void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
+void virtqueue_push(VirtQueue *vq, VirtQueueElement *elem,
                     unsigned int len)
 {
     virtqueue_fill(vq, elem, len, 0);
@@ -279,19 +665,19 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(target_phys_addr_t desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(const VRingDesc *desc,
+                                    unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = desc->next;
     /* Make sure compiler knows to grab that: we don't want it changing! */
-    wmb();
+    barrier();
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -311,16 +697,18 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
-        target_phys_addr_t desc_pa;
+        VRingDescTable table;
+        VRingDesc desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
-        desc_pa = vq->vring.desc;
+        vring_desc_table_init(vq, &table);
+        vring_desc_read(&table, i, &desc);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -333,9 +721,10 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = desc.len / sizeof(VRingDesc);
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
+            vring_desc_table_indirect(&table, &desc);
+            vring_desc_read(&table, i, &desc);
         }
 
         do {
@@ -345,16 +734,26 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+            if (desc.flags & VRING_DESC_F_WRITE) {
                 if (in_bytes > 0 &&
-                    (in_total += vring_desc_len(desc_pa, i)) >= in_bytes)
+                    (in_total += desc.len) >= in_bytes) {
+                    vring_desc_table_release(&table);
                     return 1;
+                }
             } else {
                 if (out_bytes > 0 &&
-                    (out_total += vring_desc_len(desc_pa, i)) >= out_bytes)
+                    (out_total += desc.len) >= out_bytes) {
+                    vring_desc_table_release(&table);
                     return 1;
+                }
+            }
+            i = virtqueue_next_desc(&desc, max);
+            if (i != max) {
+                vring_desc_read(&table, i, &desc);
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while (i != max);
+
+        vring_desc_table_release(&table);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -383,8 +782,10 @@ void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
 
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
-    unsigned int i, head, max;
-    target_phys_addr_t desc_pa = vq->vring.desc;
+    unsigned int i, head, max, n, order;
+    VRingDescTable table;
+    VRingDesc desc;
+    VirtQueueSG *store;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -393,41 +794,70 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     elem->out_num = elem->in_num = 0;
 
     max = vq->vring.num;
+    order = vq->sg_order;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
+    if ((vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) &&
+        vq->notification) {
+        /* no kicks for buffers behind the ones we are about to look at */
+        vring_avail_event(vq, vq->last_avail_idx);
+    }
+    vring_desc_table_init(vq, &table);
+    vring_desc_read(&table, i, &desc);
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
         i = 0;
+        vring_desc_table_indirect(&table, &desc);
+        vring_desc_read(&table, i, &desc);
+        /* which tells us how long the chain is */
+        order = virtqueue_sg_order(MIN(max, VIRTQUEUE_MAX_SIZE));
     }
 
+    store = virtqueue_alloc_sg(vq, order);
+    n = 1 << store->order;
+
     /* Collect all the descriptors */
     do {
-        struct iovec *sg;
+        unsigned int k;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
-        } else {
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+        if (elem->in_num + elem->out_num == n) {
+            if (store->order == VIRTQUEUE_SG_ORDERS - 1) {
+                error_report("virtio: too many descriptors in chain");
+                exit(1);
+            }
+            store = virtqueue_grow_sg(vq, store, elem->out_num, elem->in_num);
+            n = 1 << store->order;
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            k = n - ++elem->in_num;
+        } else {
+            k = elem->out_num++;
+        }
+        store->addr[k] = desc.addr;
+        store->sg[k].iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        i = virtqueue_next_desc(&desc, max);
+        if (i != max) {
+            vring_desc_read(&table, i, &desc);
+        }
+    } while (i != max);
+
+    vring_desc_table_release(&table);
+    virtqueue_set_sg(elem, store);
+    vq->sg_order = virtqueue_sg_order(elem->in_num + elem->out_num);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -441,6 +871,59 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     return elem->in_num + elem->out_num;
 }
 
+void virtqueue_save_element(QEMUFile *f, VirtQueueElement *elem)
+{
+    VirtQueueElementOld *old = qemu_mallocz(sizeof(*old));
+
+    old->index = elem->index;
+    old->out_num = elem->out_num;
+    old->in_num = elem->in_num;
+    memcpy(old->in_addr, elem->in_addr,
+           elem->in_num * sizeof(old->in_addr[0]));
+    memcpy(old->out_addr, elem->out_addr,
+           elem->out_num * sizeof(old->out_addr[0]));
+    memcpy(old->in_sg, elem->in_sg, elem->in_num * sizeof(old->in_sg[0]));
+    memcpy(old->out_sg, elem->out_sg, elem->out_num * sizeof(old->out_sg[0]));
+    qemu_put_buffer(f, (unsigned char *)old, sizeof(*old));
+    qemu_free(old);
+}
+
+void virtqueue_load_element(QEMUFile *f, VirtQueue *vq,
+                            VirtQueueElement *elem)
+{
+    VirtQueueElementOld *old = qemu_malloc(sizeof(*old));
+    VirtQueueSG *store;
+    unsigned int n, i;
+
+    qemu_get_buffer(f, (unsigned char *)old, sizeof(*old));
+    if (old->in_num > VIRTQUEUE_MAX_SIZE ||
+        old->out_num > VIRTQUEUE_MAX_SIZE ||
+        old->in_num + old->out_num > VIRTQUEUE_MAX_SIZE) {
+        error_report("virtio: too many descriptors in chain");
+        exit(1);
+    }
+
+    elem->index = old->index;
+    elem->out_num = old->out_num;
+    elem->in_num = old->in_num;
+    store = virtqueue_alloc_sg(vq, virtqueue_sg_order(elem->in_num +
+                                                      elem->out_num));
+    n = 1 << store->order;
+    for (i = 0; i < elem->out_num; i++) {
+        store->addr[i] = old->out_addr[i];
+        store->sg[i].iov_len = old->out_sg[i].iov_len;
+    }
+    for (i = 0; i < elem->in_num; i++) {
+        store->addr[n - 1 - i] = old->in_addr[i];
+        store->sg[n - 1 - i].iov_len = old->in_sg[i].iov_len;
+    }
+    qemu_free(old);
+
+    virtqueue_set_sg(elem, store);
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+}
+
 /* virtio device */
 static void virtio_notify_vector(VirtIODevice *vdev, uint16_t vector)
 {
@@ -472,10 +955,14 @@ void virtio_reset(void *opaque)
     virtio_notify_vector(vdev, vdev->config_vector);
 
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_unmap_ring(&vdev->vq[i]);
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].signalled_used = 0;
+        vdev->vq[i].signalled_used_valid = false;
+        vdev->vq[i].notification = true;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
     }
@@ -622,6 +1109,18 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    virtqueue_unmap_ring(&vdev->vq[n]);
+    virtqueue_release_sg(&vdev->vq[n]);
+    vdev->vq[n].vring.num = 0;
+    vdev->vq[n].handle_output = NULL;
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
@@ -629,17 +1128,42 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
+    uint16_t old, new;
+    bool v;
+
+    /* The used index must be visible before we look at what the guest
+     * asked for */
+    smp_mb();
     /* Always notify when queue is empty (when feature acknowledge) */
-    if ((vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT) &&
-        (!(vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) ||
-         (vq->inuse || vring_avail_idx(vq) != vq->last_avail_idx)))
-        return;
+    if ((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        !vq->inuse && vring_avail_idx(vq) == vq->last_avail_idx) {
+        return true;
+    }
+
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vring_used_idx(vq);
+    return !v || virtio_need_event(vring_used_event(vq), new, old);
+}
+
+/* Returns true if the guest was interrupted, false if it suppressed it */
+bool virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (!vring_notify(vdev, vq)) {
+        return false;
+    }
 
     trace_virtio_notify(vdev, vq);
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
+    return true;
 }
 
 void virtio_notify_config(VirtIODevice *vdev)
@@ -718,6 +1242,8 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
         vdev->vq[i].vring.num = qemu_get_be32(f);
         vdev->vq[i].pa = qemu_get_be64(f);
         qemu_get_be16s(f, &vdev->vq[i].last_avail_idx);
+        vdev->vq[i].signalled_used_valid = false;
+        vdev->vq[i].notification = true;
 
         if (vdev->vq[i].pa) {
             uint16_t nheads;
@@ -751,6 +1277,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_unmap_ring(&vdev->vq[i]);
+        virtqueue_release_sg(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     if (vdev->config)
         qemu_free(vdev->config);
@@ -793,6 +1325,7 @@ VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
+        vdev->vq[i].notification = true;
     }
 
     vdev->name = name;
@@ -847,8 +1380,9 @@ target_phys_addr_t virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 
 target_phys_addr_t virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    /* including the avail_event word */
     return offsetof(VRingUsed, ring) +
-        sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
+        sizeof(VRingUsedElem) * vdev->vq[n].vring.num + sizeof(uint16_t);
 }
 
 target_phys_addr_t virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
@@ -867,11 +1401,22 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].last_avail_idx = idx;
 }
 
+/* For whoever signalled the guest behind our back */
+void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
+{
+    vdev->vq[n].signalled_used_valid = false;
+}
+
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
 {
     return vdev->vq + n;
 }
 
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq - vq->vdev->vq;
+}
+
 EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq)
 {
     return &vq->guest_notifier;
@@ -51,6 +51,7 @@
 static void *ioport_opaque[MAX_IOPORTS];
 static IOPortReadFunc *ioport_read_table[3][MAX_IOPORTS];
 static IOPortWriteFunc *ioport_write_table[3][MAX_IOPORTS];
+static uint8_t ioport_lockless[MAX_IOPORTS];
 
 static IOPortReadFunc default_ioport_readb, default_ioport_readw, default_ioport_readl;
 static IOPortWriteFunc default_ioport_writeb, default_ioport_writew, default_ioport_writel;
@@ -252,9 +253,20 @@ void isa_unassign_ioport(pio_addr_t start, int length)
         ioport_write_table[2][i] = default_ioport_writel;
 
         ioport_opaque[i] = NULL;
+        ioport_lockless[i] = 0;
     }
 }
 
+void ioport_set_lockless(pio_addr_t start, int length)
+{
+    memset(ioport_lockless + start, 1, length);
+}
+
+int ioport_is_lockless(pio_addr_t addr)
+{
+    return ioport_lockless[addr & IOPORTS_MASK];
+}
+
 /***********************************************************/
 
 void cpu_outb(pio_addr_t addr, uint8_t val)
@@ -44,6 +44,12 @@ int register_ioport_write(pio_addr_t start, int length, int size,
                           IOPortWriteFunc *func, void *opaque);
 void isa_unassign_ioport(pio_addr_t start, int length);
 
+/* The handlers of [start, start + length) are safe to call without the
+ * global mutex, so KVM dispatches them straight from the vcpu thread.
+ */
+void ioport_set_lockless(pio_addr_t start, int length);
+int ioport_is_lockless(pio_addr_t addr);
+
 
 void cpu_outb(pio_addr_t addr, uint8_t val);
 void cpu_outw(pio_addr_t addr, uint16_t val);
@@ -772,6 +772,8 @@ err:
     return ret;
 }
 
+static uint64_t kvm_lockless_exits;
+
 static int kvm_handle_io(uint16_t port, void *data, int direction, int size,
                          uint32_t count)
 {
@@ -811,6 +813,34 @@ static int kvm_handle_io(uint16_t port, void *data, int direction, int size,
     return 1;
 }
 
+/* Handle an exit to a device that does not need the global mutex.
+ * Returns 1 if the vcpu can go straight back into the guest.
+ */
+static int kvm_handle_lockless_exit(struct kvm_run *run)
+{
+#ifdef KVM_CAP_COALESCED_MMIO
+    struct kvm_coalesced_mmio_ring *ring = kvm_state->coalesced_mmio_ring;
+
+    /* keep the order with the pending coalesced writes */
+    if (ring && ring->first != ring->last) {
+        return 0;
+    }
+#endif
+    if (run->exit_reason != KVM_EXIT_IO ||
+        !ioport_is_lockless(run->io.port)) {
+        return 0;
+    }
+    kvm_handle_io(run->io.port, (uint8_t *)run + run->io.data_offset,
+                  run->io.direction, run->io.size, run->io.count);
+    __sync_fetch_and_add(&kvm_lockless_exits, 1);
+    return 1;
+}
+
+uint64_t kvm_get_lockless_exits(void)
+{
+    return kvm_lockless_exits;
+}
+
 #ifdef KVM_CAP_INTERNAL_ERROR_DATA
 static void kvm_handle_internal_error(CPUState *env, struct kvm_run *run)
 {
@@ -915,7 +945,9 @@ int kvm_cpu_exec(CPUState *env)
         kvm_arch_pre_run(env, run);
         cpu_single_env = NULL;
         qemu_mutex_unlock_iothread();
-        ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+        do {
+            ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+        } while (ret == 0 && kvm_handle_lockless_exit(run));
         qemu_mutex_lock_iothread();
         cpu_single_env = env;
         kvm_arch_post_run(env, run);
@@ -104,6 +104,11 @@ int kvm_has_many_ioeventfds(void)
     return 0;
 }
 
+uint64_t kvm_get_lockless_exits(void)
+{
+    return 0;
+}
+
 void kvm_setup_guest_memory(void *start, size_t size)
 {
 }
@@ -43,6 +43,7 @@ int kvm_has_debugregs(void);
 int kvm_has_xsave(void);
 int kvm_has_xcrs(void);
 int kvm_has_many_ioeventfds(void);
+uint64_t kvm_get_lockless_exits(void);
 
 #ifdef NEED_CPU_H
 int kvm_init_vcpu(CPUState *env);
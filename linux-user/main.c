@@ -40,6 +40,8 @@
 char *exec_path;
 
 int singlestep;
+int tb_hot_threshold;
+const char *pin_globals;
 unsigned long mmap_min_addr;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long guest_base;
@@ -101,14 +103,14 @@ static int pending_cpus;
 /* Make sure everything is in a consistent state for calling fork().  */
 void fork_start(void)
 {
+    /* the mmap lock is taken before tb_lock */
+    mmap_fork_start();
     pthread_mutex_lock(&tb_lock);
     pthread_mutex_lock(&exclusive_lock);
-    mmap_fork_start();
 }
 
 void fork_end(int child)
 {
-    mmap_fork_end(child);
     if (child) {
         /* Child processes created by fork() only have a single thread.
            Discard information about the parent threads.  */
@@ -125,6 +127,7 @@ void fork_end(int child)
         pthread_mutex_unlock(&exclusive_lock);
         pthread_mutex_unlock(&tb_lock);
     }
+    mmap_fork_end(child);
 }
 
 /* Wait for pending exclusive operations to complete.  The exclusive lock
@@ -2649,11 +2652,16 @@ static void usage(void)
            "-d options   activate log (logfile=%s)\n"
            "-p pagesize  set the host page size to 'pagesize'\n"
            "-singlestep  always run in singlestep mode\n"
+           "-tb-hot-threshold n  retranslate blocks executed n times as traces\n"
+           "-pin-globals list  keep the listed TCG globals in host registers\n"
            "-strace      log system calls\n"
+           "-syscall-stats  print system call counts and times on exit\n"
            "\n"
            "Environment variables:\n"
            "QEMU_STRACE       Print system calls and arguments similar to the\n"
            "                  'strace' program.  Enable by setting to any value.\n"
+           "QEMU_SYSCALL_STATS  Same as -syscall-stats.  Enable by setting to\n"
+           "                  any value.\n"
            "You can use -E and -U options to set/unset environment variables\n"
            "for target process.  It is possible to provide several variables\n"
            "by repeating the option.  For example:\n"
@@ -2890,8 +2898,20 @@ int main(int argc, char **argv, char **envp)
             drop_ld_preload = 0;
         } else if (!strcmp(r, "singlestep")) {
             singlestep = 1;
+        } else if (!strcmp(r, "tb-hot-threshold")) {
+            if (optind >= argc)
+                break;
+            tb_hot_threshold = atoi(argv[optind++]);
+            if (tb_hot_threshold < 0)
+                tb_hot_threshold = 0;
+        } else if (!strcmp(r, "pin-globals")) {
+            if (optind >= argc)
+                break;
+            pin_globals = argv[optind++];
         } else if (!strcmp(r, "strace")) {
             do_strace = 1;
+        } else if (!strcmp(r, "syscall-stats")) {
+            do_syscall_stats = 1;
         } else
         {
             usage();
@@ -2953,7 +2973,7 @@ int main(int argc, char **argv, char **envp)
         cpu_model = "any";
 #endif
     }
-    cpu_exec_init_all(0);
+    cpu_exec_init_all(0, 0);
     /* NOTE: we need to init the CPU at this stage to get
        qemu_host_page_size */
     env = cpu_init(cpu_model);
@@ -2970,6 +2990,9 @@ int main(int argc, char **argv, char **envp)
     if (getenv("QEMU_STRACE")) {
         do_strace = 1;
     }
+    if (getenv("QEMU_SYSCALL_STATS")) {
+        do_syscall_stats = 1;
+    }
 
     target_environ = envlist_to_environ(envlist, NULL);
     envlist_free(envlist);
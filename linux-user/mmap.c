@@ -34,37 +34,74 @@
 //#define DEBUG_MMAP
 
 #if defined(CONFIG_USE_NPTL)
-static pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Changes to the guest memory map hold the lock for writing.  The
+   translator and the handler of writes to pages holding code only need
+   the map to stay put, so they hold it for reading and several guest
+   threads can run them at once.  Both kinds of locking nest, and the
+   read lock can be taken while holding the write lock but not the
+   other way round.  */
+static pthread_rwlock_t mmap_rwlock = PTHREAD_RWLOCK_INITIALIZER;
 static __thread int mmap_lock_count;
+static __thread int mmap_read_lock_count;
 
 void mmap_lock(void)
 {
+    if (mmap_read_lock_count)
+        abort();
     if (mmap_lock_count++ == 0) {
-        pthread_mutex_lock(&mmap_mutex);
+        pthread_rwlock_wrlock(&mmap_rwlock);
     }
 }
 
 void mmap_unlock(void)
 {
     if (--mmap_lock_count == 0) {
-        pthread_mutex_unlock(&mmap_mutex);
+        pthread_rwlock_unlock(&mmap_rwlock);
+    }
+}
+
+void mmap_read_lock(void)
+{
+    if (mmap_lock_count) {
+        mmap_lock_count++;
+    } else if (mmap_read_lock_count++ == 0) {
+        pthread_rwlock_rdlock(&mmap_rwlock);
+    }
+}
+
+void mmap_read_unlock(void)
+{
+    if (mmap_lock_count) {
+        mmap_unlock();
+    } else if (--mmap_read_lock_count == 0) {
+        pthread_rwlock_unlock(&mmap_rwlock);
+    }
+}
+
+/* Release the lock if a fault longjmp'd out of code that held it.  */
+void mmap_lock_reset(void)
+{
+    if (mmap_lock_count || mmap_read_lock_count) {
+        mmap_lock_count = 0;
+        mmap_read_lock_count = 0;
+        pthread_rwlock_unlock(&mmap_rwlock);
     }
 }
 
 /* Grab lock to make sure things are in a consistent state after fork().  */
 void mmap_fork_start(void)
 {
-    if (mmap_lock_count)
+    if (mmap_lock_count || mmap_read_lock_count)
         abort();
-    pthread_mutex_lock(&mmap_mutex);
+    pthread_rwlock_wrlock(&mmap_rwlock);
 }
 
 void mmap_fork_end(int child)
 {
     if (child)
-        pthread_mutex_init(&mmap_mutex, NULL);
+        pthread_rwlock_init(&mmap_rwlock, NULL);
     else
-        pthread_mutex_unlock(&mmap_mutex);
+        pthread_rwlock_unlock(&mmap_rwlock);
 }
 #else
 /* We aren't threadsafe to start with, so no need to worry about locking.  */
@@ -75,6 +112,18 @@ void mmap_lock(void)
 void mmap_unlock(void)
 {
 }
+
+void mmap_read_lock(void)
+{
+}
+
+void mmap_read_unlock(void)
+{
+}
+
+void mmap_lock_reset(void)
+{
+}
 #endif
 
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
@@ -199,6 +199,10 @@ void print_syscall(int num,
                    abi_long arg4, abi_long arg5, abi_long arg6);
 void print_syscall_ret(int num, abi_long arg1);
 extern int do_strace;
+int64_t syscall_stats_clock(void);
+void syscall_stats_account(int num, abi_long ret, int64_t ns);
+void print_syscall_stats(void);
+extern int do_syscall_stats;
 
 /* signal.c */
 void process_pending_signals(CPUState *cpu_env);
@@ -235,6 +239,9 @@ int target_msync(abi_ulong start, abi_ulong len, int flags);
 extern unsigned long last_brk;
 void mmap_lock(void);
 void mmap_unlock(void);
+void mmap_read_lock(void);
+void mmap_read_unlock(void);
+void mmap_lock_reset(void);
 abi_ulong mmap_find_vma(abi_ulong, abi_ulong);
 void cpu_list_lock(void);
 void cpu_list_unlock(void);
@@ -413,6 +420,14 @@ static inline void unlock_user(void *host_ptr, abi_ulong guest_addr,
 #endif
 }
 
+/* Guest and host agree on byte order and word size, so structures made
+   of abi_long/abi_ulong fields have the host layout and guest buffers
+   can be handed to the host without field-by-field conversion.  */
+#if TARGET_ABI_BITS == HOST_LONG_BITS && !defined(DEBUG_REMAP) && \
+    defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
+#define TARGET_HOST_SAME_LAYOUT
+#endif
+
 /* Return the length of a string in target memory or -TARGET_EFAULT if
    access error. */
 abi_long target_strlen(abi_ulong gaddr);
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <sys/sem.h>
@@ -9,6 +11,7 @@
 #include <sys/mount.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "qemu.h"
 
 int do_strace=0;
@@ -1354,3 +1357,136 @@ print_syscall_ret(int num, abi_long ret)
             break;
         }
 }
+
+/*
+ * Per-syscall call counts and host latency, enabled with -syscall-stats
+ * and printed when the guest exits.
+ */
+int do_syscall_stats;
+
+#define SYSCALL_STATS_SIZE 1024
+
+typedef struct SyscallStats {
+    int nr;             /* syscall number + 1, 0 for a free slot */
+    uint64_t calls;
+    uint64_t errors;
+    int64_t total_ns;
+    int64_t max_ns;
+} SyscallStats;
+
+static SyscallStats syscall_stats[SYSCALL_STATS_SIZE];
+#if defined(CONFIG_USE_NPTL)
+static pthread_mutex_t syscall_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int64_t syscall_stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void syscall_stats_account(int num, abi_long ret, int64_t ns)
+{
+    SyscallStats *s;
+    unsigned int i, h;
+
+#if defined(CONFIG_USE_NPTL)
+    pthread_mutex_lock(&syscall_stats_lock);
+#endif
+    h = (unsigned int)num % SYSCALL_STATS_SIZE;
+    for (i = 0; i < SYSCALL_STATS_SIZE; i++) {
+        s = &syscall_stats[(h + i) % SYSCALL_STATS_SIZE];
+        if (s->nr == 0) {
+            s->nr = num + 1;
+        }
+        if (s->nr == num + 1) {
+            s->calls++;
+            if ((abi_ulong)ret >= (abi_ulong)-4096) {
+                s->errors++;
+            }
+            s->total_ns += ns;
+            if (ns > s->max_ns) {
+                s->max_ns = ns;
+            }
+            break;
+        }
+    }
+#if defined(CONFIG_USE_NPTL)
+    pthread_mutex_unlock(&syscall_stats_lock);
+#endif
+}
+
+static int syscall_stats_cmp(const void *a, const void *b)
+{
+    const SyscallStats *sa = a, *sb = b;
+
+    if (sa->total_ns != sb->total_ns) {
+        return sa->total_ns < sb->total_ns ? 1 : -1;
+    }
+    return sa->nr - sb->nr;
+}
+
+static const char *syscall_name(int num)
+{
+    int i;
+
+    for (i = 0; i < nsyscalls; i++) {
+        if (scnames[i].nr == num) {
+            return scnames[i].name;
+        }
+    }
+    return NULL;
+}
+
+void print_syscall_stats(void)
+{
+    SyscallStats *s;
+    uint64_t calls = 0, errors = 0;
+    int64_t total_ns = 0;
+    const char *name;
+    int i, n;
+
+    if (!do_syscall_stats) {
+        return;
+    }
+#if defined(CONFIG_USE_NPTL)
+    pthread_mutex_lock(&syscall_stats_lock);
+#endif
+    /* move the used slots to the front and sort them by time spent */
+    for (i = n = 0; i < SYSCALL_STATS_SIZE; i++) {
+        if (syscall_stats[i].nr) {
+            syscall_stats[n++] = syscall_stats[i];
+        }
+    }
+    qsort(syscall_stats, n, sizeof(SyscallStats), syscall_stats_cmp);
+
+    gemu_log("%% time     seconds  usecs/call     max usecs     calls    errors syscall\n");
+    for (i = 0; i < n; i++) {
+        total_ns += syscall_stats[i].total_ns;
+    }
+    for (i = 0; i < n; i++) {
+        s = &syscall_stats[i];
+        name = syscall_name(s->nr - 1);
+        gemu_log("%6.2f %11.6f %11.3f %13.3f %9" PRIu64 " %9" PRIu64 " ",
+                 total_ns ? 100.0 * s->total_ns / total_ns : 0.0,
+                 s->total_ns / 1e9, s->total_ns / 1e3 / s->calls,
+                 s->max_ns / 1e3, s->calls, s->errors);
+        if (name) {
+            gemu_log("%s\n", name);
+        } else {
+            gemu_log("syscall_%d\n", s->nr - 1);
+        }
+        calls += s->calls;
+        errors += s->errors;
+    }
+    gemu_log("------ ----------- ----------- ------------- --------- --------- "
+             "----------------\n");
+    gemu_log("100.00 %11.6f %11s %13s %9" PRIu64 " %9" PRIu64 " total\n",
+             total_ns / 1e9, "", "", calls, errors);
+    memset(syscall_stats, 0, sizeof(syscall_stats));
+#if defined(CONFIG_USE_NPTL)
+    pthread_mutex_unlock(&syscall_stats_lock);
+#endif
+}
@@ -1650,6 +1650,23 @@ static abi_long lock_iovec(int type, struct iovec *vec, abi_ulong target_addr,
     target_vec = lock_user(VERIFY_READ, target_addr, count * sizeof(struct target_iovec), 1);
     if (!target_vec)
         return -TARGET_EFAULT;
+#ifdef TARGET_HOST_SAME_LAYOUT
+    if (GUEST_BASE == 0) {
+        /* the guest array is a host array: copy it in one go, so that
+           other guest threads cannot change it under our feet, and
+           only check the buffers */
+        memcpy(vec, target_vec, count * sizeof(struct iovec));
+        for (i = 0; i < count; i++) {
+            if (vec[i].iov_len != 0 &&
+                !access_ok(type, (abi_ulong)(unsigned long)vec[i].iov_base,
+                           vec[i].iov_len)) {
+                vec[i].iov_base = NULL;
+            }
+        }
+        unlock_user(target_vec, target_addr, 0);
+        return 0;
+    }
+#endif
     for(i = 0;i < count; i++) {
         base = tswapl(target_vec[i].iov_base);
         vec[i].iov_len = tswapl(target_vec[i].iov_len);
@@ -1669,6 +1686,7 @@ static abi_long lock_iovec(int type, struct iovec *vec, abi_ulong target_addr,
 static abi_long unlock_iovec(struct iovec *vec, abi_ulong target_addr,
                              int count, int copy)
 {
+#ifdef DEBUG_REMAP
     struct target_iovec *target_vec;
     abi_ulong base;
     int i;
@@ -1683,7 +1701,9 @@ static abi_long unlock_iovec(struct iovec *vec, abi_ulong target_addr,
         }
     }
     unlock_user (target_vec, target_addr, 0);
-
+#endif
+    /* otherwise the buffers are guest memory and nothing is written
+       back */
     return 0;
 }
 
@@ -3793,7 +3813,9 @@ static abi_long do_arch_prctl(CPUX86State *env, int code, abi_ulong addr)
 
 #if defined(CONFIG_USE_NPTL)
 
-#define NEW_STACK_SIZE PTHREAD_STACK_MIN
+/* the emulator itself runs on this stack, so it needs more than the
+   bare minimum */
+#define NEW_STACK_SIZE 0x40000
 
 static pthread_mutex_t clone_lock = PTHREAD_MUTEX_INITIALIZER;
 typedef struct {
@@ -4465,6 +4487,12 @@ int get_osversion(void)
     return osversion;
 }
 
+/* The x86_64 guest struct stat is the host's own.  */
+#if defined(TARGET_HOST_SAME_LAYOUT) && defined(TARGET_X86_64) && \
+    defined(__x86_64__)
+#define TARGET_STAT_IS_HOST
+#endif
+
 /* do_syscall() should always have a single exit point at the end so
    that actions, such as logging of syscall results, can be performed.
    All errnos that do_syscall() returns must be -TARGET_<errcode>. */
@@ -4476,12 +4504,15 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     struct stat st;
     struct statfs stfs;
     void *p;
+    int64_t stats_start = 0;
 
 #ifdef DEBUG
     gemu_log("syscall %d", num);
 #endif
     if(do_strace)
         print_syscall(num, arg1, arg2, arg3, arg4, arg5, arg6);
+    if (do_syscall_stats)
+        stats_start = syscall_stats_clock();
 
     switch(num) {
     case TARGET_NR_exit:
@@ -4526,6 +4557,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        print_syscall_stats();
         gdb_exit(cpu_env, arg1);
         _exit(arg1);
         ret = 0; /* avoid warning */
@@ -5991,6 +6023,11 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 
                 if (!lock_user_struct(VERIFY_WRITE, target_st, arg2, 0))
                     goto efault;
+#ifdef TARGET_STAT_IS_HOST
+                memcpy(target_st, &st, sizeof(*target_st));
+                unlock_user_struct(target_st, arg2, 1);
+                break;
+#endif
                 memset(target_st, 0, sizeof(*target_st));
                 __put_user(st.st_dev, &target_st->st_dev);
                 __put_user(st.st_ino, &target_st->st_ino);
@@ -6164,6 +6201,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        print_syscall_stats();
         gdb_exit(cpu_env, arg1);
         ret = get_errno(exit_group(arg1));
         break;
@@ -6310,6 +6348,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             if (!(dirp = lock_user(VERIFY_WRITE, arg2, count, 0)))
                 goto efault;
             ret = get_errno(sys_getdents(arg1, dirp, count));
+#ifndef TARGET_HOST_SAME_LAYOUT
             if (!is_error(ret)) {
                 struct linux_dirent *de;
                 int len = ret;
@@ -6326,6 +6365,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
                     len -= reclen;
                 }
             }
+#endif
             unlock_user(dirp, arg2, ret);
         }
 #endif
@@ -6338,6 +6378,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             if (!(dirp = lock_user(VERIFY_WRITE, arg2, count, 0)))
                 goto efault;
             ret = get_errno(sys_getdents64(arg1, dirp, count));
+#if defined(HOST_WORDS_BIGENDIAN) != defined(TARGET_WORDS_BIGENDIAN)
             if (!is_error(ret)) {
                 struct linux_dirent64 *de;
                 int len = ret;
@@ -6354,6 +6395,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
                     len -= reclen;
                 }
             }
+#endif
             unlock_user(dirp, arg2, ret);
         }
         break;
@@ -7638,6 +7680,8 @@ fail:
 #endif
     if(do_strace)
         print_syscall_ret(num, ret);
+    if (do_syscall_stats)
+        syscall_stats_account(num, ret, syscall_stats_clock() - stats_start);
     return ret;
 efault:
     ret = -TARGET_EFAULT;
@@ -57,6 +57,7 @@
 #include "json-parser.h"
 #include "osdep.h"
 #include "exec-all.h"
+#include "cpus.h"
 #ifdef CONFIG_SIMPLE_TRACE
 #include "trace.h"
 #endif
@@ -2894,6 +2895,20 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.info = do_info_jit,
     },
+    {
+        .name       = "timers",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show timer counts and re-arm rates",
+        .mhandler.info = do_info_timers,
+    },
+    {
+        .name       = "mutex",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show global mutex contention and vcpu kick rates",
+        .mhandler.info = do_info_mutex,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -27,7 +27,9 @@
 
 #include "net/tap.h"
 #include "net/socket.h"
+#include "net/shm.h"
 #include "net/dump.h"
+#include "net/gro.h"
 #include "net/slirp.h"
 #include "net/vde.h"
 #include "net/util.h"
@@ -255,32 +257,88 @@ VLANClientState *qemu_new_net_client(NetClientInfo *info,
         vc->send_queue = qemu_new_net_queue(qemu_deliver_packet,
                                             qemu_deliver_packet_iov,
                                             vc);
+        /* a NIC queues packets as deep as the backend it is attached to */
+        if (peer) {
+            qemu_net_queue_copy_limit(vc->send_queue, peer->send_queue);
+        }
+    }
+
+    if (info->coalesce_limit && info->receive_coalesced) {
+        vc->gro = net_gro_new(vc);
     }
 
     return vc;
 }
 
+/* A multiqueue backend registers one client per queue, all with the
+ * netdev's name and in queue order.  Return the free ones.  */
+static int qemu_find_net_queues(VLANClientState *peer,
+                                VLANClientState **peers, int max)
+{
+    VLANClientState *vc;
+    int queues = 0;
+
+    QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
+        if (queues == max) {
+            break;
+        }
+        if (vc->info == peer->info && !vc->peer &&
+            !strcmp(vc->name, peer->name)) {
+            peers[queues++] = vc;
+        }
+    }
+    return queues;
+}
+
 NICState *qemu_new_nic(NetClientInfo *info,
                        NICConf *conf,
                        const char *model,
                        const char *name,
                        void *opaque)
 {
+    VLANClientState *peers[MAX_QUEUE_NUM];
     VLANClientState *nc;
     NICState *nic;
+    int queues, i;
 
     assert(info->type == NET_CLIENT_TYPE_NIC);
     assert(info->size >= sizeof(NICState));
 
-    nc = qemu_new_net_client(info, conf->vlan, conf->peer, model, name);
+    queues = 1;
+    peers[0] = conf->peer;
+    if (conf->peer) {
+        queues = qemu_find_net_queues(conf->peer, peers, MAX_QUEUE_NUM);
+    }
+
+    nc = qemu_new_net_client(info, conf->vlan, peers[0], model, name);
 
     nic = DO_UPCAST(NICState, nc, nc);
     nic->conf = conf;
     nic->opaque = opaque;
+    nic->queues = queues;
+    nic->queue = qemu_mallocz(queues * sizeof(NICState *));
+    nic->queue[0] = nic;
+
+    for (i = 1; i < queues; i++) {
+        NICState *sub;
+
+        nc = qemu_new_net_client(info, NULL, peers[i], model, name);
+        sub = DO_UPCAST(NICState, nc, nc);
+        sub->conf = conf;
+        sub->opaque = opaque;
+        sub->queue_index = i;
+        nic->queue[i] = sub;
+    }
 
     return nic;
 }
 
+NICState *qemu_get_subqueue(NICState *nic, int queue_index)
+{
+    assert(queue_index < nic->queues);
+    return nic->queue[queue_index];
+}
+
 static void qemu_cleanup_vlan_client(VLANClientState *vc)
 {
     if (vc->vlan) {
@@ -304,6 +362,9 @@ static void qemu_free_vlan_client(VLANClientState *vc)
             vc->peer->peer = NULL;
         }
     }
+    if (vc->gro) {
+        net_gro_delete(vc->gro);
+    }
     qemu_free(vc->name);
     qemu_free(vc->model);
     qemu_free(vc);
@@ -311,6 +372,21 @@ static void qemu_free_vlan_client(VLANClientState *vc)
 
 void qemu_del_vlan_client(VLANClientState *vc)
 {
+    /* Deleting a NIC deletes all of its queues. */
+    if (vc->info->type == NET_CLIENT_TYPE_NIC) {
+        NICState *nic = DO_UPCAST(NICState, nc, vc);
+        int i;
+
+        if (nic->queue_index == 0 && nic->queue) {
+            for (i = nic->queues - 1; i > 0; i--) {
+                qemu_del_vlan_client(&nic->queue[i]->nc);
+            }
+            qemu_free(nic->queue);
+            nic->queue = NULL;
+            nic->queues = 1;
+        }
+    }
+
     /* If there is a peer NIC, delete and cleanup client, but do not free. */
     if (!vc->vlan && vc->peer && vc->peer->info->type == NET_CLIENT_TYPE_NIC) {
         NICState *nic = DO_UPCAST(NICState, nc, vc->peer);
@@ -372,7 +448,11 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
 
     QTAILQ_FOREACH(nc, &non_vlan_clients, next) {
         if (nc->info->type == NET_CLIENT_TYPE_NIC) {
-            func(DO_UPCAST(NICState, nc, nc), opaque);
+            NICState *nic = DO_UPCAST(NICState, nc, nc);
+
+            if (nic->queue_index == 0) {
+                func(nic, opaque);
+            }
         }
     }
 
@@ -391,7 +471,8 @@ int qemu_can_send_packet(VLANClientState *sender)
     VLANClientState *vc;
 
     if (sender->peer) {
-        if (sender->peer->receive_disabled) {
+        if (sender->peer->receive_disabled ||
+            qemu_net_queue_busy(sender->peer->send_queue)) {
             return 0;
         } else if (sender->peer->info->can_receive &&
                    !sender->peer->info->can_receive(sender->peer)) {
@@ -405,6 +486,10 @@ int qemu_can_send_packet(VLANClientState *sender)
         return 1;
     }
 
+    if (qemu_net_queue_busy(vlan->send_queue)) {
+        return 0;
+    }
+
     QTAILQ_FOREACH(vc, &vlan->clients, next) {
         if (vc == sender) {
             continue;
@@ -437,6 +522,8 @@ static ssize_t qemu_deliver_packet(VLANClientState *sender,
 
     if (flags & QEMU_NET_PACKET_FLAG_RAW && vc->info->receive_raw) {
         ret = vc->info->receive_raw(vc, data, size);
+    } else if (vc->gro) {
+        ret = net_gro_receive(vc->gro, data, size);
     } else {
         ret = vc->info->receive(vc, data, size);
     }
@@ -477,6 +564,8 @@ static ssize_t qemu_vlan_deliver_packet(VLANClientState *sender,
 
         if (flags & QEMU_NET_PACKET_FLAG_RAW && vc->info->receive_raw) {
             len = vc->info->receive_raw(vc, buf, size);
+        } else if (vc->gro) {
+            len = net_gro_receive(vc->gro, buf, size);
         } else {
             len = vc->info->receive(vc, buf, size);
         }
@@ -492,6 +581,41 @@ static ssize_t qemu_vlan_deliver_packet(VLANClientState *sender,
     return ret;
 }
 
+static void qemu_send_batch(VLANClientState *sender, bool start)
+{
+    VLANClientState *vc;
+
+    if (sender->peer) {
+        if (sender->peer->info->receive_batch) {
+            sender->peer->info->receive_batch(sender->peer, start);
+        }
+        return;
+    }
+
+    if (!sender->vlan) {
+        return;
+    }
+
+    QTAILQ_FOREACH(vc, &sender->vlan->clients, next) {
+        if (vc != sender && vc->info->receive_batch) {
+            vc->info->receive_batch(vc, start);
+        }
+    }
+}
+
+/* Tell the receivers of @vc that a burst of packets follows.  Every
+   begin must be paired with a qemu_send_batch_end, which is where the
+   receivers catch up on whatever they deferred.  */
+void qemu_send_batch_begin(VLANClientState *vc)
+{
+    qemu_send_batch(vc, true);
+}
+
+void qemu_send_batch_end(VLANClientState *vc)
+{
+    qemu_send_batch(vc, false);
+}
+
 void qemu_purge_queued_packets(VLANClientState *vc)
 {
     NetQueue *queue;
@@ -515,6 +639,11 @@ void qemu_flush_queued_packets(VLANClientState *vc)
 
     vc->receive_disabled = 0;
 
+    /* segments held for coalescing were received before anything queued */
+    if (vc->gro && !net_gro_flush(vc->gro)) {
+        return;
+    }
+
     if (vc->vlan) {
         queue = vc->vlan->send_queue;
     } else {
@@ -876,6 +1005,17 @@ static int net_init_nic(QemuOpts *opts,
         .help = "identifier for monitor commands", \
      }
 
+#define NET_QUEUE_PARAMS_DESC                      \
+    {                                              \
+        .name = "queue_len",                       \
+        .type = QEMU_OPT_NUMBER,                   \
+        .help = "maximum number of packets waiting to be delivered", \
+     }, {                                          \
+        .name = "queue_policy",                    \
+        .type = QEMU_OPT_STRING,                   \
+        .help = "what to do when the queue is full (drop or block)", \
+     }
+
 typedef int (*net_client_init_func)(QemuOpts *opts,
                                     Monitor *mon,
                                     const char *name,
@@ -930,6 +1070,7 @@ static const struct {
         .init = net_init_slirp,
         .desc = {
             NET_COMMON_PARAMS_DESC,
+            NET_QUEUE_PARAMS_DESC,
             {
                 .name = "hostname",
                 .type = QEMU_OPT_STRING,
@@ -991,6 +1132,7 @@ static const struct {
         .init = net_init_tap,
         .desc = {
             NET_COMMON_PARAMS_DESC,
+            NET_QUEUE_PARAMS_DESC,
             {
                 .name = "ifname",
                 .type = QEMU_OPT_STRING,
@@ -1025,6 +1167,10 @@ static const struct {
                 .name = "vhostfd",
                 .type = QEMU_OPT_STRING,
                 .help = "file descriptor of an already opened vhost net device",
+            }, {
+                .name = "queues",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of queues the backend can provide",
             },
 #endif /* _WIN32 */
             { /* end of list */ }
@@ -1034,6 +1180,7 @@ static const struct {
         .init = net_init_socket,
         .desc = {
             NET_COMMON_PARAMS_DESC,
+            NET_QUEUE_PARAMS_DESC,
             {
                 .name = "fd",
                 .type = QEMU_OPT_STRING,
@@ -1057,12 +1204,40 @@ static const struct {
             },
             { /* end of list */ }
         },
+#ifndef _WIN32
+    }, {
+        .type = "shm",
+        .init = net_init_shm,
+        .desc = {
+            NET_COMMON_PARAMS_DESC,
+            NET_QUEUE_PARAMS_DESC,
+            {
+                .name = "path",
+                .type = QEMU_OPT_STRING,
+                .help = "unix socket to listen on or connect to",
+            }, {
+                .name = "server",
+                .type = QEMU_OPT_BOOL,
+                .help = "listen for the peer and create the shared memory",
+            }, {
+                .name = "slots",
+                .type = QEMU_OPT_NUMBER,
+                .help = "frames per ring and direction (server only)",
+            }, {
+                .name = "queues",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of queues (both sides must agree)",
+            },
+            { /* end of list */ }
+        },
+#endif
 #ifdef CONFIG_VDE
     }, {
         .type = "vde",
         .init = net_init_vde,
         .desc = {
             NET_COMMON_PARAMS_DESC,
+            NET_QUEUE_PARAMS_DESC,
             {
                 .name = "sock",
                 .type = QEMU_OPT_STRING,
@@ -1103,6 +1278,45 @@ static const struct {
     { /* end of list */ }
 };
 
+static int net_parse_queue_policy(QemuOpts *opts, int *policy)
+{
+    const char *str = qemu_opt_get(opts, "queue_policy");
+
+    if (!str || !strcmp(str, "drop")) {
+        *policy = NET_QUEUE_POLICY_DROP;
+    } else if (!strcmp(str, "block")) {
+        *policy = NET_QUEUE_POLICY_BLOCK;
+    } else {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "queue_policy",
+                      "drop or block");
+        return -1;
+    }
+    return 0;
+}
+
+/* Apply queue_len and queue_policy to the queue the new client receives
+ * from: the VLAN's, or for a netdev those of all its queues.  NICs copy
+ * the setting when they are attached to the netdev.
+ */
+static void net_set_queue_limit(QemuOpts *opts, const char *name,
+                                VLANState *vlan, int policy)
+{
+    int max_len = qemu_opt_get_number(opts, "queue_len",
+                                      NET_QUEUE_DEFAULT_LEN);
+    VLANClientState *vc;
+
+    if (vlan) {
+        qemu_net_queue_set_limit(vlan->send_queue, max_len, policy);
+        return;
+    }
+
+    QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
+        if (!strcmp(vc->name, name) && vc->info->type != NET_CLIENT_TYPE_NIC) {
+            qemu_net_queue_set_limit(vc->send_queue, max_len, policy);
+        }
+    }
+}
+
 int net_client_init(Monitor *mon, QemuOpts *opts, int is_netdev)
 {
     const char *name;
@@ -1122,6 +1336,9 @@ int net_client_init(Monitor *mon, QemuOpts *opts, int is_netdev)
 #endif
 #ifdef CONFIG_VDE
             strcmp(type, "vde") != 0 &&
+#endif
+#ifndef _WIN32
+            strcmp(type, "shm") != 0 &&
 #endif
             strcmp(type, "socket") != 0) {
             qerror_report(QERR_INVALID_PARAMETER_VALUE, "type",
@@ -1151,11 +1368,22 @@ int net_client_init(Monitor *mon, QemuOpts *opts, int is_netdev)
     for (i = 0; net_client_types[i].type != NULL; i++) {
         if (!strcmp(net_client_types[i].type, type)) {
             VLANState *vlan = NULL;
+            uint64_t queue_len;
+            int policy;
             int ret;
 
             if (qemu_opts_validate(opts, &net_client_types[i].desc[0]) == -1) {
                 return -1;
             }
+            if (net_parse_queue_policy(opts, &policy) < 0) {
+                return -1;
+            }
+            queue_len = qemu_opt_get_number(opts, "queue_len", 1);
+            if (queue_len < 1 || queue_len > INT_MAX) {
+                qerror_report(QERR_INVALID_PARAMETER_VALUE, "queue_len",
+                              "a positive number");
+                return -1;
+            }
 
             /* Do not add to a vlan if it's a -netdev or a nic with a
              * netdev= parameter. */
@@ -1172,6 +1400,10 @@ int net_client_init(Monitor *mon, QemuOpts *opts, int is_netdev)
                     qerror_report(QERR_DEVICE_INIT_FAILED, type);
                     return -1;
                 }
+                if (qemu_opt_get(opts, "queue_len") ||
+                    qemu_opt_get(opts, "queue_policy")) {
+                    net_set_queue_limit(opts, name, vlan, policy);
+                }
             }
             return ret;
         }
@@ -1186,6 +1418,9 @@ static int net_host_check_device(const char *device)
 {
     int i;
     const char *valid_param_list[] = { "tap", "socket", "dump"
+#ifndef _WIN32
+                                       ,"shm"
+#endif
 #ifdef CONFIG_SLIRP
                                        ,"user"
 #endif
@@ -1270,11 +1505,40 @@ int do_netdev_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
         qerror_report(QERR_DEVICE_NOT_FOUND, id);
         return -1;
     }
-    qemu_del_vlan_client(vc);
+    /* Multiqueue backends have one client per queue */
+    do {
+        qemu_del_vlan_client(vc);
+        vc = qemu_find_netdev(id);
+    } while (vc && vc->info->type != NET_CLIENT_TYPE_NIC);
     qemu_opts_del(qemu_opts_find(qemu_find_opts("netdev"), id));
     return 0;
 }
 
+static void print_net_queue(Monitor *mon, const char *indent,
+                            NetQueue *queue)
+{
+    NetQueueStats stats;
+
+    qemu_net_queue_get_stats(queue, &stats);
+    monitor_printf(mon, "%squeue: %d/%d packets, %" PRIu64 " queued, "
+                   "%" PRIu64 " dropped, max depth %d\n", indent,
+                   stats.len, stats.max_len, stats.queued, stats.dropped,
+                   stats.max_depth);
+}
+
+static void print_net_gro(Monitor *mon, VLANClientState *vc)
+{
+    NetGROStats stats;
+
+    if (!vc->gro) {
+        return;
+    }
+    net_gro_get_stats(vc->gro, &stats);
+    monitor_printf(mon, "    rx coalescing: %" PRIu64 " packets in %" PRIu64
+                   " frames (%.2f per frame)\n", stats.packets, stats.frames,
+                   stats.frames ? (double)stats.packets / stats.frames : 0.0);
+}
+
 void do_info_network(Monitor *mon)
 {
     VLANState *vlan;
@@ -1285,7 +1549,9 @@ void do_info_network(Monitor *mon)
 
         QTAILQ_FOREACH(vc, &vlan->clients, next) {
             monitor_printf(mon, "  %s: %s\n", vc->name, vc->info_str);
+            print_net_gro(mon, vc);
         }
+        print_net_queue(mon, "  ", vlan->send_queue);
     }
     monitor_printf(mon, "Devices not on any VLAN:\n");
     QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
@@ -1294,6 +1560,17 @@ void do_info_network(Monitor *mon)
             monitor_printf(mon, " peer=%s", vc->peer->name);
         }
         monitor_printf(mon, "\n");
+        print_net_queue(mon, "    ", vc->send_queue);
+        print_net_gro(mon, vc);
+    }
+}
+
+static void qemu_set_link_status(VLANClientState *vc, int up)
+{
+    vc->link_down = !up;
+
+    if (vc->info->link_status_changed) {
+        vc->info->link_status_changed(vc);
     }
 }
 
@@ -1319,10 +1596,16 @@ done:
         return -1;
     }
 
-    vc->link_down = !up;
+    if (vc->vlan) {
+        qemu_set_link_status(vc, up);
+        return 0;
+    }
 
-    if (vc->info->link_status_changed) {
-        vc->info->link_status_changed(vc);
+    /* Multiqueue NICs and backends have one client per queue */
+    QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
+        if (strcmp(vc->name, name) == 0) {
+            qemu_set_link_status(vc, up);
+        }
     }
     return 0;
 }
@@ -1338,8 +1621,10 @@ void net_cleanup(void)
         }
     }
 
-    QTAILQ_FOREACH_SAFE(vc, &non_vlan_clients, next, next_vc) {
-        qemu_del_vlan_client(vc);
+    /* Deleting a NIC also deletes its other queues, so next_vc
+     * cannot be trusted here. */
+    while (!QTAILQ_EMPTY(&non_vlan_clients)) {
+        qemu_del_vlan_client(QTAILQ_FIRST(&non_vlan_clients));
     }
 }
 
@@ -35,13 +35,18 @@ typedef enum {
     NET_CLIENT_TYPE_TAP,
     NET_CLIENT_TYPE_SOCKET,
     NET_CLIENT_TYPE_VDE,
-    NET_CLIENT_TYPE_DUMP
+    NET_CLIENT_TYPE_DUMP,
+    NET_CLIENT_TYPE_SHM
 } net_client_type;
 
 typedef void (NetPoll)(VLANClientState *, bool enable);
+typedef void (NetReceiveBatch)(VLANClientState *, bool start);
 typedef int (NetCanReceive)(VLANClientState *);
 typedef ssize_t (NetReceive)(VLANClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(VLANClientState *, const struct iovec *, int);
+typedef ssize_t (NetReceiveCoalesced)(VLANClientState *, const uint8_t *,
+                                      size_t, int hdr_len, int mss);
+typedef int (NetCoalesceLimit)(VLANClientState *);
 typedef void (NetCleanup) (VLANClientState *);
 typedef void (LinkStatusChanged)(VLANClientState *);
 
@@ -55,6 +60,17 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    /* Brackets a burst of packets from the same sender; a receiver may
+       defer per-packet work such as raising interrupts to the end.  */
+    NetReceiveBatch *receive_batch;
+    /* A NIC that can take frames larger than the MTU returns the
+       largest one from coalesce_limit, or 0 while it can't.  TCP
+       segments for it are then merged (see net/gro.c) and frames made
+       of several segments arrive through receive_coalesced, with the
+       length of their headers and of the original segments.  Their
+       checksums are known to be good.  */
+    NetCoalesceLimit *coalesce_limit;
+    NetReceiveCoalesced *receive_coalesced;
 } NetClientInfo;
 
 struct VLANClientState {
@@ -64,17 +80,28 @@ struct VLANClientState {
     struct VLANState *vlan;
     VLANClientState *peer;
     NetQueue *send_queue;
+    struct NetGRO *gro;
     char *model;
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
 };
 
+/* Upper bound on the queues of one multiqueue backend */
+#define MAX_QUEUE_NUM 8
+
 typedef struct NICState {
     VLANClientState nc;
     NICConf *conf;
     void *opaque;
     bool peer_deleted;
+    /* A NIC on a multiqueue backend has one NICState per queue, all
+       sharing conf and opaque.  queues and queue[] are only valid in
+       the first one, which qemu_new_nic returns; deleting it deletes
+       the others.  */
+    int queue_index;
+    int queues;
+    struct NICState **queue;
 } NICState;
 
 struct VLANState {
@@ -96,6 +123,7 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *model,
                        const char *name,
                        void *opaque);
+NICState *qemu_get_subqueue(NICState *nic, int queue_index);
 void qemu_del_vlan_client(VLANClientState *vc);
 VLANClientState *qemu_find_vlan_client_by_name(Monitor *mon, int vlan_id,
                                                const char *client_str);
@@ -110,6 +138,8 @@ void qemu_send_packet(VLANClientState *vc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(VLANClientState *vc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(VLANClientState *vc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+void qemu_send_batch_begin(VLANClientState *vc);
+void qemu_send_batch_end(VLANClientState *vc);
 void qemu_purge_queued_packets(VLANClientState *vc);
 void qemu_flush_queued_packets(VLANClientState *vc);
 void qemu_format_nic_info_str(VLANClientState *vc, uint8_t macaddr[6]);
@@ -15,25 +15,194 @@
  *  along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "qemu-common.h"
 #include "net/checksum.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if !defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#endif
+
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add(int len, uint8_t *buf)
+/*
+ * The Internet checksum is a ones' complement sum of 16 bit words, and
+ * such a sum comes out the same whatever the byte order of the words,
+ * only byte swapped (RFC 1071).  So the fast versions below add up the
+ * buffer in host order, as many bytes at a time as they can, in a 64
+ * bit accumulator that cannot overflow, and net_checksum_add() folds
+ * the result to 16 bits and swaps it into network order at the end.
+ * This is the order the callers expect, and the order net_checksum_add()
+ * has always returned.
+ */
+
+static inline uint64_t csum_load32(const uint8_t *buf)
+{
+    uint32_t val;
+
+    memcpy(&val, buf, sizeof(val));
+    return val;
+}
+
+static inline uint64_t csum_load64(const uint8_t *buf)
+{
+    uint64_t val;
+
+    memcpy(&val, buf, sizeof(val));
+    return val;
+}
+
+/* add with end around carry, which keeps the sum a ones' complement one */
+static inline uint64_t csum_add64(uint64_t sum, uint64_t val)
+{
+    sum += val;
+    return sum + (sum < val);
+}
+
+/* The last 0-7 bytes, zero padded as the standard says */
+static uint64_t csum_tail(uint64_t sum, const uint8_t *buf, int len)
+{
+    uint8_t tail[8] = { 0 };
+
+    memcpy(tail, buf, len);
+    return csum_add64(sum, csum_load64(tail));
+}
+
+/* The reference version, one byte at a time, already in network order */
+static uint64_t csum_bytewise(const uint8_t *buf, int len)
 {
     uint32_t sum = 0;
     int i;
 
     for (i = 0; i < len; i++) {
-	if (i & 1)
-	    sum += (uint32_t)buf[i];
-	else
-	    sum += (uint32_t)buf[i] << 8;
+        if (i & 1) {
+            sum += (uint32_t)buf[i];
+        } else {
+            sum += (uint32_t)buf[i] << 8;
+        }
     }
     return sum;
 }
 
+static uint64_t csum_unrolled(const uint8_t *buf, int len)
+{
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+    /* four independent accumulators of 32 bit words, which cannot
+       overflow for any buffer shorter than 16 GB */
+    while (len >= 32) {
+        s0 += csum_load32(buf) + csum_load32(buf + 16);
+        s1 += csum_load32(buf + 4) + csum_load32(buf + 20);
+        s2 += csum_load32(buf + 8) + csum_load32(buf + 24);
+        s3 += csum_load32(buf + 12) + csum_load32(buf + 28);
+        buf += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        s0 += csum_load32(buf);
+        s1 += csum_load32(buf + 4);
+        buf += 8;
+        len -= 8;
+    }
+    return csum_tail(csum_add64(csum_add64(s0, s1), csum_add64(s2, s3)),
+                     buf, len);
+}
+
+#if defined(__SSE2__)
+static uint64_t csum_sse2(const uint8_t *buf, int len)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i s0 = zero, s1 = zero, s2 = zero, s3 = zero;
+    uint64_t lanes[2], sum;
+
+    /* widen each 32 bit word into a 64 bit lane, 64 bytes at a time */
+    while (len >= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)buf);
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(buf + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(buf + 48));
+
+        s0 = _mm_add_epi64(s0, _mm_unpacklo_epi32(a, zero));
+        s1 = _mm_add_epi64(s1, _mm_unpackhi_epi32(a, zero));
+        s2 = _mm_add_epi64(s2, _mm_unpacklo_epi32(b, zero));
+        s3 = _mm_add_epi64(s3, _mm_unpackhi_epi32(b, zero));
+        s0 = _mm_add_epi64(s0, _mm_unpacklo_epi32(c, zero));
+        s1 = _mm_add_epi64(s1, _mm_unpackhi_epi32(c, zero));
+        s2 = _mm_add_epi64(s2, _mm_unpacklo_epi32(d, zero));
+        s3 = _mm_add_epi64(s3, _mm_unpackhi_epi32(d, zero));
+        buf += 64;
+        len -= 64;
+    }
+    s0 = _mm_add_epi64(_mm_add_epi64(s0, s1), _mm_add_epi64(s2, s3));
+    _mm_storeu_si128((__m128i *)lanes, s0);
+    sum = csum_add64(lanes[0], lanes[1]);
+
+    return csum_add64(sum, csum_unrolled(buf, len));
+}
+
+static int csum_sse2_usable(void)
+{
+#if defined(__x86_64__)
+    return 1;
+#else
+    unsigned int eax, ebx, ecx, edx;
+
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2);
+#endif
+}
+#endif
+
+/* fastest first; the first usable one is picked on the first call */
+const NetChecksumImpl net_checksum_impls[] = {
+#if defined(__SSE2__)
+    { "sse2", csum_sse2, csum_sse2_usable, 0 },
+#endif
+    { "unrolled", csum_unrolled, NULL, 0 },
+    { "bytewise", csum_bytewise, NULL, 1 },
+    { NULL }
+};
+
+static const NetChecksumImpl *csum_impl;
+
+int net_checksum_select(const char *name)
+{
+    const NetChecksumImpl *impl;
+
+    for (impl = net_checksum_impls; impl->name; impl++) {
+        if ((!name || !strcmp(name, impl->name)) &&
+            (!impl->usable || impl->usable())) {
+            csum_impl = impl;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+uint32_t net_checksum_add(int len, const uint8_t *buf)
+{
+    uint64_t sum;
+
+    if (!csum_impl) {
+        net_checksum_select(NULL);
+    }
+    sum = csum_impl->add(buf, len);
+
+    /* fold to 16 bits; the carries of the 64 bit sum wrap around */
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+#ifndef HOST_WORDS_BIGENDIAN
+    if (!csum_impl->network_order) {
+        sum = bswap16(sum);
+    }
+#endif
+    return sum;
+}
+
 uint16_t net_checksum_finish(uint32_t sum)
 {
     while (sum>>16)
@@ -41,8 +210,21 @@ uint16_t net_checksum_finish(uint32_t sum)
     return ~sum;
 }
 
+uint16_t net_checksum_update16(uint16_t csum, uint16_t old, uint16_t new)
+{
+    /* RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m') */
+    return net_checksum_finish((uint16_t)~csum + (uint16_t)~old + new);
+}
+
+uint16_t net_checksum_update32(uint16_t csum, uint32_t old, uint32_t new)
+{
+    return net_checksum_finish((uint16_t)~csum +
+                               (uint16_t)~(old >> 16) + (uint16_t)~old +
+                               (new >> 16) + (new & 0xffff));
+}
+
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
-                             uint8_t *addrs, uint8_t *buf)
+                             const uint8_t *addrs, const uint8_t *buf)
 {
     uint32_t sum = 0;
 
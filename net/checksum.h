@@ -20,10 +20,27 @@
 
 #include <stdint.h>
 
-uint32_t net_checksum_add(int len, uint8_t *buf);
+/* Partial sums are in network byte order and can be added up */
+uint32_t net_checksum_add(int len, const uint8_t *buf);
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
-                             uint8_t *addrs, uint8_t *buf);
+                             const uint8_t *addrs, const uint8_t *buf);
 void net_checksum_calculate(uint8_t *data, int length);
 
+/* Checksum after a 16 or 32 bit field changed from old to new */
+uint16_t net_checksum_update16(uint16_t csum, uint16_t old, uint16_t new);
+uint16_t net_checksum_update32(uint16_t csum, uint32_t old, uint32_t new);
+
+typedef struct NetChecksumImpl {
+    const char *name;
+    uint64_t (*add)(const uint8_t *buf, int len);
+    int (*usable)(void);
+    int network_order;      /* add() sums bytes, not host words */
+} NetChecksumImpl;
+
+extern const NetChecksumImpl net_checksum_impls[];
+
+/* Use the named implementation, or the best one if name is NULL */
+int net_checksum_select(const char *name);
+
 #endif /* QEMU_NET_CHECKSUM_H */
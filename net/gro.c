@@ -0,0 +1,388 @@
+/*
+ * QEMU receive coalescing of TCP segments in front of a NIC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "net/gro.h"
+
+#include "net.h"
+#include "net/checksum.h"
+#include "qemu-common.h"
+
+/* Backends without a virtio_net_hdr hand us one MTU sized frame per TCP
+ * segment.  When the NIC in front of the guest can take larger frames
+ * (NetClientInfo.coalesce_limit), consecutive in-order segments of a
+ * flow are merged into one frame, the way a real NIC's LRO would, so
+ * that the guest takes one receive and one interrupt for all of them.
+ *
+ * Only plain IPv4 TCP data segments with valid checksums, no IP options
+ * and nothing but ACK and PSH set are merged; everything else is passed
+ * on as is, after any segments held for its flow.  Segments are held at
+ * most until the end of the current main loop iteration, when a bottom
+ * half flushes them, and a flow is flushed early when a segment is
+ * short, has PSH set or does not fit.
+ *
+ * The merged frame carries correct IP and TCP checksums; the NIC is
+ * also told that they were checked, so it can say so to the guest.
+ */
+
+#define GRO_MAX_FLOWS   8
+#define GRO_MAX_FRAME   (14 + 65535)    /* Ethernet header + largest IP */
+
+#define ETH_HLEN        14
+#define IP_HLEN         20
+#define IP_PROTO_TCP    6
+
+#define TCP_FLAG_PSH    0x08
+#define TCP_FLAG_ACK    0x10
+
+enum {
+    GRO_NOT_TCP,        /* not IPv4 TCP at all */
+    GRO_TCP_OTHER,      /* TCP, but nothing we can merge */
+    GRO_TCP_DATA,       /* a data segment that can be merged */
+};
+
+typedef struct GROSegment {
+    const uint8_t *buf;
+    int hdr_len;        /* Ethernet, IP and TCP headers */
+    int len;            /* TCP payload */
+    uint32_t seq;
+    uint32_t sum;       /* net_checksum_add() of the payload */
+    uint8_t flags;      /* TCP flags */
+} GROSegment;
+
+typedef struct GROFlow {
+    uint8_t *buf;       /* the headers of the first segment, then the
+                           payload of all of them */
+    int size;
+    int hdr_len;
+    int mss;            /* payload of the first segment */
+    int nb_segs;
+    uint32_t next_seq;
+    uint32_t sum;       /* of the merged payload */
+} GROFlow;
+
+struct NetGRO {
+    VLANClientState *nc;
+    QEMUBH *bh;
+    GROFlow flows[GRO_MAX_FLOWS];   /* oldest first */
+    int nb_flows;
+    int blocked;        /* the NIC refused a flushed frame */
+    uint64_t packets;
+    uint64_t frames;
+};
+
+static inline uint16_t gro_get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t gro_get32(const uint8_t *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void gro_put16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val;
+}
+
+static int gro_parse(const uint8_t *buf, size_t size, GROSegment *seg)
+{
+    const uint8_t *ip = buf + ETH_HLEN;
+    const uint8_t *tcp = ip + IP_HLEN;
+    int ip_len, tcp_hlen;
+    uint32_t sum;
+
+    if (size < ETH_HLEN + IP_HLEN + 20 ||
+        gro_get16(buf + 12) != 0x0800 ||    /* IPv4, no VLAN tag */
+        ip[0] != 0x45 ||                    /* no IP options */
+        ip[9] != IP_PROTO_TCP) {
+        return GRO_NOT_TCP;
+    }
+
+    seg->buf = buf;
+    seg->flags = tcp[13];
+
+    ip_len = gro_get16(ip + 2);
+    tcp_hlen = (tcp[12] >> 4) * 4;
+    if (ip_len > size - ETH_HLEN ||
+        tcp_hlen < 20 || IP_HLEN + tcp_hlen > ip_len ||
+        (gro_get16(ip + 6) & 0x3fff) ||     /* fragment */
+        (seg->flags & ~TCP_FLAG_PSH) != TCP_FLAG_ACK) {
+        return GRO_TCP_OTHER;
+    }
+
+    seg->hdr_len = ETH_HLEN + IP_HLEN + tcp_hlen;
+    seg->len = ETH_HLEN + ip_len - seg->hdr_len;
+    if (seg->len == 0) {
+        return GRO_TCP_OTHER;
+    }
+    seg->seq = gro_get32(tcp + 4);
+
+    /* The guest is going to be told the checksums are good, so make
+     * sure they are.  Anything broken goes through untouched and the
+     * guest drops it as usual. */
+    if (net_checksum_finish(net_checksum_add(IP_HLEN, (uint8_t *)ip))) {
+        return GRO_TCP_OTHER;
+    }
+    seg->sum = net_checksum_add(seg->len, (uint8_t *)buf + seg->hdr_len);
+    sum = seg->sum + net_checksum_add(tcp_hlen, (uint8_t *)tcp) +
+          net_checksum_add(8, (uint8_t *)ip + 12) +
+          IP_PROTO_TCP + ip_len - IP_HLEN;
+    if (net_checksum_finish(sum)) {
+        return GRO_TCP_OTHER;
+    }
+
+    return GRO_TCP_DATA;
+}
+
+/* Same MAC header, addresses and ports */
+static int gro_same_flow(GROFlow *f, const uint8_t *buf)
+{
+    return !memcmp(f->buf, buf, ETH_HLEN) &&
+           !memcmp(f->buf + ETH_HLEN + 12, buf + ETH_HLEN + 12, 8 + 4);
+}
+
+static int gro_find_flow(NetGRO *gro, const uint8_t *buf)
+{
+    int i;
+
+    for (i = 0; i < gro->nb_flows; i++) {
+        if (gro_same_flow(&gro->flows[i], buf)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int gro_can_merge(GROFlow *f, GROSegment *seg, int limit)
+{
+    const uint8_t *fip = f->buf + ETH_HLEN, *ip = seg->buf + ETH_HLEN;
+    const uint8_t *ftcp = fip + IP_HLEN, *tcp = ip + IP_HLEN;
+
+    /* The payload sums only add up at even offsets, and a short
+     * segment or one with PSH must be the last one. */
+    if (seg->seq != f->next_seq ||
+        seg->hdr_len != f->hdr_len ||
+        seg->len > f->mss ||
+        f->size - f->hdr_len != f->mss * f->nb_segs ||
+        (ftcp[13] & TCP_FLAG_PSH) ||
+        ((f->size - f->hdr_len) & 1) ||
+        f->size + seg->len > limit ||
+        f->size + seg->len > GRO_MAX_FRAME) {
+        return 0;
+    }
+
+    /* TOS, DF and TTL, then the ACK, flags, window and options */
+    return ip[1] == fip[1] && ip[6] == fip[6] && ip[8] == fip[8] &&
+           !memcmp(tcp + 8, ftcp + 8, 5) &&
+           ((tcp[13] ^ ftcp[13]) & ~TCP_FLAG_PSH) == 0 &&
+           !memcmp(tcp + 14, ftcp + 14, 2) &&
+           !memcmp(tcp + 20, ftcp + 20, f->hdr_len - ETH_HLEN - IP_HLEN - 20);
+}
+
+static void gro_start_flow(NetGRO *gro, GROSegment *seg)
+{
+    GROFlow *f = &gro->flows[gro->nb_flows++];
+
+    if (!f->buf) {
+        f->buf = qemu_malloc(GRO_MAX_FRAME);
+    }
+    f->size = seg->hdr_len + seg->len;
+    memcpy(f->buf, seg->buf, f->size);
+    f->hdr_len = seg->hdr_len;
+    f->mss = seg->len;
+    f->nb_segs = 1;
+    f->next_seq = seg->seq + seg->len;
+    f->sum = seg->sum;
+}
+
+static void gro_append(GROFlow *f, GROSegment *seg)
+{
+    memcpy(f->buf + f->size, seg->buf + seg->hdr_len, seg->len);
+    f->size += seg->len;
+    f->nb_segs++;
+    f->next_seq += seg->len;
+    f->sum += seg->sum;
+    f->buf[ETH_HLEN + IP_HLEN + 13] |= seg->flags & TCP_FLAG_PSH;
+}
+
+/* Fix up the headers of a merged frame */
+static void gro_finish(GROFlow *f)
+{
+    uint8_t *ip = f->buf + ETH_HLEN;
+    uint8_t *tcp = ip + IP_HLEN;
+    int ip_len = f->size - ETH_HLEN;
+    int tcp_hlen = f->hdr_len - ETH_HLEN - IP_HLEN;
+    uint32_t sum;
+
+    /* only the length changed since the IP checksum was verified */
+    gro_put16(ip + 10, net_checksum_update16(gro_get16(ip + 10),
+                                             gro_get16(ip + 2), ip_len));
+    gro_put16(ip + 2, ip_len);
+
+    gro_put16(tcp + 16, 0);
+    sum = f->sum + net_checksum_add(tcp_hlen, tcp) +
+          net_checksum_add(8, ip + 12) + IP_PROTO_TCP + ip_len - IP_HLEN;
+    gro_put16(tcp + 16, net_checksum_finish(sum));
+}
+
+static void gro_remove_flow(NetGRO *gro, int i)
+{
+    GROFlow f = gro->flows[i];
+
+    /* keep the buffer around for the next flow */
+    memmove(&gro->flows[i], &gro->flows[i + 1],
+            (gro->nb_flows - i - 1) * sizeof(GROFlow));
+    gro->flows[--gro->nb_flows] = f;
+}
+
+/* Returns 0 if the NIC can't take the frame now; the flow stays and is
+ * retried on the next flush. */
+static int gro_flush_flow(NetGRO *gro, int i)
+{
+    VLANClientState *nc = gro->nc;
+    GROFlow *f = &gro->flows[i];
+    ssize_t ret;
+
+    if (f->nb_segs == 1) {
+        ret = nc->info->receive(nc, f->buf, f->size);
+    } else {
+        gro_finish(f);
+        ret = nc->info->receive_coalesced(nc, f->buf, f->size,
+                                          f->hdr_len, f->mss);
+    }
+    if (ret == 0) {
+        gro->blocked = 1;
+        return 0;
+    }
+
+    gro->frames++;
+    gro_remove_flow(gro, i);
+    return 1;
+}
+
+int net_gro_flush(NetGRO *gro)
+{
+    gro->blocked = 0;
+    while (gro->nb_flows) {
+        if (!gro_flush_flow(gro, 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void net_gro_bh(void *opaque)
+{
+    net_gro_flush(opaque);
+}
+
+ssize_t net_gro_receive(NetGRO *gro, const uint8_t *buf, size_t size)
+{
+    VLANClientState *nc = gro->nc;
+    GROSegment seg = { NULL };
+    ssize_t ret;
+    int type, limit, i = -1;
+
+    /* Nothing may overtake what the NIC refused before */
+    if (gro->blocked && !net_gro_flush(gro)) {
+        return 0;
+    }
+
+    type = gro_parse(buf, size, &seg);
+    if (type != GRO_NOT_TCP) {
+        i = gro_find_flow(gro, buf);
+    }
+
+    limit = nc->info->coalesce_limit(nc);
+    if (type == GRO_TCP_DATA && limit > 0 &&
+        (!nc->info->can_receive || nc->info->can_receive(nc))) {
+        if (i >= 0) {
+            GROFlow *f = &gro->flows[i];
+
+            if (gro_can_merge(f, &seg, limit)) {
+                gro_append(f, &seg);
+                gro->packets++;
+                if (seg.len < f->mss || (seg.flags & TCP_FLAG_PSH)) {
+                    gro_flush_flow(gro, i);
+                }
+                return size;
+            }
+            if (!gro_flush_flow(gro, i)) {
+                return 0;
+            }
+        }
+
+        if (!(seg.flags & TCP_FLAG_PSH) && seg.hdr_len + seg.len <= limit) {
+            if (gro->nb_flows == GRO_MAX_FLOWS && !gro_flush_flow(gro, 0)) {
+                return 0;
+            }
+            gro_start_flow(gro, &seg);
+            gro->packets++;
+            qemu_bh_schedule(gro->bh);
+            return size;
+        }
+    } else if (limit <= 0) {
+        /* coalescing was turned off, e.g. by a guest reset */
+        if (!net_gro_flush(gro)) {
+            return 0;
+        }
+    } else if (i >= 0 && !gro_flush_flow(gro, i)) {
+        return 0;
+    }
+
+    ret = nc->info->receive(nc, buf, size);
+    if (ret != 0) {
+        gro->packets++;
+        gro->frames++;
+    }
+    return ret;
+}
+
+void net_gro_get_stats(NetGRO *gro, NetGROStats *stats)
+{
+    stats->packets = gro->packets;
+    stats->frames = gro->frames;
+}
+
+NetGRO *net_gro_new(VLANClientState *nc)
+{
+    NetGRO *gro;
+
+    gro = qemu_mallocz(sizeof(NetGRO));
+    gro->nc = nc;
+    gro->bh = qemu_bh_new(net_gro_bh, gro);
+
+    return gro;
+}
+
+void net_gro_delete(NetGRO *gro)
+{
+    int i;
+
+    qemu_bh_delete(gro->bh);
+    for (i = 0; i < GRO_MAX_FLOWS; i++) {
+        qemu_free(gro->flows[i].buf);
+    }
+    qemu_free(gro);
+}
@@ -0,0 +1,42 @@
+/*
+ * QEMU receive coalescing of TCP segments in front of a NIC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef QEMU_NET_GRO_H
+#define QEMU_NET_GRO_H
+
+#include "qemu-common.h"
+
+typedef struct NetGRO NetGRO;
+
+typedef struct NetGROStats {
+    uint64_t packets;       /* packets handed to the coalescing stage */
+    uint64_t frames;        /* frames it passed on to the NIC */
+} NetGROStats;
+
+NetGRO *net_gro_new(VLANClientState *nc);
+void net_gro_delete(NetGRO *gro);
+
+ssize_t net_gro_receive(NetGRO *gro, const uint8_t *buf, size_t size);
+int net_gro_flush(NetGRO *gro);
+void net_gro_get_stats(NetGRO *gro, NetGROStats *stats);
+
+#endif /* QEMU_NET_GRO_H */
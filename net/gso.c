@@ -0,0 +1,329 @@
+/*
+ * QEMU segmentation offload for backends that take only MTU sized frames
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "net/gso.h"
+
+#include "net.h"
+#include "net/checksum.h"
+#include "iov.h"
+#include "qemu-common.h"
+
+/* A guest that negotiated checksum and segmentation offload hands its
+ * NIC partially checksummed frames of up to 64k, described by a
+ * virtio_net_hdr.  A tap with IFF_VNET_HDR passes those on to the host
+ * kernel, but every other backend (slirp, socket, vde, ...) wants what
+ * would go out on a wire.  Rather than make the guest segment for them,
+ * we do it here, right before the frame leaves the NIC: the checksum is
+ * filled in, then TCP frames are cut into segments of info->size bytes
+ * of payload and UDP datagrams into IP fragments, each with its own
+ * headers and checksums.
+ *
+ * Frames we cannot make sense of are sent as they are.
+ */
+
+#define GSO_MAX_FRAME   (18 + 40 + 65535)   /* VLAN tagged Ethernet header,
+                                               largest IPv6 packet */
+
+#define ETH_HLEN        14
+#define ETH_P_IP        0x0800
+#define ETH_P_IPV6      0x86dd
+#define ETH_P_VLAN      0x8100
+
+#define IP_PROTO_TCP    6
+#define IP_PROTO_UDP    17
+#define IPV6_FRAGMENT   44
+#define IP_MF           0x2000
+
+#define TCP_FLAG_FIN    0x01
+#define TCP_FLAG_PSH    0x08
+#define TCP_FLAG_CWR    0x80
+
+static uint8_t *gso_frame;      /* the frame from the guest */
+static uint8_t *gso_seg;        /* one segment of it */
+static int gso_busy;            /* a sent callback sends again */
+static uint32_t gso_frag_id;    /* IPv6 has no identification to copy */
+
+static inline uint16_t gso_get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t gso_get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void gso_put16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val;
+}
+
+static inline void gso_put32(uint8_t *p, uint32_t val)
+{
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+static void gso_ip_csum(uint8_t *ip)
+{
+    int ihl = (ip[0] & 0xf) * 4;
+
+    gso_put16(ip + 10, 0);
+    gso_put16(ip + 10, net_checksum_finish(net_checksum_add(ihl, ip)));
+}
+
+/* Fill in the TCP or UDP checksum of a frame, pseudo header included */
+static void gso_l4_csum(uint8_t *buf, int l3, int v6, int l4, int proto,
+                        int len)
+{
+    int csum_offset = proto == IP_PROTO_TCP ? 16 : 6;
+    uint32_t sum;
+    uint16_t csum;
+
+    gso_put16(buf + l4 + csum_offset, 0);
+    if (v6) {
+        sum = net_checksum_add(32, buf + l3 + 8);
+    } else {
+        sum = net_checksum_add(8, buf + l3 + 12);
+    }
+    sum += proto + len + net_checksum_add(len, buf + l4);
+    csum = net_checksum_finish(sum);
+    if (csum == 0 && proto == IP_PROTO_UDP) {
+        csum = 0xffff;
+    }
+    gso_put16(buf + l4 + csum_offset, csum);
+}
+
+/* Segments are sent without the callback, which only goes with the last
+ * one: the sender waits for it before sending more, and by then the
+ * queue has delivered everything before it, too.
+ */
+static ssize_t gso_send(VLANClientState *sender, uint8_t *seg, int len,
+                        int last, NetPacketSent *sent_cb)
+{
+    return qemu_send_packet_async(sender, seg, len,
+                                  last ? sent_cb : NULL);
+}
+
+static ssize_t gso_send_tcp(VLANClientState *sender, uint8_t *frame,
+                            uint8_t *seg, int size, int l3, int v6, int l4,
+                            int mss, NetPacketSent *sent_cb)
+{
+    int tcp_hlen = (frame[l4 + 12] >> 4) * 4;
+    int hdr_len = l4 + tcp_hlen;
+    uint32_t seq = gso_get32(frame + l4 + 4);
+    uint16_t id = gso_get16(frame + l3 + 4);
+    uint8_t flags = frame[l4 + 13];
+    ssize_t ret = size;
+    int off, len, last;
+
+    if (tcp_hlen < 20 || hdr_len >= size) {
+        return qemu_send_packet_async(sender, frame, size, sent_cb);
+    }
+
+    for (off = hdr_len; off < size; off += len) {
+        len = MIN(mss, size - off);
+        last = off + len == size;
+
+        memcpy(seg, frame, hdr_len);
+        memcpy(seg + hdr_len, frame + off, len);
+        if (v6) {
+            gso_put16(seg + l3 + 4, hdr_len - l3 - 40 + len);
+        } else {
+            gso_put16(seg + l3 + 2, hdr_len - l3 + len);
+            gso_put16(seg + l3 + 4, id++);
+            gso_ip_csum(seg + l3);
+        }
+
+        /* FIN and PSH go with the last segment, CWR with the first */
+        gso_put32(seg + l4 + 4, seq + off - hdr_len);
+        seg[l4 + 13] = flags;
+        if (!last) {
+            seg[l4 + 13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        }
+        if (off != hdr_len) {
+            seg[l4 + 13] &= ~TCP_FLAG_CWR;
+        }
+        gso_l4_csum(seg, l3, v6, l4, IP_PROTO_TCP, tcp_hlen + len);
+
+        ret = gso_send(sender, seg, hdr_len + len, last, sent_cb);
+    }
+
+    return ret ? size : 0;
+}
+
+/* The UDP checksum covers the whole datagram and is already in place;
+ * only IP headers are added.
+ */
+static ssize_t gso_send_udp(VLANClientState *sender, uint8_t *frame,
+                            uint8_t *seg, int size, int l3, int v6, int mss,
+                            NetPacketSent *sent_cb)
+{
+    int hdr_len = v6 ? l3 + 40 : l3 + (frame[l3] & 0xf) * 4;
+    int frag_hdr_len = v6 ? 8 : 0;
+    int frag_size = mss & ~7;
+    uint32_t id = gso_frag_id++;
+    ssize_t ret = size;
+    int off, len, last;
+
+    if (frag_size == 0 ||
+        (v6 && frame[l3 + 6] != IP_PROTO_UDP) ||   /* extension headers */
+        (!v6 && (gso_get16(frame + l3 + 6) & 0x3fff))) {
+        return qemu_send_packet_async(sender, frame, size, sent_cb);
+    }
+
+    for (off = hdr_len; off < size; off += len) {
+        len = MIN(frag_size, size - off);
+        last = off + len == size;
+
+        memcpy(seg, frame, hdr_len);
+        memcpy(seg + hdr_len + frag_hdr_len, frame + off, len);
+        if (v6) {
+            uint8_t *frag = seg + hdr_len;
+
+            seg[l3 + 6] = IPV6_FRAGMENT;
+            gso_put16(seg + l3 + 4, frag_hdr_len + len);
+            frag[0] = IP_PROTO_UDP;
+            frag[1] = 0;
+            gso_put16(frag + 2, (off - hdr_len) | !last);
+            gso_put32(frag + 4, id);
+        } else {
+            gso_put16(seg + l3 + 2, hdr_len - l3 + len);
+            gso_put16(seg + l3 + 6, ((off - hdr_len) >> 3) | (last ? 0 : IP_MF));
+            gso_ip_csum(seg + l3);
+        }
+
+        ret = gso_send(sender, seg, hdr_len + frag_hdr_len + len, last, sent_cb);
+    }
+
+    return ret ? size : 0;
+}
+
+static ssize_t gso_segment(VLANClientState *sender, const NetGSOInfo *info,
+                           uint8_t *frame, uint8_t *seg, size_t size,
+                           NetPacketSent *sent_cb)
+{
+    int type = info->type & ~NET_GSO_ECN;
+    int l3, l4, v6, proto;
+
+    if (info->flags & NET_GSO_F_NEEDS_CSUM) {
+        int start = info->csum_start, pos = start + info->csum_offset;
+
+        /* the guest left the pseudo header sum in the checksum field */
+        if (pos + 2 <= size) {
+            uint32_t sum = net_checksum_add(size - start, frame + start);
+
+            gso_put16(frame + pos, net_checksum_finish(sum));
+        }
+    }
+
+    if (type == NET_GSO_NONE || size < ETH_HLEN + 4 || info->size == 0) {
+        return qemu_send_packet_async(sender, frame, size, sent_cb);
+    }
+
+    l3 = ETH_HLEN;
+    if (gso_get16(frame + 12) == ETH_P_VLAN) {
+        l3 += 4;
+    }
+    switch (gso_get16(frame + l3 - 2)) {
+    case ETH_P_IP:
+        v6 = 0;
+        l4 = l3 + (frame[l3] & 0xf) * 4;
+        proto = frame[l3 + 9];
+        break;
+    case ETH_P_IPV6:
+        v6 = 1;
+        l4 = l3 + 40;
+        proto = frame[l3 + 6];
+        break;
+    default:
+        return qemu_send_packet_async(sender, frame, size, sent_cb);
+    }
+    /* csum_start finds TCP behind IPv6 extension headers */
+    if ((info->flags & NET_GSO_F_NEEDS_CSUM) && info->csum_start > l4) {
+        l4 = info->csum_start;
+        proto = type == NET_GSO_UDP ? IP_PROTO_UDP : IP_PROTO_TCP;
+    }
+    if (l4 < l3 + 20 || l4 + 20 > size) {
+        return qemu_send_packet_async(sender, frame, size, sent_cb);
+    }
+
+    if ((type == NET_GSO_TCPV4 && !v6 && proto == IP_PROTO_TCP) ||
+        (type == NET_GSO_TCPV6 && v6 && proto == IP_PROTO_TCP)) {
+        return gso_send_tcp(sender, frame, seg, size, l3, v6, l4,
+                            info->size, sent_cb);
+    }
+    if (type == NET_GSO_UDP && proto == IP_PROTO_UDP) {
+        return gso_send_udp(sender, frame, seg, size, l3, v6,
+                            info->size, sent_cb);
+    }
+    return qemu_send_packet_async(sender, frame, size, sent_cb);
+}
+
+ssize_t net_gso_sendv(VLANClientState *sender, const NetGSOInfo *info,
+                      const struct iovec *iov, int iovcnt,
+                      NetPacketSent *sent_cb)
+{
+    uint8_t *frame, *seg;
+    size_t size;
+    ssize_t ret;
+
+    if ((info->type & ~NET_GSO_ECN) == NET_GSO_NONE &&
+        !(info->flags & NET_GSO_F_NEEDS_CSUM)) {
+        return qemu_sendv_packet_async(sender, iov, iovcnt, sent_cb);
+    }
+
+    size = iov_size(iov, iovcnt);
+    if (size > GSO_MAX_FRAME) {
+        return size;
+    }
+
+    /* Delivering a segment can flush a queue and so run the sent
+     * callback of another NIC, which may be back here before we are
+     * done with the buffers. */
+    if (gso_busy) {
+        frame = qemu_malloc(GSO_MAX_FRAME);
+        seg = qemu_malloc(GSO_MAX_FRAME);
+    } else {
+        if (!gso_frame) {
+            gso_frame = qemu_malloc(GSO_MAX_FRAME);
+            gso_seg = qemu_malloc(GSO_MAX_FRAME);
+        }
+        frame = gso_frame;
+        seg = gso_seg;
+        gso_busy = 1;
+    }
+
+    iov_to_buf(iov, iovcnt, frame, 0, size);
+    ret = gso_segment(sender, info, frame, seg, size, sent_cb);
+
+    if (frame == gso_frame) {
+        gso_busy = 0;
+    } else {
+        qemu_free(frame);
+        qemu_free(seg);
+    }
+    return ret;
+}
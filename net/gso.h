@@ -0,0 +1,52 @@
+/*
+ * QEMU segmentation offload for backends that take only MTU sized frames
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef QEMU_NET_GSO_H
+#define QEMU_NET_GSO_H
+
+#include "qemu-common.h"
+#include "net/queue.h"
+
+/* What a NIC knows about a frame it was asked to checksum or segment.
+ * The values are those of struct virtio_net_hdr, in host byte order.
+ */
+typedef struct NetGSOInfo {
+    uint8_t flags;
+    uint8_t type;
+    uint16_t size;          /* payload per segment */
+    uint16_t csum_start;    /* checksum from here to the end ... */
+    uint16_t csum_offset;   /* ... goes here, relative to csum_start */
+} NetGSOInfo;
+
+#define NET_GSO_F_NEEDS_CSUM    1
+
+#define NET_GSO_NONE            0
+#define NET_GSO_TCPV4           1
+#define NET_GSO_UDP             3
+#define NET_GSO_TCPV6           4
+#define NET_GSO_ECN             0x80
+
+ssize_t net_gso_sendv(VLANClientState *sender, const NetGSOInfo *info,
+                      const struct iovec *iov, int iovcnt,
+                      NetPacketSent *sent_cb);
+
+#endif /* QEMU_NET_GSO_H */
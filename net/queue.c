@@ -34,10 +34,20 @@
  * until we have invoked the callback. Only in that case will we queue
  * the packet.
  *
- * If a sent callback isn't provided, we just drop the packet to avoid
- * unbounded queueing.
+ * If a sent callback isn't provided, the packet is queued only while
+ * the queue holds fewer than max_len packets, and dropped otherwise.
+ * Packets with a callback are always queued: their sender waits for the
+ * callback before sending more, so they cannot flood the queue.
+ *
+ * Packets up to NET_PACKET_POOL_SIZE bytes are copied into buffers that
+ * are recycled through a per-queue pool instead of going back to
+ * malloc; only larger (GSO) packets get a buffer of their own.
  */
 
+#define NET_PACKET_POOL_SIZE  2048
+/* free buffers kept around once a burst has drained */
+#define NET_PACKET_POOL_MAX   64
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     VLANClientState *sender;
@@ -53,6 +63,13 @@ struct NetQueue {
     void *opaque;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) pool;
+    int nb_packets;
+    int nb_pool;
+
+    int max_len;
+    int policy;
+    NetQueueStats stats;
 
     unsigned delivering : 1;
 };
@@ -70,6 +87,10 @@ NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
     queue->opaque = opaque;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool);
+
+    queue->max_len = NET_QUEUE_DEFAULT_LEN;
+    queue->policy = NET_QUEUE_POLICY_DROP;
 
     queue->delivering = 0;
 
@@ -84,27 +105,111 @@ void qemu_del_net_queue(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         qemu_free(packet);
     }
+    QTAILQ_FOREACH_SAFE(packet, &queue->pool, entry, next) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        qemu_free(packet);
+    }
 
     qemu_free(queue);
 }
 
-static ssize_t qemu_net_queue_append(NetQueue *queue,
-                                     VLANClientState *sender,
-                                     unsigned flags,
-                                     const uint8_t *buf,
-                                     size_t size,
-                                     NetPacketSent *sent_cb)
+void qemu_net_queue_set_limit(NetQueue *queue, int max_len, int policy)
+{
+    queue->max_len = max_len;
+    queue->policy = policy;
+}
+
+void qemu_net_queue_copy_limit(NetQueue *queue, NetQueue *from)
+{
+    qemu_net_queue_set_limit(queue, from->max_len, from->policy);
+}
+
+/* Whether senders that can hold back their packets should do so */
+int qemu_net_queue_busy(NetQueue *queue)
+{
+    return queue->policy == NET_QUEUE_POLICY_BLOCK &&
+           queue->nb_packets >= queue->max_len;
+}
+
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    *stats = queue->stats;
+    stats->len = queue->nb_packets;
+    stats->max_len = queue->max_len;
+}
+
+static NetPacket *qemu_net_packet_alloc(NetQueue *queue, size_t size)
 {
     NetPacket *packet;
 
-    packet = qemu_malloc(sizeof(NetPacket) + size);
+    if (size > NET_PACKET_POOL_SIZE) {
+        return qemu_malloc(sizeof(NetPacket) + size);
+    }
+
+    packet = QTAILQ_FIRST(&queue->pool);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        queue->nb_pool--;
+        return packet;
+    }
+    return qemu_malloc(sizeof(NetPacket) + NET_PACKET_POOL_SIZE);
+}
+
+static void qemu_net_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->size <= NET_PACKET_POOL_SIZE &&
+        queue->nb_pool < NET_PACKET_POOL_MAX) {
+        QTAILQ_INSERT_HEAD(&queue->pool, packet, entry);
+        queue->nb_pool++;
+    } else {
+        qemu_free(packet);
+    }
+}
+
+/* Take a buffer for a packet of @size bytes and put it at the tail of
+ * the queue, or return NULL if the packet has to be dropped.
+ */
+static NetPacket *qemu_net_queue_get_packet(NetQueue *queue,
+                                            VLANClientState *sender,
+                                            unsigned flags,
+                                            size_t size,
+                                            NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    if (!sent_cb && queue->nb_packets >= queue->max_len) {
+        queue->stats.dropped++;
+        return NULL;
+    }
+
+    packet = qemu_net_packet_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
 
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    queue->stats.queued++;
+    if (++queue->nb_packets > queue->stats.max_depth) {
+        queue->stats.max_depth = queue->nb_packets;
+    }
+
+    return packet;
+}
+
+static ssize_t qemu_net_queue_append(NetQueue *queue,
+                                     VLANClientState *sender,
+                                     unsigned flags,
+                                     const uint8_t *buf,
+                                     size_t size,
+                                     NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    packet = qemu_net_queue_get_packet(queue, sender, flags, size, sent_cb);
+    if (packet) {
+        memcpy(packet->data, buf, size);
+    }
 
     return size;
 }
@@ -117,29 +222,24 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
                                          NetPacketSent *sent_cb)
 {
     NetPacket *packet;
-    size_t max_len = 0;
+    size_t size = 0, offset = 0;
     int i;
 
     for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
+        size += iov[i].iov_len;
     }
 
-    packet = qemu_malloc(sizeof(NetPacket) + max_len);
-    packet->sender = sender;
-    packet->sent_cb = sent_cb;
-    packet->flags = flags;
-    packet->size = 0;
+    packet = qemu_net_queue_get_packet(queue, sender, flags, size, sent_cb);
+    if (!packet) {
+        return size;
+    }
 
     for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
-
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
+        memcpy(packet->data + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
     }
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
-
-    return packet->size;
+    return size;
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -227,7 +327,8 @@ void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            qemu_free(packet);
+            queue->nb_packets--;
+            qemu_net_packet_free(queue, packet);
         }
     }
 }
@@ -240,6 +341,7 @@ void qemu_net_queue_flush(NetQueue *queue)
 
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
+        queue->nb_packets--;
 
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
@@ -248,6 +350,7 @@ void qemu_net_queue_flush(NetQueue *queue)
                                      packet->size);
         if (ret == 0) {
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
+            queue->nb_packets++;
             break;
         }
 
@@ -255,6 +358,6 @@ void qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        qemu_free(packet);
+        qemu_net_packet_free(queue, packet);
     }
 }
@@ -46,11 +46,32 @@ typedef ssize_t (NetPacketDeliverIOV) (VLANClientState *sender,
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
+/* What happens to packets that find the queue full */
+#define NET_QUEUE_POLICY_DROP   0   /* drop them */
+#define NET_QUEUE_POLICY_BLOCK  1   /* drop them, but also report the
+                                       queue as busy to senders that
+                                       poll qemu_can_send_packet() */
+
+#define NET_QUEUE_DEFAULT_LEN   1000
+
+typedef struct NetQueueStats {
+    int len;                /* packets waiting now */
+    int max_len;            /* limit on waiting packets */
+    int max_depth;          /* most packets ever waiting at once */
+    uint64_t queued;        /* packets that had to wait */
+    uint64_t dropped;       /* packets dropped because the queue was full */
+} NetQueueStats;
+
 NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
                              NetPacketDeliverIOV *deliver_iov,
                              void *opaque);
 void qemu_del_net_queue(NetQueue *queue);
 
+void qemu_net_queue_set_limit(NetQueue *queue, int max_len, int policy);
+void qemu_net_queue_copy_limit(NetQueue *queue, NetQueue *from);
+int qemu_net_queue_busy(NetQueue *queue);
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             VLANClientState *sender,
                             unsigned flags,
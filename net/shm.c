@@ -0,0 +1,772 @@
+/*
+ * QEMU shared memory network backend
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "net/shm.h"
+
+#include "config-host.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "net.h"
+#include "iov.h"
+#include "qemu-barrier.h"
+#include "qemu-char.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu-option.h"
+#include "qemu_socket.h"
+
+/*
+ * Two QEMU processes on the same host exchange frames through rings in
+ * a shared memory area.  The side started with "server" listens on a
+ * unix socket.  When the other side connects, the server creates the
+ * area and one doorbell per side and queue, and passes their file
+ * descriptors over the socket; after that the socket is only watched to
+ * notice when the peer goes away.
+ *
+ * Every queue has one ring per direction: a single producer, single
+ * consumer array of fixed size slots indexed by free running counters.
+ * A doorbell (an eventfd, or a pipe where there is none) is only rung
+ * when the other side has said it is about to sleep, so a busy link
+ * moves frames without a system call per frame.  Each frame is copied
+ * once into the ring by the sender and once out of it by the receiving
+ * NIC.
+ */
+
+#define SHM_NET_MAGIC           0x4e4d4853      /* "SHMN" */
+#define SHM_NET_VERSION         1
+#define SHM_NET_HDR_SIZE        4096    /* rings start page aligned */
+#define SHM_NET_SLOT_SIZE       2048
+#define SHM_NET_DEFAULT_SLOTS   1024
+#define SHM_NET_MAX_SLOTS       4096
+#define SHM_NET_CACHELINE       64
+#define SHM_NET_MAX_FDS         (1 + 2 * MAX_QUEUE_NUM)
+
+/* At offset 0 of the shared area; also the handshake message */
+typedef struct ShmNetHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t queues;
+    uint32_t slots;         /* per ring, a power of two */
+    uint32_t slot_size;     /* bytes, including the length word */
+    uint32_t ring_size;     /* bytes per ring, including the slots */
+} ShmNetHeader;
+
+/* The header is followed by 2 * queues rings.  Queue n sends from the
+ * server to the client through ring 2n, and back through ring 2n + 1.
+ */
+typedef struct ShmNetRing {
+    /* written by the producer */
+    volatile uint32_t head;         /* slots filled so far */
+    volatile uint32_t prod_waiting; /* ring full, kick when there is room */
+    uint8_t pad0[SHM_NET_CACHELINE - 8];
+    /* written by the consumer */
+    volatile uint32_t tail;         /* slots consumed so far */
+    volatile uint32_t cons_waiting; /* ring empty, kick on the next frame */
+    uint8_t pad1[SHM_NET_CACHELINE - 8];
+} ShmNetRing;
+
+typedef struct ShmNetSlot {
+    uint32_t len;
+    uint8_t data[0];
+} ShmNetSlot;
+
+typedef struct ShmNetLink ShmNetLink;
+
+typedef struct ShmNetState {
+    VLANClientState nc;
+    ShmNetLink *link;
+    int index;
+    /* valid while connected; NULL otherwise */
+    ShmNetRing *rx;
+    ShmNetRing *tx;
+    /* the indexes we own; the copies in the rings are only for the peer */
+    uint32_t rx_tail;
+    uint32_t tx_head;
+    int doorbell;                   /* rung by the peer */
+    int peer_doorbell;
+    unsigned int rx_stopped : 1;    /* the NIC queued a frame */
+    unsigned int tx_full : 1;       /* we queued a frame of the NIC */
+} ShmNetState;
+
+/* What the queues of one netdev share */
+struct ShmNetLink {
+    char *path;
+    int server;
+    int listen_fd;
+    int fd;                         /* connection to the peer, or -1 */
+    int queues;
+    ShmNetHeader hdr;               /* our copy, the peer may scribble */
+    uint8_t *mem;
+    size_t size;
+    ShmNetState *queue[MAX_QUEUE_NUM];
+    int refcount;
+};
+
+static void shm_net_disconnect(ShmNetLink *link);
+
+static ShmNetRing *shm_net_ring(ShmNetLink *link, int n)
+{
+    return (ShmNetRing *)(link->mem + SHM_NET_HDR_SIZE +
+                          (size_t)n * link->hdr.ring_size);
+}
+
+static ShmNetSlot *shm_net_slot(ShmNetLink *link, ShmNetRing *ring,
+                                uint32_t index)
+{
+    return (ShmNetSlot *)((uint8_t *)(ring + 1) +
+                          (size_t)(index & (link->hdr.slots - 1)) *
+                          link->hdr.slot_size);
+}
+
+static void shm_net_kick(int fd)
+{
+    uint64_t value = 1;
+    ssize_t len;
+
+    /* EAGAIN means that a wakeup is pending already */
+    do {
+        len = write(fd, &value, sizeof(value));
+    } while (len < 0 && errno == EINTR);
+}
+
+static void shm_net_update_info(ShmNetState *s)
+{
+    ShmNetLink *link = s->link;
+    int len;
+
+    len = snprintf(s->nc.info_str, sizeof(s->nc.info_str), "shm: path=%s%s",
+                   link->path, link->server ? ",server" : "");
+    if (link->queues > 1) {
+        len += snprintf(s->nc.info_str + len, sizeof(s->nc.info_str) - len,
+                        ",queue=%d", s->index);
+    }
+    snprintf(s->nc.info_str + len, sizeof(s->nc.info_str) - len, " (%s)",
+             s->rx ? "connected" : "not connected");
+}
+
+static ssize_t shm_net_receive_iov(VLANClientState *nc,
+                                   const struct iovec *iov, int iovcnt)
+{
+    ShmNetState *s = DO_UPCAST(ShmNetState, nc, nc);
+    ShmNetLink *link = s->link;
+    ShmNetRing *ring = s->tx;
+    size_t size = iov_size(iov, iovcnt);
+    ShmNetSlot *slot;
+    uint32_t used;
+
+    /* nobody to talk to, or too big for a slot: drop */
+    if (!ring || size > link->hdr.slot_size - sizeof(ShmNetSlot)) {
+        return size;
+    }
+
+    used = s->tx_head - ring->tail;
+    if (used >= link->hdr.slots) {
+        /* ask for a kick once the peer made room, then look again in
+           case it did so in the meantime */
+        ring->prod_waiting = 1;
+        smp_mb();
+        used = s->tx_head - ring->tail;
+        if (used > link->hdr.slots) {
+            error_report("shm: %s: peer corrupted its ring", link->path);
+            shm_net_disconnect(link);
+            return size;
+        }
+        if (used == link->hdr.slots) {
+            s->tx_full = 1;
+            return 0;
+        }
+    }
+
+    slot = shm_net_slot(link, ring, s->tx_head);
+    iov_to_buf(iov, iovcnt, slot->data, 0, size);
+    slot->len = size;
+    smp_wmb();
+    ring->head = ++s->tx_head;
+
+    smp_mb();
+    if (ring->cons_waiting) {
+        ring->cons_waiting = 0;
+        shm_net_kick(s->peer_doorbell);
+    }
+    return size;
+}
+
+static ssize_t shm_net_receive(VLANClientState *nc, const uint8_t *buf,
+                               size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return shm_net_receive_iov(nc, &iov, 1);
+}
+
+static void shm_net_send_completed(VLANClientState *nc, ssize_t len);
+
+/* Hand the frames in the rx ring to the NIC until the ring is empty or
+ * the NIC has to queue one.
+ */
+static void shm_net_flush_rx(ShmNetState *s)
+{
+    ShmNetLink *link = s->link;
+    uint32_t payload = link->hdr.slot_size - sizeof(ShmNetSlot);
+
+    qemu_send_batch_begin(&s->nc);
+    while (s->rx && !s->rx_stopped) {
+        ShmNetRing *ring = s->rx;
+        ShmNetSlot *slot;
+        uint32_t head = ring->head;
+        uint32_t len;
+        ssize_t ret = 1;
+
+        if (head == s->rx_tail) {
+            /* tell the producer to kick us, then check that nothing
+               slipped in before it could see that */
+            ring->cons_waiting = 1;
+            smp_mb();
+            if (ring->head == s->rx_tail) {
+                break;
+            }
+            continue;
+        }
+        if (head - s->rx_tail > link->hdr.slots) {
+            error_report("shm: %s: peer corrupted its ring", link->path);
+            shm_net_disconnect(link);
+            break;
+        }
+        smp_rmb();
+
+        slot = shm_net_slot(link, ring, s->rx_tail);
+        /* the peer can rewrite the length at any time: check and use
+           a single read of it */
+        len = *(volatile uint32_t *)&slot->len;
+        if (len <= payload) {
+            ret = qemu_send_packet_async(&s->nc, slot->data, len,
+                                         shm_net_send_completed);
+        }
+
+        /* done with the slot, which the producer may now reuse */
+        smp_mb();
+        ring->tail = ++s->rx_tail;
+        smp_mb();
+        if (ring->prod_waiting) {
+            ring->prod_waiting = 0;
+            shm_net_kick(s->peer_doorbell);
+        }
+
+        if (ret == 0) {
+            s->rx_stopped = 1;
+        }
+    }
+    qemu_send_batch_end(&s->nc);
+}
+
+static void shm_net_send_completed(VLANClientState *nc, ssize_t len)
+{
+    ShmNetState *s = DO_UPCAST(ShmNetState, nc, nc);
+
+    s->rx_stopped = 0;
+    shm_net_flush_rx(s);
+}
+
+static void shm_net_doorbell(void *opaque)
+{
+    ShmNetState *s = opaque;
+    uint64_t buf[8];
+
+    /* one read empties an eventfd; a pipe may need more */
+    while (read(s->doorbell, buf, sizeof(buf)) == sizeof(buf)) {
+        /* loop */
+    }
+
+    shm_net_flush_rx(s);
+
+    if (s->tx_full) {
+        s->tx_full = 0;
+        qemu_flush_queued_packets(&s->nc);
+    }
+}
+
+static void shm_net_attach(ShmNetLink *link, int *doorbell, int *peer_doorbell)
+{
+    int i;
+
+    for (i = 0; i < link->queues; i++) {
+        ShmNetState *s = link->queue[i];
+        ShmNetRing *to_client = shm_net_ring(link, 2 * i);
+        ShmNetRing *to_server = shm_net_ring(link, 2 * i + 1);
+
+        if (!s) {
+            close(doorbell[i]);
+            close(peer_doorbell[i]);
+            continue;
+        }
+
+        s->tx = link->server ? to_client : to_server;
+        s->rx = link->server ? to_server : to_client;
+        s->tx_head = s->rx_tail = 0;
+        s->doorbell = doorbell[i];
+        s->peer_doorbell = peer_doorbell[i];
+        socket_set_nonblock(s->doorbell);
+        socket_set_nonblock(s->peer_doorbell);
+        qemu_set_fd_handler(s->doorbell, shm_net_doorbell, NULL, s);
+        shm_net_update_info(s);
+
+        /* the peer may have started sending already */
+        shm_net_flush_rx(s);
+    }
+}
+
+static void shm_net_detach(ShmNetState *s)
+{
+    if (s->doorbell >= 0) {
+        qemu_set_fd_handler(s->doorbell, NULL, NULL, NULL);
+        close(s->doorbell);
+        close(s->peer_doorbell);
+        s->doorbell = s->peer_doorbell = -1;
+    }
+    s->rx = s->tx = NULL;
+    s->rx_stopped = 0;
+    shm_net_update_info(s);
+
+    /* whatever the NIC queued for us is dropped now */
+    if (s->tx_full) {
+        s->tx_full = 0;
+        qemu_flush_queued_packets(&s->nc);
+    }
+}
+
+static void shm_net_disconnect(ShmNetLink *link)
+{
+    int i;
+
+    for (i = 0; i < link->queues; i++) {
+        if (link->queue[i]) {
+            shm_net_detach(link->queue[i]);
+        }
+    }
+    if (link->fd >= 0) {
+        qemu_set_fd_handler(link->fd, NULL, NULL, NULL);
+        closesocket(link->fd);
+        link->fd = -1;
+    }
+    if (link->mem) {
+        munmap(link->mem, link->size);
+        link->mem = NULL;
+    }
+}
+
+/* The peer never sends anything after the handshake; readable means gone */
+static void shm_net_peer_read(void *opaque)
+{
+    ShmNetLink *link = opaque;
+    char buf[64];
+    ssize_t len;
+
+    len = recv(link->fd, buf, sizeof(buf), 0);
+    if (len == 0 || (len < 0 && socket_error() != EWOULDBLOCK &&
+                     socket_error() != EINTR)) {
+        shm_net_disconnect(link);
+    }
+}
+
+static int shm_net_send_hello(int fd, ShmNetHeader *hdr, int *fds, int nfds)
+{
+    char control[CMSG_SPACE(sizeof(int) * SHM_NET_MAX_FDS)];
+    struct iovec iov = {
+        .iov_base = hdr,
+        .iov_len = sizeof(*hdr),
+    };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+    do {
+        ret = sendmsg(fd, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret == sizeof(*hdr) ? 0 : -1;
+}
+
+/* Returns the number of file descriptors received, or -1 */
+static int shm_net_recv_hello(int fd, ShmNetHeader *hdr, int *fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * SHM_NET_MAX_FDS)];
+    struct iovec iov = {
+        .iov_base = hdr,
+        .iov_len = sizeof(*hdr),
+    };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+    int i, nfds = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        ret = recvmsg(fd, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); ret > 0 && cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+            break;
+        }
+    }
+    for (i = 0; i < nfds; i++) {
+        qemu_set_cloexec(fds[i]);
+    }
+
+    if (ret != sizeof(*hdr) || (msg.msg_flags & MSG_CTRUNC)) {
+        for (i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return nfds;
+}
+
+/* An unlinked file in /dev/shm, or in /tmp if that is missing */
+static int shm_net_create_mem(size_t size)
+{
+    static const char *const dirs[] = { "/dev/shm", "/tmp" };
+    char path[64];
+    int i, fd = -1;
+
+    for (i = 0; i < ARRAY_SIZE(dirs) && fd < 0; i++) {
+        snprintf(path, sizeof(path), "%s/qemu-shm-net-XXXXXX", dirs[i]);
+        fd = mkstemp(path);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    qemu_set_cloexec(fd);
+
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int shm_net_map(ShmNetLink *link, int memfd)
+{
+    void *mem;
+
+    mem = mmap(NULL, link->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    link->mem = mem;
+    return 0;
+}
+
+static int shm_net_server_connect(ShmNetLink *link, int fd)
+{
+    int doorbell[MAX_QUEUE_NUM], peer_doorbell[MAX_QUEUE_NUM];
+    int fds[SHM_NET_MAX_FDS];
+    int memfd, i, nfds = 0, ret = -1;
+
+    memfd = shm_net_create_mem(link->size);
+    if (memfd < 0) {
+        error_report("shm: %s: cannot create the shared memory: %s",
+                     link->path, strerror(errno));
+        return -1;
+    }
+    fds[nfds++] = memfd;
+    if (shm_net_map(link, memfd) < 0) {
+        error_report("shm: %s: cannot map the shared memory: %s",
+                     link->path, strerror(errno));
+        goto out;
+    }
+    memcpy(link->mem, &link->hdr, sizeof(link->hdr));
+    for (i = 0; i < link->queues; i++) {
+        int ours[2], theirs[2];
+
+        if (qemu_eventfd(ours) < 0) {
+            goto out;
+        }
+        if (qemu_eventfd(theirs) < 0) {
+            close(ours[0]);
+            close(ours[1]);
+            goto out;
+        }
+        doorbell[i] = ours[0];
+        peer_doorbell[i] = theirs[1];
+        fds[nfds++] = theirs[0];        /* the client waits on this one */
+        fds[nfds++] = ours[1];          /* and rings this one */
+    }
+
+    if (shm_net_send_hello(fd, &link->hdr, fds, nfds) < 0) {
+        error_report("shm: %s: handshake failed", link->path);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    /* our copies of what the client got are no longer needed */
+    for (i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+    if (ret < 0) {
+        for (i = 0; i < (nfds - 1) / 2; i++) {
+            close(doorbell[i]);
+            close(peer_doorbell[i]);
+        }
+        if (link->mem) {
+            munmap(link->mem, link->size);
+            link->mem = NULL;
+        }
+        return -1;
+    }
+
+    link->fd = fd;
+    socket_set_nonblock(fd);
+    qemu_set_fd_handler(fd, shm_net_peer_read, NULL, link);
+    shm_net_attach(link, doorbell, peer_doorbell);
+    return 0;
+}
+
+static void shm_net_accept(void *opaque)
+{
+    ShmNetLink *link = opaque;
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+    int fd;
+
+    fd = qemu_accept(link->listen_fd, (struct sockaddr *)&addr, &len);
+    if (fd < 0) {
+        return;
+    }
+
+    /* one peer at a time */
+    if (link->fd >= 0 || shm_net_server_connect(link, fd) < 0) {
+        closesocket(fd);
+    }
+}
+
+static void shm_net_set_size(ShmNetLink *link, uint32_t slots,
+                             uint32_t slot_size)
+{
+    ShmNetHeader *hdr = &link->hdr;
+
+    hdr->magic = SHM_NET_MAGIC;
+    hdr->version = SHM_NET_VERSION;
+    hdr->queues = link->queues;
+    hdr->slots = slots;
+    hdr->slot_size = slot_size;
+    hdr->ring_size = (sizeof(ShmNetRing) + slots * slot_size +
+                      SHM_NET_HDR_SIZE - 1) & ~(SHM_NET_HDR_SIZE - 1);
+    link->size = SHM_NET_HDR_SIZE + 2 * link->queues * hdr->ring_size;
+}
+
+static int shm_net_client_connect(ShmNetLink *link)
+{
+    int doorbell[MAX_QUEUE_NUM], peer_doorbell[MAX_QUEUE_NUM];
+    int fds[SHM_NET_MAX_FDS];
+    ShmNetHeader hdr;
+    struct stat st;
+    int fd, i, nfds;
+
+    fd = unix_connect(link->path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    nfds = shm_net_recv_hello(fd, &hdr, fds);
+    if (nfds < 0) {
+        error_report("shm: %s: handshake failed", link->path);
+        closesocket(fd);
+        return -1;
+    }
+
+    if (nfds != 1 + 2 * link->queues ||
+        hdr.magic != SHM_NET_MAGIC || hdr.version != SHM_NET_VERSION ||
+        hdr.queues != link->queues) {
+        error_report("shm: %s: the server does not use %d queue%s",
+                     link->path, link->queues, link->queues > 1 ? "s" : "");
+        goto fail;
+    }
+    if (hdr.slots < 2 || hdr.slots > SHM_NET_MAX_SLOTS ||
+        (hdr.slots & (hdr.slots - 1)) ||
+        hdr.slot_size < 64 || hdr.slot_size > SHM_NET_SLOT_SIZE * 64 ||
+        (hdr.slot_size & 3)) {
+        error_report("shm: %s: bad ring geometry", link->path);
+        goto fail;
+    }
+
+    shm_net_set_size(link, hdr.slots, hdr.slot_size);
+    if (fstat(fds[0], &st) < 0 || st.st_size < link->size ||
+        shm_net_map(link, fds[0]) < 0) {
+        error_report("shm: %s: cannot map the shared memory", link->path);
+        goto fail;
+    }
+    close(fds[0]);
+
+    for (i = 0; i < link->queues; i++) {
+        doorbell[i] = fds[1 + 2 * i];
+        peer_doorbell[i] = fds[2 + 2 * i];
+    }
+
+    link->fd = fd;
+    socket_set_nonblock(fd);
+    qemu_set_fd_handler(fd, shm_net_peer_read, NULL, link);
+    shm_net_attach(link, doorbell, peer_doorbell);
+    return 0;
+
+fail:
+    for (i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+    closesocket(fd);
+    return -1;
+}
+
+static void shm_net_cleanup(VLANClientState *nc)
+{
+    ShmNetState *s = DO_UPCAST(ShmNetState, nc, nc);
+    ShmNetLink *link = s->link;
+
+    qemu_purge_queued_packets(nc);
+    shm_net_detach(s);
+    link->queue[s->index] = NULL;
+
+    if (--link->refcount > 0) {
+        return;
+    }
+
+    shm_net_disconnect(link);
+    if (link->listen_fd >= 0) {
+        qemu_set_fd_handler(link->listen_fd, NULL, NULL, NULL);
+        closesocket(link->listen_fd);
+        unlink(link->path);
+    }
+    qemu_free(link->path);
+    qemu_free(link);
+}
+
+static NetClientInfo net_shm_info = {
+    .type = NET_CLIENT_TYPE_SHM,
+    .size = sizeof(ShmNetState),
+    .receive = shm_net_receive,
+    .receive_iov = shm_net_receive_iov,
+    .cleanup = shm_net_cleanup,
+};
+
+int net_init_shm(QemuOpts *opts, Monitor *mon, const char *name,
+                 VLANState *vlan)
+{
+    ShmNetState *queue[MAX_QUEUE_NUM];
+    const char *path = qemu_opt_get(opts, "path");
+    int server = qemu_opt_get_bool(opts, "server", 0);
+    uint64_t queues = qemu_opt_get_number(opts, "queues", 1);
+    uint64_t slots = qemu_opt_get_number(opts, "slots",
+                                         SHM_NET_DEFAULT_SLOTS);
+    ShmNetLink *link;
+    int i;
+
+    if (!path) {
+        error_report("shm: path= is required");
+        return -1;
+    }
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("shm: queues must be between 1 and %d", MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (queues > 1 && vlan) {
+        error_report("shm: queues= is only valid with -netdev");
+        return -1;
+    }
+    if (qemu_opt_get(opts, "slots") && !server) {
+        error_report("shm: slots= is only valid with server");
+        return -1;
+    }
+    if (slots < 2 || slots > SHM_NET_MAX_SLOTS || (slots & (slots - 1))) {
+        error_report("shm: slots must be a power of two between 2 and %d",
+                     SHM_NET_MAX_SLOTS);
+        return -1;
+    }
+
+    link = qemu_mallocz(sizeof(*link));
+    link->path = qemu_strdup(path);
+    link->server = server;
+    link->queues = queues;
+    link->listen_fd = -1;
+    link->fd = -1;
+
+    for (i = 0; i < queues; i++) {
+        VLANClientState *nc;
+        ShmNetState *s;
+
+        nc = qemu_new_net_client(&net_shm_info, vlan, NULL, "shm", name);
+        s = DO_UPCAST(ShmNetState, nc, nc);
+        s->link = link;
+        s->index = i;
+        s->doorbell = s->peer_doorbell = -1;
+        shm_net_update_info(s);
+        link->queue[i] = queue[i] = s;
+        link->refcount++;
+    }
+
+    if (server) {
+        shm_net_set_size(link, slots, SHM_NET_SLOT_SIZE);
+        link->listen_fd = unix_listen(path, NULL, 0);
+        if (link->listen_fd < 0) {
+            goto fail;
+        }
+        qemu_set_fd_handler(link->listen_fd, shm_net_accept, NULL, link);
+    } else if (shm_net_client_connect(link) < 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    /* the last one frees the link */
+    for (i = 0; i < queues; i++) {
+        qemu_del_vlan_client(&queue[i]->nc);
+    }
+    return -1;
+}
@@ -37,7 +37,8 @@
 #include <util.h>
 #endif
 
-int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required)
+int tap_open(char *ifname, int ifname_size, int *vnet_hdr,
+             int vnet_hdr_required, int mq_required)
 {
     int fd;
     char *dev;
@@ -97,6 +98,14 @@ int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required
             return -1;
         }
     }
+
+    if (mq_required) {
+        /* BSD doesn't have IFF_MULTI_QUEUE */
+        error_report("multiqueue required, but no kernel "
+                     "support for IFF_MULTI_QUEUE available");
+        close(fd);
+        return -1;
+    }
     fcntl(fd, F_SETFL, O_NONBLOCK);
     return fd;
 }
@@ -129,3 +138,13 @@ void tap_fd_set_offload(int fd, int csum, int tso4,
                         int tso6, int ecn, int ufo)
 {
 }
+
+int tap_fd_enable(int fd)
+{
+    return -1;
+}
+
+int tap_fd_disable(int fd)
+{
+    return -1;
+}
@@ -35,7 +35,8 @@
 
 #define PATH_NET_TUN "/dev/net/tun"
 
-int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required)
+int tap_open(char *ifname, int ifname_size, int *vnet_hdr,
+             int vnet_hdr_required, int mq_required)
 {
     struct ifreq ifr;
     int fd, ret;
@@ -67,6 +68,19 @@ int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required
         }
     }
 
+    if (mq_required) {
+        unsigned int features;
+
+        if (ioctl(fd, TUNGETFEATURES, &features) != 0 ||
+            !(features & IFF_MULTI_QUEUE)) {
+            error_report("multiqueue required, but no kernel "
+                         "support for IFF_MULTI_QUEUE available");
+            close(fd);
+            return -1;
+        }
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+
     if (ifname[0] != '\0')
         pstrcpy(ifr.ifr_name, IFNAMSIZ, ifname);
     else
@@ -188,3 +202,29 @@ void tap_fd_set_offload(int fd, int csum, int tso4,
         }
     }
 }
+
+/* Attach or detach a queue of a multiqueue tap device, so that the
+ * kernel stops steering packets to queues the guest is not using.
+ */
+static int tap_fd_set_queue(int fd, int flags)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = flags;
+    if (ioctl(fd, TUNSETQUEUE, (void *) &ifr) != 0) {
+        error_report("TUNSETQUEUE ioctl() failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int tap_fd_enable(int fd)
+{
+    return tap_fd_set_queue(fd, IFF_ATTACH_QUEUE);
+}
+
+int tap_fd_disable(int fd)
+{
+    return tap_fd_set_queue(fd, IFF_DETACH_QUEUE);
+}
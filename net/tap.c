@@ -49,16 +49,25 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Number of frames read from the tap fd before they are handed to the
+ * peer as one burst; see tap_send()
+ */
+#define TAP_RX_BATCH 16
+
 typedef struct TAPState {
     VLANClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[TAP_BUFSIZE];
+    uint8_t *rx_ring;                 /* TAP_RX_BATCH * TAP_BUFSIZE */
+    int rx_len[TAP_RX_BATCH];
+    int rx_count;                     /* frames read into rx_ring */
+    int rx_next;                      /* next frame to deliver */
     unsigned int read_poll : 1;
     unsigned int write_poll : 1;
     unsigned int using_vnet_hdr : 1;
     unsigned int has_ufo: 1;
+    unsigned int enabled : 1;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
 } TAPState;
@@ -71,9 +80,11 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    int read_poll = s->read_poll && s->enabled;
+
     qemu_set_fd_handler2(s->fd,
-                         s->read_poll  ? tap_can_send : NULL,
-                         s->read_poll  ? tap_send     : NULL,
+                         read_poll     ? tap_can_send : NULL,
+                         read_poll     ? tap_send     : NULL,
                          s->write_poll ? tap_writable : NULL,
                          s);
 }
@@ -183,35 +194,75 @@ ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
 }
 #endif
 
+static void tap_send_completed(VLANClientState *nc, ssize_t len);
+
+/* Hand the frames still waiting in the rx ring to the peer, in order.
+ * If the peer queues one of them, stop there and stop reading from the
+ * fd; tap_send_completed picks up with the rest of the ring.  Returns
+ * true if the ring was emptied.
+ */
+static bool tap_flush_rx(TAPState *s)
+{
+    bool done = true;
+
+    qemu_send_batch_begin(&s->nc);
+    while (s->rx_next < s->rx_count) {
+        uint8_t *buf = s->rx_ring + s->rx_next * TAP_BUFSIZE;
+        int size = s->rx_len[s->rx_next++];
+
+        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+            buf  += s->host_vnet_hdr_len;
+            size -= s->host_vnet_hdr_len;
+        }
+
+        if (qemu_send_packet_async(&s->nc, buf, size,
+                                   tap_send_completed) == 0) {
+            tap_read_poll(s, 0);
+            done = false;
+            break;
+        }
+    }
+    qemu_send_batch_end(&s->nc);
+
+    return done;
+}
+
 static void tap_send_completed(VLANClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
-    tap_read_poll(s, 1);
+
+    if (tap_flush_rx(s)) {
+        tap_read_poll(s, 1);
+    }
 }
 
+/* Read up to TAP_RX_BATCH frames before delivering any, so that the
+ * peer sees them as one burst and can e.g. raise a single interrupt for
+ * all of them.
+ */
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
 
     do {
-        uint8_t *buf = s->buf;
-
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
+        s->rx_count = s->rx_next = 0;
+        while (s->rx_count < TAP_RX_BATCH) {
+            int size = tap_read_packet(s->fd,
+                                       s->rx_ring + s->rx_count * TAP_BUFSIZE,
+                                       TAP_BUFSIZE);
+            if (size <= 0) {
+                break;
+            }
+            s->rx_len[s->rx_count++] = size;
         }
-
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+        if (s->rx_count == 0) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, 0);
+        if (!tap_flush_rx(s)) {
+            return;
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (s->rx_count == TAP_RX_BATCH && qemu_can_send_packet(&s->nc));
 }
 
 int tap_has_ufo(VLANClientState *nc)
@@ -294,6 +345,9 @@ static void tap_cleanup(VLANClientState *nc)
     tap_write_poll(s, 0);
     close(s->fd);
     s->fd = -1;
+
+    qemu_free(s->rx_ring);
+    s->rx_ring = NULL;
 }
 
 static void tap_poll(VLANClientState *nc, bool enable)
@@ -310,6 +364,41 @@ int tap_get_fd(VLANClientState *nc)
     return s->fd;
 }
 
+/* Queues of a multiqueue tap that the guest does not use are detached,
+ * so that the kernel does not steer packets to them.
+ */
+int tap_enable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+    if (s->enabled) {
+        return 0;
+    }
+    if (tap_fd_enable(s->fd) < 0) {
+        return -1;
+    }
+    s->enabled = 1;
+    tap_update_fd_handler(s);
+    return 0;
+}
+
+int tap_disable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+    if (!s->enabled) {
+        return 0;
+    }
+    if (tap_fd_disable(s->fd) < 0) {
+        return -1;
+    }
+    s->enabled = 0;
+    tap_update_fd_handler(s);
+    return 0;
+}
+
 /* fd support */
 
 static NetClientInfo net_tap_info = {
@@ -336,6 +425,8 @@ static TAPState *net_tap_fd_init(VLANState *vlan,
     s = DO_UPCAST(TAPState, nc, nc);
 
     s->fd = fd;
+    s->enabled = 1;
+    s->rx_ring = qemu_malloc(TAP_RX_BATCH * TAP_BUFSIZE);
     s->host_vnet_hdr_len = vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
     s->using_vnet_hdr = 0;
     s->has_ufo = tap_probe_has_ufo(s->fd);
@@ -389,7 +480,7 @@ static int launch_script(const char *setup_script, const char *ifname, int fd)
     return -1;
 }
 
-static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
+static int net_tap_init(QemuOpts *opts, int *vnet_hdr, int queue, int mq)
 {
     int fd, vnet_hdr_required;
     char ifname[128] = {0,};
@@ -406,11 +497,18 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required,
+                      mq));
     if (fd < 0) {
         return -1;
     }
 
+    /* The other queues attach to the interface created for queue 0,
+     * which has already been set up.  */
+    if (queue > 0) {
+        return fd;
+    }
+
     setup_script = qemu_opt_get(opts, "script");
     if (setup_script &&
         setup_script[0] != '\0' &&
@@ -425,42 +523,10 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
     return fd;
 }
 
-int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+static int net_init_tap_one(QemuOpts *opts, Monitor *mon, const char *name,
+                            VLANState *vlan, int fd, int vnet_hdr, int queue)
 {
     TAPState *s;
-    int fd, vnet_hdr = 0;
-
-    if (qemu_opt_get(opts, "fd")) {
-        if (qemu_opt_get(opts, "ifname") ||
-            qemu_opt_get(opts, "script") ||
-            qemu_opt_get(opts, "downscript") ||
-            qemu_opt_get(opts, "vnet_hdr")) {
-            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
-            return -1;
-        }
-
-        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
-        if (fd == -1) {
-            return -1;
-        }
-
-        fcntl(fd, F_SETFL, O_NONBLOCK);
-
-        vnet_hdr = tap_probe_vnet_hdr(fd);
-    } else {
-        if (!qemu_opt_get(opts, "script")) {
-            qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
-        }
-
-        if (!qemu_opt_get(opts, "downscript")) {
-            qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
-        }
-
-        fd = net_tap_init(opts, &vnet_hdr);
-        if (fd == -1) {
-            return -1;
-        }
-    }
 
     s = net_tap_fd_init(vlan, "tap", name, fd, vnet_hdr);
     if (!s) {
@@ -484,8 +550,15 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
         snprintf(s->nc.info_str, sizeof(s->nc.info_str),
                  "ifname=%s,script=%s,downscript=%s",
                  ifname, script, downscript);
+        if (qemu_opt_get_number(opts, "queues", 1) > 1) {
+            size_t len = strlen(s->nc.info_str);
 
-        if (strcmp(downscript, "no") != 0) {
+            snprintf(s->nc.info_str + len, sizeof(s->nc.info_str) - len,
+                     ",queue=%d", queue);
+        }
+
+        /* The interface is set up and torn down once, by queue 0 */
+        if (queue == 0 && strcmp(downscript, "no") != 0) {
             snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
             snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
         }
@@ -515,6 +588,70 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
     return 0;
 }
 
+int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+{
+    int fd, vnet_hdr = 0, queues, i;
+
+    queues = qemu_opt_get_number(opts, "queues", 1);
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("queues= must be between 1 and %d", MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (queues > 1 && vlan) {
+        error_report("queues= is only valid with -netdev");
+        return -1;
+    }
+
+    if (qemu_opt_get(opts, "fd")) {
+        if (qemu_opt_get(opts, "ifname") ||
+            qemu_opt_get(opts, "script") ||
+            qemu_opt_get(opts, "downscript") ||
+            qemu_opt_get(opts, "vnet_hdr") ||
+            qemu_opt_get(opts, "queues")) {
+            error_report("ifname=, script=, downscript=, vnet_hdr= and queues= is invalid with fd=");
+            return -1;
+        }
+
+        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
+        if (fd == -1) {
+            return -1;
+        }
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        vnet_hdr = tap_probe_vnet_hdr(fd);
+
+        return net_init_tap_one(opts, mon, name, vlan, fd, vnet_hdr, 0);
+    }
+
+    if (queues > 1 && qemu_opt_get(opts, "vhostfd")) {
+        error_report("vhostfd= is invalid with queues=");
+        return -1;
+    }
+
+    if (!qemu_opt_get(opts, "script")) {
+        qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
+    }
+
+    if (!qemu_opt_get(opts, "downscript")) {
+        qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
+    }
+
+    /* Every queue is a separate fd on the same interface, and a separate
+     * client sharing the netdev name; the NIC picks them up in order.  */
+    for (i = 0; i < queues; i++) {
+        fd = net_tap_init(opts, &vnet_hdr, i, queues > 1);
+        if (fd == -1) {
+            return -1;
+        }
+        if (net_init_tap_one(opts, mon, name, vlan, fd, vnet_hdr, i) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 VHostNetState *tap_get_vhost_net(VLANClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
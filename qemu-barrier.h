@@ -3,6 +3,9 @@
 
 /* FIXME: arch dependant, x86 version */
 #define smp_wmb()   asm volatile("" ::: "memory")
+#define smp_rmb()   asm volatile("" ::: "memory")
+/* stores may pass later loads even on x86 */
+#define smp_mb()    __sync_synchronize()
 
 /* Compiler barrier */
 #define barrier()   asm volatile("" ::: "memory")
@@ -1079,7 +1079,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' and use the\n"
     "                network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1091,12 +1091,20 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                use vnet_hdr=on to make the lack of IFF_VNET_HDR support an error condition\n"
     "                use vhost=on to enable experimental in kernel accelerator\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to open 'n' queues of a multiqueue TAP interface\n"
+    "                (-netdev only)\n"
 #endif
     "-net socket[,vlan=n][,name=str][,fd=h][,listen=[host]:port][,connect=host:port]\n"
     "                connect the vlan 'n' to another VLAN using a socket connection\n"
     "-net socket[,vlan=n][,name=str][,fd=h][,mcast=maddr:port[,localaddr=addr]]\n"
     "                connect the vlan 'n' to multicast maddr and port\n"
     "                use 'localaddr=addr' to specify the host address to send packets from\n"
+#ifndef _WIN32
+    "-net shm[,vlan=n][,name=str],path=socketpath[,server][,slots=n][,queues=n]\n"
+    "                connect the vlan 'n' to another QEMU on the same host through\n"
+    "                shared memory; the side with 'server' listens on 'socketpath'\n"
+    "                and sets the ring size 'slots' (default 1024)\n"
+#endif
 #ifdef CONFIG_VDE
     "-net vde[,vlan=n][,name=str][,sock=socketpath][,port=n][,group=groupname][,mode=octalmode]\n"
     "                connect the vlan 'n' to port 'n' of a vde switch running\n"
@@ -1106,6 +1114,9 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
+    "                the user, tap, socket, shm and vde backends also accept\n"
+    "                '[,queue_len=n][,queue_policy=drop|block]' to limit how many\n"
+    "                packets may wait for them (default 1000)\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
     "                is provided, the default is '-net nic -net user'\n", QEMU_ARCH_ALL)
 DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
@@ -1114,6 +1125,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "user|"
 #endif
     "tap|"
+#ifndef _WIN32
+    "shm|"
+#endif
 #ifdef CONFIG_VDE
     "vde|"
 #endif
@@ -1270,6 +1284,17 @@ qemu linux.img -net nic,vlan=0 -net tap,vlan=0,ifname=tap0 \
                -net nic,vlan=1 -net tap,vlan=1,ifname=tap1
 @end example
 
+With @option{-netdev}, @option{queues}=@var{n} opens @var{n} queues of a
+multiqueue TAP interface.  A virtio-net device connected to it gets one
+receive/transmit virtqueue pair, one MSI-X vector per virtqueue and, with
+@option{vhost=on}, one vhost-net instance per queue; the guest selects
+how many pairs to use.  Example:
+
+@example
+qemu linux.img -netdev tap,id=net0,queues=4,vhost=on \
+               -device virtio-net-pci,netdev=net0
+@end example
+
 @item -net socket[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}] [,listen=[@var{host}]:@var{port}][,connect=@var{host}:@var{port}]
 
 Connect the VLAN @var{n} to a remote VLAN in another QEMU virtual
@@ -1336,6 +1361,30 @@ qemu linux.img -net nic,macaddr=52:54:00:12:34:56 \
                -net socket,mcast=239.192.168.1:1102,localaddr=1.2.3.4
 @end example
 
+@item -net shm[,vlan=@var{n}][,name=@var{name}],path=@var{socketpath}[,server][,slots=@var{n}][,queues=@var{n}]
+Connect VLAN @var{n} to a VLAN of another QEMU process on the same host.
+Frames go through rings in memory shared by the two processes, so a
+busy link needs no system call per frame.  One side is started with
+@option{server} and listens on the unix socket @var{socketpath}; the
+other side connects to it, and the socket is then used to hand over the
+shared memory and to notice when either side exits.  When the client
+goes away the server waits for a new one.  @option{slots} sets how many
+frames each ring holds (a power of two, 1024 by default) and is only
+given to the server.  Frames larger than 2044 bytes are dropped.
+
+With @option{-netdev}, @option{queues} opens @var{n} pairs of rings for
+a multiqueue NIC; both sides must use the same number.
+
+Example:
+@example
+# first instance
+qemu linux.img -netdev shm,id=net0,path=/tmp/vmnet,server \
+               -device virtio-net-pci,netdev=net0
+# second instance
+qemu linux.img -netdev shm,id=net0,path=/tmp/vmnet \
+               -device virtio-net-pci,netdev=net0,mac=52:54:00:12:34:57
+@end example
+
 @item -net vde[,vlan=@var{n}][,name=@var{name}][,sock=@var{socketpath}] [,port=@var{n}][,group=@var{groupname}][,mode=@var{octalmode}]
 Connect VLAN @var{n} to PORT @var{n} of a vde switch running on host and
 listening for incoming connections on @var{socketpath}. Use GROUP @var{groupname}
@@ -1362,6 +1411,19 @@ override the default configuration (@option{-net nic -net user}) which
 is activated if no @option{-net} options are provided.
 
 @end table
+
+Packets that a network client cannot take right away wait in a queue.
+The @option{user}, @option{tap}, @option{socket}, @option{shm} and
+@option{vde} backends accept @option{queue_len=@var{n}} to limit that queue to
+@var{n} packets (1000 by default), and
+@option{queue_policy=drop|block} to choose what happens once it is full.
+With @code{drop}, further packets are dropped; with @code{block}, they
+are dropped too, but backends that read from the host also stop reading
+until the queue drains, leaving the packets in the host's buffers.
+With @option{-netdev} the limit also applies to the packets queued for
+the guest NIC attached to the backend; with @option{-net} it applies to
+the whole VLAN.  @code{info network} shows how full each queue is, and
+how many packets were queued and dropped.
 ETEXI
 
 DEFHEADING()
@@ -2250,6 +2312,75 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-max-size", HAS_ARG, QEMU_OPTION_tb_max_size, \
+    "-tb-max-size n  let the TB cache grow up to n MB\n", QEMU_ARCH_ALL)
+STEXI
+@item -tb-max-size @var{n}
+@findex -tb-max-size
+Let the translation buffer grow up to @var{n} MB.  When the buffer is
+full, the oldest part of the translated code is evicted; if much of the
+code translated since then is code that had been evicted before, the
+buffer grows instead, up to this limit.  By default the buffer keeps
+the size given with @option{-tb-size}.
+ETEXI
+
+DEF("tb-hot-threshold", HAS_ARG, QEMU_OPTION_tb_hot_threshold, \
+    "-tb-hot-threshold n\n"
+    "                retranslate blocks executed n times as traces\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-hot-threshold @var{n}
+@findex -tb-hot-threshold
+Count the executions of each translated block and retranslate a block
+as a trace once it has run @var{n} times.  A trace follows forward
+direct branches inside its page instead of ending at them, so guest
+registers stay in host registers across those branches.  0 (the default)
+disables trace formation.
+ETEXI
+
+DEF("pin-globals", HAS_ARG, QEMU_OPTION_pin_globals, \
+    "-pin-globals name[,name...]\n"
+    "                keep the named TCG globals in host registers between TBs\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -pin-globals @var{name}[,@var{name}...]
+@findex -pin-globals
+Keep the named TCG globals (e.g. @code{r0,r1,pc} for ARM or
+@code{rax,rcx,rdx} for x86_64) in callee saved host registers while
+translated code runs, instead of reloading them from the CPU state at the
+start of each translated block.  They are written back only around helper
+calls and when returning to the main loop.  Only supported on x86_64
+hosts, with at most four globals.
+ETEXI
+
+DEF("timer-slack", HAS_ARG, QEMU_OPTION_timer_slack, \
+    "-timer-slack us let timers fire up to us microseconds late\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -timer-slack @var{us}
+@findex -timer-slack
+Allow emulated timers to fire up to @var{us} microseconds after their
+deadline.  Timers whose deadlines fall within this window of each other
+are then run from a single host wakeup, which reduces the number of
+times an idle guest wakes up the host.  @code{info timers} in the
+monitor shows the resulting host wakeups per second.  The default is 0.
+ETEXI
+
+DEF("main-loop", HAS_ARG, QEMU_OPTION_main_loop, \
+    "-main-loop backend\n"
+    "                wait for I/O events with 'epoll' or 'select'\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -main-loop @var{backend}
+@findex -main-loop
+Select how the main loop waits for file descriptors.  @option{epoll}
+keeps the descriptors registered with the kernel and only looks at the
+ones that are ready, so its cost does not grow with the number of
+network, character and block descriptors.  @option{select} rebuilds the
+descriptor sets on every iteration.  The default is @option{epoll} where
+the host supports it.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
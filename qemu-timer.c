@@ -42,6 +42,10 @@
 #ifdef __linux__
 #include <sys/ioctl.h>
 #include <linux/rtc.h>
+#include <sys/prctl.h>
+#ifdef CONFIG_TIMERFD
+#include <sys/timerfd.h>
+#endif
 /* For the benefit of older linux systems which don't supply it,
    we use a local copy of hpet.h. */
 /* #include <linux/hpet.h> */
@@ -157,15 +161,36 @@ void cpu_disable_ticks(void)
 struct QEMUClock {
     int type;
     int enabled;
+    /* pending timers, as a binary min-heap on expire_time (1-based) */
+    QEMUTimer **heap;
+    int nb_pending;
+    int heap_size;
+    /* how late a timer may fire, unless it sets its own slack */
+    int64_t slack;
     /* XXX: add frequency */
 };
 
+/* Timers are accounted to the callback they run, for "info timers" */
+typedef struct QEMUTimerOwner {
+    const char *name;
+    int clock_type;
+    int nb_timers;
+    uint64_t nb_mods;
+    uint64_t nb_fires;
+    uint64_t last_mods;
+    uint64_t last_fires;
+    struct QEMUTimerOwner *next;
+} QEMUTimerOwner;
+
 struct QEMUTimer {
     QEMUClock *clock;
     int64_t expire_time;
     QEMUTimerCB *cb;
     void *opaque;
-    struct QEMUTimer *next;
+    int heap_pos; /* 0 if not pending */
+    int has_slack;
+    int64_t slack;
+    QEMUTimerOwner *owner;
 };
 
 struct qemu_alarm_timer {
@@ -224,6 +249,13 @@ static int dynticks_start_timer(struct qemu_alarm_timer *t);
 static void dynticks_stop_timer(struct qemu_alarm_timer *t);
 static void dynticks_rearm_timer(struct qemu_alarm_timer *t);
 
+#if defined(CONFIG_TIMERFD) && defined(CONFIG_IOTHREAD)
+#define USE_TIMERFD_ALARM
+static int timerfd_start_timer(struct qemu_alarm_timer *t);
+static void timerfd_stop_timer(struct qemu_alarm_timer *t);
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t);
+#endif
+
 static int hpet_start_timer(struct qemu_alarm_timer *t);
 static void hpet_stop_timer(struct qemu_alarm_timer *t);
 
@@ -292,6 +324,11 @@ int64_t qemu_icount_round(int64_t count)
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
 #ifdef __linux__
+#ifdef USE_TIMERFD_ALARM
+    /* no signal needed when the CPUs do not run in the I/O thread */
+    {"timerfd", timerfd_start_timer,
+     timerfd_stop_timer, timerfd_rearm_timer, NULL},
+#endif
     {"dynticks", dynticks_start_timer,
      dynticks_stop_timer, dynticks_rearm_timer, NULL},
     /* HPET - if available - is preferred */
@@ -379,8 +416,18 @@ QEMUClock *rt_clock;
 QEMUClock *vm_clock;
 QEMUClock *host_clock;
 
+/* Earliest pending timer of each clock.  This mirrors the top of the
+   clock's heap so that the signal handler never looks at the heap array,
+   which may be reallocated under it.  */
 static QEMUTimer *active_timers[QEMU_NUM_CLOCKS];
 
+static QEMUTimerOwner *timer_owners;
+static int64_t timer_stats_time;
+
+/* host wakeups of the main loop, by the alarm and by other events */
+static uint64_t alarm_wakeups, last_alarm_wakeups;
+static uint64_t main_loop_wakeups, last_main_loop_wakeups;
+
 static QEMUClock *qemu_new_clock(int type)
 {
     QEMUClock *clock;
@@ -395,7 +442,51 @@ void qemu_clock_enable(QEMUClock *clock, int enabled)
     clock->enabled = enabled;
 }
 
-QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
+void qemu_timer_set_slack(QEMUTimer *ts, int64_t slack)
+{
+    ts->has_slack = 1;
+    ts->slack = slack;
+}
+
+void configure_timer_slack(int64_t slack_ns)
+{
+    rt_clock->slack = slack_ns / 1000000;
+    vm_clock->slack = slack_ns;
+    host_clock->slack = slack_ns;
+#ifdef __linux__
+    /* let the kernel coalesce our own sleeps the same way */
+    if (slack_ns > 0) {
+        prctl(PR_SET_TIMERSLACK, (unsigned long)slack_ns, 0, 0, 0);
+    }
+#endif
+}
+
+static QEMUTimerOwner *qemu_timer_owner(QEMUClock *clock, const char *name)
+{
+    QEMUTimerOwner *o;
+
+    /* the name is the callback expression; drop casts and '&' */
+    if (*name == '(' && strchr(name, ')')) {
+        name = strchr(name, ')') + 1;
+    }
+    while (*name == ' ' || *name == '&') {
+        name++;
+    }
+    for (o = timer_owners; o != NULL; o = o->next) {
+        if (o->clock_type == clock->type && !strcmp(o->name, name)) {
+            return o;
+        }
+    }
+    o = qemu_mallocz(sizeof(QEMUTimerOwner));
+    o->name = name;
+    o->clock_type = clock->type;
+    o->next = timer_owners;
+    timer_owners = o;
+    return o;
+}
+
+QEMUTimer *qemu_new_timer_named(QEMUClock *clock, QEMUTimerCB *cb,
+                                void *opaque, const char *name)
 {
     QEMUTimer *ts;
 
@@ -403,31 +494,84 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
     ts->clock = clock;
     ts->cb = cb;
     ts->opaque = opaque;
+    ts->owner = qemu_timer_owner(clock, name);
+    ts->owner->nb_timers++;
     return ts;
 }
 
 void qemu_free_timer(QEMUTimer *ts)
 {
+    qemu_del_timer(ts);
+    ts->owner->nb_timers--;
     qemu_free(ts);
 }
 
-/* stop a timer, but do not dealloc it */
-void qemu_del_timer(QEMUTimer *ts)
+static inline void timer_heap_set(QEMUTimer **heap, int pos, QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    heap[pos] = ts;
+    ts->heap_pos = pos;
+}
 
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
+static void timer_heap_up(QEMUTimer **heap, int pos)
+{
+    QEMUTimer *ts = heap[pos];
+
+    while (pos > 1 && heap[pos >> 1]->expire_time > ts->expire_time) {
+        timer_heap_set(heap, pos, heap[pos >> 1]);
+        pos >>= 1;
+    }
+    timer_heap_set(heap, pos, ts);
+}
+
+static void timer_heap_down(QEMUTimer **heap, int n, int pos)
+{
+    QEMUTimer *ts = heap[pos];
+    int child;
+
+    for (;;) {
+        child = pos << 1;
+        if (child > n) {
             break;
-        if (t == ts) {
-            *pt = t->next;
+        }
+        if (child < n &&
+            heap[child + 1]->expire_time < heap[child]->expire_time) {
+            child++;
+        }
+        if (heap[child]->expire_time >= ts->expire_time) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(heap, pos, heap[child]);
+        pos = child;
+    }
+    timer_heap_set(heap, pos, ts);
+}
+
+static void timer_heap_remove(QEMUClock *clock, QEMUTimer *ts)
+{
+    QEMUTimer **heap = clock->heap;
+    QEMUTimer *last;
+    int pos = ts->heap_pos;
+
+    last = heap[clock->nb_pending--];
+    ts->heap_pos = 0;
+    if (last != ts) {
+        timer_heap_set(heap, pos, last);
+        if (pos > 1 && heap[pos >> 1]->expire_time > last->expire_time) {
+            timer_heap_up(heap, pos);
+        } else {
+            timer_heap_down(heap, clock->nb_pending, pos);
+        }
+    }
+    active_timers[clock->type] = clock->nb_pending ? heap[1] : NULL;
+}
+
+/* stop a timer, but do not dealloc it */
+void qemu_del_timer(QEMUTimer *ts)
+{
+    /* NOTE: active_timers[] must stay consistent because
+       qemu_timer_expired() can be called from a signal. */
+    if (ts->heap_pos) {
+        timer_heap_remove(ts->clock, ts);
     }
 }
 
@@ -435,28 +579,35 @@ void qemu_del_timer(QEMUTimer *ts)
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    qemu_del_timer(ts);
-
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t->expire_time > expire_time)
-            break;
-        pt = &t->next;
+    QEMUClock *clock = ts->clock;
+    QEMUTimer **heap;
+    int pos;
+
+    ts->owner->nb_mods++;
+    if (ts->heap_pos) {
+        /* move the timer in place rather than removing and adding it */
+        pos = ts->heap_pos;
+        ts->expire_time = expire_time;
+        timer_heap_up(clock->heap, pos);
+        if (ts->heap_pos == pos) {
+            timer_heap_down(clock->heap, clock->nb_pending, pos);
+        }
+    } else {
+        if (clock->nb_pending + 1 >= clock->heap_size) {
+            clock->heap_size = clock->heap_size ? clock->heap_size * 2 : 64;
+            clock->heap = qemu_realloc(clock->heap,
+                                       clock->heap_size * sizeof(QEMUTimer *));
+        }
+        ts->expire_time = expire_time;
+        pos = ++clock->nb_pending;
+        clock->heap[pos] = ts;
+        timer_heap_up(clock->heap, pos);
     }
-    ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    heap = clock->heap;
+    active_timers[clock->type] = heap[1];
 
     /* Rearm if necessary  */
-    if (pt == &active_timers[ts->clock->type]) {
+    if (heap[1] == ts) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -468,12 +619,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 int qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for(t = active_timers[ts->clock->type]; t != NULL; t = t->next) {
-        if (t == ts)
-            return 1;
-    }
-    return 0;
+    return ts->heap_pos != 0;
 }
 
 int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -485,27 +631,129 @@ int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
 
 static void qemu_run_timers(QEMUClock *clock)
 {
-    QEMUTimer **ptimer_head, *ts;
+    QEMUTimer *ts;
     int64_t current_time;
    
     if (!clock->enabled)
         return;
 
     current_time = qemu_get_clock (clock);
-    ptimer_head = &active_timers[clock->type];
     for(;;) {
-        ts = *ptimer_head;
+        ts = active_timers[clock->type];
         if (!ts || ts->expire_time > current_time)
             break;
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        timer_heap_remove(clock, ts);
+        ts->owner->nb_fires++;
 
-        /* run the callback (the timer list can be modified) */
+        /* run the callback (the timers can be modified) */
         ts->cb(ts->opaque);
     }
 }
 
+static int64_t timer_heap_deadline(QEMUClock *clock, int pos, int64_t best)
+{
+    QEMUTimer *ts;
+    int64_t slack;
+
+    if (pos > clock->nb_pending) {
+        return best;
+    }
+    ts = clock->heap[pos];
+    /* nothing below this node expires before the current candidate */
+    if (ts->expire_time >= best) {
+        return best;
+    }
+    slack = ts->has_slack ? ts->slack : clock->slack;
+    if (slack <= 0) {
+        return ts->expire_time;
+    }
+    if (ts->expire_time < INT64_MAX - slack &&
+        ts->expire_time + slack < best) {
+        best = ts->expire_time + slack;
+    }
+    best = timer_heap_deadline(clock, pos * 2, best);
+    return timer_heap_deadline(clock, pos * 2 + 1, best);
+}
+
+/* The latest time at which the clock's timers can be run without making
+   any of them later than its slack allows; every timer that expired by
+   then runs in the same wakeup.  INT64_MAX if no timer is pending.  */
+static int64_t qemu_clock_deadline(QEMUClock *clock)
+{
+    if (!clock->nb_pending) {
+        return INT64_MAX;
+    }
+    if (!clock->slack && !clock->heap[1]->has_slack) {
+        return clock->heap[1]->expire_time;
+    }
+    return timer_heap_deadline(clock, 1, INT64_MAX);
+}
+
+static const char *timer_clock_name(int type)
+{
+    switch (type) {
+    case QEMU_CLOCK_REALTIME:
+        return "rt";
+    case QEMU_CLOCK_VIRTUAL:
+        return "vm";
+    default:
+        return "host";
+    }
+}
+
+void do_info_timers(Monitor *mon)
+{
+    QEMUClock *clocks[QEMU_NUM_CLOCKS] = { rt_clock, vm_clock, host_clock };
+    QEMUTimerOwner *o;
+    int64_t now, delta;
+    int i, j, pending;
+
+    now = get_clock();
+    delta = now - timer_stats_time;
+    if (delta <= 0) {
+        delta = 1;
+    }
+
+    monitor_printf(mon, "alarm timer %s: %.1f host wakeups/s "
+                   "(%.1f by the alarm, %.1f by other events)\n",
+                   alarm_timer->name,
+                   (alarm_wakeups - last_alarm_wakeups +
+                    main_loop_wakeups - last_main_loop_wakeups) * 1e9 / delta,
+                   (alarm_wakeups - last_alarm_wakeups) * 1e9 / delta,
+                   (main_loop_wakeups - last_main_loop_wakeups) * 1e9 / delta);
+    last_alarm_wakeups = alarm_wakeups;
+    last_main_loop_wakeups = main_loop_wakeups;
+    for (i = 0; i < QEMU_NUM_CLOCKS; i++) {
+        monitor_printf(mon, "%-4s clock: %d pending, heap size %d, "
+                       "slack %" PRId64 "\n",
+                       timer_clock_name(i), clocks[i]->nb_pending,
+                       clocks[i]->heap_size, clocks[i]->slack);
+    }
+    monitor_printf(mon, "%-32s %-4s %6s %7s %10s %10s\n", "owner", "clk",
+                   "timers", "pending", "mods/s", "fires/s");
+    for (o = timer_owners; o != NULL; o = o->next) {
+        if (!o->nb_timers && o->nb_mods == o->last_mods) {
+            continue;
+        }
+        pending = 0;
+        for (j = 1; j <= clocks[o->clock_type]->nb_pending; j++) {
+            if (clocks[o->clock_type]->heap[j]->owner == o) {
+                pending++;
+            }
+        }
+        monitor_printf(mon, "%-32s %-4s %6d %7d %10.1f %10.1f\n",
+                       o->name, timer_clock_name(o->clock_type),
+                       o->nb_timers, pending,
+                       (o->nb_mods - o->last_mods) * 1e9 / delta,
+                       (o->nb_fires - o->last_fires) * 1e9 / delta);
+        o->last_mods = o->nb_mods;
+        o->last_fires = o->nb_fires;
+    }
+    monitor_printf(mon, "(rates over the last %.1f s)\n", delta / 1e9);
+    timer_stats_time = now;
+}
+
 int64_t qemu_get_clock(QEMUClock *clock)
 {
     switch(clock->type) {
@@ -547,6 +795,7 @@ void init_clocks(void)
     host_clock = qemu_new_clock(QEMU_CLOCK_HOST);
 
     rtc_clock = host_clock;
+    timer_stats_time = get_clock();
 }
 
 /* save a timer */
@@ -618,6 +867,18 @@ void configure_icount(const char *option)
                    qemu_get_clock(vm_clock) + get_ticks_per_sec() / 10);
 }
 
+/* Called once each time the main loop wakes up from a blocking wait.
+   The alarm only makes it pending, so a wakeup is counted once whether
+   the signal came directly or through the I/O thread's signalfd.  */
+void qemu_account_wakeup(void)
+{
+    if (alarm_timer->pending) {
+        alarm_wakeups++;
+    } else {
+        main_loop_wakeups++;
+    }
+}
+
 void qemu_run_all_timers(void)
 {
     alarm_timer->pending = 0;
@@ -699,11 +960,10 @@ int64_t qemu_next_deadline(void)
     int64_t delta = INT32_MAX;
 
     if (active_timers[QEMU_CLOCK_VIRTUAL]) {
-        delta = active_timers[QEMU_CLOCK_VIRTUAL]->expire_time -
-                     qemu_get_clock(vm_clock);
+        delta = qemu_clock_deadline(vm_clock) - qemu_get_clock(vm_clock);
     }
     if (active_timers[QEMU_CLOCK_HOST]) {
-        int64_t hdelta = active_timers[QEMU_CLOCK_HOST]->expire_time -
+        int64_t hdelta = qemu_clock_deadline(host_clock) -
                  qemu_get_clock(host_clock);
         if (hdelta < delta)
             delta = hdelta;
@@ -732,7 +992,7 @@ static uint64_t qemu_next_deadline_dyntick(void)
         delta = (qemu_next_deadline() + 999) / 1000;
 
     if (active_timers[QEMU_CLOCK_REALTIME]) {
-        rtdelta = (active_timers[QEMU_CLOCK_REALTIME]->expire_time -
+        rtdelta = (qemu_clock_deadline(rt_clock) -
                  qemu_get_clock(rt_clock))*1000;
         if (rtdelta < delta)
             delta = rtdelta;
@@ -921,6 +1181,78 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     }
 }
 
+#ifdef USE_TIMERFD_ALARM
+static void timerfd_alarm_read(void *opaque)
+{
+    struct qemu_alarm_timer *t = opaque;
+    int fd = (long)t->priv;
+    uint64_t expirations;
+
+    /* this runs in the main loop, which runs the timers right after */
+    if (read(fd, &expirations, sizeof(expirations)) > 0) {
+        t->expired = 1;
+        t->pending = 1;
+    }
+}
+
+static int timerfd_start_timer(struct qemu_alarm_timer *t)
+{
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    t->priv = (void *)(long)fd;
+    qemu_set_fd_handler(fd, timerfd_alarm_read, NULL, t);
+
+    return 0;
+}
+
+static void timerfd_stop_timer(struct qemu_alarm_timer *t)
+{
+    int fd = (long)t->priv;
+
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    close(fd);
+}
+
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t)
+{
+    int fd = (long)t->priv;
+    struct itimerspec timeout;
+    int64_t nearest_delta_us;
+    int64_t current_us;
+
+    if (!active_timers[QEMU_CLOCK_REALTIME] &&
+        !active_timers[QEMU_CLOCK_VIRTUAL] &&
+        !active_timers[QEMU_CLOCK_HOST])
+        return;
+
+    nearest_delta_us = qemu_next_deadline_dyntick();
+
+    /* check whether a timer is already running */
+    if (timerfd_gettime(fd, &timeout)) {
+        perror("timerfd_gettime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+    current_us = timeout.it_value.tv_sec * 1000000 + timeout.it_value.tv_nsec/1000;
+    if (current_us && current_us <= nearest_delta_us)
+        return;
+
+    timeout.it_interval.tv_sec = 0;
+    timeout.it_interval.tv_nsec = 0;
+    timeout.it_value.tv_sec =  nearest_delta_us / 1000000;
+    timeout.it_value.tv_nsec = (nearest_delta_us % 1000000) * 1000;
+    if (timerfd_settime(fd, 0 /* RELATIVE */, &timeout, NULL)) {
+        perror("timerfd_settime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+}
+#endif
+
 #endif /* defined(__linux__) */
 
 static int unix_start_timer(struct qemu_alarm_timer *t)
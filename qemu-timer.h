@@ -37,22 +37,30 @@ int64_t qemu_get_clock(QEMUClock *clock);
 int64_t qemu_get_clock_ns(QEMUClock *clock);
 void qemu_clock_enable(QEMUClock *clock, int enabled);
 
-QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque);
+QEMUTimer *qemu_new_timer_named(QEMUClock *clock, QEMUTimerCB *cb,
+                                void *opaque, const char *name);
+/* timers are accounted to their callback in "info timers" */
+#define qemu_new_timer(clock, cb, opaque) \
+    qemu_new_timer_named(clock, cb, opaque, #cb)
 void qemu_free_timer(QEMUTimer *ts);
 void qemu_del_timer(QEMUTimer *ts);
 void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time);
+void qemu_timer_set_slack(QEMUTimer *ts, int64_t slack);
 int qemu_timer_pending(QEMUTimer *ts);
 int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time);
 
+void qemu_account_wakeup(void);
 void qemu_run_all_timers(void);
 int qemu_alarm_pending(void);
 int64_t qemu_next_deadline(void);
 void configure_alarms(char const *opt);
 void configure_icount(const char *option);
+void configure_timer_slack(int64_t slack_ns);
 int qemu_calculate_timeout(void);
 void init_clocks(void);
 int init_timer_alarm(void);
 void quit_timers(void);
+void do_info_timers(Monitor *mon);
 
 static inline int64_t get_ticks_per_sec(void)
 {
@@ -1051,6 +1051,11 @@ Each json-object contain the following:
     - "wr_operations": write operations (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "completions": requests the guest device has completed, for devices
+                     that account them, e.g. virtio-blk (json-int)
+    - "completion_irqs": interrupts the device raised for those completions;
+                         completions / completion_irqs is the average number
+                         of requests reported per interrupt (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1066,6 +1071,8 @@ Example:
             "parent":{
                "stats":{
                   "wr_highest_offset":3686448128,
+                  "completions":0,
+                  "completion_irqs":0,
                   "wr_bytes":9786368,
                   "wr_operations":751,
                   "rd_bytes":122567168,
@@ -1074,6 +1081,8 @@ Example:
             },
             "stats":{
                "wr_highest_offset":2821110784,
+               "completions":0,
+               "completion_irqs":0,
                "wr_bytes":9786368,
                "wr_operations":692,
                "rd_bytes":122739200,
@@ -1084,6 +1093,8 @@ Example:
             "device":"ide1-cd0",
             "stats":{
                "wr_highest_offset":0,
+               "completions":0,
+               "completion_irqs":0,
                "wr_bytes":0,
                "wr_operations":0,
                "rd_bytes":0,
@@ -1094,6 +1105,8 @@ Example:
             "device":"floppy0",
             "stats":{
                "wr_highest_offset":0,
+               "completions":0,
+               "completion_irqs":0,
                "wr_bytes":0,
                "wr_operations":0,
                "rd_bytes":0,
@@ -1104,6 +1117,8 @@ Example:
             "device":"sd0",
             "stats":{
                "wr_highest_offset":0,
+               "completions":0,
+               "completion_irqs":0,
                "wr_bytes":0,
                "wr_operations":0,
                "rd_bytes":0,
@@ -129,6 +129,7 @@ void arm_translate_init(void)
 
 #define GEN_HELPER 2
 #include "helpers.h"
+    tcg_pin_globals(pin_globals);
 }
 
 #ifdef RESOURCE_LEAK_DEBUG
@@ -3460,6 +3461,14 @@ static inline void gen_jmp (DisasContext *s, uint32_t dest)
         if (s->thumb)
             dest |= 1;
         gen_bx_im(s, dest);
+    } else if ((s->tb->cflags & CF_TRACE) && !s->condjmp &&
+               dest >= s->pc &&
+               (dest & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK)) {
+        /* When building a trace, follow unconditional forward branches
+           within the page instead of ending the block.  The skipped
+           code stays inside [tb->pc, tb->pc + tb->size[ so that page
+           invalidation remains conservative.  */
+        s->pc = dest;
     } else {
         gen_goto_tb(s, 0, dest);
         s->is_jmp = DISAS_TB_JUMP;
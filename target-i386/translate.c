@@ -2735,6 +2735,22 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* direct jmp/call to 'eip'. When building a trace, forward jumps
+   close enough to stay in the block size limit are followed instead
+   of ending the block. */
+static void gen_jmp_direct(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc;
+
+    pc = s->cs_base + eip;
+    if ((s->tb->cflags & CF_TRACE) && s->jmp_opt &&
+        pc >= s->pc && (pc - s->tb->pc) < (TARGET_PAGE_SIZE - 32)) {
+        s->pc = pc;
+        return;
+    }
+    gen_jmp(s, eip);
+}
+
 static inline void gen_ldq_env_A0(int idx, int offset)
 {
     int mem_index = (idx >> 2) - 1;
@@ -3082,6 +3098,53 @@ static struct sse_op_helper_s sse_op_table7[256] = {
     [0x63] = SSE42_OP(pcmpistri),
 };
 
+/* generate the common integer MMX/SSE2 operations as TCG vector ops
+   instead of helper calls.  Return 0 if 'b' is not one of them. */
+static int gen_sse_vec(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+    int len = is_xmm ? 16 : 8;
+
+    switch(b) {
+    case 0xfc: /* paddb */
+    case 0xfd: /* paddw */
+    case 0xfe: /* paddd */
+        tcg_gen_vec_add(cpu_env, b - 0xfc, len,
+                        op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_vec_add(cpu_env, 3, len, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xf8: /* psubb */
+    case 0xf9: /* psubw */
+    case 0xfa: /* psubd */
+    case 0xfb: /* psubq */
+        tcg_gen_vec_sub(cpu_env, b - 0xf8, len,
+                        op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xdb: /* pand */
+        tcg_gen_vec_and(cpu_env, 3, len, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xdf: /* pandn */
+        tcg_gen_vec_andc(cpu_env, 3, len, op1_offset, op2_offset, op1_offset);
+        break;
+    case 0xeb: /* por */
+        tcg_gen_vec_or(cpu_env, 3, len, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xef: /* pxor */
+        tcg_gen_vec_xor(cpu_env, 3, len, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0x74: /* pcmpeqb */
+    case 0x75: /* pcmpeqw */
+    case 0x76: /* pcmpeqd */
+        tcg_gen_vec_cmpeq(cpu_env, b - 0x74, len,
+                          op1_offset, op1_offset, op2_offset);
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
 static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
 {
     int b1, op1_offset, op2_offset, is_xmm, val, ot;
@@ -4034,6 +4097,11 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
         case 0x70: /* pshufx insn */
         case 0xc6: /* pshufx insn */
             val = ldub_code(s->pc++);
+            if (b == 0x70 && b1 == 1) {
+                /* pshufd */
+                tcg_gen_vec_shuf32(cpu_env, op1_offset, op2_offset, val);
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             ((void (*)(TCGv_ptr, TCGv_ptr, TCGv_i32))sse_op2)(cpu_ptr0, cpu_ptr1, tcg_const_i32(val));
@@ -4069,6 +4137,8 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
             ((void (*)(TCGv_ptr, TCGv_ptr, TCGv))sse_op2)(cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_vec(b, is_xmm, op1_offset, op2_offset))
+                break;
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             ((void (*)(TCGv_ptr, TCGv_ptr))sse_op2)(cpu_ptr0, cpu_ptr1);
@@ -6267,7 +6337,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 tval &= 0xffffffff;
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
-            gen_jmp(s, tval);
+            gen_jmp_direct(s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6294,7 +6364,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             tval &= 0xffff;
         else if(!CODE64(s))
             tval &= 0xffffffff;
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6315,7 +6385,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         tval += s->pc - s->cs_base;
         if (s->dflag == 0)
             tval &= 0xffff;
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(s, OT_BYTE);
@@ -7720,6 +7790,7 @@ void optimize_flags_init(void)
     /* register helpers */
 #define GEN_HELPER 2
 #include "helper.h"
+    tcg_pin_globals(pin_globals);
 }
 
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
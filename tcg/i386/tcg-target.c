@@ -234,11 +234,13 @@ static inline int tcg_target_const_match(tcg_target_long val,
 # define P_REXW		0x800		/* Set REX.W = 1 */
 # define P_REXB_R	0x1000		/* REG field as byte register */
 # define P_REXB_RM	0x2000		/* R/M field as byte register */
+# define P_SIMDF3	0x4000		/* 0xf3 opcode prefix */
 #else
 # define P_ADDR32	0
 # define P_REXW		0
 # define P_REXB_R	0
 # define P_REXB_RM	0
+# define P_SIMDF3	0
 #endif
 
 #define OPC_ARITH_EvIz	(0x81)
@@ -268,6 +270,27 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_MOVSLQ	(0x63 | P_REXW)
 #define OPC_MOVZBL	(0xb6 | P_EXT)
 #define OPC_MOVZWL	(0xb7 | P_EXT)
+#define OPC_MOVDQU_VxWx	(0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx	(0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq	(0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq	(0xd6 | P_EXT | P_DATA16)
+#define OPC_MOVHPD_VqMq	(0x16 | P_EXT | P_DATA16)
+#define OPC_PADDB	(0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW	(0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD	(0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ	(0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND	(0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN	(0xdf | P_EXT | P_DATA16)
+#define OPC_PCMPEQB	(0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW	(0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD	(0x76 | P_EXT | P_DATA16)
+#define OPC_POR		(0xeb | P_EXT | P_DATA16)
+#define OPC_PSHUFD	(0x70 | P_EXT | P_DATA16)
+#define OPC_PSUBB	(0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW	(0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD	(0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ	(0xfb | P_EXT | P_DATA16)
+#define OPC_PXOR	(0xef | P_EXT | P_DATA16)
 #define OPC_POP_r32	(0x58)
 #define OPC_PUSH_r32	(0x50)
 #define OPC_PUSH_Iv	(0x68)
@@ -357,6 +380,9 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         assert((opc & P_REXW) == 0);
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
@@ -1427,6 +1453,55 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 #endif
 }
 
+#ifdef TCG_TARGET_HAS_vec
+/* The vector ops work on memory, using %xmm0 and %xmm1 as scratch
+   registers: TCG does not allocate the SSE registers otherwise.  */
+static const int tcg_vec_padd[4] = {
+    OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+};
+static const int tcg_vec_psub[4] = {
+    OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+};
+static const int tcg_vec_pcmpeq[4] = {
+    OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD, 0
+};
+
+/* 16 byte vectors are loaded as two halves: the guest registers are
+   mostly written 8 bytes at a time, and a single 16 byte load would
+   not be forwarded from those stores.  */
+static void tcg_out_vec_ld(TCGContext *s, int len, int xmm, int base,
+                           tcg_target_long ofs)
+{
+    tcg_out_modrm_offset(s, OPC_MOVQ_VqWq, xmm, base, ofs);
+    if (len == 16) {
+        tcg_out_modrm_offset(s, OPC_MOVHPD_VqMq, xmm, base, ofs + 8);
+    }
+}
+
+static void tcg_out_vec_st(TCGContext *s, int len, int xmm, int base,
+                           tcg_target_long ofs)
+{
+    tcg_out_modrm_offset(s, len == 16 ? OPC_MOVDQU_WxVx : OPC_MOVQ_WqVq,
+                         xmm, base, ofs);
+}
+
+/* args: base, dofs, aofs, bofs, desc.  With 'swap', the operation is
+   done as b op a (for pandn, which complements its destination).  */
+static void tcg_out_vec_binop(TCGContext *s, int opc, const TCGArg *args,
+                              int swap)
+{
+    int len = TCG_VEC_LEN(args[4]);
+
+    if (opc == 0) {
+        tcg_abort();
+    }
+    tcg_out_vec_ld(s, len, 0, args[0], args[swap ? 3 : 2]);
+    tcg_out_vec_ld(s, len, 1, args[0], args[swap ? 2 : 3]);
+    tcg_out_modrm(s, opc, 0, 1);
+    tcg_out_vec_st(s, len, 0, args[0], args[1]);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1745,6 +1820,36 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         break;
 #endif
 
+#ifdef TCG_TARGET_HAS_vec
+    case INDEX_op_vec_add:
+        tcg_out_vec_binop(s, tcg_vec_padd[TCG_VEC_VECE(args[4])], args, 0);
+        break;
+    case INDEX_op_vec_sub:
+        tcg_out_vec_binop(s, tcg_vec_psub[TCG_VEC_VECE(args[4])], args, 0);
+        break;
+    case INDEX_op_vec_and:
+        tcg_out_vec_binop(s, OPC_PAND, args, 0);
+        break;
+    case INDEX_op_vec_or:
+        tcg_out_vec_binop(s, OPC_POR, args, 0);
+        break;
+    case INDEX_op_vec_xor:
+        tcg_out_vec_binop(s, OPC_PXOR, args, 0);
+        break;
+    case INDEX_op_vec_andc:
+        tcg_out_vec_binop(s, OPC_PANDN, args, 1);
+        break;
+    case INDEX_op_vec_cmpeq:
+        tcg_out_vec_binop(s, tcg_vec_pcmpeq[TCG_VEC_VECE(args[4])], args, 0);
+        break;
+    case INDEX_op_vec_shuf32:
+        tcg_out_vec_ld(s, 16, 0, args[0], args[2]);
+        tcg_out_modrm(s, OPC_PSHUFD, 0, 0);
+        tcg_out8(s, TCG_VEC_IMM(args[4]));
+        tcg_out_vec_st(s, 16, 0, args[0], args[1]);
+        break;
+#endif
+
     default:
         tcg_abort();
     }
@@ -1853,6 +1958,17 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_ext32u_i64, { "r", "r" } },
 #endif
 
+#ifdef TCG_TARGET_HAS_vec
+    { INDEX_op_vec_add, { "r" } },
+    { INDEX_op_vec_sub, { "r" } },
+    { INDEX_op_vec_and, { "r" } },
+    { INDEX_op_vec_or, { "r" } },
+    { INDEX_op_vec_xor, { "r" } },
+    { INDEX_op_vec_andc, { "r" } },
+    { INDEX_op_vec_cmpeq, { "r" } },
+    { INDEX_op_vec_shuf32, { "r" } },
+#endif
+
 #if TCG_TARGET_REG_BITS == 64
     { INDEX_op_qemu_ld8u, { "r", "L" } },
     { INDEX_op_qemu_ld8s, { "r", "L" } },
@@ -1911,6 +2027,16 @@ static int tcg_target_callee_save_regs[] = {
 #endif
 };
 
+#ifdef TCG_TARGET_HAS_pinned_globals
+/* callee saved registers which can hold pinned globals */
+static const int tcg_target_pin_regs[] = {
+    TCG_REG_RBX,
+    TCG_REG_R12,
+    TCG_REG_R13,
+    TCG_REG_R15,
+};
+#endif
+
 /* Generate global QEMU prologue and epilogue code */
 static void tcg_target_qemu_prologue(TCGContext *s)
 {
@@ -1933,12 +2059,16 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     stack_addend = frame_size - push_size;
     tcg_out_addi(s, TCG_REG_ESP, -stack_addend);
 
+    tcg_load_pinned(s);
+
     /* jmp *tb.  */
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[0]);
 
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
+    tcg_sync_pinned(s, 1);
+
     tcg_out_addi(s, TCG_REG_ESP, stack_addend);
 
     for (i = ARRAY_SIZE(tcg_target_callee_save_regs) - 1; i >= 0; i--) {
@@ -110,6 +110,11 @@ enum {
 // #define TCG_TARGET_HAS_eqv_i64
 // #define TCG_TARGET_HAS_nand_i64
 // #define TCG_TARGET_HAS_nor_i64
+
+/* globals can be kept in callee saved registers between TBs */
+#define TCG_TARGET_HAS_pinned_globals
+/* SSE2 is always present on x86-64 hosts */
+#define TCG_TARGET_HAS_vec
 #endif
 
 #define TCG_TARGET_HAS_GUEST_BASE
@@ -2467,3 +2467,226 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #define tcg_gen_addi_ptr tcg_gen_addi_i64
 #define tcg_gen_ext_i32_ptr tcg_gen_ext_i32_i64
 #endif /* TCG_TARGET_REG_BITS != 32 */
+
+/* Vector operations on vectors of 'len' (8 or 16) bytes stored at
+   'base' + offset as host endian integers, made of elements of
+   1 << 'vece' bytes.  Hosts without TCG_TARGET_HAS_vec work on 64-bit
+   chunks with i64 ops. */
+
+#ifdef TCG_TARGET_HAS_vec
+static inline void tcg_gen_vec_op(TCGOpcode opc, TCGv_ptr base,
+                                  tcg_target_long dofs, tcg_target_long aofs,
+                                  tcg_target_long bofs, TCGArg desc)
+{
+    *gen_opc_ptr++ = opc;
+    *gen_opparam_ptr++ = GET_TCGV_PTR(base);
+    *gen_opparam_ptr++ = dofs;
+    *gen_opparam_ptr++ = aofs;
+    *gen_opparam_ptr++ = bofs;
+    *gen_opparam_ptr++ = desc;
+}
+#else
+/* replicate an element value over 64 bits */
+static inline uint64_t tcg_vec_dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case 0:
+        return c * 0x0101010101010101ull;
+    case 1:
+        return c * 0x0001000100010001ull;
+    case 2:
+        return c * 0x0000000100000001ull;
+    default:
+        return c;
+    }
+}
+
+/* mask of the sign bit of each element */
+static inline uint64_t tcg_vec_sign_mask(unsigned vece)
+{
+    return tcg_vec_dup_const(vece, 1ull << ((8 << vece) - 1));
+}
+
+static inline void tcg_gen_vec_add_i64(unsigned vece, TCGv_i64 d,
+                                       TCGv_i64 a, TCGv_i64 b)
+{
+    uint64_t m = tcg_vec_sign_mask(vece);
+    TCGv_i64 t1, t2;
+
+    if (vece == 3) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+    /* add without the sign bits so that no carry crosses an element,
+       then put the sign bits back */
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_add_i64(t1, t1, t2);
+    tcg_gen_xor_i64(t2, a, b);
+    tcg_gen_andi_i64(t2, t2, m);
+    tcg_gen_xor_i64(d, t1, t2);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+}
+
+static inline void tcg_gen_vec_sub_i64(unsigned vece, TCGv_i64 d,
+                                       TCGv_i64 a, TCGv_i64 b)
+{
+    uint64_t m = tcg_vec_sign_mask(vece);
+    TCGv_i64 t1, t2;
+
+    if (vece == 3) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+    /* set the sign bits of 'a' so that no borrow crosses an element */
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_sub_i64(t1, t1, t2);
+    tcg_gen_eqv_i64(t2, a, b);
+    tcg_gen_andi_i64(t2, t2, m);
+    tcg_gen_xor_i64(d, t1, t2);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+}
+
+static inline void tcg_gen_vec_and_i64(unsigned vece, TCGv_i64 d,
+                                       TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static inline void tcg_gen_vec_or_i64(unsigned vece, TCGv_i64 d,
+                                      TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static inline void tcg_gen_vec_xor_i64(unsigned vece, TCGv_i64 d,
+                                       TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static inline void tcg_gen_vec_andc_i64(unsigned vece, TCGv_i64 d,
+                                        TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static inline void tcg_gen_vec_cmpeq_i64(unsigned vece, TCGv_i64 d,
+                                         TCGv_i64 a, TCGv_i64 b)
+{
+    uint64_t m = tcg_vec_sign_mask(vece);
+    TCGv_i64 t1, t2;
+
+    if (vece == 3) {
+        tcg_gen_setcond_i64(TCG_COND_EQ, d, a, b);
+        tcg_gen_neg_i64(d, d);
+        return;
+    }
+    /* the sign bit of each element of t1 is set if the element of
+       a ^ b is not zero */
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    tcg_gen_xor_i64(t2, a, b);
+    tcg_gen_andi_i64(t1, t2, ~m);
+    tcg_gen_addi_i64(t1, t1, ~m);
+    tcg_gen_or_i64(t1, t1, t2);
+    /* turn the clear sign bits into all ones elements */
+    tcg_gen_not_i64(t1, t1);
+    tcg_gen_shri_i64(t1, t1, (8 << vece) - 1);
+    tcg_gen_andi_i64(t1, t1, tcg_vec_dup_const(vece, 1));
+    tcg_gen_shli_i64(t2, t1, 8 << vece);
+    tcg_gen_sub_i64(d, t2, t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+}
+
+static inline void tcg_gen_vec_expand(void (*fn)(unsigned, TCGv_i64,
+                                                 TCGv_i64, TCGv_i64),
+                                      TCGv_ptr base, tcg_target_long dofs,
+                                      tcg_target_long aofs,
+                                      tcg_target_long bofs, TCGArg desc)
+{
+    TCGv_i64 a, b;
+    int i;
+
+    a = tcg_temp_new_i64();
+    b = tcg_temp_new_i64();
+    for (i = 0; i < TCG_VEC_LEN(desc); i += 8) {
+        tcg_gen_ld_i64(a, base, aofs + i);
+        tcg_gen_ld_i64(b, base, bofs + i);
+        fn(TCG_VEC_VECE(desc), a, a, b);
+        tcg_gen_st_i64(a, base, dofs + i);
+    }
+    tcg_temp_free_i64(b);
+    tcg_temp_free_i64(a);
+}
+#endif
+
+#ifdef TCG_TARGET_HAS_vec
+#define TCG_GEN_VEC_BINOP(name)                                             \
+static inline void tcg_gen_vec_##name(TCGv_ptr base, unsigned vece,         \
+                                      unsigned len, tcg_target_long dofs,   \
+                                      tcg_target_long aofs,                 \
+                                      tcg_target_long bofs)                 \
+{                                                                           \
+    tcg_gen_vec_op(INDEX_op_vec_##name, base, dofs, aofs, bofs,             \
+                   TCG_VEC_DESC(vece, len, 0));                             \
+}
+#else
+#define TCG_GEN_VEC_BINOP(name)                                             \
+static inline void tcg_gen_vec_##name(TCGv_ptr base, unsigned vece,         \
+                                      unsigned len, tcg_target_long dofs,   \
+                                      tcg_target_long aofs,                 \
+                                      tcg_target_long bofs)                 \
+{                                                                           \
+    tcg_gen_vec_expand(tcg_gen_vec_##name##_i64, base, dofs, aofs, bofs,    \
+                       TCG_VEC_DESC(vece, len, 0));                         \
+}
+#endif
+
+TCG_GEN_VEC_BINOP(add)
+TCG_GEN_VEC_BINOP(sub)
+TCG_GEN_VEC_BINOP(and)
+TCG_GEN_VEC_BINOP(or)
+TCG_GEN_VEC_BINOP(xor)
+TCG_GEN_VEC_BINOP(andc)
+TCG_GEN_VEC_BINOP(cmpeq)
+
+/* 32-bit element shuffle of a 16 byte vector (pshufd): element i of
+   the result is element (imm >> (2 * i)) & 3 of the source */
+static inline void tcg_gen_vec_shuf32(TCGv_ptr base, tcg_target_long dofs,
+                                      tcg_target_long aofs, unsigned imm)
+{
+#ifdef TCG_TARGET_HAS_vec
+    tcg_gen_vec_op(INDEX_op_vec_shuf32, base, dofs, aofs, aofs,
+                   TCG_VEC_DESC(2, 16, imm));
+#else
+    TCGv_i32 t[4];
+    int i, n;
+
+    for (i = 0; i < 4; i++) {
+        t[i] = tcg_temp_new_i32();
+        n = (imm >> (2 * i)) & 3;
+#ifdef HOST_WORDS_BIGENDIAN
+        n = 3 - n;
+#endif
+        tcg_gen_ld_i32(t[i], base, aofs + n * 4);
+    }
+    for (i = 0; i < 4; i++) {
+#ifdef HOST_WORDS_BIGENDIAN
+        n = 3 - i;
+#else
+        n = i;
+#endif
+        tcg_gen_st_i32(t[i], base, dofs + n * 4);
+        tcg_temp_free_i32(t[i]);
+    }
+#endif
+}
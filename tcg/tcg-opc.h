@@ -220,6 +220,18 @@ DEF(nor_i64, 1, 2, 0, 0)
 #endif
 #endif
 
+#ifdef TCG_TARGET_HAS_vec
+/* vectors in memory: base, dst offset, src1 offset, src2 offset, desc */
+DEF(vec_add, 0, 1, 4, TCG_OPF_SIDE_EFFECTS)
+DEF(vec_sub, 0, 1, 4, TCG_OPF_SIDE_EFFECTS)
+DEF(vec_and, 0, 1, 4, TCG_OPF_SIDE_EFFECTS)
+DEF(vec_or, 0, 1, 4, TCG_OPF_SIDE_EFFECTS)
+DEF(vec_xor, 0, 1, 4, TCG_OPF_SIDE_EFFECTS)
+DEF(vec_andc, 0, 1, 4, TCG_OPF_SIDE_EFFECTS)
+DEF(vec_cmpeq, 0, 1, 4, TCG_OPF_SIDE_EFFECTS)
+DEF(vec_shuf32, 0, 1, 4, TCG_OPF_SIDE_EFFECTS)
+#endif
+
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
 DEF(debug_insn_start, 0, 0, 2, 0)
@@ -67,6 +67,8 @@ static void tcg_target_init(TCGContext *s);
 static void tcg_target_qemu_prologue(TCGContext *s);
 static void patch_reloc(uint8_t *code_ptr, int type, 
                         tcg_target_long value, tcg_target_long addend);
+static void tcg_sync_pinned(TCGContext *s, int all);
+static void tcg_load_pinned(TCGContext *s);
 
 static TCGOpDef tcg_op_defs[] = {
 #define DEF(s, oargs, iargs, cargs, flags) { #s, oargs, iargs, cargs, iargs + oargs + cargs, flags },
@@ -402,6 +404,57 @@ TCGv_i64 tcg_global_mem_new_i64(int reg, tcg_target_long offset,
     return MAKE_TCGV_I64(idx);
 }
 
+/* Keep the globals named in the comma separated 'list' in host
+   registers across TBs.  They are loaded by the prologue, written back
+   by the epilogue and synchronized with their canonical location
+   around helper calls.  Return the number of pinned globals.  */
+int tcg_pin_globals(const char *list)
+{
+#ifdef TCG_TARGET_HAS_pinned_globals
+    TCGContext *s = &tcg_ctx;
+    TCGTemp *ts;
+    const char *p;
+    int i, len, n;
+
+    n = 0;
+    while (list && *list) {
+        p = strchr(list, ',');
+        len = p ? p - list : strlen(list);
+        ts = NULL;
+        for(i = 0; i < s->nb_globals; i++) {
+            if (!s->temps[i].fixed_reg && s->temps[i].mem_reg == TCG_AREG0 &&
+                s->temps[i].type == s->temps[i].base_type &&
+                strlen(s->temps[i].name) == len &&
+                !memcmp(s->temps[i].name, list, len)) {
+                ts = &s->temps[i];
+                break;
+            }
+        }
+        if (!ts) {
+            fprintf(stderr, "tcg: cannot pin unknown global '%.*s'\n",
+                    len, list);
+        } else if (n >= ARRAY_SIZE(tcg_target_pin_regs)) {
+            fprintf(stderr, "tcg: no host register left to pin '%.*s'\n",
+                    len, list);
+            break;
+        } else {
+            ts->fixed_reg = 1;
+            ts->pinned = 1;
+            ts->reg = tcg_target_pin_regs[n++];
+            tcg_regset_set_reg(s->reserved_regs, ts->reg);
+        }
+        list = p ? p + 1 : NULL;
+    }
+    if (n > 0) {
+        /* the prologue and epilogue must load and store them */
+        tcg_prologue_init(s);
+    }
+    return n;
+#else
+    return 0;
+#endif
+}
+
 static inline int tcg_temp_new_internal(TCGType type, int temp_local)
 {
     TCGContext *s = &tcg_ctx;
@@ -730,6 +783,9 @@ static void tcg_reg_alloc_start(TCGContext *s)
         ts = &s->temps[i];
         if (ts->fixed_reg) {
             ts->val_type = TEMP_VAL_REG;
+            /* the TB may be entered by a chained jump from a TB which
+               modified a pinned global */
+            ts->mem_coherent = 0;
         } else {
             ts->val_type = TEMP_VAL_MEM;
         }
@@ -1507,8 +1563,41 @@ static void save_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
+/* store the pinned globals to their canonical location. If 'all' is
+   false, only the ones modified since the last synchronization are
+   stored. */
+static void tcg_sync_pinned(TCGContext *s, int all)
+{
+    TCGTemp *ts;
+    int i;
+
+    for(i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (ts->pinned && (all || !ts->mem_coherent)) {
+            tcg_out_st(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+            ts->mem_coherent = 1;
+        }
+    }
+}
+
+/* load the pinned globals from their canonical location */
+static void tcg_load_pinned(TCGContext *s)
+{
+    TCGTemp *ts;
+    int i;
+
+    for(i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (ts->pinned) {
+            tcg_out_ld(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+            ts->mem_coherent = 1;
+        }
+    }
+}
+
 /* at the end of a basic block, we assume all temporaries are dead and
-   all globals are stored at their canonical location. */
+   all globals are stored at their canonical location, except the
+   pinned ones which stay in their register. */
 static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
 {
     TCGTemp *ts;
@@ -1527,6 +1616,14 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     }
 
     save_globals(s, allocated_regs);
+
+    /* several paths may join at the next label */
+    for(i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (ts->pinned) {
+            ts->mem_coherent = 0;
+        }
+    }
 }
 
 #define IS_DEAD_IARG(n) ((dead_iargs >> (n)) & 1)
@@ -1543,6 +1640,7 @@ static void tcg_reg_alloc_movi(TCGContext *s, const TCGArg *args)
         /* for fixed registers, we do not do any constant
            propagation */
         tcg_out_movi(s, ots->type, ots->reg, val);
+        ots->mem_coherent = 0;
     } else {
         /* The movi is not explicitly generated here */
         if (ots->val_type == TEMP_VAL_REG)
@@ -1722,6 +1820,7 @@ static void tcg_reg_alloc_op(TCGContext *s,
             /* store globals and free associated registers (we assume the insn
                can modify any global. */
             save_globals(s, allocated_regs);
+            tcg_sync_pinned(s, 0);
         }
         
         /* satisfy the output constraints */
@@ -1766,8 +1865,11 @@ static void tcg_reg_alloc_op(TCGContext *s,
     for(i = 0; i < nb_oargs; i++) {
         ts = &s->temps[args[i]];
         reg = new_args[i];
-        if (ts->fixed_reg && ts->reg != reg) {
-            tcg_out_mov(s, ts->type, ts->reg, reg);
+        if (ts->fixed_reg) {
+            if (ts->reg != reg) {
+                tcg_out_mov(s, ts->type, ts->reg, reg);
+            }
+            ts->mem_coherent = 0;
         }
     }
 }
@@ -1925,6 +2027,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
        can modify any global. */
     if (!(flags & TCG_CALL_CONST)) {
         save_globals(s, allocated_regs);
+        tcg_sync_pinned(s, 0);
     }
 
     tcg_out_op(s, opc, &func_arg, &const_func_arg);
@@ -1933,6 +2036,12 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
         tcg_out_addi(s, TCG_REG_CALL_STACK, STACK_DIR(call_stack_size));
     }
 
+    /* the pinned globals are preserved by the callee, but it may have
+       modified their canonical location */
+    if (!(flags & (TCG_CALL_CONST | TCG_CALL_PURE))) {
+        tcg_load_pinned(s);
+    }
+
     /* assign output registers and emit moves if needed */
     for(i = 0; i < nb_oargs; i++) {
         arg = args[i];
@@ -1943,6 +2052,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
             if (ts->reg != reg) {
                 tcg_out_mov(s, ts->type, ts->reg, reg);
             }
+            ts->mem_coherent = 0;
         } else {
             if (ts->val_type == TEMP_VAL_REG)
                 s->reg_to_temp[ts->reg] = -1;
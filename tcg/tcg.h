@@ -256,6 +256,9 @@ typedef struct TCGTemp {
                                   basic blocks. Otherwise, it is not
                                   preserved accross basic blocks. */
     unsigned int temp_allocated:1; /* never used for code gen */
+    unsigned int pinned:1; /* global kept in a fixed host register
+                              across TBs and only written back to its
+                              canonical location when needed */
     /* index of next free temp of same base type, -1 if end */
     int next_free_temp;
     const char *name;
@@ -380,6 +383,7 @@ char *tcg_get_arg_str_i32(TCGContext *s, char *buf, int buf_size, TCGv_i32 arg);
 TCGv_i64 tcg_global_reg_new_i64(int reg, const char *name);
 TCGv_i64 tcg_global_mem_new_i64(int reg, tcg_target_long offset,
                                 const char *name);
+int tcg_pin_globals(const char *list);
 TCGv_i64 tcg_temp_new_internal_i64(int temp_local);
 static inline TCGv_i64 tcg_temp_new_i64(void)
 {
@@ -409,6 +413,14 @@ typedef struct TCGArgConstraint {
 
 #define TCG_MAX_OP_ARGS 16
 
+/* Descriptor of the vector ops: log2 of the element size in bytes,
+   vector length (8 or 16 bytes) and an immediate (shuffle control). */
+#define TCG_VEC_DESC(vece, len, imm) \
+    ((vece) | ((len) == 16 ? 4 : 0) | ((imm) << 8))
+#define TCG_VEC_VECE(desc)  ((desc) & 3)
+#define TCG_VEC_LEN(desc)   ((desc) & 4 ? 16 : 8)
+#define TCG_VEC_IMM(desc)   (((desc) >> 8) & 0xff)
+
 #define TCG_OPF_BB_END     0x01 /* instruction defines the end of a basic
                                    block */
 #define TCG_OPF_CALL_CLOBBER 0x02 /* instruction clobbers call registers 
@@ -0,0 +1,290 @@
+/*
+ * Measure how many frames per second QEMU forwards between two taps.
+ *
+ * The program creates two tap devices, starts QEMU with both of them on
+ * the same VLAN, then sends small frames into the first one from the
+ * host and counts what comes out of the second one.  QEMU only needs
+ * to run its main loop, so the guest can stay stopped (-S).  It also
+ * checks that frames arrive in the order they were sent.  Needs root.
+ *
+ *   tap-pps [-t seconds] [-s frame size] qemu [qemu options...]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/if_packet.h>
+
+#include "test-util.h"
+
+#define TAP_IN      "tpps0"
+#define TAP_OUT     "tpps1"
+#define ETH_TYPE    0x88b5          /* local experimental ethertype */
+#define BURST       64
+#define MAX_FRAME   1514
+
+static volatile int stop_rx;
+static uint64_t nb_rx, nb_reordered;
+
+static void die(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/* Create a persistent tap so that QEMU can attach to it by name */
+static void tap_create(const char *name, int persist)
+{
+    struct ifreq ifr;
+    int fd, s;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
+        die("/dev/net/tun");
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        die("TUNSETIFF");
+    }
+    if (ioctl(fd, TUNSETPERSIST, persist) < 0) {
+        die("TUNSETPERSIST");
+    }
+    close(fd);
+
+    if (!persist) {
+        return;
+    }
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) {
+        die("socket");
+    }
+    if (ioctl(s, SIOCGIFFLAGS, &ifr) < 0) {
+        die("SIOCGIFFLAGS");
+    }
+    ifr.ifr_flags |= IFF_UP;
+    if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0) {
+        die("SIOCSIFFLAGS");
+    }
+    close(s);
+}
+
+static int packet_socket(const char *name)
+{
+    struct sockaddr_ll sll;
+    struct timeval tv = { 0, 200000 };
+    int s, bufsize = 4 << 20;
+
+    s = socket(AF_PACKET, SOCK_RAW, htons(ETH_TYPE));
+    if (s < 0) {
+        die("AF_PACKET socket");
+    }
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_TYPE);
+    sll.sll_ifindex = if_nametoindex(name);
+    if (sll.sll_ifindex == 0) {
+        die(name);
+    }
+    if (bind(s, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        die("bind");
+    }
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return s;
+}
+
+static void *rx_thread(void *arg)
+{
+    int s = *(int *)arg;
+    static uint8_t bufs[BURST][MAX_FRAME];
+    struct mmsghdr msgs[BURST];
+    struct iovec iov[BURST];
+    uint32_t seq, last = 0;
+    int i, n, idle = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < BURST; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = MAX_FRAME;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* keep going until the sender is done and the taps have drained */
+    while (!stop_rx || idle < 2) {
+        n = recvmmsg(s, msgs, BURST, 0, NULL);
+        if (n <= 0) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+        for (i = 0; i < n; i++) {
+            memcpy(&seq, bufs[i] + 14, 4);
+            if (nb_rx && seq < last) {
+                nb_reordered++;
+            }
+            last = seq;
+            nb_rx++;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t send_frames(int s, int size, int seconds)
+{
+    static uint8_t bufs[BURST][MAX_FRAME];
+    struct mmsghdr msgs[BURST];
+    struct iovec iov[BURST];
+    uint64_t nb_tx = 0;
+    int64_t end;
+    uint32_t seq;
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < BURST; i++) {
+        /* broadcast, from a locally administered address */
+        memset(bufs[i], 0xff, 6);
+        memcpy(bufs[i] + 6, "\x02\x00\x00\x00\x00\x01", 6);
+        bufs[i][12] = ETH_TYPE >> 8;
+        bufs[i][13] = ETH_TYPE & 0xff;
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = size;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    end = get_time_us() + seconds * 1000000LL;
+    while (get_time_us() < end) {
+        for (i = 0; i < BURST; i++) {
+            seq = nb_tx + i;
+            memcpy(bufs[i] + 14, &seq, 4);
+        }
+        n = sendmmsg(s, msgs, BURST, 0);
+        if (n < 0) {
+            if (errno == ENOBUFS || errno == EINTR) {
+                continue;
+            }
+            die("sendmmsg");
+        }
+        nb_tx += n;
+    }
+    return nb_tx;
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = 5, size = 60;
+    int c, i, tx_sock, rx_sock;
+    uint64_t nb_tx;
+    int64_t t, cpu;
+    struct rusage ru;
+    pthread_t tid;
+    pid_t pid;
+
+    while ((c = getopt(argc, argv, "+t:s:")) != -1) {
+        switch (c) {
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            if (size < 60 || size > MAX_FRAME) {
+                fprintf(stderr, "frame size must be 60..%d\n", MAX_FRAME);
+                return 1;
+            }
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind >= argc) {
+    usage:
+        fprintf(stderr,
+                "usage: tap-pps [-t seconds] [-s size] qemu [options...]\n");
+        return 1;
+    }
+
+    tap_create(TAP_IN, 1);
+    tap_create(TAP_OUT, 1);
+
+    pid = fork();
+    if (pid < 0) {
+        die("fork");
+    }
+    if (pid == 0) {
+        char **args = calloc(argc - optind + 5, sizeof(char *));
+
+        for (i = 0; optind + i < argc; i++) {
+            args[i] = argv[optind + i];
+        }
+        args[i++] = (char *)"-net";
+        args[i++] = (char *)"tap,vlan=0,ifname=" TAP_IN
+                            ",script=no,downscript=no";
+        args[i++] = (char *)"-net";
+        args[i++] = (char *)"tap,vlan=0,ifname=" TAP_OUT
+                            ",script=no,downscript=no";
+        execvp(args[0], args);
+        die(args[0]);
+    }
+
+    /* give QEMU time to attach to the taps */
+    sleep(2);
+
+    tx_sock = packet_socket(TAP_IN);
+    rx_sock = packet_socket(TAP_OUT);
+    pthread_create(&tid, NULL, rx_thread, &rx_sock);
+
+    t = get_time_us();
+    nb_tx = send_frames(tx_sock, size, seconds);
+    t = get_time_us() - t;
+    stop_rx = 1;
+    pthread_join(tid, NULL);
+
+    /* on a busy host the rate mostly shows how the CPU was shared with
+       the sender, so also report what QEMU spent per frame */
+    kill(pid, SIGTERM);
+    wait4(pid, NULL, 0, &ru);
+    cpu = (int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+          ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    tap_create(TAP_IN, 0);
+    tap_create(TAP_OUT, 0);
+
+    printf("%d byte frames: sent %" PRIu64 ", forwarded %" PRIu64
+           " (%.0f pps, %.2f us of QEMU CPU time each), %" PRIu64
+           " out of order\n",
+           size, nb_tx, nb_rx, nb_rx * 1000000.0 / t,
+           nb_rx ? (double)cpu / nb_rx : 0.0, nb_reordered);
+    if (nb_rx == 0 || nb_reordered) {
+        return 1;
+    }
+    return 0;
+}
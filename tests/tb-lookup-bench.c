@@ -0,0 +1,127 @@
+/*
+ * Measure the cost of finding translated blocks as their number grows.
+ *
+ * The program generates N tiny functions and calls them in a scrambled
+ * order, so that every call ends a translated block with an indirect
+ * jump.  Once N is larger than the per-CPU jump cache, most calls are
+ * resolved through the physical hash table, and the time per call
+ * shows how lookups scale with the number of TBs.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "test-util.h"
+
+#define STUB_SIZE   16
+#define MAX_STUBS   (256 * 1024)
+#define TOTAL_CALLS (8 * 1024 * 1024)
+
+typedef int (*stub_fn)(void);
+
+/* 'mov $i, %eax; ret' for i386 and x86_64 alike */
+static uint8_t *gen_stubs(int n)
+{
+    uint8_t *code, *p;
+    int i;
+
+    code = mmap(NULL, n * STUB_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        p = code + i * STUB_SIZE;
+        p[0] = 0xb8;
+        memcpy(p + 1, &i, 4);
+        p[5] = 0xc3;
+    }
+    return code;
+}
+
+static void bench(int n)
+{
+    stub_fn *order, tmp;
+    uint8_t *code;
+    uint32_t seed, sum, expected;
+    int i, j, k, passes;
+    int64_t t;
+
+    code = gen_stubs(n);
+    order = malloc(n * sizeof(stub_fn));
+    for (i = 0; i < n; i++) {
+        order[i] = (stub_fn)(code + i * STUB_SIZE);
+    }
+    /* shuffle so that consecutive calls do not share a jump cache line */
+    seed = 12345;
+    for (i = n - 1; i > 0; i--) {
+        seed = seed * 1103515245 + 12345;
+        j = (seed >> 8) % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    /* first pass translates every stub */
+    sum = 0;
+    for (i = 0; i < n; i++) {
+        sum += order[i]();
+    }
+    expected = (uint32_t)((int64_t)n * (n - 1) / 2);
+    if (sum != expected) {
+        printf("error: n=%d sum=%u expected=%u\n", n, sum, expected);
+        exit(1);
+    }
+
+    passes = TOTAL_CALLS / n;
+    if (passes < 4) {
+        passes = 4;
+    }
+    t = get_time_us();
+    sum = 0;
+    for (k = 0; k < passes; k++) {
+        for (i = 0; i < n; i++) {
+            sum += order[i]();
+        }
+    }
+    t = get_time_us() - t;
+    if (sum != (uint32_t)(expected * passes)) {
+        printf("error: n=%d bad sum\n", n);
+        exit(1);
+    }
+    printf("%8d blocks: %7.1f ns/call\n",
+           n, (double)t * 1000.0 / ((double)passes * n));
+
+    munmap(code, n * STUB_SIZE);
+    free(order);
+}
+
+int main(int argc, char **argv)
+{
+    int n, max_stubs;
+
+    max_stubs = MAX_STUBS;
+    if (argc > 1) {
+        max_stubs = atoi(argv[1]);
+    }
+    for (n = 256; n <= max_stubs; n *= 2) {
+        bench(n);
+    }
+    return 0;
+}
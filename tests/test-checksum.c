@@ -0,0 +1,228 @@
+/*
+ * Internet checksum (RFC 1071) implementations of net/checksum.c
+ *
+ * The bytewise loop is the reference.  Each faster implementation the
+ * host can run is compared with it on buffers of 0 to MAX_LEN bytes,
+ * starting at each of 16 alignments.  net_checksum_update16/32 are
+ * compared with a full recomputation of a changed 20 byte IP header.
+ *
+ * Run as "test-checksum -b" for the GB/s of each implementation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "net/checksum.h"
+#include "test-util.h"
+
+#define MAX_LEN     3000
+#define MAX_ALIGN   16
+#define NB_HEADERS  100000
+#define BENCH_BYTES (4ULL << 30)
+
+static int errors;
+
+static void error(const char *fmt, ...)
+{
+    va_list ap;
+
+    /* a broken implementation fails everywhere; a few lines are enough */
+    if (errors++ >= 10) {
+        return;
+    }
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static int impl_usable(const NetChecksumImpl *impl)
+{
+    return !impl->usable || impl->usable();
+}
+
+static uint16_t csum(const char *impl, const uint8_t *buf, int len)
+{
+    net_checksum_select(impl);
+    return net_checksum_finish(net_checksum_add(len, buf));
+}
+
+/* Random bytes for odd lengths, all ones for even ones so that the
+ * carries of the wide implementations pile up. */
+static void fill(uint8_t *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (len & 1) ? test_rand64() : 0xff;
+    }
+}
+
+static void check_impl(const NetChecksumImpl *impl)
+{
+    static uint8_t buf[MAX_ALIGN + MAX_LEN];
+    uint16_t expected, sum;
+    int len, align;
+
+    for (len = 0; len <= MAX_LEN; len++) {
+        for (align = 0; align < MAX_ALIGN; align++) {
+            fill(buf + align, len);
+            expected = csum("bytewise", buf + align, len);
+            sum = csum(impl->name, buf + align, len);
+            if (sum != expected) {
+                error("%s: %d bytes at offset %d: %04x instead of %04x\n",
+                      impl->name, len, align, sum, expected);
+            }
+        }
+    }
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint16_t hdr_csum(const uint8_t *hdr)
+{
+    return net_checksum_finish(net_checksum_add(20, hdr));
+}
+
+static void check_updates(void)
+{
+    uint8_t hdr[20];
+    uint16_t sum, old16, new16;
+    uint32_t old32, new32;
+    int i, n, field;
+
+    net_checksum_select(NULL);
+    for (n = 0; n < NB_HEADERS; n++) {
+        for (i = 0; i < 20; i++) {
+            hdr[i] = test_rand64();
+        }
+        put16(hdr + 10, 0);
+        sum = hdr_csum(hdr);
+
+        /* any 16 bit field but the checksum, e.g. the total length;
+           every eighth value is 0 or 0xffff, the two zeroes of the
+           one's complement sum */
+        field = 2 * (test_rand64() % 9);
+        if (field >= 10) {
+            field += 2;
+        }
+        old16 = get16(hdr + field);
+        new16 = (n & 7) ? test_rand64() : (n & 8) ? 0 : 0xffff;
+        put16(hdr + field, new16);
+        sum = net_checksum_update16(sum, old16, new16);
+        if (sum != hdr_csum(hdr)) {
+            error("update16: %04x -> %04x at %d: %04x instead of %04x\n",
+                  old16, new16, field, sum, hdr_csum(hdr));
+        }
+
+        /* the source address, as rewritten by NAT */
+        old32 = (uint32_t)get16(hdr + 12) << 16 | get16(hdr + 14);
+        new32 = test_rand64();
+        put16(hdr + 12, new32 >> 16);
+        put16(hdr + 14, new32);
+        sum = net_checksum_update32(sum, old32, new32);
+        if (sum != hdr_csum(hdr)) {
+            error("update32: %08x -> %08x: %04x instead of %04x\n",
+                  old32, new32, sum, hdr_csum(hdr));
+        }
+    }
+}
+
+static double gbps(const NetChecksumImpl *impl, const uint8_t *buf,
+                   int size)
+{
+    uint64_t n, iters = BENCH_BYTES / size;
+    uint32_t acc = 0;
+    int64_t t;
+
+    /* the bytewise reference is far slower */
+    if (impl->network_order) {
+        iters /= 16;
+    }
+    net_checksum_select(impl->name);
+    t = get_time_us();
+    for (n = 0; n < iters; n++) {
+        acc += net_checksum_add(size, buf + (n & 1));
+    }
+    t = get_time_us() - t;
+    /* keep the loop */
+    if (acc == 1) {
+        printf("\n");
+    }
+    return (double)iters * size / t / 1e3;
+}
+
+static void bench(void)
+{
+    static const int sizes[] = { 64, 1500, 65536 };
+    static uint8_t buf[65536 + 1];
+    const NetChecksumImpl *impl;
+    int i;
+
+    fill(buf, sizeof(buf));
+    printf("GB/s      ");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        printf(" %8d bytes", sizes[i]);
+    }
+    printf("\n");
+    for (impl = net_checksum_impls; impl->name; impl++) {
+        if (!impl_usable(impl)) {
+            continue;
+        }
+        printf("%-10s", impl->name);
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            printf(" %14.2f", gbps(impl, buf, sizes[i]));
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const NetChecksumImpl *impl, *best = NULL;
+
+    if (test_bench_mode(argc, argv)) {
+        bench();
+        return 0;
+    }
+
+    for (impl = net_checksum_impls; impl->name; impl++) {
+        if (!impl_usable(impl)) {
+            printf("checksum: %s cannot run here, skipped\n", impl->name);
+            continue;
+        }
+        if (!best) {
+            best = impl;
+        }
+        check_impl(impl);
+    }
+    check_updates();
+
+    if (errors) {
+        printf("checksum: %d errors\n", errors);
+        return 1;
+    }
+    printf("checksum: OK, %s is used by default\n", best->name);
+    return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * Check the host FPU fast path of softfloat against the software routines.
+ *
+ * Every operation is run twice on the same operands: once with no flags
+ * raised, which always takes the software path, and once with the inexact
+ * flag already raised, which lets the fast path kick in.  Results must be
+ * bit-identical and the flags must agree.  With -b the program reports
+ * the throughput of both paths instead.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "../fpu/softfloat.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test-util.h"
+
+#define ITERATIONS  2000000
+#define BENCH_OPS   20000000
+
+enum { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_SQRT, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = { "add", "sub", "mul", "div", "sqrt" };
+
+/* Operands are drawn from a few classes so that cancellation, overflow
+ * and underflow at the edges of the fast path are all exercised.
+ */
+static uint32_t rnd_f32(uint32_t other)
+{
+    uint32_t r = test_rand64();
+
+    switch (test_rand64() % 5) {
+    case 0:     /* any bit pattern */
+        return r;
+    case 1:     /* close to the other operand */
+        return other ^ (r & 0x800000ff);
+    case 2:     /* tiny */
+        return (r & 0x807fffff) | ((r >> 8) & 0x07800000);
+    case 3:     /* huge */
+        return (r & 0x807fffff) | 0x78000000 | ((r >> 8) & 0x07800000);
+    default:    /* ordinary magnitudes */
+        return (r & 0x807fffff) | ((0x70 + (r >> 24) % 32) << 23);
+    }
+}
+
+static uint64_t rnd_f64(uint64_t other)
+{
+    uint64_t r = test_rand64();
+
+    switch (test_rand64() % 5) {
+    case 0:
+        return r;
+    case 1:
+        return other ^ (r & 0x80000000000000ffULL);
+    case 2:
+        return (r & 0x800fffffffffffffULL) | ((r >> 8) & 0x00f0000000000000ULL);
+    case 3:
+        return (r & 0x800fffffffffffffULL) | 0x7f00000000000000ULL |
+               ((r >> 8) & 0x00f0000000000000ULL);
+    default:
+        return (r & 0x800fffffffffffffULL) |
+               ((uint64_t)(0x3f0 + (r >> 56) % 32) << 52);
+    }
+}
+
+static uint32_t do_f32(int op, uint32_t a, uint32_t b, float_status *s)
+{
+    float32 fa = make_float32(a), fb = make_float32(b), r;
+
+    switch (op) {
+    case OP_ADD:
+        r = float32_add(fa, fb, s);
+        break;
+    case OP_SUB:
+        r = float32_sub(fa, fb, s);
+        break;
+    case OP_MUL:
+        r = float32_mul(fa, fb, s);
+        break;
+    case OP_DIV:
+        r = float32_div(fa, fb, s);
+        break;
+    default:
+        r = float32_sqrt(fa, s);
+        break;
+    }
+    return float32_val(r);
+}
+
+static uint64_t do_f64(int op, uint64_t a, uint64_t b, float_status *s)
+{
+    float64 fa = make_float64(a), fb = make_float64(b), r;
+
+    switch (op) {
+    case OP_ADD:
+        r = float64_add(fa, fb, s);
+        break;
+    case OP_SUB:
+        r = float64_sub(fa, fb, s);
+        break;
+    case OP_MUL:
+        r = float64_mul(fa, fb, s);
+        break;
+    case OP_DIV:
+        r = float64_div(fa, fb, s);
+        break;
+    default:
+        r = float64_sqrt(fa, s);
+        break;
+    }
+    return float64_val(r);
+}
+
+static void init_status(float_status *s, int flags, int ftz)
+{
+    memset(s, 0, sizeof(*s));
+    set_float_rounding_mode(float_round_nearest_even, s);
+    set_flush_to_zero(ftz, s);
+    set_flush_inputs_to_zero(ftz, s);
+    s->float_exception_flags = flags;
+}
+
+static int check(int ftz)
+{
+    float_status soft, hard;
+    int i, op, failures = 0;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        uint32_t a32 = test_rand64(), b32 = rnd_f32(a32), r_soft32, r_hard32;
+        uint64_t a64 = test_rand64(), b64 = rnd_f64(a64), r_soft64, r_hard64;
+
+        op = i % OP_COUNT;
+        if (i & 1) {
+            a32 = rnd_f32(b32);
+            a64 = rnd_f64(b64);
+        }
+
+        init_status(&soft, 0, ftz);
+        init_status(&hard, float_flag_inexact, ftz);
+        r_soft32 = do_f32(op, a32, b32, &soft);
+        r_hard32 = do_f32(op, a32, b32, &hard);
+        if (r_soft32 != r_hard32 ||
+            (soft.float_exception_flags | float_flag_inexact) !=
+            hard.float_exception_flags) {
+            fprintf(stderr, "float32_%s(%08x, %08x) ftz=%d: "
+                    "soft %08x/%02x hard %08x/%02x\n", op_names[op],
+                    a32, b32, ftz, r_soft32, soft.float_exception_flags,
+                    r_hard32, hard.float_exception_flags);
+            failures++;
+        }
+
+        init_status(&soft, 0, ftz);
+        init_status(&hard, float_flag_inexact, ftz);
+        r_soft64 = do_f64(op, a64, b64, &soft);
+        r_hard64 = do_f64(op, a64, b64, &hard);
+        if (r_soft64 != r_hard64 ||
+            (soft.float_exception_flags | float_flag_inexact) !=
+            hard.float_exception_flags) {
+            fprintf(stderr, "float64_%s(%016llx, %016llx) ftz=%d: "
+                    "soft %016llx/%02x hard %016llx/%02x\n", op_names[op],
+                    (unsigned long long)a64, (unsigned long long)b64, ftz,
+                    (unsigned long long)r_soft64, soft.float_exception_flags,
+                    (unsigned long long)r_hard64, hard.float_exception_flags);
+            failures++;
+        }
+
+        if (failures > 20) {
+            break;
+        }
+    }
+    return failures;
+}
+
+static void bench(void)
+{
+    static uint32_t ops32[1024];
+    static uint64_t ops64[1024];
+    float_status s;
+    int i, op, flags;
+
+    for (i = 0; i < 1024; i++) {
+        ops32[i] = (test_rand64() & 0x007fffff) | ((0x78 + i % 16) << 23);
+        ops64[i] = (test_rand64() & 0x000fffffffffffffULL) |
+                   ((uint64_t)(0x3f8 + i % 16) << 52);
+    }
+
+    printf("%-12s %14s %14s\n", "op", "soft Mops/s", "hard Mops/s");
+    for (op = 0; op < OP_COUNT; op++) {
+        double t[2];
+        uint32_t acc32 = 0;
+        uint64_t acc64 = 0;
+
+        for (flags = 0; flags < 2; flags++) {
+            int64_t start = get_time_us();
+
+            for (i = 0; i < BENCH_OPS; i++) {
+                init_status(&s, flags ? float_flag_inexact : 0, 0);
+                acc32 ^= do_f32(op, ops32[i & 1023], ops32[(i + 7) & 1023], &s);
+            }
+            t[flags] = (get_time_us() - start) / 1e6;
+        }
+        printf("float32_%-4s %14.1f %14.1f\n", op_names[op],
+               BENCH_OPS / t[0] / 1e6, BENCH_OPS / t[1] / 1e6);
+
+        for (flags = 0; flags < 2; flags++) {
+            int64_t start = get_time_us();
+
+            for (i = 0; i < BENCH_OPS; i++) {
+                init_status(&s, flags ? float_flag_inexact : 0, 0);
+                acc64 ^= do_f64(op, ops64[i & 1023], ops64[(i + 7) & 1023], &s);
+            }
+            t[flags] = (get_time_us() - start) / 1e6;
+        }
+        printf("float64_%-4s %14.1f %14.1f\n", op_names[op],
+               BENCH_OPS / t[0] / 1e6, BENCH_OPS / t[1] / 1e6);
+
+        /* keep the loops from being optimized away */
+        if (acc32 == 1 && acc64 == 1) {
+            printf("\n");
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int failures;
+
+    if (test_bench_mode(argc, argv)) {
+        bench();
+        return 0;
+    }
+
+#ifndef USE_HARDFLOAT
+    printf("host FPU fast path not compiled in, checking software path only\n");
+#endif
+    failures = check(0) + check(1);
+    if (failures) {
+        printf("softfloat: %d mismatches\n", failures);
+        return 1;
+    }
+    printf("softfloat: %d operations OK\n", ITERATIONS * 4);
+    return 0;
+}
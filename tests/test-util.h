@@ -0,0 +1,50 @@
+/*
+ * Helpers for the host programs in this directory that check or measure
+ * parts of QEMU: a clock, reproducible random numbers and the -b switch.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+static inline int64_t get_time_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* xorshift64*, with a fixed seed so that failures can be reproduced */
+static inline uint64_t test_rand64(void)
+{
+    static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+/* The checks report throughput instead when run with -b */
+static inline int test_bench_mode(int argc, char **argv)
+{
+    return argc > 1 && !strcmp(argv[1], "-b");
+}
+
+#endif
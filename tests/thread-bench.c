@@ -0,0 +1,165 @@
+/*
+ * Measure how linux-user scales with the number of guest threads.
+ *
+ * Every thread runs the same fixed amount of work: it generates a set of
+ * tiny functions in its own code buffer, calls them in a loop (so that
+ * blocks are looked up and chained), rewrites them (so that they are
+ * invalidated and translated again) and maps and unmaps some memory.
+ * The program runs the workload with 1, 2, 4, ... threads and prints the
+ * wall clock time of each run; on an SMP host the time should stay
+ * roughly flat as long as there are idle host CPUs.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "test-util.h"
+
+#define STUB_SIZE   16
+#define NB_STUBS    512
+#define ROUNDS      40
+#define CALLS       20
+#define MAX_THREADS 16
+
+typedef uint32_t (*stub_fn)(void);
+
+struct thread_info {
+    pthread_t tid;
+    int id;
+    uint8_t *code;
+    uint64_t sum;
+    int error;
+};
+
+static uint32_t stub_value(int id, int round, int i)
+{
+    return id * 100000 + round * 1000 + i;
+}
+
+/* 'mov $v, %eax; ret' for i386 and x86_64 alike */
+static void gen_stub(uint8_t *p, uint32_t v)
+{
+    p[0] = 0xb8;
+    memcpy(p + 1, &v, 4);
+    p[5] = 0xc3;
+}
+
+static void *thread_func(void *arg)
+{
+    struct thread_info *ti = arg;
+    uint32_t v;
+    void *m;
+    int round, rep, i;
+
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < NB_STUBS; i++) {
+            gen_stub(ti->code + i * STUB_SIZE, stub_value(ti->id, round, i));
+        }
+        for (rep = 0; rep < CALLS; rep++) {
+            for (i = 0; i < NB_STUBS; i++) {
+                v = ((stub_fn)(ti->code + i * STUB_SIZE))();
+                if (v != stub_value(ti->id, round, i)) {
+                    ti->error = 1;
+                    return NULL;
+                }
+                ti->sum += v;
+            }
+        }
+        m = mmap(NULL, 65536, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) {
+            ti->error = 1;
+            return NULL;
+        }
+        ((volatile char *)m)[100] = 1;
+        munmap(m, 65536);
+    }
+    return NULL;
+}
+
+static int64_t bench(int nb_threads)
+{
+    struct thread_info ti[MAX_THREADS];
+    int64_t t;
+    int i;
+
+    for (i = 0; i < nb_threads; i++) {
+        memset(&ti[i], 0, sizeof(ti[i]));
+        ti[i].id = i;
+        /* one buffer per thread, so that threads do not invalidate
+           each other's code */
+        ti[i].code = mmap(NULL, NB_STUBS * STUB_SIZE,
+                          PROT_READ | PROT_WRITE | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ti[i].code == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+    }
+
+    t = get_time_us();
+    for (i = 0; i < nb_threads; i++) {
+        pthread_create(&ti[i].tid, NULL, thread_func, &ti[i]);
+    }
+    for (i = 0; i < nb_threads; i++) {
+        pthread_join(ti[i].tid, NULL);
+    }
+    t = get_time_us() - t;
+
+    for (i = 0; i < nb_threads; i++) {
+        uint64_t expected = 0;
+        int round, j;
+
+        for (round = 0; round < ROUNDS; round++) {
+            for (j = 0; j < NB_STUBS; j++) {
+                expected += (uint64_t)CALLS * stub_value(i, round, j);
+            }
+        }
+        if (ti[i].error || ti[i].sum != expected) {
+            printf("error: thread %d of %d computed a wrong result\n",
+                   i, nb_threads);
+            exit(1);
+        }
+        munmap(ti[i].code, NB_STUBS * STUB_SIZE);
+    }
+    return t;
+}
+
+int main(int argc, char **argv)
+{
+    int n, max_threads;
+    int64_t t, t1 = 0;
+
+    max_threads = 8;
+    if (argc > 1) {
+        max_threads = atoi(argv[1]);
+        if (max_threads > MAX_THREADS) {
+            max_threads = MAX_THREADS;
+        }
+    }
+    for (n = 1; n <= max_threads; n *= 2) {
+        t = bench(n);
+        if (n == 1) {
+            t1 = t;
+        }
+        printf("%3d threads: %8.1f ms, %5.2fx the work in %5.2fx the time\n",
+               n, t / 1000.0, (double)n, (double)t / t1);
+    }
+    return 0;
+}
@@ -28,7 +28,7 @@
 #include "cpu.h"
 #include "exec-all.h"
 #include "disas.h"
-#include "tcg.h"
+#include "tcg-op.h"
 #include "qemu-timer.h"
 
 /* code generation context */
@@ -41,6 +41,28 @@ target_ulong gen_opc_pc[OPC_BUF_SIZE];
 uint16_t gen_opc_icount[OPC_BUF_SIZE];
 uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
 
+/* Decrement the execution counter of 'tb' on entry and leave the
+   block with exit code 3 when it reaches zero, so that cpu_exec can
+   retranslate it as a trace. */
+static void gen_tb_hot_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr;
+    TCGv_i32 count;
+    int l1;
+
+    l1 = gen_new_label();
+    ptr = tcg_const_ptr((tcg_target_long)&tb->hot_count);
+    count = tcg_temp_new_i32();
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_subi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+    tcg_gen_brcondi_i32(TCG_COND_NE, count, 0, l1);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+    tcg_gen_exit_tb((long)tb + 3);
+    gen_set_label(l1);
+}
+
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
@@ -70,6 +92,9 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
     tcg_func_start(s);
 
+    if (tb->cflags & CF_HOT_COUNT) {
+        gen_tb_hot_count(tb);
+    }
     gen_intermediate_code(env, tb);
 
     /* generate machine code */
@@ -127,6 +152,9 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     tcg_func_start(s);
 
+    if (tb->cflags & CF_HOT_COUNT) {
+        gen_tb_hot_count(tb);
+    }
     gen_intermediate_code_pc(env, tb);
 
     if (use_icount) {
@@ -47,6 +47,9 @@
 #include <dirent.h>
 #include <netdb.h>
 #include <sys/select.h>
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 #ifdef CONFIG_SIMPLE_TRACE
 #include "trace.h"
 #endif
@@ -205,6 +208,9 @@ int win2k_install_hack = 0;
 int rtc_td_hack = 0;
 int usb_enabled = 0;
 int singlestep = 0;
+int tb_hot_threshold = 0;
+const char *pin_globals = NULL;
+static int64_t timer_slack = 0;
 int smp_cpus = 1;
 int max_cpus = 0;
 int smp_cores = 1;
@@ -1025,14 +1031,140 @@ typedef struct IOHandlerRecord {
     IOHandler *fd_write;
     int deleted;
     void *opaque;
-    /* temporary data */
-    struct pollfd *ufd;
+    /* events the backend is currently waiting for */
+    int events;
+    int always_ready;
     QLIST_ENTRY(IOHandlerRecord) next;
+    QLIST_ENTRY(IOHandlerRecord) poll_next;
 } IOHandlerRecord;
 
+#define IO_EVENT_READ   1
+#define IO_EVENT_WRITE  2
+
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+/* Handlers with a fd_read_poll callback, or that the backend cannot
+   wait on; these are looked at on every iteration.  */
+static QLIST_HEAD(, IOHandlerRecord) io_poll_handlers =
+    QLIST_HEAD_INITIALIZER(io_poll_handlers);
+
+static int io_handlers_deleted;
+
+/* A main loop backend keeps its own copy of the interest set, updated
+   when a handler changes, so that waiting does not need to walk all
+   handlers.  The select backend has no such state and rebuilds its fd
+   sets every time.  */
+typedef struct IOBackend {
+    const char *name;
+    int (*init)(void);
+    void (*update)(IOHandlerRecord *ioh, int events);
+    int (*wait)(int timeout);
+} IOBackend;
+
+static int io_select_wait(int timeout);
+
+static IOBackend io_backend_select = {
+    .name = "select",
+    .wait = io_select_wait,
+};
+
+#ifdef CONFIG_EPOLL
+static int io_epoll_init(void);
+static void io_epoll_update(IOHandlerRecord *ioh, int events);
+static int io_epoll_wait(int timeout);
+
+static IOBackend io_backend_epoll = {
+    .name = "epoll",
+    .init = io_epoll_init,
+    .update = io_epoll_update,
+    .wait = io_epoll_wait,
+};
+
+static IOBackend *io_backend = &io_backend_epoll;
+#else
+static IOBackend *io_backend = &io_backend_select;
+#endif
+static int io_backend_ready;
+
+static IOBackend *io_backends[] = {
+#ifdef CONFIG_EPOLL
+    &io_backend_epoll,
+#endif
+    &io_backend_select,
+    NULL
+};
+
+static int io_handler_events(IOHandlerRecord *ioh)
+{
+    int events = 0;
+
+    if (ioh->deleted) {
+        return 0;
+    }
+    if (ioh->fd_read &&
+        (!ioh->fd_read_poll || ioh->fd_read_poll(ioh->opaque) != 0)) {
+        events |= IO_EVENT_READ;
+    }
+    if (ioh->fd_write) {
+        events |= IO_EVENT_WRITE;
+    }
+    return events;
+}
+
+static void io_handler_update(IOHandlerRecord *ioh)
+{
+    int events;
+
+    if (!io_backend_ready || !io_backend->update) {
+        return;
+    }
+    events = io_handler_events(ioh);
+    if (events != ioh->events) {
+        io_backend->update(ioh, events);
+    }
+}
+
+static void io_handler_set_poll(IOHandlerRecord *ioh, int poll)
+{
+    int on_list = ioh->fd_read_poll != NULL || ioh->always_ready;
+
+    if (poll && !on_list) {
+        QLIST_INSERT_HEAD(&io_poll_handlers, ioh, poll_next);
+    } else if (!poll && on_list) {
+        QLIST_REMOVE(ioh, poll_next);
+    }
+}
+
+static int io_backend_start(void)
+{
+    IOHandlerRecord *ioh;
+
+    if (io_backend->init && io_backend->init() < 0) {
+        return -1;
+    }
+    io_backend_ready = 1;
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        io_handler_update(ioh);
+    }
+    return 0;
+}
+
+static int qemu_set_main_loop(const char *name)
+{
+    IOBackend **b;
+
+    for (b = io_backends; *b; b++) {
+        if (!strcmp((*b)->name, name)) {
+            if (io_backend_ready) {
+                return -1;
+            }
+            io_backend = *b;
+            return 0;
+        }
+    }
+    return -1;
+}
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -1046,8 +1178,14 @@ int qemu_set_fd_handler2(int fd,
 
     if (!fd_read && !fd_write) {
         QLIST_FOREACH(ioh, &io_handlers, next) {
-            if (ioh->fd == fd) {
+            if (ioh->fd == fd && !ioh->deleted) {
+                /* the backend must forget the fd before it is closed */
+                io_handler_set_poll(ioh, 0);
+                ioh->fd_read_poll = NULL;
+                ioh->always_ready = 0;
                 ioh->deleted = 1;
+                io_handlers_deleted++;
+                io_handler_update(ioh);
                 break;
             }
         }
@@ -1059,16 +1197,242 @@ int qemu_set_fd_handler2(int fd,
         ioh = qemu_mallocz(sizeof(IOHandlerRecord));
         QLIST_INSERT_HEAD(&io_handlers, ioh, next);
     found:
+        if (ioh->deleted) {
+            ioh->deleted = 0;
+            io_handlers_deleted--;
+        }
+        io_handler_set_poll(ioh, fd_read_poll != NULL || ioh->always_ready);
         ioh->fd = fd;
         ioh->fd_read_poll = fd_read_poll;
         ioh->fd_read = fd_read;
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
-        ioh->deleted = 0;
+        io_handler_update(ioh);
     }
     return 0;
 }
 
+static void io_handler_dispatch(IOHandlerRecord *ioh, int events)
+{
+    if (!ioh->deleted && ioh->fd_read && (events & IO_EVENT_READ)) {
+        ioh->fd_read(ioh->opaque);
+    }
+    if (!ioh->deleted && ioh->fd_write && (events & IO_EVENT_WRITE)) {
+        ioh->fd_write(ioh->opaque);
+    }
+}
+
+static void io_handlers_free_deleted(void)
+{
+    IOHandlerRecord *ioh, *pioh;
+
+    if (!io_handlers_deleted) {
+        return;
+    }
+    QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
+        if (ioh->deleted) {
+            QLIST_REMOVE(ioh, next);
+            qemu_free(ioh);
+        }
+    }
+    io_handlers_deleted = 0;
+}
+
+static int io_select_wait(int timeout)
+{
+    IOHandlerRecord *ioh;
+    fd_set rfds, wfds, xfds;
+    int ret, nfds, events;
+    struct timeval tv;
+
+    /* XXX: separate device handlers from system ones */
+    nfds = -1;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        events = io_handler_events(ioh);
+        if (events & IO_EVENT_READ) {
+            FD_SET(ioh->fd, &rfds);
+        }
+        if (events & IO_EVENT_WRITE) {
+            FD_SET(ioh->fd, &wfds);
+        }
+        if (events && ioh->fd > nfds) {
+            nfds = ioh->fd;
+        }
+    }
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+
+    qemu_mutex_unlock_iothread();
+    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    qemu_mutex_lock_iothread();
+    if (ret > 0) {
+        QLIST_FOREACH(ioh, &io_handlers, next) {
+            events = 0;
+            if (FD_ISSET(ioh->fd, &rfds)) {
+                events |= IO_EVENT_READ;
+            }
+            if (FD_ISSET(ioh->fd, &wfds)) {
+                events |= IO_EVENT_WRITE;
+            }
+            io_handler_dispatch(ioh, events);
+        }
+    }
+
+    slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+    return ret;
+}
+
+#ifdef CONFIG_EPOLL
+#define IO_EPOLL_MAX_EVENTS 64
+
+static int io_epoll_fd = -1;
+
+static int io_epoll_init(void)
+{
+    io_epoll_fd = epoll_create(IO_EPOLL_MAX_EVENTS);
+    if (io_epoll_fd < 0) {
+        return -1;
+    }
+    qemu_set_cloexec(io_epoll_fd);
+    return 0;
+}
+
+static void io_epoll_update(IOHandlerRecord *ioh, int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (ioh->always_ready) {
+        ioh->events = events;
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = ioh;
+    if (events & IO_EVENT_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if (events & IO_EVENT_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+    /* Drop the fd altogether rather than leaving it with an empty mask;
+       epoll would still report hangups on it, which select does not.  */
+    if (!events) {
+        op = EPOLL_CTL_DEL;
+    } else if (!ioh->events) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    if (epoll_ctl(io_epoll_fd, op, ioh->fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+        /* the fd may have been closed and reused without telling us */
+        if (errno == ENOENT || errno == EEXIST) {
+            op = (errno == ENOENT) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+            if (epoll_ctl(io_epoll_fd, op, ioh->fd, &ev) == 0) {
+                ioh->events = events;
+                return;
+            }
+        }
+        if (errno == EPERM) {
+            /* regular files cannot be waited on and are always ready,
+               like select reports them */
+            io_handler_set_poll(ioh, 1);
+            ioh->always_ready = 1;
+        } else {
+            fprintf(stderr, "epoll_ctl fd %d: %s\n", ioh->fd, strerror(errno));
+        }
+    }
+    ioh->events = events;
+}
+
+static int io_epoll_events(uint32_t ev)
+{
+    int events = 0;
+
+    if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        events |= IO_EVENT_READ;
+    }
+    if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        events |= IO_EVENT_WRITE;
+    }
+    return events;
+}
+
+static int io_epoll_wait(int timeout)
+{
+    struct epoll_event ev[IO_EPOLL_MAX_EVENTS];
+    IOHandlerRecord *ioh;
+    fd_set rfds, wfds, xfds;
+    int ret, i, nfds, ready;
+
+    /* Re-check the handlers that can refuse input; only those whose
+       answer changed touch the epoll set.  */
+    ready = 0;
+    QLIST_FOREACH(ioh, &io_poll_handlers, poll_next) {
+        io_handler_update(ioh);
+        if (ioh->always_ready && ioh->events) {
+            ready = 1;
+        }
+    }
+    if (ready) {
+        timeout = 0;
+    }
+
+    /* slirp sockets come and go with every packet, so wait for them
+       with select, with the epoll fd as one more descriptor.  */
+    nfds = -1;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+
+    qemu_mutex_unlock_iothread();
+    if (nfds >= 0) {
+        struct timeval tv;
+
+        FD_SET(io_epoll_fd, &rfds);
+        if (io_epoll_fd > nfds) {
+            nfds = io_epoll_fd;
+        }
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+        if (ret > 0 && FD_ISSET(io_epoll_fd, &rfds)) {
+            ret = epoll_wait(io_epoll_fd, ev, IO_EPOLL_MAX_EVENTS, 0);
+        } else if (ret >= 0) {
+            ret = 0;
+        }
+    } else {
+        ret = epoll_wait(io_epoll_fd, ev, IO_EPOLL_MAX_EVENTS, timeout);
+    }
+    qemu_mutex_lock_iothread();
+
+    /* Handlers are only freed after dispatching, so a callback deleting
+       another handler cannot leave a dangling pointer in ev[].  */
+    for (i = 0; i < ret; i++) {
+        ioh = ev[i].data.ptr;
+        io_handler_dispatch(ioh, io_epoll_events(ev[i].events) & ioh->events);
+    }
+    if (ready) {
+        QLIST_FOREACH(ioh, &io_poll_handlers, poll_next) {
+            if (ioh->always_ready) {
+                io_handler_dispatch(ioh, ioh->events);
+            }
+        }
+    }
+
+    if (nfds >= 0) {
+        slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+    }
+    return ret;
+}
+#endif
+
 int qemu_set_fd_handler(int fd,
                         IOHandler *fd_read,
                         IOHandler *fd_write,
@@ -1306,10 +1670,6 @@ void qemu_system_powerdown_request(void)
 
 void main_loop_wait(int nonblocking)
 {
-    IOHandlerRecord *ioh;
-    fd_set rfds, wfds, xfds;
-    int ret, nfds;
-    struct timeval tv;
     int timeout;
 
     if (nonblocking)
@@ -1321,57 +1681,19 @@ void main_loop_wait(int nonblocking)
 
     os_host_main_loop_wait(&timeout);
 
-    /* poll any events */
-    /* XXX: separate device handlers from system ones */
-    nfds = -1;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&xfds);
-    QLIST_FOREACH(ioh, &io_handlers, next) {
-        if (ioh->deleted)
-            continue;
-        if (ioh->fd_read &&
-            (!ioh->fd_read_poll ||
-             ioh->fd_read_poll(ioh->opaque) != 0)) {
-            FD_SET(ioh->fd, &rfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
-        }
-        if (ioh->fd_write) {
-            FD_SET(ioh->fd, &wfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
-        }
+    if (!io_backend_ready && io_backend_start() < 0) {
+        fprintf(stderr, "could not start the %s main loop, using select\n",
+                io_backend->name);
+        io_backend = &io_backend_select;
+        io_backend_start();
     }
 
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000) * 1000;
-
-    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
-
-    qemu_mutex_unlock_iothread();
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
-    qemu_mutex_lock_iothread();
-    if (ret > 0) {
-        IOHandlerRecord *pioh;
-
-        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
-            if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, &rfds)) {
-                ioh->fd_read(ioh->opaque);
-            }
-            if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, &wfds)) {
-                ioh->fd_write(ioh->opaque);
-            }
-
-            /* Do this last in case read/write handlers marked it for deletion */
-            if (ioh->deleted) {
-                QLIST_REMOVE(ioh, next);
-                qemu_free(ioh);
-            }
-        }
+    /* poll any events */
+    io_backend->wait(timeout);
+    if (timeout) {
+        qemu_account_wakeup();
     }
-
-    slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+    io_handlers_free_deleted();
 
     qemu_run_all_timers();
 
@@ -1917,7 +2239,7 @@ int main(int argc, char **argv, char **envp)
     const char *loadvm = NULL;
     QEMUMachine *machine;
     const char *cpu_model;
-    int tb_size;
+    int tb_size, tb_max_size;
     const char *pid_file = NULL;
     const char *incoming = NULL;
     int show_vnc_port = 0;
@@ -1957,6 +2279,7 @@ int main(int argc, char **argv, char **envp)
     nb_nics = 0;
 
     tb_size = 0;
+    tb_max_size = 0;
     autostart= 1;
 
     /* first pass of option parsing */
@@ -2675,6 +2998,30 @@ int main(int argc, char **argv, char **envp)
                 if (tb_size < 0)
                     tb_size = 0;
                 break;
+            case QEMU_OPTION_tb_max_size:
+                tb_max_size = strtol(optarg, NULL, 0);
+                if (tb_max_size < 0)
+                    tb_max_size = 0;
+                break;
+            case QEMU_OPTION_tb_hot_threshold:
+                tb_hot_threshold = strtol(optarg, NULL, 0);
+                if (tb_hot_threshold < 0)
+                    tb_hot_threshold = 0;
+                break;
+            case QEMU_OPTION_pin_globals:
+                pin_globals = optarg;
+                break;
+            case QEMU_OPTION_timer_slack:
+                timer_slack = strtoll(optarg, NULL, 0);
+                if (timer_slack < 0)
+                    timer_slack = 0;
+                break;
+            case QEMU_OPTION_main_loop:
+                if (qemu_set_main_loop(optarg) < 0) {
+                    fprintf(stderr, "Unknown main loop backend '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
@@ -2910,6 +3257,7 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
     configure_icount(icount_option);
+    configure_timer_slack(timer_slack * 1000);
 
     if (net_init_clients() < 0) {
         exit(1);
@@ -2924,7 +3272,8 @@ int main(int argc, char **argv, char **envp)
         ram_size = DEFAULT_RAM_SIZE * 1024 * 1024;
 
     /* init the dynamic translator */
-    cpu_exec_init_all(tb_size * 1024 * 1024);
+    cpu_exec_init_all((unsigned long)tb_size * 1024 * 1024,
+                      (unsigned long)tb_max_size * 1024 * 1024);
 
     bdrv_init_with_whitelist();
 
@@ -3108,6 +3457,8 @@ int main(int argc, char **argv, char **envp)
     while (dcl != NULL) {
         if (dcl->dpy_refresh != NULL) {
             ds->gui_timer = qemu_new_timer(rt_clock, gui_update, ds);
+            /* a refresh may be late without anyone noticing */
+            qemu_timer_set_slack(ds->gui_timer, GUI_REFRESH_INTERVAL / 2);
             qemu_mod_timer(ds->gui_timer, qemu_get_clock(rt_clock));
             break;
         }
@@ -3115,6 +3466,7 @@ int main(int argc, char **argv, char **envp)
     }
     if (ds->gui_timer == NULL) {
         nographic_timer = qemu_new_timer(rt_clock, nographic_update, NULL);
+        qemu_timer_set_slack(nographic_timer, GUI_REFRESH_INTERVAL / 2);
         qemu_mod_timer(nographic_timer, qemu_get_clock(rt_clock));
     }
     text_consoles_set_display(ds);